@@ -0,0 +1,213 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/adaptive_batch_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "tensorflow/core/lib/core/bits.h"
+#include "tensorflow/core/lib/core/errors.h"
+
+namespace tensorflow {
+namespace serving {
+
+namespace {
+
+// The number of standard deviations above the mean at which the 99th
+// percentile of a normal distribution lies.
+constexpr double kP99StandardDeviations = 2.326;
+
+// The weights given to the latest sample in the moving averages of processing
+// time and arrival rate, respectively.
+constexpr double kProcessingTimeSmoothing = 1.0 / 8;
+constexpr double kArrivalRateSmoothing = 1.0 / 4;
+
+}  // namespace
+
+Status AdaptiveBatchController::Create(
+    const Options& options,
+    std::unique_ptr<AdaptiveBatchController>* controller) {
+  if (options.target_latency_micros <= 0) {
+    return errors::InvalidArgument(
+        "target_latency_micros must be positive; was ",
+        options.target_latency_micros);
+  }
+  if (options.min_batch_size < 1 ||
+      options.min_batch_size > options.max_batch_size) {
+    return errors::InvalidArgument(
+        "Batch size bounds must satisfy 1 <= min_batch_size <= max_batch_size; "
+        "were ",
+        options.min_batch_size, " and ", options.max_batch_size);
+  }
+  if (options.min_batch_timeout_micros < 0 ||
+      options.min_batch_timeout_micros > options.max_batch_timeout_micros) {
+    return errors::InvalidArgument(
+        "Batch timeout bounds must satisfy 0 <= min_batch_timeout_micros <= "
+        "max_batch_timeout_micros; were ",
+        options.min_batch_timeout_micros, " and ",
+        options.max_batch_timeout_micros);
+  }
+  if (options.adjustment_interval_micros <= 0) {
+    return errors::InvalidArgument(
+        "adjustment_interval_micros must be positive; was ",
+        options.adjustment_interval_micros);
+  }
+  controller->reset(new AdaptiveBatchController(options));
+  return Status::OK();
+}
+
+AdaptiveBatchController::AdaptiveBatchController(const Options& options)
+    : options_(options),
+      stats_(Log2Floor(options.max_batch_size) + 1),
+      last_adjustment_time_micros_(options.env->NowMicros()),
+      max_batch_size_(options.max_batch_size),
+      batch_timeout_micros_(options.max_batch_timeout_micros) {}
+
+void AdaptiveBatchController::RecordArrival(int task_size) {
+  arrivals_since_last_adjustment_ += task_size;
+}
+
+bool AdaptiveBatchController::RecordBatch(int batch_size,
+                                          int64 processing_micros) {
+  if (batch_size >= 1) {
+    BatchSizeRangeStats* stats = &stats_[SizeRangeIndex(batch_size)];
+    if (stats->num_batches == 0) {
+      stats->mean_batch_size = batch_size;
+      stats->mean_processing_micros = processing_micros;
+    } else {
+      // An exponentially-weighted mean and variance.
+      const double diff = processing_micros - stats->mean_processing_micros;
+      stats->mean_processing_micros += kProcessingTimeSmoothing * diff;
+      stats->processing_micros_variance =
+          (1 - kProcessingTimeSmoothing) *
+          (stats->processing_micros_variance +
+           kProcessingTimeSmoothing * diff * diff);
+      stats->mean_batch_size +=
+          kProcessingTimeSmoothing * (batch_size - stats->mean_batch_size);
+    }
+    ++stats->num_batches;
+  }
+
+  if (options_.env->NowMicros() - last_adjustment_time_micros_ <
+      options_.adjustment_interval_micros) {
+    return false;
+  }
+  return Adjust();
+}
+
+int AdaptiveBatchController::SizeRangeIndex(int batch_size) const {
+  return std::min<int>(Log2Floor(batch_size), stats_.size() - 1);
+}
+
+double AdaptiveBatchController::EstimateProcessingMicros(
+    int batch_size) const {
+  const int index = SizeRangeIndex(batch_size);
+  // Use the closest measured size range, preferring smaller sizes (whose
+  // estimate gets scaled up below).
+  const BatchSizeRangeStats* stats = nullptr;
+  for (int i = index; i >= 0 && stats == nullptr; --i) {
+    if (stats_[i].num_batches > 0) {
+      stats = &stats_[i];
+    }
+  }
+  for (int i = index + 1; i < stats_.size() && stats == nullptr; ++i) {
+    if (stats_[i].num_batches > 0) {
+      stats = &stats_[i];
+    }
+  }
+  if (stats == nullptr) {
+    return -1;
+  }
+
+  double estimate =
+      stats->mean_processing_micros +
+      kP99StandardDeviations * std::sqrt(stats->processing_micros_variance);
+  // Assume processing time is at most proportional to batch size.
+  if (batch_size > stats->mean_batch_size) {
+    estimate *= batch_size / stats->mean_batch_size;
+  }
+  return estimate;
+}
+
+bool AdaptiveBatchController::Adjust() {
+  const uint64 now_micros = options_.env->NowMicros();
+  const double arrival_rate_per_micro =
+      static_cast<double>(arrivals_since_last_adjustment_) /
+      (now_micros - last_adjustment_time_micros_);
+  if (arrival_rate_per_micro_ == 0) {
+    arrival_rate_per_micro_ = arrival_rate_per_micro;
+  } else {
+    arrival_rate_per_micro_ +=
+        kArrivalRateSmoothing *
+        (arrival_rate_per_micro - arrival_rate_per_micro_);
+  }
+  arrivals_since_last_adjustment_ = 0;
+  last_adjustment_time_micros_ = now_micros;
+
+  // Try maximum batch sizes of 'min_batch_size' times successive powers of
+  // two, and 'max_batch_size'.
+  int best_batch_size = options_.min_batch_size;
+  int64 best_batch_timeout_micros = options_.min_batch_timeout_micros;
+  double best_expected_batch_size = -1;
+  for (int batch_size = options_.min_batch_size;;
+       batch_size = std::min(batch_size * 2, options_.max_batch_size)) {
+    const double processing_micros = EstimateProcessingMicros(batch_size);
+    if (processing_micros < 0) {
+      // Nothing to go on yet.
+      return false;
+    }
+    const double latency_budget_micros =
+        options_.target_latency_micros - processing_micros;
+    if (latency_budget_micros < 0 && batch_size > options_.min_batch_size) {
+      // Larger batches would take even longer to process.
+      break;
+    }
+
+    // Wait no longer than the latency budget allows, nor than it takes to
+    // fill the batch.
+    double batch_timeout_micros = std::max(latency_budget_micros, 0.0);
+    if (arrival_rate_per_micro_ > 0) {
+      batch_timeout_micros =
+          std::min(batch_timeout_micros, batch_size / arrival_rate_per_micro_);
+    }
+    batch_timeout_micros = std::min<double>(
+        std::max<double>(batch_timeout_micros,
+                         options_.min_batch_timeout_micros),
+        options_.max_batch_timeout_micros);
+
+    const double expected_batch_size = std::min<double>(
+        batch_size,
+        std::max(1.0, arrival_rate_per_micro_ * batch_timeout_micros));
+    if (expected_batch_size > best_expected_batch_size) {
+      best_batch_size = batch_size;
+      best_batch_timeout_micros = static_cast<int64>(batch_timeout_micros);
+      best_expected_batch_size = expected_batch_size;
+    }
+
+    if (batch_size >= options_.max_batch_size) {
+      break;
+    }
+  }
+
+  const bool changed = best_batch_size != max_batch_size_ ||
+                       best_batch_timeout_micros != batch_timeout_micros_;
+  max_batch_size_ = best_batch_size;
+  batch_timeout_micros_ = best_batch_timeout_micros;
+  return changed;
+}
+
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,144 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_SERVING_BATCHING_ADAPTIVE_BATCH_CONTROLLER_H_
+#define TENSORFLOW_SERVING_BATCHING_ADAPTIVE_BATCH_CONTROLLER_H_
+
+#include <memory>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace serving {
+
+// Chooses the batch timeout and maximum batch size for a batch scheduler
+// queue, so as to batch as much as the traffic allows while keeping task
+// latency within a target.
+//
+// A task's latency is modeled as the time it waits for its batch to close (at
+// most the batch timeout, less if the batch fills up sooner) plus the batch's
+// processing time. The controller tracks the rate at which tasks arrive, and
+// the mean and variance of the processing time for each range of batch sizes
+// (the ranges being [1, 1], [2, 3], [4, 7], ...). Periodically it considers a
+// range of candidate maximum batch sizes, and for each one picks the longest
+// timeout for which the expected time to fill the batch plus the estimated
+// 99th-percentile processing time fits within the target. It then settles on
+// the candidate that yields the largest expected batches.
+//
+// For example, under heavy traffic batches fill up quickly, so the controller
+// chooses a large maximum batch size and the timeout rarely matters. Under
+// light traffic it chooses the timeout that uses up the latency budget left
+// over after processing, within the configured bounds.
+//
+// This class is not thread-safe.
+class AdaptiveBatchController {
+ public:
+  struct Options {
+    // The target for the 99th-percentile latency of a task, from when it is
+    // enqueued until its batch has been processed. Must be positive.
+    int64 target_latency_micros = 0;
+
+    // The range of batch sizes the controller may choose as the maximum.
+    // Requires 1 <= 'min_batch_size' <= 'max_batch_size'.
+    int min_batch_size = 1;
+    int max_batch_size = 1;
+
+    // The range of batch timeouts the controller may choose. Requires
+    // 0 <= 'min_batch_timeout_micros' <= 'max_batch_timeout_micros'.
+    int64 min_batch_timeout_micros = 0;
+    int64 max_batch_timeout_micros = 0;
+
+    // The minimum time between successive adjustments. Must be positive.
+    int64 adjustment_interval_micros = 100 * 1000 /* 100 milliseconds */;
+
+    // The environment to use.
+    // (Typically only overridden by test code.)
+    Env* env = Env::Default();
+  };
+  static Status Create(const Options& options,
+                       std::unique_ptr<AdaptiveBatchController>* controller);
+
+  ~AdaptiveBatchController() = default;
+
+  // Records the arrival of a task of size 'task_size'.
+  void RecordArrival(int task_size);
+
+  // Records that a batch of size 'batch_size' took 'processing_micros' to
+  // process. If at least 'adjustment_interval_micros' have elapsed since the
+  // last adjustment, also adjusts the choices below. Returns true iff they
+  // changed.
+  bool RecordBatch(int batch_size, int64 processing_micros);
+
+  // The chosen maximum batch size and batch timeout. Until processing times
+  // have been measured, these are 'max_batch_size' and
+  // 'max_batch_timeout_micros'.
+  int max_batch_size() const { return max_batch_size_; }
+  int64 batch_timeout_micros() const { return batch_timeout_micros_; }
+
+  // The estimated arrival rate, in units of task size per second, as of the
+  // last adjustment.
+  double arrival_rate_per_second() const {
+    return arrival_rate_per_micro_ * 1e6;
+  }
+
+ private:
+  // Statistics about the processing time of batches in one size range.
+  struct BatchSizeRangeStats {
+    int64 num_batches = 0;
+    double mean_batch_size = 0;
+    double mean_processing_micros = 0;
+    double processing_micros_variance = 0;
+  };
+
+  explicit AdaptiveBatchController(const Options& options);
+
+  // Returns the index in 'stats_' of the size range containing 'batch_size'.
+  int SizeRangeIndex(int batch_size) const;
+
+  // Returns the estimated 99th-percentile time to process a batch of size
+  // 'batch_size', or a negative value if no batches have been measured yet.
+  double EstimateProcessingMicros(int batch_size) const;
+
+  // Re-chooses 'max_batch_size_' and 'batch_timeout_micros_'. Returns true iff
+  // they changed.
+  bool Adjust();
+
+  const Options options_;
+
+  // Indexed by floor(log2(batch size)).
+  std::vector<BatchSizeRangeStats> stats_;
+
+  // The sum of the sizes of the tasks that arrived since the last adjustment.
+  int64 arrivals_since_last_adjustment_ = 0;
+
+  uint64 last_adjustment_time_micros_;
+
+  // A moving average of the arrival rate, or 0 if not known yet.
+  double arrival_rate_per_micro_ = 0;
+
+  int max_batch_size_;
+  int64 batch_timeout_micros_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(AdaptiveBatchController);
+};
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_BATCHING_ADAPTIVE_BATCH_CONTROLLER_H_
@@ -0,0 +1,122 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/adaptive_batch_controller.h"
+
+#include <gtest/gtest.h>
+#include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow_serving/test_util/fake_clock_env.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+AdaptiveBatchController::Options DefaultOptions(Env* env) {
+  AdaptiveBatchController::Options options;
+  options.target_latency_micros = 10 * 1000;
+  options.min_batch_size = 1;
+  options.max_batch_size = 64;
+  options.min_batch_timeout_micros = 0;
+  options.max_batch_timeout_micros = 5 * 1000;
+  options.adjustment_interval_micros = 1000;
+  options.env = env;
+  return options;
+}
+
+// Records one batch of each power-of-two size up to 64, whose processing time
+// is 100 + 10 * size microseconds. Returns true iff any of the calls adjusted
+// the controller's choices.
+bool RecordBatches(AdaptiveBatchController* controller) {
+  bool changed = false;
+  for (int size = 1; size <= 64; size *= 2) {
+    changed |= controller->RecordBatch(size, 100 + 10 * size);
+  }
+  return changed;
+}
+
+TEST(AdaptiveBatchControllerTest, HeavyTraffic) {
+  test_util::FakeClockEnv env(Env::Default());
+  std::unique_ptr<AdaptiveBatchController> controller;
+  TF_ASSERT_OK(
+      AdaptiveBatchController::Create(DefaultOptions(&env), &controller));
+  EXPECT_EQ(64, controller->max_batch_size());
+  EXPECT_EQ(5 * 1000, controller->batch_timeout_micros());
+
+  // No adjustment happens until the adjustment interval has elapsed.
+  controller->RecordArrival(64 * 1000);
+  EXPECT_FALSE(RecordBatches(controller.get()));
+  EXPECT_EQ(64, controller->max_batch_size());
+
+  // 64 units per microsecond fill the largest batches within a microsecond,
+  // so there is no point in waiting longer than that.
+  env.AdvanceByMicroseconds(1000);
+  EXPECT_TRUE(controller->RecordBatch(64, 100 + 10 * 64));
+  EXPECT_DOUBLE_EQ(64e6, controller->arrival_rate_per_second());
+  EXPECT_EQ(64, controller->max_batch_size());
+  EXPECT_EQ(1, controller->batch_timeout_micros());
+}
+
+TEST(AdaptiveBatchControllerTest, LightTraffic) {
+  test_util::FakeClockEnv env(Env::Default());
+  std::unique_ptr<AdaptiveBatchController> controller;
+  TF_ASSERT_OK(
+      AdaptiveBatchController::Create(DefaultOptions(&env), &controller));
+  RecordBatches(controller.get());
+
+  // At one unit per millisecond, batches reach size 5 by the maximum timeout,
+  // so the controller waits that long with batches of up to 8.
+  controller->RecordArrival(1);
+  env.AdvanceByMicroseconds(1000);
+  EXPECT_TRUE(controller->RecordBatch(1, 110));
+  EXPECT_EQ(8, controller->max_batch_size());
+  EXPECT_EQ(5 * 1000, controller->batch_timeout_micros());
+}
+
+TEST(AdaptiveBatchControllerTest, ProcessingTimeLimitsBatchSize) {
+  test_util::FakeClockEnv env(Env::Default());
+  AdaptiveBatchController::Options options = DefaultOptions(&env);
+  options.target_latency_micros = 500;
+  std::unique_ptr<AdaptiveBatchController> controller;
+  TF_ASSERT_OK(AdaptiveBatchController::Create(options, &controller));
+  RecordBatches(controller.get());
+
+  // Batches of size 64 take 740 microseconds, over the target, whereas ones of
+  // size 32 take 420.
+  controller->RecordArrival(64 * 1000);
+  env.AdvanceByMicroseconds(1000);
+  EXPECT_TRUE(controller->RecordBatch(1, 110));
+  EXPECT_EQ(32, controller->max_batch_size());
+  EXPECT_EQ(0, controller->batch_timeout_micros());
+}
+
+TEST(AdaptiveBatchControllerTest, InvalidOptions) {
+  test_util::FakeClockEnv env(Env::Default());
+  std::unique_ptr<AdaptiveBatchController> controller;
+  AdaptiveBatchController::Options options = DefaultOptions(&env);
+  options.target_latency_micros = 0;
+  EXPECT_FALSE(AdaptiveBatchController::Create(options, &controller).ok());
+
+  options = DefaultOptions(&env);
+  options.min_batch_size = 128;
+  EXPECT_FALSE(AdaptiveBatchController::Create(options, &controller).ok());
+
+  options = DefaultOptions(&env);
+  options.min_batch_timeout_micros = 10 * 1000;
+  EXPECT_FALSE(AdaptiveBatchController::Create(options, &controller).ok());
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,299 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/allowed_batch_sizes.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "tensorflow/core/framework/register_types.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/types.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace tensorflow {
+namespace serving {
+
+namespace {
+
+// The maximum number of candidate sizes ChooseAllowedBatchSizes() considers.
+// Beyond this, the candidates are spread evenly up to the maximum batch size,
+// to bound the (quadratic) cost of the search.
+constexpr int kMaxNumCandidateBatchSizes = 1024;
+
+template <typename T>
+Tensor ZeroTensor(const TensorShape& shape) {
+  Tensor tensor(DataTypeToEnum<T>::value, shape);
+  tensor.flat<T>().setConstant(T());
+  return tensor;
+}
+
+// Returns the latency of 'batch_size', interpolated linearly between the
+// nearest measured sizes.
+double InterpolateLatency(const std::vector<int>& measured_batch_sizes,
+                          const std::vector<double>& latencies_micros,
+                          int batch_size) {
+  if (batch_size <= measured_batch_sizes.front()) {
+    return latencies_micros.front();
+  }
+  const int upper = std::lower_bound(measured_batch_sizes.begin(),
+                                     measured_batch_sizes.end(), batch_size) -
+                    measured_batch_sizes.begin();
+  const int lower = upper - 1;
+  const double fraction =
+      static_cast<double>(batch_size - measured_batch_sizes[lower]) /
+      (measured_batch_sizes[upper] - measured_batch_sizes[lower]);
+  return latencies_micros[lower] +
+         fraction * (latencies_micros[upper] - latencies_micros[lower]);
+}
+
+}  // namespace
+
+Status CreateSyntheticInputs(const SignatureDef& signature, int batch_size,
+                             std::vector<std::pair<string, Tensor>>* inputs) {
+  inputs->clear();
+  for (const auto& entry : signature.inputs()) {
+    const TensorInfo& info = entry.second;
+    if (info.tensor_shape().unknown_rank() ||
+        info.tensor_shape().dim_size() == 0) {
+      return errors::InvalidArgument(
+          "Cannot create a synthetic batch for input ", entry.first,
+          " without a known rank of at least 1");
+    }
+    TensorShape shape;
+    for (int d = 0; d < info.tensor_shape().dim_size(); ++d) {
+      const int64 size = info.tensor_shape().dim(d).size();
+      shape.AddDim(d == 0 ? batch_size : (size < 0 ? 1 : size));
+    }
+    Tensor tensor;
+    switch (info.dtype()) {
+#define CASE(type)                    \
+  case DataTypeToEnum<type>::value:   \
+    tensor = ZeroTensor<type>(shape); \
+    break;
+      TF_CALL_POD_TYPES(CASE);
+      TF_CALL_string(CASE);
+#undef CASE
+      default:
+        return errors::InvalidArgument(
+            "Cannot create a synthetic batch for input ", entry.first,
+            " of dtype ", DataTypeString(info.dtype()));
+    }
+    inputs->emplace_back(info.name(), tensor);
+  }
+  return Status::OK();
+}
+
+Status MeasureBatchLatencies(Session* session, const SignatureDef& signature,
+                             const std::vector<int>& batch_sizes, int num_runs,
+                             std::vector<double>* latencies_micros) {
+  if (num_runs < 1) {
+    return errors::InvalidArgument("num_runs must be positive; was ",
+                                   num_runs);
+  }
+  std::vector<string> output_names;
+  for (const auto& entry : signature.outputs()) {
+    output_names.push_back(entry.second.name());
+  }
+  latencies_micros->clear();
+  for (int batch_size : batch_sizes) {
+    std::vector<std::pair<string, Tensor>> inputs;
+    TF_RETURN_IF_ERROR(CreateSyntheticInputs(signature, batch_size, &inputs));
+    std::vector<Tensor> outputs;
+    TF_RETURN_IF_ERROR(session->Run(inputs, output_names, {}, &outputs));
+    std::vector<uint64> run_latencies_micros;
+    for (int i = 0; i < num_runs; ++i) {
+      const uint64 start_time_micros = Env::Default()->NowMicros();
+      TF_RETURN_IF_ERROR(session->Run(inputs, output_names, {}, &outputs));
+      run_latencies_micros.push_back(Env::Default()->NowMicros() -
+                                     start_time_micros);
+    }
+    std::sort(run_latencies_micros.begin(), run_latencies_micros.end());
+    latencies_micros->push_back(run_latencies_micros[num_runs / 2]);
+  }
+  return Status::OK();
+}
+
+Status ChooseAllowedBatchSizes(const std::vector<int>& measured_batch_sizes,
+                               const std::vector<double>& latencies_micros,
+                               const std::vector<double>& batch_size_weights,
+                               int max_batch_size,
+                               int max_num_allowed_batch_sizes,
+                               std::vector<int>* allowed_batch_sizes) {
+  if (max_batch_size < 1) {
+    return errors::InvalidArgument("max_batch_size must be positive; was ",
+                                   max_batch_size);
+  }
+  if (max_num_allowed_batch_sizes < 1 ||
+      max_num_allowed_batch_sizes > max_batch_size) {
+    return errors::InvalidArgument(
+        "max_num_allowed_batch_sizes must be between 1 and max_batch_size (",
+        max_batch_size, "); was ", max_num_allowed_batch_sizes);
+  }
+  if (measured_batch_sizes.empty() ||
+      measured_batch_sizes.size() != latencies_micros.size()) {
+    return errors::InvalidArgument(
+        "Need one latency per measured batch size; got ",
+        measured_batch_sizes.size(), " sizes and ", latencies_micros.size(),
+        " latencies");
+  }
+  if (measured_batch_sizes.back() != max_batch_size ||
+      !std::is_sorted(measured_batch_sizes.begin(),
+                      measured_batch_sizes.end()) ||
+      std::adjacent_find(measured_batch_sizes.begin(),
+                         measured_batch_sizes.end()) !=
+          measured_batch_sizes.end() ||
+      measured_batch_sizes.front() < 1) {
+    return errors::InvalidArgument(
+        "Measured batch sizes must be positive, increasing, and end with "
+        "max_batch_size; got ",
+        str_util::Join(measured_batch_sizes, ","));
+  }
+
+  // cumulative_weights[n] is the total weight of the batch sizes up to n.
+  std::vector<double> cumulative_weights(max_batch_size + 1, 0);
+  for (int n = 1; n <= max_batch_size; ++n) {
+    double weight = 1;
+    if (!batch_size_weights.empty()) {
+      weight = n <= batch_size_weights.size() ? batch_size_weights[n - 1] : 0;
+    }
+    if (weight < 0) {
+      return errors::InvalidArgument(
+          "Batch size weights must be non-negative; got ", weight,
+          " for size ", n);
+    }
+    cumulative_weights[n] = cumulative_weights[n - 1] + weight;
+  }
+  if (cumulative_weights[max_batch_size] <= 0) {
+    return errors::InvalidArgument(
+        "Batch size weights must not all be 0 up to max_batch_size");
+  }
+
+  // The candidate sizes, in increasing order and ending with 'max_batch_size'.
+  std::vector<int> candidates;
+  const int step = (max_batch_size + kMaxNumCandidateBatchSizes - 1) /
+                   kMaxNumCandidateBatchSizes;
+  for (int size = step; size < max_batch_size; size += step) {
+    candidates.push_back(size);
+  }
+  candidates.push_back(max_batch_size);
+  const int num_candidates = candidates.size();
+  std::vector<double> candidate_latencies(num_candidates);
+  for (int j = 0; j < num_candidates; ++j) {
+    candidate_latencies[j] = InterpolateLatency(
+        measured_batch_sizes, latencies_micros, candidates[j]);
+  }
+
+  // A dynamic program over the candidates, taking O(num_sizes * C^2) time and
+  // O(num_sizes * C) space for C candidates.
+  //
+  // cost[k][j] is the least expected latency (times the total weight) of the
+  // batches of sizes up to 'candidates[j]', using k + 1 allowed sizes of
+  // which 'candidates[j]' is the largest; previous[k][j] is the index of the
+  // next smaller allowed size in that solution (or -1).
+  const double kInfinity = std::numeric_limits<double>::infinity();
+  const int num_sizes = std::min(max_num_allowed_batch_sizes, num_candidates);
+  std::vector<std::vector<double>> cost(
+      num_sizes, std::vector<double>(num_candidates, kInfinity));
+  std::vector<std::vector<int>> previous(num_sizes,
+                                         std::vector<int>(num_candidates, -1));
+  for (int j = 0; j < num_candidates; ++j) {
+    cost[0][j] = cumulative_weights[candidates[j]] * candidate_latencies[j];
+  }
+  for (int k = 1; k < num_sizes; ++k) {
+    for (int j = k; j < num_candidates; ++j) {
+      for (int i = k - 1; i < j; ++i) {
+        const double candidate_cost =
+            cost[k - 1][i] + (cumulative_weights[candidates[j]] -
+                              cumulative_weights[candidates[i]]) *
+                                 candidate_latencies[j];
+        if (candidate_cost < cost[k][j]) {
+          cost[k][j] = candidate_cost;
+          previous[k][j] = i;
+        }
+      }
+    }
+  }
+
+  // Use more sizes only if doing so strictly lowers the cost.
+  int best_k = 0;
+  for (int k = 1; k < num_sizes; ++k) {
+    if (cost[k][num_candidates - 1] < cost[best_k][num_candidates - 1]) {
+      best_k = k;
+    }
+  }
+  allowed_batch_sizes->clear();
+  for (int k = best_k, j = num_candidates - 1; j >= 0; j = previous[k--][j]) {
+    allowed_batch_sizes->push_back(candidates[j]);
+  }
+  std::reverse(allowed_batch_sizes->begin(), allowed_batch_sizes->end());
+  return Status::OK();
+}
+
+Status ProfileAllowedBatchSizes(const ProfileAllowedBatchSizesOptions& options,
+                                const std::vector<SignatureDef>& signatures,
+                                Session* session,
+                                std::vector<int>* allowed_batch_sizes) {
+  if (options.max_batch_size < 1) {
+    return errors::InvalidArgument("max_batch_size must be positive; was ",
+                                   options.max_batch_size);
+  }
+  // (Checked here too, so as to fail before spending time on measurements.)
+  if (options.max_num_allowed_batch_sizes < 1 ||
+      options.max_num_allowed_batch_sizes > options.max_batch_size) {
+    return errors::InvalidArgument(
+        "max_num_allowed_batch_sizes must be between 1 and max_batch_size (",
+        options.max_batch_size, "); was ",
+        options.max_num_allowed_batch_sizes);
+  }
+  if (signatures.empty()) {
+    return errors::InvalidArgument("No signatures to profile");
+  }
+
+  std::vector<int> measured_batch_sizes;
+  for (int size = 1; size < options.max_batch_size; size *= 2) {
+    measured_batch_sizes.push_back(size);
+  }
+  measured_batch_sizes.push_back(options.max_batch_size);
+  std::vector<double> latencies_micros(measured_batch_sizes.size(), 0);
+  for (const SignatureDef& signature : signatures) {
+    std::vector<double> signature_latencies_micros;
+    TF_RETURN_IF_ERROR(MeasureBatchLatencies(session, signature,
+                                             measured_batch_sizes,
+                                             options.num_runs,
+                                             &signature_latencies_micros));
+    for (int i = 0; i < latencies_micros.size(); ++i) {
+      latencies_micros[i] += signature_latencies_micros[i];
+    }
+  }
+  for (int i = 0; i < measured_batch_sizes.size(); ++i) {
+    VLOG(1) << "Batch size " << measured_batch_sizes[i] << " took "
+            << latencies_micros[i] << " microseconds";
+  }
+
+  TF_RETURN_IF_ERROR(ChooseAllowedBatchSizes(
+      measured_batch_sizes, latencies_micros, options.batch_size_weights,
+      options.max_batch_size, options.max_num_allowed_batch_sizes,
+      allowed_batch_sizes));
+  LOG(INFO) << "Chose allowed batch sizes "
+            << str_util::Join(*allowed_batch_sizes, ",");
+  return Status::OK();
+}
+
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,107 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Utilities for choosing the allowed batch sizes of a BatchingSession (see
+// BatchingSessionOptions::allowed_batch_sizes) from the measured latency of
+// the wrapped session, rather than by hand.
+//
+// Each allowed size costs a specialization of the graph (e.g. an XLA
+// compilation, or a cuDNN algorithm choice) and memory for it, while every
+// batch padded beyond its own size wastes work. Given a latency curve and the
+// expected distribution of batch sizes, ChooseAllowedBatchSizes() picks the
+// sizes that minimize the expected latency of a (padded) batch, which also
+// captures the cost of the padding.
+
+#ifndef TENSORFLOW_SERVING_BATCHING_ALLOWED_BATCH_SIZES_H_
+#define TENSORFLOW_SERVING_BATCHING_ALLOWED_BATCH_SIZES_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/protobuf/meta_graph.pb.h"
+#include "tensorflow/core/public/session.h"
+
+namespace tensorflow {
+namespace serving {
+
+// Creates inputs of 'batch_size' rows for a Run() call on 'signature': one
+// zero-filled tensor per signature input, of the input's dtype and shape,
+// with dimension 0 set to 'batch_size' and any other unknown dimensions set
+// to 1. Each input must have a known dtype and rank (of at least 1).
+Status CreateSyntheticInputs(const SignatureDef& signature, int batch_size,
+                             std::vector<std::pair<string, Tensor>>* inputs);
+
+// Measures the latency, in microseconds, of running 'signature' on 'session'
+// with synthetic inputs (see CreateSyntheticInputs()) at each of
+// 'batch_sizes'. Each size is run once to warm up, and then 'num_runs' times,
+// of which the median latency is reported.
+Status MeasureBatchLatencies(Session* session, const SignatureDef& signature,
+                             const std::vector<int>& batch_sizes, int num_runs,
+                             std::vector<double>* latencies_micros);
+
+// Chooses up to 'max_num_allowed_batch_sizes' allowed batch sizes, in
+// increasing order and ending with 'max_batch_size', so as to minimize the
+// expected latency of a batch once padded up to the next allowed size.
+// 'max_num_allowed_batch_sizes' must be between 1 and 'max_batch_size'.
+//
+// The sizes are picked from C = min('max_batch_size', 1024) evenly spaced
+// candidates, in O('max_num_allowed_batch_sizes' * C^2) time, e.g. about 10^8
+// steps for 100 sizes out of 1024 candidates.
+//
+// The latency of each size is interpolated linearly from 'latencies_micros',
+// measured at 'measured_batch_sizes' (which must be in increasing order and
+// end with 'max_batch_size'). Entry i of 'batch_size_weights' is the relative
+// frequency of batches of size i + 1; sizes beyond the end of the vector get
+// weight 0, and if it is empty, all sizes are taken to be equally likely.
+Status ChooseAllowedBatchSizes(const std::vector<int>& measured_batch_sizes,
+                               const std::vector<double>& latencies_micros,
+                               const std::vector<double>& batch_size_weights,
+                               int max_batch_size,
+                               int max_num_allowed_batch_sizes,
+                               std::vector<int>* allowed_batch_sizes);
+
+// Options for ProfileAllowedBatchSizes().
+struct ProfileAllowedBatchSizesOptions {
+  // The largest batch size, which is always allowed.
+  int max_batch_size = 0;
+
+  // The maximum number of allowed batch sizes to choose. Must be between 1 and
+  // 'max_batch_size'; the time to choose them grows linearly with it (see
+  // ChooseAllowedBatchSizes()).
+  int max_num_allowed_batch_sizes = 1;
+
+  // The expected distribution of batch sizes; see ChooseAllowedBatchSizes().
+  std::vector<double> batch_size_weights;
+
+  // The number of timed runs at each batch size.
+  int num_runs = 3;
+};
+
+// Measures the latency of 'session' at batch sizes 1, 2, 4, ... and
+// 'options.max_batch_size', summed over 'signatures', and chooses the allowed
+// batch sizes from that (see ChooseAllowedBatchSizes()). Intended to be called
+// when a model is loaded, before the session is wrapped for batching.
+Status ProfileAllowedBatchSizes(const ProfileAllowedBatchSizesOptions& options,
+                                const std::vector<SignatureDef>& signatures,
+                                Session* session,
+                                std::vector<int>* allowed_batch_sizes);
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_BATCHING_ALLOWED_BATCH_SIZES_H_
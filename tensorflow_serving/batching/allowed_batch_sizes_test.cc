@@ -0,0 +1,125 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/allowed_batch_sizes.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include "tensorflow/core/framework/tensor_testutil.h"
+#include "tensorflow/core/lib/core/status_test_util.h"
+
+using ::testing::ElementsAre;
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+TEST(AllowedBatchSizesTest, ChooseWithFlatLatency) {
+  // If larger batches cost no more, padding is free, so one size suffices.
+  std::vector<int> allowed_batch_sizes;
+  TF_ASSERT_OK(ChooseAllowedBatchSizes({1, 2, 4, 8}, {10, 10, 10, 10}, {}, 8,
+                                       3, &allowed_batch_sizes));
+  EXPECT_THAT(allowed_batch_sizes, ElementsAre(8));
+}
+
+TEST(AllowedBatchSizesTest, ChooseWithLinearLatency) {
+  // The latency of batch size b is b (interpolated between 1 and 4).
+  std::vector<int> allowed_batch_sizes;
+  TF_ASSERT_OK(ChooseAllowedBatchSizes({1, 4}, {1, 4}, {}, 4, 4,
+                                       &allowed_batch_sizes));
+  EXPECT_THAT(allowed_batch_sizes, ElementsAre(1, 2, 3, 4));
+
+  // With two sizes, {2, 4} costs 2 + 2 + 4 + 4 = 12, less than {1, 4} or
+  // {3, 4} (13 each).
+  TF_ASSERT_OK(ChooseAllowedBatchSizes({1, 4}, {1, 4}, {}, 4, 2,
+                                       &allowed_batch_sizes));
+  EXPECT_THAT(allowed_batch_sizes, ElementsAre(2, 4));
+
+  // Only the sizes that occur matter.
+  TF_ASSERT_OK(ChooseAllowedBatchSizes({1, 4}, {1, 4}, {0, 0, 1, 1}, 4, 2,
+                                       &allowed_batch_sizes));
+  EXPECT_THAT(allowed_batch_sizes, ElementsAre(3, 4));
+}
+
+TEST(AllowedBatchSizesTest, ChooseWithLargeMaxBatchSize) {
+  // A step in latency at 3000: sizes up to there should share one size.
+  std::vector<int> allowed_batch_sizes;
+  TF_ASSERT_OK(ChooseAllowedBatchSizes({1, 3000, 3001, 5000},
+                                       {100, 100, 1000, 1000}, {}, 5000, 2,
+                                       &allowed_batch_sizes));
+  ASSERT_EQ(2, allowed_batch_sizes.size());
+  EXPECT_LE(allowed_batch_sizes[0], 3000);
+  EXPECT_GT(allowed_batch_sizes[0], 2990);
+  EXPECT_EQ(5000, allowed_batch_sizes[1]);
+}
+
+TEST(AllowedBatchSizesTest, ChooseWithInvalidArguments) {
+  std::vector<int> allowed_batch_sizes;
+  // The measured sizes must end with the maximum batch size.
+  EXPECT_FALSE(
+      ChooseAllowedBatchSizes({1, 2}, {1, 2}, {}, 4, 2, &allowed_batch_sizes)
+          .ok());
+  // ... and be increasing.
+  EXPECT_FALSE(
+      ChooseAllowedBatchSizes({2, 1, 4}, {1, 2, 4}, {}, 4, 2,
+                              &allowed_batch_sizes)
+          .ok());
+  // One latency per size.
+  EXPECT_FALSE(
+      ChooseAllowedBatchSizes({1, 4}, {1}, {}, 4, 2, &allowed_batch_sizes)
+          .ok());
+  // Some size must have positive weight.
+  EXPECT_FALSE(ChooseAllowedBatchSizes({1, 4}, {1, 4}, {0, 0, 0, 0, 1}, 4, 2,
+                                       &allowed_batch_sizes)
+                   .ok());
+  // The number of sizes must be between 1 and the maximum batch size.
+  EXPECT_FALSE(
+      ChooseAllowedBatchSizes({1, 4}, {1, 4}, {}, 4, 0, &allowed_batch_sizes)
+          .ok());
+  EXPECT_FALSE(
+      ChooseAllowedBatchSizes({1, 4}, {1, 4}, {}, 4, 5, &allowed_batch_sizes)
+          .ok());
+}
+
+TEST(AllowedBatchSizesTest, CreateSyntheticInputs) {
+  SignatureDef signature;
+  TensorInfo x;
+  x.set_name("x:0");
+  x.set_dtype(DT_FLOAT);
+  x.mutable_tensor_shape()->add_dim()->set_size(-1);
+  x.mutable_tensor_shape()->add_dim()->set_size(3);
+  x.mutable_tensor_shape()->add_dim()->set_size(-1);
+  (*signature.mutable_inputs())["x"] = x;
+
+  std::vector<std::pair<string, Tensor>> inputs;
+  TF_ASSERT_OK(CreateSyntheticInputs(signature, 4, &inputs));
+  ASSERT_EQ(1, inputs.size());
+  EXPECT_EQ("x:0", inputs[0].first);
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>(std::vector<float>(12, 0), {4, 3, 1}),
+      inputs[0].second);
+
+  // Inputs without a known rank or dtype are rejected.
+  (*signature.mutable_inputs())["x"].mutable_tensor_shape()->set_unknown_rank(
+      true);
+  EXPECT_FALSE(CreateSyntheticInputs(signature, 4, &inputs).ok());
+  (*signature.mutable_inputs())["x"] = x;
+  (*signature.mutable_inputs())["x"].set_dtype(DT_INVALID);
+  EXPECT_FALSE(CreateSyntheticInputs(signature, 4, &inputs).ok());
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
@@ -21,6 +21,7 @@ limitations under the License.
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "tensorflow_serving/batching/shared_batch_scheduler.h"
 
@@ -175,6 +176,15 @@ class BasicBatchScheduler : public BatchScheduler<TaskType> {
     // parameter.
     int max_enqueued_batches = 1;
 
+    // If true, tasks larger than 'max_batch_size' are split across multiple
+    // batches using 'split_input_task_func', rather than rejected. See the
+    // corresponding SharedBatchScheduler::QueueOptions fields for details.
+    bool enable_large_batch_splitting = false;
+    std::function<Status(std::unique_ptr<TaskType>* input_task,
+                         int first_output_task_size, int max_batch_size,
+                         std::vector<std::unique_ptr<TaskType>>* output_tasks)>
+        split_input_task_func;
+
     // The following options are typically only overridden by test code.
 
     // The environment to use.
@@ -188,6 +198,8 @@ class BasicBatchScheduler : public BatchScheduler<TaskType> {
   ~BasicBatchScheduler() override = default;
 
   Status Schedule(std::unique_ptr<TaskType>* task) override;
+  Status ScheduleWithTimeout(std::unique_ptr<TaskType>* task,
+                             int64 timeout_micros) override;
   size_t NumEnqueuedTasks() const override;
   size_t SchedulingCapacity() const override;
 
@@ -226,6 +238,10 @@ Status BasicBatchScheduler<TaskType>::Create(
       options.batch_timeout_micros;
   shared_scheduler_queue_options.max_enqueued_batches =
       options.max_enqueued_batches;
+  shared_scheduler_queue_options.enable_large_batch_splitting =
+      options.enable_large_batch_splitting;
+  shared_scheduler_queue_options.split_input_task_func =
+      options.split_input_task_func;
   std::unique_ptr<BatchScheduler<TaskType>> shared_scheduler_queue;
   TF_RETURN_IF_ERROR(shared_scheduler->AddQueue(shared_scheduler_queue_options,
                                                 process_batch_callback,
@@ -242,6 +258,12 @@ Status BasicBatchScheduler<TaskType>::Schedule(
   return shared_scheduler_queue_->Schedule(task);
 }
 
+template <typename TaskType>
+Status BasicBatchScheduler<TaskType>::ScheduleWithTimeout(
+    std::unique_ptr<TaskType>* task, int64 timeout_micros) {
+  return shared_scheduler_queue_->ScheduleWithTimeout(task, timeout_micros);
+}
+
 template <typename TaskType>
 size_t BasicBatchScheduler<TaskType>::NumEnqueuedTasks() const {
   return shared_scheduler_queue_->NumEnqueuedTasks();
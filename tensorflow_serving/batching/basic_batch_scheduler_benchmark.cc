@@ -14,7 +14,8 @@ limitations under the License.
 ==============================================================================*/
 
 // Benchmarks for performance (throughput and latency) of BasicBatchScheduler
-// under various rates of task injection.
+// under various rates of task injection, and for the accuracy with which it
+// honors batch timeouts.
 //
 // Run with:
 // bazel run -c opt --dynamic_mode=off \
@@ -409,6 +410,64 @@ static void RunLatencyBenchmark(int64 task_injection_interval_micros,
   benchmark.RunBenchmark();
 }
 
+// Measures how promptly the scheduler closes a batch once it reaches its
+// timeout: injects tasks one at a time into an otherwise idle scheduler (so
+// each batch closes due to the timeout), and records how long after the
+// timeout each batch starts being processed.
+static void RunTimeoutAccuracyBenchmark(int64 batch_timeout_micros) {
+  BasicBatchScheduler<BenchmarkBatchTask>::Options scheduler_options;
+  scheduler_options.max_batch_size = 100;
+  scheduler_options.batch_timeout_micros = batch_timeout_micros;
+  scheduler_options.num_batch_threads = 1;
+
+  mutex mu;
+  // A histogram of the time between each batch's timeout and the start of its
+  // processing, in microseconds.
+  Histogram lateness_micros_histogram;
+  auto process_batch_callback =
+      [&mu, &lateness_micros_histogram,
+       batch_timeout_micros](std::unique_ptr<Batch<BenchmarkBatchTask>> batch) {
+        const int64 wait_micros =
+            Env::Default()->NowMicros() - batch->task(0).start_time_micros();
+        mutex_lock l(mu);
+        lateness_micros_histogram.Add(wait_micros - batch_timeout_micros);
+      };
+  std::unique_ptr<BasicBatchScheduler<BenchmarkBatchTask>> scheduler;
+  TF_CHECK_OK(BasicBatchScheduler<BenchmarkBatchTask>::Create(
+      scheduler_options, process_batch_callback, &scheduler));
+
+  // Leave enough time between tasks for each batch to time out and be
+  // processed before the next task arrives.
+  const int kNumTasks = 2000;
+  const int64 kTaskSpacingMicros = 2 * 1000;
+  UniformLoadInjector injector;
+  injector.InjectLoad(
+      [&scheduler] {
+        auto task = std::unique_ptr<BenchmarkBatchTask>(new BenchmarkBatchTask);
+        TF_CHECK_OK(scheduler->Schedule(&task));
+      },
+      kNumTasks, batch_timeout_micros + kTaskSpacingMicros);
+  scheduler.reset();
+
+  mutex_lock l(mu);
+  std::cout << "\t"
+            << "median lateness: " << lateness_micros_histogram.Median()
+            << "us"
+            << "\t"
+            << "99% lateness: " << lateness_micros_histogram.Percentile(99)
+            << "us" << std::endl;
+}
+
+static void RunTimeoutAccuracyBenchmarks() {
+  for (const int64 batch_timeout_micros : {100, 200, 500, 1000, 2000}) {
+    std::cout << "Timeout accuracy benchmark w/ batch timeout "
+              << batch_timeout_micros << "us"
+              << "\t...";
+    RunTimeoutAccuracyBenchmark(batch_timeout_micros);
+  }
+  std::cout << std::endl;
+}
+
 static void RunLatencyBenchmarks() {
   for (const int64 batch_timeout_micros : {0, 1 * 1000, 2 * 1000, 5 * 1000}) {
     for (const int64 task_injection_interval_micros : {1000, 50, 20}) {
@@ -432,7 +491,9 @@ int main(int argc, char** argv) {
   tensorflow::port::InitMain(argv[0], &argc, &argv);
   std::setprecision(5);
 
-  // Run latency benchmarks (outside of tensorflow benchmark framework).
+  // Run timeout accuracy and latency benchmarks (outside of tensorflow
+  // benchmark framework).
+  tensorflow::serving::RunTimeoutAccuracyBenchmarks();
   tensorflow::serving::RunLatencyBenchmarks();
 
   // Run throughput benchmarks (via tensorflow benchmark framework).
@@ -40,6 +40,7 @@ limitations under the License.
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/thread_annotations.h"
 #include "tensorflow/core/platform/types.h"
+#include "tensorflow_serving/util/free_list.h"
 
 namespace tensorflow {
 namespace serving {
@@ -62,6 +63,25 @@ class BatchTask {
   // Returns the size of the task, in terms of how much it contributes to the
   // size of a batch. (A batch's size is the sum of its task sizes.)
   virtual size_t size() const = 0;
+
+  // Returns the cost of the task, for schedulers that limit the total cost of a
+  // batch as well as its size (see e.g. SharedBatchScheduler's
+  // 'max_batch_cost'). Subclasses may override it to account for work that
+  // does not scale with size alone, e.g. the length of sequence inputs.
+  // Defaults to size().
+  virtual size_t cost() const { return size(); }
+
+  // Returns the number of bytes of memory the task holds while it waits to be
+  // processed (e.g. the size of its input tensors), for schedulers that bound
+  // the memory of their enqueued tasks (see e.g. SharedBatchScheduler's
+  // 'max_enqueued_bytes'). Defaults to 0, i.e. unaccounted.
+  virtual size_t bytes() const { return 0; }
+
+  // Returns the absolute time, in microseconds (as per Env::NowMicros() of the
+  // scheduler's environment), by which the task ought to have been processed,
+  // or 0 if the task has no deadline. Schedulers may use deadlines to decide
+  // when to close a batch; see e.g. SharedBatchScheduler.
+  virtual uint64 deadline_micros() const { return 0; }
 };
 
 // A thread-safe collection of BatchTasks, to be executed together in some
@@ -73,11 +93,14 @@ class BatchTask {
 // remains fixed for the remainder of its life. A closed batch cannot be re-
 // opened. Tasks can never be removed from a batch.
 //
+// Batches are created and destroyed once per batch by the schedulers, so their
+// memory, and the storage of their task vectors, is recycled via free lists.
+//
 // Type parameter TaskType must be a subclass of BatchTask.
 template <typename TaskType>
-class Batch {
+class Batch : public FreeListAllocated<Batch<TaskType>> {
  public:
-  Batch() = default;
+  Batch();
   ~Batch();  // Blocks until the batch is closed.
 
   // Appends 'task' to the batch. After calling AddTask(), the newly-added task
@@ -104,6 +127,9 @@ class Batch {
   // Returns the sum of the task sizes.
   size_t size() const;
 
+  // Returns the sum of the task costs.
+  size_t cost() const;
+
   // Returns true iff the batch is currently closed.
   bool IsClosed() const;
 
@@ -122,9 +148,15 @@ class Batch {
   // The sum of the sizes of the tasks in 'tasks_'.
   size_t size_ GUARDED_BY(mu_) = 0;
 
+  // The sum of the costs of the tasks in 'tasks_'.
+  size_t cost_ GUARDED_BY(mu_) = 0;
+
   // Whether the batch has been closed.
   Notification closed_;
 
+  // Emptied task vectors of destroyed batches, which retain their capacity.
+  static FreeList<std::vector<std::unique_ptr<TaskType>>>* TaskVectorFreeList();
+
   TF_DISALLOW_COPY_AND_ASSIGN(Batch);
 };
 
@@ -158,6 +190,18 @@ class BatchScheduler {
   // of the batch that includes the task can be reported to 'task'.
   virtual Status Schedule(std::unique_ptr<TaskType>* task) = 0;
 
+  // Like Schedule(), except that if there is no capacity for the task, blocks
+  // for up to 'timeout_micros' until there is, before giving up with an
+  // UNAVAILABLE error. Callers blocked on the same scheduler (or queue) are
+  // served in the order in which they called.
+  //
+  // The default implementation doesn't block, i.e. is equivalent to
+  // Schedule(). Subclasses that can tell when capacity frees up override it.
+  virtual Status ScheduleWithTimeout(std::unique_ptr<TaskType>* task,
+                                     int64 timeout_micros) {
+    return Schedule(task);
+  }
+
   // Returns the number of tasks that have been scheduled (i.e. accepted by
   // Schedule()), but have yet to be handed to a thread for execution as part of
   // a batch. Note that this returns the number of tasks, not the aggregate task
@@ -183,9 +227,19 @@ class BatchScheduler {
 //////////
 // Implementation details follow. API users need not read.
 
+template <typename TaskType>
+Batch<TaskType>::Batch() {
+  TaskVectorFreeList()->Pop(&tasks_);
+}
+
 template <typename TaskType>
 Batch<TaskType>::~Batch() {
   WaitUntilClosed();
+  {
+    mutex_lock l(mu_);
+    tasks_.clear();
+    TaskVectorFreeList()->Push(&tasks_);
+  }
 }
 
 template <typename TaskType>
@@ -194,6 +248,7 @@ void Batch<TaskType>::AddTask(std::unique_ptr<TaskType> task) {
   {
     mutex_lock l(mu_);
     size_ += task->size();
+    cost_ += task->cost();
     tasks_.push_back(std::move(task));
   }
 }
@@ -207,6 +262,8 @@ std::unique_ptr<TaskType> Batch<TaskType>::RemoveTask() {
     }
     std::unique_ptr<TaskType> task = std::move(tasks_.back());
     tasks_.pop_back();
+    size_ -= task->size();
+    cost_ -= task->cost();
     return task;
   }
 }
@@ -255,6 +312,14 @@ size_t Batch<TaskType>::size() const {
   }
 }
 
+template <typename TaskType>
+size_t Batch<TaskType>::cost() const {
+  {
+    mutex_lock l(mu_);
+    return cost_;
+  }
+}
+
 template <typename TaskType>
 bool Batch<TaskType>::IsClosed() const {
   return const_cast<Notification*>(&closed_)->HasBeenNotified();
@@ -270,6 +335,15 @@ void Batch<TaskType>::Close() {
   closed_.Notify();
 }
 
+template <typename TaskType>
+FreeList<std::vector<std::unique_ptr<TaskType>>>*
+Batch<TaskType>::TaskVectorFreeList() {
+  // Never destroyed; see FreeListAllocated.
+  static FreeList<std::vector<std::unique_ptr<TaskType>>>* const free_list =
+      new FreeList<std::vector<std::unique_ptr<TaskType>>>(1024);
+  return free_list;
+}
+
 }  // namespace serving
 }  // namespace tensorflow
 
@@ -0,0 +1,506 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A load benchmark for comparing batch scheduler configurations offline.
+// Injects tasks into a BasicBatchScheduler, a SharedBatchScheduler with
+// several queues, or a StreamingBatchScheduler following a Poisson, bursty
+// (on/off) or replayed arrival pattern, and processes each batch by burning
+// CPU for a time given by a synthetic cost model. Reports the distribution of
+// the time tasks spend queued (from Schedule() until their batch starts being
+// processed), the distribution of batch sizes, and the CPU time used.
+//
+// Run with e.g.:
+// bazel run -c opt --dynamic_mode=off \
+// tensorflow_serving/batching:batch_scheduler_load_benchmark -- \
+// --scheduler=shared --num_queues=4 --arrival_pattern=bursty \
+// --arrival_rate=20000 --batch_timeout_micros=2000
+//
+// A replayed arrival pattern is read from a file listing one arrival time per
+// line, in microseconds (e.g. request timestamps taken from a server log); it
+// is shifted to start at time 0.
+
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/histogram/histogram.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/init_main.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/command_line_flags.h"
+#include "tensorflow_serving/batching/basic_batch_scheduler.h"
+#include "tensorflow_serving/batching/shared_batch_scheduler.h"
+#include "tensorflow_serving/batching/streaming_batch_scheduler.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+using ::tensorflow::histogram::Histogram;
+
+// The benchmark's parameters, settable via flags (see main()).
+struct BenchmarkOptions {
+  // One of "basic", "shared" and "streaming".
+  string scheduler = "basic";
+  // The number of queues to spread the tasks over (round-robin), with the
+  // "shared" scheduler.
+  int32 num_queues = 1;
+  int32 max_batch_size = 100;
+  int64 batch_timeout_micros = 1000;
+  int32 num_batch_threads = 4;
+  int32 max_enqueued_batches = 100;
+
+  // One of "poisson", "bursty" and "trace".
+  string arrival_pattern = "poisson";
+  // The mean arrival rate of a Poisson pattern, and of a bursty one during its
+  // on-periods, in tasks per second.
+  int64 arrival_rate = 1000;
+  // The lengths of the on- and off-periods of a bursty pattern.
+  int64 burst_on_micros = 100 * 1000;
+  int64 burst_off_micros = 400 * 1000;
+  // The file from which to replay a "trace" pattern.
+  string arrival_trace;
+  // How long to inject tasks for. (A trace is cut off after this long.)
+  int64 duration_micros = 10 * 1000 * 1000;
+
+  // The time to process a batch of size N is 'batch_fixed_cost_micros' +
+  // N * 'batch_per_task_cost_micros'.
+  int64 batch_fixed_cost_micros = 500;
+  int64 batch_per_task_cost_micros = 10;
+};
+
+// A sequence of task arrival times.
+class ArrivalProcess {
+ public:
+  virtual ~ArrivalProcess() = default;
+
+  // Returns the time of the next arrival, in microseconds since the start of
+  // the benchmark, or a negative value if there are no more arrivals.
+  virtual int64 NextArrivalMicros() = 0;
+};
+
+// Arrivals with exponentially-distributed spacing.
+class PoissonArrivalProcess : public ArrivalProcess {
+ public:
+  explicit PoissonArrivalProcess(int64 arrival_rate)
+      : spacing_micros_(arrival_rate / 1e6) {}
+  ~PoissonArrivalProcess() override = default;
+
+  int64 NextArrivalMicros() override {
+    time_micros_ += spacing_micros_(random_);
+    return static_cast<int64>(time_micros_);
+  }
+
+ private:
+  std::mt19937_64 random_;
+  std::exponential_distribution<double> spacing_micros_;
+  double time_micros_ = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(PoissonArrivalProcess);
+};
+
+// Poisson arrivals during on-periods, separated by off-periods without any.
+class BurstyArrivalProcess : public ArrivalProcess {
+ public:
+  BurstyArrivalProcess(int64 arrival_rate, int64 on_micros, int64 off_micros)
+      : poisson_(arrival_rate),
+        on_micros_(on_micros),
+        off_micros_(off_micros) {}
+  ~BurstyArrivalProcess() override = default;
+
+  // Maps the arrivals of a Poisson process onto the on-periods, i.e. an
+  // arrival at time t of the Poisson process happens t into the total time the
+  // bursty process has been on.
+  int64 NextArrivalMicros() override {
+    const int64 on_time_micros = poisson_.NextArrivalMicros();
+    const int64 num_periods = on_time_micros / on_micros_;
+    return on_time_micros + num_periods * off_micros_;
+  }
+
+ private:
+  PoissonArrivalProcess poisson_;
+  const int64 on_micros_;
+  const int64 off_micros_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(BurstyArrivalProcess);
+};
+
+// Arrivals at recorded times.
+class TraceArrivalProcess : public ArrivalProcess {
+ public:
+  // Reads the arrival times from 'path'; see the file comment above.
+  static Status Create(const string& path,
+                       std::unique_ptr<ArrivalProcess>* process) {
+    string contents;
+    TF_RETURN_IF_ERROR(ReadFileToString(Env::Default(), path, &contents));
+    std::vector<int64> arrival_times_micros;
+    for (const string& line : str_util::Split(contents, '\n')) {
+      if (line.empty()) {
+        continue;
+      }
+      int64 arrival_time_micros;
+      if (!strings::safe_strto64(line, &arrival_time_micros)) {
+        return errors::InvalidArgument("Invalid arrival time in ", path, ": ",
+                                       line);
+      }
+      arrival_times_micros.push_back(arrival_time_micros);
+    }
+    if (arrival_times_micros.empty()) {
+      return errors::InvalidArgument("No arrival times in ", path);
+    }
+    std::sort(arrival_times_micros.begin(), arrival_times_micros.end());
+    const int64 start_time_micros = arrival_times_micros.front();
+    for (int64& arrival_time_micros : arrival_times_micros) {
+      arrival_time_micros -= start_time_micros;
+    }
+    process->reset(new TraceArrivalProcess(std::move(arrival_times_micros)));
+    return Status::OK();
+  }
+
+  ~TraceArrivalProcess() override = default;
+
+  int64 NextArrivalMicros() override {
+    if (next_ == arrival_times_micros_.size()) {
+      return -1;
+    }
+    return arrival_times_micros_[next_++];
+  }
+
+ private:
+  explicit TraceArrivalProcess(std::vector<int64> arrival_times_micros)
+      : arrival_times_micros_(std::move(arrival_times_micros)) {}
+
+  const std::vector<int64> arrival_times_micros_;
+  size_t next_ = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(TraceArrivalProcess);
+};
+
+class BenchmarkBatchTask : public BatchTask {
+ public:
+  BenchmarkBatchTask() : enqueue_time_micros_(Env::Default()->NowMicros()) {}
+
+  BenchmarkBatchTask(const BenchmarkBatchTask&) = delete;
+  BenchmarkBatchTask& operator=(const BenchmarkBatchTask&) = delete;
+
+  ~BenchmarkBatchTask() override = default;
+
+  size_t size() const override { return 1; }
+
+  uint64 enqueue_time_micros() const { return enqueue_time_micros_; }
+
+ private:
+  // The time at which the task was created, in microseconds.
+  const uint64 enqueue_time_micros_;
+};
+
+// The measurements taken by the benchmark.
+class BenchmarkStats {
+ public:
+  BenchmarkStats() = default;
+
+  // Records a batch that is about to be processed.
+  void RecordBatch(const Batch<BenchmarkBatchTask>& batch) {
+    const uint64 now_micros = Env::Default()->NowMicros();
+    mutex_lock l(mu_);
+    batch_size_histogram_.Add(batch.num_tasks());
+    for (int i = 0; i < batch.num_tasks(); ++i) {
+      queueing_micros_histogram_.Add(now_micros -
+                                     batch.task(i).enqueue_time_micros());
+    }
+  }
+
+  void RecordRejection() { ++num_rejections_; }
+
+  // Writes the measurements to std::cout, given the wall-clock and CPU time the
+  // benchmark took.
+  void Report(double wall_seconds, double cpu_seconds) {
+    mutex_lock l(mu_);
+    std::cout << "tasks processed: " << queueing_micros_histogram_.num()
+              << "\trejected: " << num_rejections_ << std::endl
+              << "queueing latency (us):"
+              << "\tp50 " << queueing_micros_histogram_.Median() << "\tp99 "
+              << queueing_micros_histogram_.Percentile(99) << "\tp99.9 "
+              << queueing_micros_histogram_.Percentile(99.9) << "\tmax "
+              << queueing_micros_histogram_.Maximum() << std::endl
+              << "batch size:"
+              << "\tmean " << batch_size_histogram_.Average() << "\tp1 "
+              << batch_size_histogram_.Percentile(1) << "\tp50 "
+              << batch_size_histogram_.Median() << "\tp99 "
+              << batch_size_histogram_.Percentile(99) << std::endl
+              << "CPU: " << cpu_seconds << "s over " << wall_seconds
+              << "s wall time (" << cpu_seconds / wall_seconds << " cores)"
+              << std::endl;
+  }
+
+ private:
+  mutex mu_;
+  Histogram queueing_micros_histogram_ GUARDED_BY(mu_);
+  Histogram batch_size_histogram_ GUARDED_BY(mu_);
+  std::atomic<int64> num_rejections_{0};
+
+  TF_DISALLOW_COPY_AND_ASSIGN(BenchmarkStats);
+};
+
+// Burns CPU for 'micros' microseconds, as a stand-in for model computation.
+void BurnCpu(int64 micros) {
+  const uint64 end_time_micros = Env::Default()->NowMicros() + micros;
+  while (Env::Default()->NowMicros() < end_time_micros) {
+  }
+}
+
+// A scheduler under test, hiding its type.
+class SchedulerUnderTest {
+ public:
+  virtual ~SchedulerUnderTest() = default;
+
+  virtual Status Schedule(std::unique_ptr<BenchmarkBatchTask>* task) = 0;
+
+  // Waits until all the scheduled tasks have been processed.
+  virtual void Drain() = 0;
+};
+
+// Wraps BatchScheduler objects, scheduling tasks on them in turn, and any
+// other object that must be destroyed after them.
+class BatchSchedulersUnderTest : public SchedulerUnderTest {
+ public:
+  BatchSchedulersUnderTest(
+      std::vector<std::unique_ptr<BatchScheduler<BenchmarkBatchTask>>>
+          schedulers,
+      std::shared_ptr<void> owner)
+      : schedulers_(std::move(schedulers)), owner_(std::move(owner)) {}
+  ~BatchSchedulersUnderTest() override = default;
+
+  Status Schedule(std::unique_ptr<BenchmarkBatchTask>* task) override {
+    return schedulers_[next_scheduler_++ % schedulers_.size()]->Schedule(task);
+  }
+
+  void Drain() override {
+    schedulers_.clear();
+    owner_.reset();
+  }
+
+ private:
+  std::vector<std::unique_ptr<BatchScheduler<BenchmarkBatchTask>>> schedulers_;
+  std::shared_ptr<void> owner_;
+  std::atomic<uint64> next_scheduler_{0};
+
+  TF_DISALLOW_COPY_AND_ASSIGN(BatchSchedulersUnderTest);
+};
+
+Status CreateSchedulerUnderTest(
+    const BenchmarkOptions& options,
+    std::function<void(std::unique_ptr<Batch<BenchmarkBatchTask>>)>
+        process_batch_callback,
+    std::unique_ptr<SchedulerUnderTest>* scheduler) {
+  std::vector<std::unique_ptr<BatchScheduler<BenchmarkBatchTask>>> schedulers;
+  std::shared_ptr<void> owner;
+  if (options.scheduler == "basic") {
+    BasicBatchScheduler<BenchmarkBatchTask>::Options scheduler_options;
+    scheduler_options.max_batch_size = options.max_batch_size;
+    scheduler_options.batch_timeout_micros = options.batch_timeout_micros;
+    scheduler_options.num_batch_threads = options.num_batch_threads;
+    scheduler_options.max_enqueued_batches = options.max_enqueued_batches;
+    std::unique_ptr<BasicBatchScheduler<BenchmarkBatchTask>> basic_scheduler;
+    TF_RETURN_IF_ERROR(BasicBatchScheduler<BenchmarkBatchTask>::Create(
+        scheduler_options, process_batch_callback, &basic_scheduler));
+    schedulers.push_back(std::move(basic_scheduler));
+  } else if (options.scheduler == "shared") {
+    SharedBatchScheduler<BenchmarkBatchTask>::Options scheduler_options;
+    scheduler_options.num_batch_threads = options.num_batch_threads;
+    std::shared_ptr<SharedBatchScheduler<BenchmarkBatchTask>> shared_scheduler;
+    TF_RETURN_IF_ERROR(SharedBatchScheduler<BenchmarkBatchTask>::Create(
+        scheduler_options, &shared_scheduler));
+    SharedBatchScheduler<BenchmarkBatchTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = options.max_batch_size;
+    queue_options.batch_timeout_micros = options.batch_timeout_micros;
+    queue_options.max_enqueued_batches = options.max_enqueued_batches;
+    for (int i = 0; i < options.num_queues; ++i) {
+      std::unique_ptr<BatchScheduler<BenchmarkBatchTask>> queue;
+      TF_RETURN_IF_ERROR(shared_scheduler->AddQueue(
+          queue_options, process_batch_callback, &queue));
+      schedulers.push_back(std::move(queue));
+    }
+    owner = std::move(shared_scheduler);
+  } else if (options.scheduler == "streaming") {
+    StreamingBatchScheduler<BenchmarkBatchTask>::Options scheduler_options;
+    scheduler_options.max_batch_size = options.max_batch_size;
+    scheduler_options.batch_timeout_micros = options.batch_timeout_micros;
+    scheduler_options.num_batch_threads = options.num_batch_threads;
+    std::unique_ptr<StreamingBatchScheduler<BenchmarkBatchTask>>
+        streaming_scheduler;
+    TF_RETURN_IF_ERROR(StreamingBatchScheduler<BenchmarkBatchTask>::Create(
+        scheduler_options, process_batch_callback, &streaming_scheduler));
+    schedulers.push_back(std::move(streaming_scheduler));
+  } else {
+    return errors::InvalidArgument("Unknown scheduler: ", options.scheduler);
+  }
+  scheduler->reset(
+      new BatchSchedulersUnderTest(std::move(schedulers), std::move(owner)));
+  return Status::OK();
+}
+
+Status CreateArrivalProcess(const BenchmarkOptions& options,
+                            std::unique_ptr<ArrivalProcess>* process) {
+  if (options.arrival_pattern == "poisson") {
+    process->reset(new PoissonArrivalProcess(options.arrival_rate));
+  } else if (options.arrival_pattern == "bursty") {
+    process->reset(new BurstyArrivalProcess(options.arrival_rate,
+                                            options.burst_on_micros,
+                                            options.burst_off_micros));
+  } else if (options.arrival_pattern == "trace") {
+    return TraceArrivalProcess::Create(options.arrival_trace, process);
+  } else {
+    return errors::InvalidArgument("Unknown arrival pattern: ",
+                                   options.arrival_pattern);
+  }
+  return Status::OK();
+}
+
+Status RunBenchmark(const BenchmarkOptions& options) {
+  if (options.num_queues < 1 || options.max_batch_size < 1 ||
+      options.num_batch_threads < 1 || options.max_enqueued_batches < 1) {
+    return errors::InvalidArgument(
+        "num_queues, max_batch_size, num_batch_threads and "
+        "max_enqueued_batches must be at least 1");
+  }
+  if (options.batch_timeout_micros < 0 || options.duration_micros < 0 ||
+      options.batch_fixed_cost_micros < 0 ||
+      options.batch_per_task_cost_micros < 0) {
+    return errors::InvalidArgument(
+        "batch_timeout_micros, duration_micros, batch_fixed_cost_micros and "
+        "batch_per_task_cost_micros must be non-negative");
+  }
+  if (options.arrival_rate <= 0 || options.burst_on_micros <= 0 ||
+      options.burst_off_micros < 0) {
+    return errors::InvalidArgument(
+        "arrival_rate and burst_on_micros must be positive, and "
+        "burst_off_micros non-negative");
+  }
+  std::unique_ptr<ArrivalProcess> arrivals;
+  TF_RETURN_IF_ERROR(CreateArrivalProcess(options, &arrivals));
+
+  BenchmarkStats stats;
+  auto process_batch_callback =
+      [&options, &stats](std::unique_ptr<Batch<BenchmarkBatchTask>> batch) {
+        // (StreamingBatchScheduler hands over batches while they are open.)
+        batch->WaitUntilClosed();
+        stats.RecordBatch(*batch);
+        BurnCpu(options.batch_fixed_cost_micros +
+                batch->num_tasks() * options.batch_per_task_cost_micros);
+      };
+  std::unique_ptr<SchedulerUnderTest> scheduler;
+  TF_RETURN_IF_ERROR(
+      CreateSchedulerUnderTest(options, process_batch_callback, &scheduler));
+
+  const uint64 start_time_micros = Env::Default()->NowMicros();
+  const std::clock_t start_cpu_time = std::clock();
+  for (int64 arrival_micros = arrivals->NextArrivalMicros();
+       arrival_micros >= 0 && arrival_micros < options.duration_micros;
+       arrival_micros = arrivals->NextArrivalMicros()) {
+    // Wait for the arrival time, sleeping unless it is imminent.
+    const uint64 arrival_time_micros = start_time_micros + arrival_micros;
+    for (uint64 now_micros = Env::Default()->NowMicros();
+         now_micros < arrival_time_micros;
+         now_micros = Env::Default()->NowMicros()) {
+      const int64 kSleepThresholdMicros = 1000;
+      if (arrival_time_micros - now_micros >= kSleepThresholdMicros) {
+        Env::Default()->SleepForMicroseconds(arrival_time_micros - now_micros -
+                                             kSleepThresholdMicros / 2);
+      }
+    }
+
+    auto task = std::unique_ptr<BenchmarkBatchTask>(new BenchmarkBatchTask);
+    if (!scheduler->Schedule(&task).ok()) {
+      stats.RecordRejection();
+    }
+  }
+  scheduler->Drain();
+
+  const double wall_seconds =
+      (Env::Default()->NowMicros() - start_time_micros) / 1e6;
+  const double cpu_seconds =
+      static_cast<double>(std::clock() - start_cpu_time) / CLOCKS_PER_SEC;
+  // (The CPU time includes the injecting thread's, which mostly sleeps.)
+  stats.Report(wall_seconds, cpu_seconds);
+  return Status::OK();
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
+
+int main(int argc, char** argv) {
+  tensorflow::serving::BenchmarkOptions options;
+  std::vector<tensorflow::Flag> flag_list = {
+      tensorflow::Flag("scheduler", &options.scheduler,
+                       "the scheduler to benchmark: basic, shared or "
+                       "streaming"),
+      tensorflow::Flag("num_queues", &options.num_queues,
+                       "the number of queues to spread tasks over, with the "
+                       "shared scheduler"),
+      tensorflow::Flag("max_batch_size", &options.max_batch_size,
+                       "the maximum batch size"),
+      tensorflow::Flag("batch_timeout_micros", &options.batch_timeout_micros,
+                       "the batch timeout"),
+      tensorflow::Flag("num_batch_threads", &options.num_batch_threads,
+                       "the number of batch threads"),
+      tensorflow::Flag("max_enqueued_batches", &options.max_enqueued_batches,
+                       "the maximum number of enqueued batches (per queue; "
+                       "ignored by the streaming scheduler)"),
+      tensorflow::Flag("arrival_pattern", &options.arrival_pattern,
+                       "how tasks arrive: poisson, bursty or trace"),
+      tensorflow::Flag("arrival_rate", &options.arrival_rate,
+                       "the mean arrival rate of the poisson pattern, and of "
+                       "the bursty pattern while on, in tasks per second"),
+      tensorflow::Flag("burst_on_micros", &options.burst_on_micros,
+                       "the length of the bursty pattern's on-periods"),
+      tensorflow::Flag("burst_off_micros", &options.burst_off_micros,
+                       "the length of the bursty pattern's off-periods"),
+      tensorflow::Flag("arrival_trace", &options.arrival_trace,
+                       "for the trace pattern, a file listing one arrival "
+                       "time per line, in microseconds"),
+      tensorflow::Flag("duration_micros", &options.duration_micros,
+                       "how long to inject tasks for"),
+      tensorflow::Flag("batch_fixed_cost_micros",
+                       &options.batch_fixed_cost_micros,
+                       "the CPU time to process a batch, regardless of size"),
+      tensorflow::Flag("batch_per_task_cost_micros",
+                       &options.batch_per_task_cost_micros,
+                       "the additional CPU time to process each task in a "
+                       "batch")};
+  const tensorflow::string usage =
+      tensorflow::Flags::Usage(argv[0], flag_list);
+  if (!tensorflow::Flags::Parse(&argc, argv, flag_list)) {
+    std::cout << usage;
+    return -1;
+  }
+  tensorflow::port::InitMain(argv[0], &argc, &argv);
+
+  const tensorflow::Status status = tensorflow::serving::RunBenchmark(options);
+  if (!status.ok()) {
+    std::cout << status.ToString() << std::endl << usage;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/batch_scheduler_metrics.h"
+
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/monitoring/counter.h"
+
+namespace tensorflow {
+namespace serving {
+
+namespace {
+
+auto* batch_size_histogram = monitoring::Sampler<2>::New(
+    {"/tensorflow/serving/batching/batch_size",
+     "The sizes of the batches taken for processing from batch scheduler "
+     "queues, sliced down by model_name and queue_name.",
+     "model_name", "queue_name"},
+    // Powers of 2 up to 2^20.
+    monitoring::Buckets::Exponential(1, 2, 21));
+
+auto* queue_delay_micros_histogram = monitoring::Sampler<2>::New(
+    {"/tensorflow/serving/batching/queue_delay_micros",
+     "The time the first task of each batch taken for processing from a batch "
+     "scheduler queue spent in the queue, in microseconds, sliced down by "
+     "model_name and queue_name.",
+     "model_name", "queue_name"},
+    // 10us to about 100s, in steps of 2x.
+    monitoring::Buckets::Exponential(10, 2, 24));
+
+auto* mean_queue_delay_micros_histogram = monitoring::Sampler<2>::New(
+    {"/tensorflow/serving/batching/mean_queue_delay_micros",
+     "The mean time the tasks of each batch taken for processing from a batch "
+     "scheduler queue spent in the queue, in microseconds, sliced down by "
+     "model_name and queue_name.",
+     "model_name", "queue_name"},
+    // 10us to about 100s, in steps of 2x.
+    monitoring::Buckets::Exponential(10, 2, 24));
+
+auto* schedule_rejections = monitoring::Counter<3>::New(
+    "/tensorflow/serving/batching/schedule_rejections",
+    "The number of tasks rejected by batch scheduler queues, sliced down by "
+    "model_name, queue_name and error code.",
+    "model_name", "queue_name", "status_code");
+
+}  // namespace
+
+BatchQueueMetrics::BatchQueueMetrics(const string& model_name,
+                                     const string& queue_name)
+    : model_name_(model_name),
+      queue_name_(queue_name),
+      batch_size_(batch_size_histogram->GetCell(model_name, queue_name)),
+      queue_delay_micros_(
+          queue_delay_micros_histogram->GetCell(model_name, queue_name)),
+      mean_queue_delay_micros_(mean_queue_delay_micros_histogram->GetCell(
+          model_name, queue_name)) {}
+
+void BatchQueueMetrics::RecordBatch(int batch_size, int64 queue_delay_micros,
+                                    int64 mean_queue_delay_micros) {
+  batch_size_->Add(batch_size);
+  queue_delay_micros_->Add(queue_delay_micros);
+  mean_queue_delay_micros_->Add(mean_queue_delay_micros);
+}
+
+void BatchQueueMetrics::RecordScheduleRejection(const Status& status) {
+  schedule_rejections
+      ->GetCell(model_name_, queue_name_, error::Code_Name(status.code()))
+      ->IncrementBy(1);
+}
+
+}  // namespace serving
+}  // namespace tensorflow
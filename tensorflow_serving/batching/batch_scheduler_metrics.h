@@ -0,0 +1,72 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_SERVING_BATCHING_BATCH_SCHEDULER_METRICS_H_
+#define TENSORFLOW_SERVING_BATCHING_BATCH_SCHEDULER_METRICS_H_
+
+#include <string>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/monitoring/sampler.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace serving {
+
+// Records the metrics of one batch scheduler queue, which are exported via the
+// TensorFlow monitoring API sliced down by model name and queue name:
+//  - /tensorflow/serving/batching/batch_size: a histogram of the sizes of the
+//    batches the queue hands to batch threads.
+//  - /tensorflow/serving/batching/queue_delay_micros: a histogram of how long
+//    the first task of each such batch waited in the queue. (The batch's other
+//    tasks waited no longer.)
+//  - /tensorflow/serving/batching/mean_queue_delay_micros: a histogram of how
+//    long the tasks of each such batch waited in the queue on average.
+//  - /tensorflow/serving/batching/schedule_rejections: the number of tasks the
+//    queue rejected, further sliced down by error code.
+//
+// This class is thread-safe.
+class BatchQueueMetrics {
+ public:
+  // The names need not be unique; queues with the same names share metrics.
+  BatchQueueMetrics(const string& model_name, const string& queue_name);
+
+  ~BatchQueueMetrics() = default;
+
+  // Records that a batch of size 'batch_size', whose first task was enqueued
+  // 'queue_delay_micros' ago and whose tasks were enqueued
+  // 'mean_queue_delay_micros' ago on average, has been taken for processing.
+  void RecordBatch(int batch_size, int64 queue_delay_micros,
+                   int64 mean_queue_delay_micros);
+
+  // Records that a task was rejected with 'status'.
+  void RecordScheduleRejection(const Status& status);
+
+ private:
+  const string model_name_;
+  const string queue_name_;
+
+  monitoring::SamplerCell* const batch_size_;
+  monitoring::SamplerCell* const queue_delay_micros_;
+  monitoring::SamplerCell* const mean_queue_delay_micros_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(BatchQueueMetrics);
+};
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_BATCHING_BATCH_SCHEDULER_METRICS_H_
@@ -0,0 +1,107 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/batch_scheduler_metrics.h"
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/monitoring/collection_registry.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+// Returns the point of metric 'metric_name' whose label values are
+// 'label_values', or null if there is none.
+const monitoring::Point* FindPoint(
+    const monitoring::CollectedMetrics& collected_metrics,
+    const string& metric_name, const std::vector<string>& label_values) {
+  auto it = collected_metrics.point_set_map.find(metric_name);
+  if (it == collected_metrics.point_set_map.end()) {
+    return nullptr;
+  }
+  for (const auto& point : it->second->points) {
+    if (point->labels.size() != label_values.size()) {
+      continue;
+    }
+    bool match = true;
+    for (int i = 0; i < label_values.size(); ++i) {
+      match &= point->labels[i].value == label_values[i];
+    }
+    if (match) {
+      return point.get();
+    }
+  }
+  return nullptr;
+}
+
+TEST(BatchQueueMetricsTest, RecordsBatchesAndRejections) {
+  BatchQueueMetrics metrics("metrics_test_model", "metrics_test_queue");
+  metrics.RecordBatch(4, 100, 60);
+  metrics.RecordBatch(8, 300, 150);
+  metrics.RecordScheduleRejection(errors::Unavailable("full"));
+  metrics.RecordScheduleRejection(errors::Unavailable("full"));
+  metrics.RecordScheduleRejection(errors::InvalidArgument("too large"));
+
+  // Another queue with the same names shares the metrics.
+  BatchQueueMetrics same_named_metrics("metrics_test_model",
+                                       "metrics_test_queue");
+  same_named_metrics.RecordBatch(4, 200, 200);
+
+  monitoring::CollectionRegistry::CollectMetricsOptions options;
+  std::unique_ptr<monitoring::CollectedMetrics> collected_metrics =
+      monitoring::CollectionRegistry::Default()->CollectMetrics(options);
+
+  const monitoring::Point* batch_size =
+      FindPoint(*collected_metrics, "/tensorflow/serving/batching/batch_size",
+                {"metrics_test_model", "metrics_test_queue"});
+  ASSERT_NE(nullptr, batch_size);
+  EXPECT_EQ(3, batch_size->histogram_value.num());
+  EXPECT_EQ(16, batch_size->histogram_value.sum());
+
+  const monitoring::Point* queue_delay = FindPoint(
+      *collected_metrics, "/tensorflow/serving/batching/queue_delay_micros",
+      {"metrics_test_model", "metrics_test_queue"});
+  ASSERT_NE(nullptr, queue_delay);
+  EXPECT_EQ(3, queue_delay->histogram_value.num());
+  EXPECT_EQ(600, queue_delay->histogram_value.sum());
+  EXPECT_EQ(300, queue_delay->histogram_value.max());
+
+  const monitoring::Point* mean_queue_delay =
+      FindPoint(*collected_metrics,
+                "/tensorflow/serving/batching/mean_queue_delay_micros",
+                {"metrics_test_model", "metrics_test_queue"});
+  ASSERT_NE(nullptr, mean_queue_delay);
+  EXPECT_EQ(3, mean_queue_delay->histogram_value.num());
+  EXPECT_EQ(410, mean_queue_delay->histogram_value.sum());
+
+  const monitoring::Point* unavailable = FindPoint(
+      *collected_metrics, "/tensorflow/serving/batching/schedule_rejections",
+      {"metrics_test_model", "metrics_test_queue", "UNAVAILABLE"});
+  ASSERT_NE(nullptr, unavailable);
+  EXPECT_EQ(2, unavailable->int64_value);
+  const monitoring::Point* invalid_argument = FindPoint(
+      *collected_metrics, "/tensorflow/serving/batching/schedule_rejections",
+      {"metrics_test_model", "metrics_test_queue", "INVALID_ARGUMENT"});
+  ASSERT_NE(nullptr, invalid_argument);
+  EXPECT_EQ(1, invalid_argument->int64_value);
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
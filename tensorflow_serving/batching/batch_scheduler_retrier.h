@@ -33,6 +33,10 @@ namespace serving {
 // Schedule() requests. Returns an UNAVAILABLE error only after retry attempts
 // have failed (based on parameters that govern the maximum number of retries
 // and the retry time interval).
+//
+// If the wrapped scheduler supports BatchScheduler::ScheduleWithTimeout(), the
+// retrier simply waits on that for up to the maximum time, and is woken as
+// soon as capacity frees up instead of polling.
 template <typename TaskType>
 class BatchSchedulerRetrier : public BatchScheduler<TaskType> {
  public:
@@ -90,11 +94,11 @@ Status BatchSchedulerRetrier<TaskType>::Create(
 template <typename TaskType>
 Status BatchSchedulerRetrier<TaskType>::Schedule(
     std::unique_ptr<TaskType>* task) {
-  Status status;
-
   const uint64 start_time_micros = options_.env->NowMicros();
+  // (A scheduler that doesn't support waiting returns right away.)
+  Status status =
+      wrapped_->ScheduleWithTimeout(task, options_.max_time_micros);
   for (;;) {
-    status = wrapped_->Schedule(task);
     if (status.code() != error::UNAVAILABLE) {
       // We either succeeded, or got a permanent (non-retriable) error.
       break;
@@ -107,6 +111,7 @@ Status BatchSchedulerRetrier<TaskType>::Schedule(
     }
 
     options_.env->SleepForMicroseconds(options_.retry_delay_micros);
+    status = wrapped_->Schedule(task);
   }
 
   return status;
@@ -16,7 +16,9 @@ limitations under the License.
 #include "tensorflow_serving/batching/batch_scheduler_retrier.h"
 
 #include <limits>
+#include <vector>
 
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/errors.h"
@@ -26,6 +28,8 @@ limitations under the License.
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow_serving/test_util/fake_clock_env.h"
 
+using ::testing::ElementsAre;
+
 namespace tensorflow {
 namespace serving {
 namespace {
@@ -99,6 +103,29 @@ class StubbornScheduler : public BatchScheduler<FakeTask> {
   TF_DISALLOW_COPY_AND_ASSIGN(StubbornScheduler);
 };
 
+// A batch scheduler that supports ScheduleWithTimeout(), and records the
+// timeouts with which it was called.
+class WaitingScheduler : public StubbornScheduler {
+ public:
+  WaitingScheduler() : StubbornScheduler(1 /* num_attempts_to_succeed */) {}
+  ~WaitingScheduler() override = default;
+
+  Status ScheduleWithTimeout(std::unique_ptr<FakeTask>* task,
+                             int64 timeout_micros) override {
+    timeouts_micros_.push_back(timeout_micros);
+    return Schedule(task);
+  }
+
+  const std::vector<int64>& timeouts_micros() const {
+    return timeouts_micros_;
+  }
+
+ private:
+  std::vector<int64> timeouts_micros_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(WaitingScheduler);
+};
+
 TEST(BatchSchedulerRetrierTest, ConstMethodsForwardToWrappedScheduler) {
   auto broken_scheduler = std::unique_ptr<BrokenScheduler>(new BrokenScheduler);
   BatchSchedulerRetrier<FakeTask>::Options options;
@@ -202,6 +229,21 @@ TEST(BatchSchedulerRetrierTest, RetryDelay) {
   done.WaitForNotification();
 }
 
+TEST(BatchSchedulerRetrierTest, WaitsOnScheduleWithTimeout) {
+  auto waiting_scheduler =
+      std::unique_ptr<WaitingScheduler>(new WaitingScheduler);
+  auto waiting_scheduler_ptr = waiting_scheduler.get();
+  BatchSchedulerRetrier<FakeTask>::Options options;
+  options.max_time_micros = 100;
+  std::unique_ptr<BatchSchedulerRetrier<FakeTask>> retrier;
+  TF_CHECK_OK(BatchSchedulerRetrier<FakeTask>::Create(
+      options, std::move(waiting_scheduler), &retrier));
+  auto task = std::unique_ptr<FakeTask>(new FakeTask);
+  TF_EXPECT_OK(retrier->Schedule(&task));
+  EXPECT_THAT(waiting_scheduler_ptr->timeouts_micros(), ElementsAre(100));
+  EXPECT_EQ(1, waiting_scheduler_ptr->num_attempts());
+}
+
 }  // namespace
 }  // namespace serving
 }  // namespace tensorflow
@@ -74,9 +74,14 @@ TEST(BatchTest, Basic) {
   EXPECT_EQ(task0->size(), batch.task(0).size());
   EXPECT_EQ(task1->size(), batch.task(1).size());
 
+  EXPECT_EQ(task0->cost() + task1->cost(), batch.cost());
+
   EXPECT_EQ(7, batch.RemoveTask()->size());
+  EXPECT_EQ(3, batch.size());
+  EXPECT_EQ(3, batch.cost());
   EXPECT_EQ(3, batch.RemoveTask()->size());
   EXPECT_TRUE(batch.empty());
+  EXPECT_EQ(0, batch.size());
 }
 
 TEST(BatchTest, WaitUntilClosed) {
@@ -112,6 +117,24 @@ TEST(BatchTest, DeletionBlocksUntilClosed) {
   deleted.WaitForNotification();
 }
 
+TEST(BatchTest, RecyclesMemory) {
+  std::unique_ptr<Batch<FakeTask>> batch(new Batch<FakeTask>);
+  for (int i = 0; i < 10; ++i) {
+    batch->AddTask(std::unique_ptr<FakeTask>(new FakeTask(1)));
+  }
+  batch->Close();
+  Batch<FakeTask>* const old_batch = batch.get();
+  batch.reset();
+
+  // The next batch reuses the old batch's memory.
+  batch.reset(new Batch<FakeTask>);
+  EXPECT_EQ(old_batch, batch.get());
+  EXPECT_TRUE(batch->empty());
+  batch->AddTask(std::unique_ptr<FakeTask>(new FakeTask(1)));
+  EXPECT_EQ(1, batch->size());
+  batch->Close();
+}
+
 }  // namespace
 }  // namespace serving
 }  // namespace tensorflow
@@ -16,25 +16,100 @@ limitations under the License.
 #include "tensorflow_serving/batching/batching_session.h"
 
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
 
 #include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor.pb.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/tensor_util.h"
+#include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/notification.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/lib/monitoring/counter.h"
+#include "tensorflow/core/lib/monitoring/sampler.h"
 #include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/thread_annotations.h"
 #include "tensorflow/core/platform/types.h"
+#include "tensorflow_serving/batching/batching_util.h"
 #include "tensorflow_serving/servables/tensorflow/serving_session.h"
 #include "tensorflow_serving/util/cleanup.h"
+#include "tensorflow_serving/util/cpu_affinity.h"
 #include "tensorflow_serving/util/hash.h"
 
 namespace tensorflow {
 namespace serving {
 
+struct IncrementalMergeBuffer {
+  // The staging tensor for each input, keyed by tensor name. Each tensor has
+  // BatchingSessionOptions::incremental_merge_buffer_size rows. Immutable once
+  // the buffer has been created (aside from the tensors' contents).
+  std::map<string, Tensor> tensors;
+
+  // The number of rows (from the start of each tensor) that have been reserved
+  // by tasks. Guarded by the owning IncrementalInputMerger's mutex.
+  int64 num_rows_reserved = 0;
+};
+
+struct SplitTaskContext {
+  explicit SplitTaskContext(int num_subtasks)
+      : subtask_outputs(num_subtasks), num_pending_subtasks(num_subtasks) {}
+
+  // The completion fields of the original task (see BatchingSessionTask).
+  std::function<void(const Status&)> done;
+  std::vector<Tensor>* outputs;
+
+  // The outputs of each subtask, in order.
+  std::vector<std::vector<Tensor>> subtask_outputs;
+
+  mutex mu;
+
+  // The number of subtasks that have yet to finish.
+  int num_pending_subtasks GUARDED_BY(mu);
+
+  // The first error reported by a subtask, if any.
+  Status first_error GUARDED_BY(mu);
+};
+
 namespace {
 
+auto* input_buffer_pool_requests = monitoring::Counter<1>::New(
+    "/tensorflow/serving/batching_session/input_buffer_pool_requests",
+    "The number of requests for tensors into which to merge batch inputs, "
+    "made to batching sessions' input buffer pools, sliced down by outcome "
+    "(hit or miss).",
+    "outcome");
+
+auto* proto_input_requests = monitoring::Counter<1>::New(
+    "/tensorflow/serving/batching_session/proto_input_requests",
+    "The number of requests with TensorProto inputs made to batching "
+    "sessions, sliced down by whether the inputs were decoded straight into "
+    "merge buffers (decoded) or parsed into tensors first (parsed).",
+    "path");
+
+auto* padded_batch_size_histogram = monitoring::Sampler<1>::New(
+    {"/tensorflow/serving/batching_session/padded_batch_size",
+     "The sizes of the batches run by batching sessions, after padding to an "
+     "allowed batch size, sliced down by model_name.",
+     "model_name"},
+    // Powers of 2 up to 2^20.
+    monitoring::Buckets::Exponential(1, 2, 21));
+
+auto* padding_rows = monitoring::Counter<1>::New(
+    "/tensorflow/serving/batching_session/padding_rows",
+    "The number of padding rows that batching sessions added to batches to "
+    "reach an allowed batch size, sliced down by model_name.",
+    "model_name");
+
 string TensorSignatureDebugString(const TensorSignature& signature) {
   return strings::StrCat("{input_tensors: <",
                          str_util::Join(signature.input_tensors, ", "),
@@ -63,10 +138,11 @@ struct EqTensorSignature {
   }
 };
 
-// Constructs a TensorSignature from a Run() call's 'inputs' and
-// 'output_tensor_names' arguments.
+// Constructs a TensorSignature from a Run() call's 'inputs' (tensors or
+// TensorProtos, keyed by name) and 'output_tensor_names' arguments.
+template <typename InputType>
 TensorSignature TensorSignatureFromRunArgs(
-    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<std::pair<string, InputType>>& inputs,
     const std::vector<string>& output_tensor_names) {
   TensorSignature signature;
   for (const auto& entry : inputs) {
@@ -79,6 +155,551 @@ TensorSignature TensorSignatureFromRunArgs(
   return signature;
 }
 
+// Returns true iff tensors of type 'dtype' can be copied row-wise by
+// CopyTensorRows().
+bool CanCopyTensorRows(DataType dtype) {
+  return DataTypeCanUseMemcpy(dtype) || dtype == DT_STRING;
+}
+
+// Copies all rows of 'src' into 'dst', starting at row 'dst_offset' of 'dst'.
+// The tensors must have the same dtype (one accepted by CanCopyTensorRows()),
+// and the same shape in all but the 0th dimension. 'src' need not be aligned.
+void CopyTensorRows(const Tensor& src, int64 dst_offset, Tensor* dst) {
+  const int64 num_elements = src.NumElements();
+  if (num_elements == 0) {
+    return;
+  }
+  const int64 elements_per_row = num_elements / src.dim_size(0);
+  if (DataTypeCanUseMemcpy(src.dtype())) {
+    const StringPiece src_data = src.tensor_data();
+    char* dst_data = const_cast<char*>(dst->tensor_data().data()) +
+                     dst_offset * elements_per_row * DataTypeSize(src.dtype());
+    memcpy(dst_data, src_data.data(), src_data.size());
+    return;
+  }
+  DCHECK_EQ(DT_STRING, src.dtype());
+  auto src_flat = src.unaligned_flat<string>();
+  auto dst_flat = dst->flat<string>();
+  const int64 dst_start = dst_offset * elements_per_row;
+  for (int64 i = 0; i < num_elements; ++i) {
+    dst_flat(dst_start + i) = src_flat(i);
+  }
+}
+
+// Copies the first 'num_elements' of 'values' (a repeated proto field) into
+// 'dst'. As in Tensor::FromProto(), if there are fewer values than elements,
+// the last value is repeated, and if there are none, the elements are zeroed.
+template <typename T, typename RepeatedField>
+void DecodeRepeatedField(const RepeatedField& values, int64 num_elements,
+                         T* dst) {
+  const int64 num_values = std::min<int64>(values.size(), num_elements);
+  for (int64 i = 0; i < num_values; ++i) {
+    dst[i] = static_cast<T>(values.Get(i));
+  }
+  std::fill(dst + num_values, dst + num_elements,
+            num_values == 0 ? T() : dst[num_values - 1]);
+}
+
+// Returns true iff 'proto' can be decoded by DecodeTensorProtoRows(), i.e. it
+// holds a well-formed tensor of rank at least 1, of a dtype that can be
+// copied with memcpy, whose values are in 'tensor_content' or in a repeated
+// field of the dtype itself (e.g. 'float_val' for DT_FLOAT).
+bool CanDecodeTensorProtoRows(const TensorProto& proto) {
+  if (!DataTypeCanUseMemcpy(proto.dtype()) ||
+      !TensorShape::IsValid(proto.tensor_shape()) ||
+      proto.tensor_shape().dim_size() == 0) {
+    return false;
+  }
+  if (!proto.tensor_content().empty()) {
+    const TensorShape shape(proto.tensor_shape());
+    return proto.tensor_content().size() ==
+           shape.num_elements() * DataTypeSize(proto.dtype());
+  }
+  switch (proto.dtype()) {
+    case DT_FLOAT:
+    case DT_DOUBLE:
+    case DT_INT32:
+    case DT_INT16:
+    case DT_INT8:
+    case DT_UINT8:
+    case DT_INT64:
+    case DT_BOOL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Decodes all rows of the tensor held by 'proto' into 'dst', starting at row
+// 'dst_offset' of 'dst', with the same result as Tensor::FromProto() followed
+// by CopyTensorRows(). 'proto' must satisfy CanDecodeTensorProtoRows(), and
+// 'dst' must have its dtype, and its shape in all but the 0th dimension.
+void DecodeTensorProtoRows(const TensorProto& proto, int64 dst_offset,
+                           Tensor* dst) {
+  const TensorShape shape(proto.tensor_shape());
+  const int64 num_elements = shape.num_elements();
+  if (num_elements == 0) {
+    return;
+  }
+  const int64 element_size = DataTypeSize(proto.dtype());
+  char* dst_data = const_cast<char*>(dst->tensor_data().data()) +
+                   dst_offset * (num_elements / shape.dim_size(0)) *
+                       element_size;
+  if (!proto.tensor_content().empty()) {
+    memcpy(dst_data, proto.tensor_content().data(),
+           num_elements * element_size);
+    return;
+  }
+  switch (proto.dtype()) {
+#define CASE(dtype, type, field)                            \
+  case dtype:                                               \
+    DecodeRepeatedField(proto.field(), num_elements,        \
+                        reinterpret_cast<type*>(dst_data)); \
+    break;
+    CASE(DT_FLOAT, float, float_val);
+    CASE(DT_DOUBLE, double, double_val);
+    CASE(DT_INT32, int32, int_val);
+    CASE(DT_INT16, int16, int_val);
+    CASE(DT_INT8, int8, int_val);
+    CASE(DT_UINT8, uint8, int_val);
+    CASE(DT_INT64, int64, int64_val);
+    CASE(DT_BOOL, bool, bool_val);
+#undef CASE
+    default:
+      LOG(FATAL) << "Cannot decode a TensorProto of dtype "
+                 << DataTypeString(proto.dtype());
+  }
+}
+
+// The properties of an input tensor that determine where its rows can be
+// merged incrementally: its name, dtype and shape.
+struct InputTensorSpec {
+  const string* name;
+  DataType dtype;
+  TensorShape shape;
+};
+
+std::vector<InputTensorSpec> InputTensorSpecs(
+    const std::vector<std::pair<string, Tensor>>& inputs) {
+  std::vector<InputTensorSpec> specs;
+  specs.reserve(inputs.size());
+  for (const auto& entry : inputs) {
+    specs.push_back({&entry.first, entry.second.dtype(), entry.second.shape()});
+  }
+  return specs;
+}
+
+// Populates 'specs' with those of the tensors held by 'inputs', and returns
+// true iff the tensors can all be decoded by DecodeTensorProtoRows(), and have
+// a common 0th-dimension size of between 1 and 'max_rows'.
+bool GetDecodableInputTensorSpecs(
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    int64 max_rows, std::vector<InputTensorSpec>* specs) {
+  specs->clear();
+  if (inputs.empty()) {
+    return false;
+  }
+  specs->reserve(inputs.size());
+  for (const auto& entry : inputs) {
+    const TensorProto& proto = *entry.second;
+    if (!CanDecodeTensorProtoRows(proto)) {
+      return false;
+    }
+    specs->push_back(
+        {&entry.first, proto.dtype(), TensorShape(proto.tensor_shape())});
+    const int64 num_rows = specs->back().shape.dim_size(0);
+    if (num_rows < 1 || num_rows > max_rows ||
+        num_rows != specs->front().shape.dim_size(0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Hands out rows of IncrementalMergeBuffers to tasks with a given signature, in
+// the order in which the tasks are submitted to the batch scheduler. Since a
+// batch scheduler groups consecutively-submitted tasks into batches, the tasks
+// in a given batch typically occupy a contiguous range of rows in one buffer.
+class IncrementalInputMerger {
+ public:
+  explicit IncrementalInputMerger(int buffer_size)
+      : buffer_size_(buffer_size) {}
+
+  // Must be held across a call to ReserveRows() and the Schedule() call that
+  // submits the task, so that row reservations occur in scheduling order.
+  mutex* mu() LOCK_RETURNED(mu_) { return &mu_; }
+
+  // Reserves rows for 'task', whose input tensors are described by 'inputs',
+  // in the current buffer, starting a new buffer if the current one lacks room
+  // or doesn't match the inputs. Populates 'task->merge_buffer' and
+  // 'task->merge_buffer_offset', or leaves them untouched if the task cannot be
+  // merged incrementally.
+  void ReserveRows(const std::vector<InputTensorSpec>& inputs,
+                   BatchingSessionTask* task) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Undoes the most recent ReserveRows() call, which reserved rows for 'task'.
+  // Used if the task was rejected by the batch scheduler.
+  void UnreserveRows(BatchingSessionTask* task) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Copies the task's input rows into the rows reserved via ReserveRows(), and
+  // notifies 'task->inputs_merged'.
+  static void CopyInputs(BatchingSessionTask* task);
+
+ private:
+  // Determines whether 'inputs' can be stored in 'buffer_', in terms of the
+  // tensor names, dtypes and non-0th dimension sizes.
+  bool InputsMatchBuffer(const std::vector<InputTensorSpec>& inputs) const
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // The number of rows in each staging tensor.
+  const int buffer_size_;
+
+  mutex mu_;
+
+  // The buffer from which rows are currently being reserved, or null if no
+  // task has been seen yet.
+  std::shared_ptr<IncrementalMergeBuffer> buffer_ GUARDED_BY(mu_);
+
+  TF_DISALLOW_COPY_AND_ASSIGN(IncrementalInputMerger);
+};
+
+void IncrementalInputMerger::ReserveRows(
+    const std::vector<InputTensorSpec>& inputs, BatchingSessionTask* task) {
+  const int64 num_rows = task->zeroth_dim_size;
+  if (num_rows > buffer_size_) {
+    return;
+  }
+  for (const InputTensorSpec& input : inputs) {
+    if (!CanCopyTensorRows(input.dtype)) {
+      return;
+    }
+  }
+
+  if (buffer_ == nullptr || !InputsMatchBuffer(inputs) ||
+      buffer_->num_rows_reserved + num_rows > buffer_size_) {
+    buffer_.reset(new IncrementalMergeBuffer);
+    for (const InputTensorSpec& input : inputs) {
+      TensorShape shape = input.shape;
+      shape.set_dim(0, buffer_size_);
+      buffer_->tensors[*input.name] = Tensor(input.dtype, shape);
+    }
+  }
+
+  task->merge_buffer = buffer_;
+  task->merge_buffer_offset = buffer_->num_rows_reserved;
+  buffer_->num_rows_reserved += num_rows;
+}
+
+void IncrementalInputMerger::UnreserveRows(BatchingSessionTask* task) {
+  if (task->merge_buffer == nullptr) {
+    return;
+  }
+  DCHECK(buffer_ == task->merge_buffer);
+  DCHECK_EQ(buffer_->num_rows_reserved,
+            task->merge_buffer_offset + task->zeroth_dim_size);
+  buffer_->num_rows_reserved = task->merge_buffer_offset;
+  task->merge_buffer = nullptr;
+}
+
+void IncrementalInputMerger::CopyInputs(BatchingSessionTask* task) {
+  for (const auto& entry : *task->inputs) {
+    CopyTensorRows(entry.second, task->merge_buffer_offset,
+                   &task->merge_buffer->tensors[entry.first]);
+  }
+  task->inputs_merged.Notify();
+}
+
+bool IncrementalInputMerger::InputsMatchBuffer(
+    const std::vector<InputTensorSpec>& inputs) const {
+  if (inputs.size() != buffer_->tensors.size()) {
+    return false;
+  }
+  for (const InputTensorSpec& input : inputs) {
+    auto it = buffer_->tensors.find(*input.name);
+    if (it == buffer_->tensors.end()) {
+      return false;
+    }
+    const Tensor& buffer_tensor = it->second;
+    if (input.dtype != buffer_tensor.dtype() ||
+        input.shape.dims() != buffer_tensor.dims()) {
+      return false;
+    }
+    for (int i = 1; i < input.shape.dims(); ++i) {
+      if (input.shape.dim_size(i) != buffer_tensor.dim_size(i)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// If the inputs of all the tasks in 'batch' have been merged incrementally into
+// a contiguous range of rows of a single IncrementalMergeBuffer, populates
+// 'merged_inputs' with slices of that buffer (keyed by tensor name) and returns
+// true. Otherwise returns false. Assumes 'batch' is non-empty, and that every
+// participating task's 'inputs_merged' has been notified.
+bool GetIncrementallyMergedInputs(const Batch<BatchingSessionTask>& batch,
+                                  std::map<string, Tensor>* merged_inputs) {
+  const BatchingSessionTask& first_task = batch.task(0);
+  if (first_task.merge_buffer == nullptr) {
+    return false;
+  }
+  int64 next_offset = first_task.merge_buffer_offset;
+  for (int i = 0; i < batch.num_tasks(); ++i) {
+    const BatchingSessionTask& task = batch.task(i);
+    if (task.merge_buffer != first_task.merge_buffer ||
+        task.merge_buffer_offset != next_offset) {
+      return false;
+    }
+    next_offset += task.zeroth_dim_size;
+  }
+  for (const auto& entry : first_task.merge_buffer->tensors) {
+    (*merged_inputs)[entry.first] =
+        entry.second.Slice(first_task.merge_buffer_offset, next_offset);
+  }
+  return true;
+}
+
+// A pool of recycled tensors into which batches' inputs are merged, for a
+// given signature. Tensors are keyed by input tensor name, dtype and shape, so
+// in steady state there is a set of buffers for each allowed batch size.
+//
+// A pooled tensor is only handed out again once no one else holds a reference
+// to it, i.e. once the batch that last used it, and any output tensors that
+// alias it, have been destroyed.
+class BatchInputBufferPool {
+ public:
+  explicit BatchInputBufferPool(int64 max_bytes) : max_bytes_(max_bytes) {}
+
+  // Returns a tensor with the given dtype and shape, for merging the input
+  // tensor named 'tensor_name'. Sets '*rows_initialized' to true iff every row
+  // of the returned tensor has been populated by an earlier batch, in which
+  // case any row not overwritten by the caller still holds a valid input row
+  // (and can serve as padding).
+  Tensor Acquire(const string& tensor_name, DataType dtype,
+                 const TensorShape& shape, bool* rows_initialized);
+
+ private:
+  struct Entry {
+    string tensor_name;
+    Tensor tensor;
+    bool rows_initialized;
+  };
+
+  // Removes entries that aren't in use until 'total_bytes_' + 'bytes' fits in
+  // 'max_bytes_', or no more entries can be removed.
+  void EvictToMakeRoom(int64 bytes) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // The maximum combined size of the pooled tensors, in bytes.
+  const int64 max_bytes_;
+
+  mutex mu_;
+
+  std::list<Entry> entries_ GUARDED_BY(mu_);
+
+  // The combined size of the tensors in 'entries_', in bytes.
+  int64 total_bytes_ GUARDED_BY(mu_) = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(BatchInputBufferPool);
+};
+
+Tensor BatchInputBufferPool::Acquire(const string& tensor_name, DataType dtype,
+                                     const TensorShape& shape,
+                                     bool* rows_initialized) {
+  if (shape.num_elements() == 0) {
+    *rows_initialized = true;
+    return Tensor(dtype, shape);
+  }
+
+  mutex_lock l(mu_);
+  for (Entry& entry : entries_) {
+    if (entry.tensor_name == tensor_name && entry.tensor.dtype() == dtype &&
+        entry.tensor.shape().IsSameSize(shape) &&
+        entry.tensor.RefCountIsOne()) {
+      input_buffer_pool_requests->GetCell("hit")->IncrementBy(1);
+      *rows_initialized = entry.rows_initialized;
+      // The caller is about to populate every row.
+      entry.rows_initialized = true;
+      return entry.tensor;
+    }
+  }
+
+  input_buffer_pool_requests->GetCell("miss")->IncrementBy(1);
+  *rows_initialized = false;
+  Tensor tensor(dtype, shape);
+  const int64 bytes = tensor.TotalBytes();
+  EvictToMakeRoom(bytes);
+  if (total_bytes_ + bytes <= max_bytes_) {
+    entries_.push_back({tensor_name, tensor, true /* rows_initialized */});
+    total_bytes_ += bytes;
+  }
+  return tensor;
+}
+
+void BatchInputBufferPool::EvictToMakeRoom(int64 bytes) {
+  auto it = entries_.begin();
+  while (total_bytes_ + bytes > max_bytes_ && it != entries_.end()) {
+    if (it->tensor.RefCountIsOne()) {
+      total_bytes_ -= it->tensor.TotalBytes();
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Merges 'tensors' into a tensor with 'padded_batch_size' rows obtained from
+// 'pool'. The rows of 'tensors' are copied to the start of the merged tensor,
+// and any remaining rows hold padding. Returns an error if the tensors differ
+// in dtype or in any dimension other than the 0th one.
+Status MergeIntoPooledTensor(const string& tensor_name,
+                             const std::vector<Tensor>& tensors,
+                             int64 padded_batch_size,
+                             BatchInputBufferPool* pool, Tensor* merged) {
+  const Tensor& first_tensor = tensors[0];
+  for (const Tensor& tensor : tensors) {
+    bool compatible = tensor.dtype() == first_tensor.dtype() &&
+                      tensor.dims() == first_tensor.dims();
+    for (int i = 1; compatible && i < tensor.dims(); ++i) {
+      compatible = tensor.dim_size(i) == first_tensor.dim_size(i);
+    }
+    if (!compatible) {
+      return errors::InvalidArgument(
+          "Batching session Run() input tensors named ", tensor_name,
+          " must have equal dtypes and equal sizes in all dimensions except "
+          "the 0th one");
+    }
+  }
+
+  TensorShape shape = first_tensor.shape();
+  shape.set_dim(0, padded_batch_size);
+  bool rows_initialized;
+  *merged = pool->Acquire(tensor_name, first_tensor.dtype(), shape,
+                          &rows_initialized);
+
+  int64 num_rows = 0;
+  for (const Tensor& tensor : tensors) {
+    CopyTensorRows(tensor, num_rows, merged);
+    num_rows += tensor.dim_size(0);
+  }
+
+  // Only a freshly-allocated tensor needs its padding rows written; in a
+  // recycled one they already hold valid rows from earlier batches.
+  if (!rows_initialized && num_rows < padded_batch_size) {
+    const Tensor padding_tensor = tensors.back().Slice(0, 1);
+    for (int64 row = num_rows; row < padded_batch_size; ++row) {
+      CopyTensorRows(padding_tensor, row, merged);
+    }
+  }
+  return Status::OK();
+}
+
+// Concatenates the outputs of a split task's subtasks, in order, into
+// 'outputs'.
+Status MergeSplitTaskOutputs(const SplitTaskContext& context,
+                             std::vector<Tensor>* outputs) {
+  const std::vector<Tensor>& first_subtask_outputs =
+      context.subtask_outputs[0];
+  for (int i = 0; i < first_subtask_outputs.size(); ++i) {
+    const Tensor& first = first_subtask_outputs[i];
+    std::vector<Tensor> tensors;
+    for (const std::vector<Tensor>& subtask_outputs : context.subtask_outputs) {
+      if (subtask_outputs.size() != first_subtask_outputs.size()) {
+        return errors::Internal("Subtasks of a split task output ",
+                                first_subtask_outputs.size(), " and ",
+                                subtask_outputs.size(), " tensors");
+      }
+      const Tensor& tensor = subtask_outputs[i];
+      bool compatible =
+          tensor.dtype() == first.dtype() && tensor.dims() == first.dims();
+      for (int d = 1; compatible && d < tensor.dims(); ++d) {
+        compatible = tensor.dim_size(d) == first.dim_size(d);
+      }
+      if (!compatible) {
+        return errors::FailedPrecondition(
+            "Outputs of the batches spanned by a split task cannot be "
+            "concatenated; got shapes ",
+            first.shape().DebugString(), " and ", tensor.shape().DebugString());
+      }
+      tensors.push_back(tensor);
+    }
+    outputs->push_back(tensor::Concat(tensors));
+  }
+  return Status::OK();
+}
+
+// Reports 'status' as the outcome of 'task', and signals that it is done. For a
+// subtask of a split task, the original task is completed once all of its
+// subtasks have been.
+void CompleteTask(const Status& status, BatchingSessionTask* task) {
+  SplitTaskContext* context = task->split_context.get();
+  if (context == nullptr) {
+    task->done(status);
+    return;
+  }
+
+  Status merged_status;
+  {
+    mutex_lock l(context->mu);
+    context->first_error.Update(status);
+    if (--context->num_pending_subtasks > 0) {
+      return;
+    }
+    merged_status = context->first_error;
+  }
+  if (merged_status.ok()) {
+    merged_status = MergeSplitTaskOutputs(*context, context->outputs);
+  }
+  context->done(merged_status);
+}
+
+// Returns the absolute deadline of a call with 'run_options', i.e.
+// 'timeout_in_ms' from now, or 0 (no deadline) if the timeout isn't positive.
+uint64 DeadlineMicros(const RunOptions& run_options) {
+  return run_options.timeout_in_ms() > 0
+             ? Env::Default()->NowMicros() + run_options.timeout_in_ms() * 1000
+             : 0;
+}
+
+// Fails each task in 'batch' whose deadline has passed with DEADLINE_EXCEEDED,
+// and returns a closed batch of the remaining tasks (in their original order).
+// Assumes 'batch' is closed.
+std::unique_ptr<Batch<BatchingSessionTask>> RemoveExpiredTasks(
+    std::unique_ptr<Batch<BatchingSessionTask>> batch) {
+  const uint64 now_micros = Env::Default()->NowMicros();
+  auto is_expired = [now_micros](const BatchingSessionTask& task) {
+    return task.absolute_deadline_micros != 0 &&
+           task.absolute_deadline_micros < now_micros;
+  };
+  bool any_expired = false;
+  for (int i = 0; i < batch->num_tasks(); ++i) {
+    any_expired |= is_expired(batch->task(i));
+  }
+  if (!any_expired) {
+    return batch;
+  }
+
+  // Batch only supports removing its last task, so unload the tasks in
+  // reverse order.
+  std::vector<std::unique_ptr<BatchingSessionTask>> tasks;
+  while (!batch->empty()) {
+    tasks.push_back(batch->RemoveTask());
+  }
+  std::unique_ptr<Batch<BatchingSessionTask>> remaining_batch(
+      new Batch<BatchingSessionTask>);
+  for (auto it = tasks.rbegin(); it != tasks.rend(); ++it) {
+    if (is_expired(**it)) {
+      CompleteTask(errors::DeadlineExceeded(
+                       "Deadline passed before the request was processed"),
+                   it->get());
+    } else {
+      remaining_batch->AddTask(std::move(*it));
+    }
+  }
+  remaining_batch->Close();
+  return remaining_batch;
+}
+
 }  // namespace
 
 TensorSignature TensorSignatureFromSignatureDef(
@@ -119,16 +740,81 @@ class BatchingSession : public ServingSession {
           signatures_with_scheduler_creators,
       std::unique_ptr<BatchingSession>* result);
 
-  ~BatchingSession() override = default;
+  ~BatchingSession() override;
 
   Status Run(const std::vector<std::pair<string, Tensor>>& inputs,
              const std::vector<string>& output_tensor_names,
              const std::vector<string>& target_node_names,
              std::vector<Tensor>* outputs) override;
 
+  // Honors 'run_options.timeout_in_ms' as a deadline; see batching_session.h.
+  Status Run(const RunOptions& run_options,
+             const std::vector<std::pair<string, Tensor>>& inputs,
+             const std::vector<string>& output_tensor_names,
+             const std::vector<string>& target_node_names,
+             std::vector<Tensor>* outputs, RunMetadata* run_metadata) override;
+
+  // Returns a handle to the batching signature that calls with these tensor
+  // names belong to (see FindSignatureState()), or an unresolved handle if
+  // there is none.
+  RunSignatureHandle ResolveRunSignature(
+      const std::vector<string>& input_tensor_names,
+      const std::vector<string>& output_tensor_names) const override;
+
+  // Returns once a call that matches one of the batching signatures has been
+  // scheduled, and invokes 'done' from the batch thread that processes it.
+  // Other calls are run in-line. Honors 'run_options.timeout_in_ms' like
+  // Run().
+  void RunAsync(const RunOptions& run_options,
+                const RunSignatureHandle& signature,
+                const std::vector<std::pair<string, Tensor>>& inputs,
+                const std::vector<string>& output_tensor_names,
+                std::vector<Tensor>* outputs,
+                std::function<void(const Status&)> done) override;
+
+  // Like RunAsync(). If incremental input merging is enabled (see
+  // BatchingSessionOptions::incremental_merge_buffer_size), decodes the input
+  // protos straight into the task's rows of the staging buffers, once the
+  // task has been scheduled. Inputs that cannot be decoded that way (e.g.
+  // strings, or tensors too large for the buffers) are parsed into tensors
+  // and take the RunAsync() path instead.
+  void RunAsyncFromProtos(
+      const RunOptions& run_options, const RunSignatureHandle& signature,
+      const std::vector<std::pair<string, const TensorProto*>>& inputs,
+      const std::vector<string>& output_tensor_names,
+      std::vector<Tensor>* outputs,
+      std::function<void(const Status&)> done) override;
+
+  // Returns true, since calls that match one of the batching signatures are
+  // queued. (Calls that don't are still run in-line.)
+  bool RunsAsync() const override { return true; }
+
  private:
   explicit BatchingSession(const BatchingSessionOptions& options);
 
+  // Implements both flavors of Run(). A Run() call that matches one of the
+  // batching signatures gets 'deadline_micros' as its task's deadline (0 means
+  // none). Other calls are passed through to 'wrapped_', with 'run_options'
+  // and 'run_metadata' if 'run_options' is non-null.
+  Status InternalRun(const RunOptions* run_options,
+                     const std::vector<std::pair<string, Tensor>>& inputs,
+                     const std::vector<string>& output_tensor_names,
+                     const std::vector<string>& target_node_names,
+                     uint64 deadline_micros, std::vector<Tensor>* outputs,
+                     RunMetadata* run_metadata);
+
+  // Creates a task for a call that matches one of the batching signatures, and
+  // schedules it on 'batch_scheduler'. 'merger' is the scheduler's incremental
+  // input merger, or null if incremental merging is disabled. Once the task
+  // has been processed, 'done' is invoked from the batch thread. If an error
+  // is returned, the task was not scheduled and 'done' will not be invoked.
+  Status ScheduleTask(const std::vector<std::pair<string, Tensor>>& inputs,
+                      const std::vector<string>& output_tensor_names,
+                      uint64 deadline_micros, std::vector<Tensor>* outputs,
+                      BatchScheduler<BatchingSessionTask>* batch_scheduler,
+                      IncrementalInputMerger* merger,
+                      std::function<void(const Status&)> done);
+
   // Computes the size of an input tensor list for batching purposes, by
   // analyzing the 0th dimension size of each of the tensors. All tensors in the
   // list must have the same 0th dimension size to be batchable. If the sizes
@@ -136,13 +822,31 @@ class BatchingSession : public ServingSession {
   Status ComputeInputSize(const std::vector<std::pair<string, Tensor>>& inputs,
                           size_t* size) const;
 
+  // Computes the cost of a task with 'inputs' (whose size is 'size'), as per
+  // 'options_.task_cost_measure'.
+  size_t ComputeInputCost(const std::vector<std::pair<string, Tensor>>& inputs,
+                          size_t size) const;
+
   // Returns the smallest entry in 'options_.allowed_batch_sizes' that is
   // greater than or equal to 'batch_size'. If 'options_.allowed_batch_sizes' is
   // empty, simply returns 'batch_size'.
   int RoundToLowestAllowedBatchSize(int batch_size) const;
 
+  // Returns the index of the length bucket (see
+  // BatchingSessionOptions::length_bucket_limits) that a task with 'inputs'
+  // belongs to.
+  int LengthBucket(const std::vector<std::pair<string, Tensor>>& inputs) const;
+  int LengthBucket(const std::vector<InputTensorSpec>& inputs) const;
+
+  // Pads each of 'tensors', which are the batch's tensors named 'tensor_name',
+  // to the largest size among them in every dimension other than the 0th. See
+  // BatchingSessionOptions::pad_variable_length_inputs.
+  Status PadVariableLengthInputs(const string& tensor_name,
+                                 std::vector<Tensor>* tensors) const;
+
   // Merges the input tensors in a batch, via concatenation of correspondingly-
-  // named tensors. Puts the merged inputs in the order they are in in the
+  // named tensors (or, if the inputs were merged incrementally, by slicing the
+  // staging buffer). Puts the merged inputs in the order they are in in the
   // signature. Assumes 'batch' is non-empty. Returns an error if there are any
   // mismatches among the tasks in the batch that violate the constraints for
   // batchability.
@@ -150,8 +854,18 @@ class BatchingSession : public ServingSession {
       const TensorSignature& signature, const Batch<BatchingSessionTask>& batch,
       std::vector<std::pair<string, Tensor>>* merged_inputs);
 
+  // If 'tensor_name' is listed in
+  // BatchingSessionOptions::variable_length_output_sources, trims 'output' (the
+  // task's slice of that batched output) in dimension 1 to the size of the
+  // task's corresponding input tensor.
+  Status TrimVariableLengthOutput(const string& tensor_name,
+                                  const BatchingSessionTask& task,
+                                  Tensor* output) const;
+
   // Splits the output of a batched call to 'wrapped_->Run()' into individual
-  // task outputs. Assumes the output tensor order matches the signature.
+  // task outputs, which are slices that alias the batched outputs (see
+  // BatchingSessionOptions::align_split_outputs). Assumes the output tensor
+  // order matches the signature.
   Status SplitOutputTensors(const TensorSignature& signature,
                             const std::vector<Tensor>& combined_outputs,
                             Batch<BatchingSessionTask>* batch);
@@ -161,13 +875,98 @@ class BatchingSession : public ServingSession {
   void ProcessBatch(const TensorSignature& signature,
                     std::unique_ptr<Batch<BatchingSessionTask>> batch);
 
+  // Hands 'batch', whose inputs have been merged into 'merged_inputs', over to
+  // 'execution_pool_' and then 'completion_pool_' (see
+  // BatchingSessionOptions::num_pipeline_threads). Blocks while
+  // 'options_.num_pipeline_threads' batches are executing.
+  void ExecuteInPipeline(const TensorSignature& signature,
+                         std::unique_ptr<Batch<BatchingSessionTask>> batch,
+                         std::vector<std::pair<string, Tensor>> merged_inputs);
+
+  // Pins the calling thread, one of 'execution_pool_' or 'completion_pool_', to
+  // 'pipeline_cpus_', the first time it is called on that thread.
+  void MaybePinPipelineThread();
+
   const BatchingSessionOptions options_;
 
+  // This session's cells of the metrics defined above.
+  monitoring::SamplerCell* const padded_batch_size_cell_;
+  monitoring::CounterCell* const padding_rows_cell_;
+
   std::unique_ptr<Session> wrapped_;
-  std::unordered_map<TensorSignature,
-                     std::unique_ptr<BatchScheduler<BatchingSessionTask>>,
-                     HashTensorSignature, EqTensorSignature>
-      batch_schedulers_;
+
+  // If 'options_.num_pipeline_threads' is positive, the threads that run
+  // prepared batches on 'wrapped_', and those that split the batches' outputs
+  // and complete their tasks, respectively. Otherwise null.
+  std::unique_ptr<thread::ThreadPool> execution_pool_;
+  std::unique_ptr<thread::ThreadPool> completion_pool_;
+
+  // The CPUs to pin the threads of 'execution_pool_' and 'completion_pool_'
+  // to (see BatchingSessionOptions::pipeline_cpus), if any.
+  std::vector<int> pipeline_cpus_;
+
+  // The number of batches handed to 'execution_pool_' that have not finished
+  // running, and a condition variable notified whenever one does.
+  mutex pipeline_mu_;
+  int num_executing_batches_ GUARDED_BY(pipeline_mu_) = 0;
+  condition_variable execution_finished_cv_;
+
+  // The batching state for one signature.
+  struct SignatureState {
+    // One batch scheduler per length bucket (see
+    // BatchingSessionOptions::length_bucket_limits), or a single one if length
+    // bucketing is disabled.
+    std::vector<std::unique_ptr<BatchScheduler<BatchingSessionTask>>>
+        batch_schedulers;
+
+    // If incremental input merging is enabled, the row allocator for each entry
+    // in 'batch_schedulers'. Otherwise empty.
+    std::vector<std::unique_ptr<IncrementalInputMerger>>
+        incremental_input_mergers;
+
+    // If input buffer pooling is enabled, the pool used to merge the inputs of
+    // the signature's batches. Otherwise null.
+    std::unique_ptr<BatchInputBufferPool> input_buffer_pool;
+  };
+  std::unordered_map<TensorSignature, SignatureState, HashTensorSignature,
+                     EqTensorSignature>
+      signature_states_;
+
+  // Returns the state of the batching signature that a Run() call with
+  // 'signature' belongs to: the one that matches it exactly or, failing that,
+  // the one with the fewest output tensors among those with the same input
+  // tensors whose output tensors include the call's. (The call's task then
+  // takes only its own outputs from the batch's.) Returns null if there is no
+  // such signature.
+  const SignatureState* FindSignatureState(
+      const TensorSignature& signature) const;
+
+  // Returns the state that 'handle' refers to if this session resolved it,
+  // without looking at the call's tensor names again (which the caller
+  // guarantees are the ones the handle was resolved for; checked in debug
+  // builds). Otherwise falls back to matching 'inputs' and
+  // 'output_tensor_names' via FindSignatureState().
+  template <typename InputType>
+  const SignatureState* FindSignatureState(
+      const RunSignatureHandle& handle,
+      const std::vector<std::pair<string, InputType>>& inputs,
+      const std::vector<string>& output_tensor_names) const;
+
+  // The signatures resolved by ResolveRunSignature(), each mapped to the state
+  // of the batching signature it belongs to. RunSignatureHandles point at
+  // these entries, which record the tensor names each was resolved for.
+  using ResolvedSignatureMap =
+      std::unordered_map<TensorSignature, const SignatureState*,
+                         HashTensorSignature, EqTensorSignature>;
+  mutable mutex resolved_signatures_mu_;
+  mutable ResolvedSignatureMap resolved_signatures_
+      GUARDED_BY(resolved_signatures_mu_);
+
+  // Shares ownership with the RunSignatureHandles this session resolves, which
+  // point at entries of 'resolved_signatures_'. Reset when the session is
+  // destroyed, which expires the handles.
+  std::shared_ptr<const void> signature_handle_owner_ =
+      std::make_shared<int>(0);
 
   TF_DISALLOW_COPY_AND_ASSIGN(BatchingSession);
 };
@@ -177,24 +976,67 @@ Status BatchingSession::Create(
     const std::vector<SignatureWithBatchingSessionSchedulerCreator>&
         signatures_with_scheduler_creators,
     std::unique_ptr<BatchingSession>* result) {
+  if (options.num_pipeline_threads < 0) {
+    return errors::InvalidArgument(
+        "num_pipeline_threads must be non-negative; was ",
+        options.num_pipeline_threads);
+  }
   auto batching_session =
       std::unique_ptr<BatchingSession>(new BatchingSession(options));
   BatchingSession* raw_batching_session = batching_session.get();
   batching_session->wrapped_ = std::move(wrapped);
+  if (options.num_pipeline_threads > 0) {
+    batching_session->pipeline_cpus_ = options.pipeline_cpus;
+    for (int cpu : options.pipeline_cpus) {
+      if (cpu < 0) {
+        return errors::InvalidArgument("Invalid CPU in pipeline_cpus: ", cpu);
+      }
+    }
+    if (options.pipeline_cpus.empty() && options.pipeline_numa_node >= 0) {
+      TF_RETURN_IF_ERROR(GetNumaNodeCpus(options.pipeline_numa_node,
+                                         &batching_session->pipeline_cpus_));
+    }
+    batching_session->execution_pool_.reset(
+        new thread::ThreadPool(Env::Default(), "batch_execution",
+                               options.num_pipeline_threads));
+    batching_session->completion_pool_.reset(
+        new thread::ThreadPool(Env::Default(), "batch_completion",
+                               options.num_pipeline_threads));
+  }
+
+  for (int i = 1; i < options.length_bucket_limits.size(); ++i) {
+    if (options.length_bucket_limits[i] <=
+        options.length_bucket_limits[i - 1]) {
+      return errors::InvalidArgument(
+          "length_bucket_limits entries must be in increasing order");
+    }
+  }
+  const int num_length_buckets = options.length_bucket_limits.size() + 1;
 
   for (const auto& entry : signatures_with_scheduler_creators) {
     const TensorSignature& signature = entry.signature;
     const BatchingSessionSchedulerCreator& scheduler_creator =
         entry.scheduler_creator;
 
-    std::unique_ptr<BatchScheduler<BatchingSessionTask>> batch_scheduler;
-    TF_RETURN_IF_ERROR(scheduler_creator(
-        [signature, raw_batching_session](
-            std::unique_ptr<Batch<BatchingSessionTask>> batch) {
-          raw_batching_session->ProcessBatch(signature, std::move(batch));
-        },
-        &batch_scheduler));
-    batching_session->batch_schedulers_[signature] = std::move(batch_scheduler);
+    SignatureState& state = batching_session->signature_states_[signature];
+    for (int bucket = 0; bucket < num_length_buckets; ++bucket) {
+      std::unique_ptr<BatchScheduler<BatchingSessionTask>> batch_scheduler;
+      TF_RETURN_IF_ERROR(scheduler_creator(
+          [signature, raw_batching_session](
+              std::unique_ptr<Batch<BatchingSessionTask>> batch) {
+            raw_batching_session->ProcessBatch(signature, std::move(batch));
+          },
+          &batch_scheduler));
+      state.batch_schedulers.push_back(std::move(batch_scheduler));
+      if (options.incremental_merge_buffer_size > 0) {
+        state.incremental_input_mergers.emplace_back(
+            new IncrementalInputMerger(options.incremental_merge_buffer_size));
+      }
+    }
+    if (options.input_buffer_pool_max_bytes > 0) {
+      state.input_buffer_pool.reset(
+          new BatchInputBufferPool(options.input_buffer_pool_max_bytes));
+    }
   }
 
   *result = std::move(batching_session);
@@ -206,6 +1048,28 @@ Status BatchingSession::Run(
     const std::vector<string>& output_tensor_names,
     const std::vector<string>& target_node_names,
     std::vector<Tensor>* outputs) {
+  return InternalRun(nullptr /* run_options */, inputs, output_tensor_names,
+                     target_node_names, 0 /* deadline_micros */, outputs,
+                     nullptr /* run_metadata */);
+}
+
+Status BatchingSession::Run(
+    const RunOptions& run_options,
+    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    const std::vector<string>& target_node_names,
+    std::vector<Tensor>* outputs, RunMetadata* run_metadata) {
+  return InternalRun(&run_options, inputs, output_tensor_names,
+                     target_node_names, DeadlineMicros(run_options), outputs,
+                     run_metadata);
+}
+
+Status BatchingSession::InternalRun(
+    const RunOptions* run_options,
+    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    const std::vector<string>& target_node_names, uint64 deadline_micros,
+    std::vector<Tensor>* outputs, RunMetadata* run_metadata) {
   if (!target_node_names.empty()) {
     return errors::PermissionDenied(
         "BatchingSession does not support target nodes");
@@ -213,38 +1077,269 @@ Status BatchingSession::Run(
 
   const TensorSignature signature =
       TensorSignatureFromRunArgs(inputs, output_tensor_names);
-  auto batch_scheduler_it = batch_schedulers_.find(signature);
-  if (batch_scheduler_it == batch_schedulers_.end()) {
+  const SignatureState* signature_state = FindSignatureState(signature);
+  if (signature_state == nullptr) {
     // We have a Run() call that doesn't match one of our batching signatures.
     // Run it in-line.
     LOG(WARNING) << "Request doesn't match any declared signature. Bypassing "
                     "batcher. Request signature is: "
                  << TensorSignatureDebugString(signature);
+    if (run_options != nullptr) {
+      return wrapped_->Run(*run_options, inputs, output_tensor_names,
+                           target_node_names, outputs, run_metadata);
+    }
     return wrapped_->Run(inputs, output_tensor_names, target_node_names,
                          outputs);
   }
-  BatchScheduler<BatchingSessionTask>* batch_scheduler =
-      batch_scheduler_it->second.get();
-
-  outputs->clear();
+  const int bucket = LengthBucket(inputs);
+  IncrementalInputMerger* merger =
+      signature_state->incremental_input_mergers.empty()
+          ? nullptr
+          : signature_state->incremental_input_mergers[bucket].get();
 
   Notification done;
   Status status;
+  TF_RETURN_IF_ERROR(ScheduleTask(
+      inputs, output_tensor_names, deadline_micros, outputs,
+      signature_state->batch_schedulers[bucket].get(), merger,
+      [&done, &status](const Status& task_status) {
+        status = task_status;
+        done.Notify();
+      }));
+  done.WaitForNotification();
+  return status;
+}
+
+RunSignatureHandle BatchingSession::ResolveRunSignature(
+    const std::vector<string>& input_tensor_names,
+    const std::vector<string>& output_tensor_names) const {
+  TensorSignature signature;
+  signature.input_tensors.insert(input_tensor_names.begin(),
+                                 input_tensor_names.end());
+  signature.output_tensors.insert(output_tensor_names.begin(),
+                                  output_tensor_names.end());
+  const SignatureState* signature_state = FindSignatureState(signature);
+  if (signature_state == nullptr) {
+    return RunSignatureHandle();
+  }
+  mutex_lock l(resolved_signatures_mu_);
+  const ResolvedSignatureMap::value_type& resolved_signature =
+      *resolved_signatures_.emplace(std::move(signature), signature_state)
+           .first;
+  // An aliasing pointer: it shares ownership with 'signature_handle_owner_'.
+  return RunSignatureHandle(std::shared_ptr<const void>(
+      signature_handle_owner_, &resolved_signature));
+}
+
+void BatchingSession::RunAsync(
+    const RunOptions& run_options, const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  const SignatureState* signature_state =
+      FindSignatureState(signature, inputs, output_tensor_names);
+  if (signature_state == nullptr) {
+    // Run() bypasses the batcher for this call, so run it in-line.
+    ServingSession::RunAsync(run_options, signature, inputs,
+                             output_tensor_names, outputs, std::move(done));
+    return;
+  }
+  const int bucket = LengthBucket(inputs);
+  IncrementalInputMerger* merger =
+      signature_state->incremental_input_mergers.empty()
+          ? nullptr
+          : signature_state->incremental_input_mergers[bucket].get();
+
+  const Status schedule_status = ScheduleTask(
+      inputs, output_tensor_names, DeadlineMicros(run_options), outputs,
+      signature_state->batch_schedulers[bucket].get(), merger, done);
+  if (!schedule_status.ok()) {
+    done(schedule_status);
+  }
+}
+
+void BatchingSession::RunAsyncFromProtos(
+    const RunOptions& run_options, const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  const SignatureState* signature_state =
+      FindSignatureState(signature, inputs, output_tensor_names);
+  std::vector<InputTensorSpec> input_specs;
+  if (signature_state == nullptr ||
+      signature_state->incremental_input_mergers.empty() ||
+      !GetDecodableInputTensorSpecs(
+          inputs, options_.incremental_merge_buffer_size, &input_specs)) {
+    // Parse the protos into tensors, and take the RunAsync() path.
+    proto_input_requests->GetCell("parsed")->IncrementBy(1);
+    ServingSession::RunAsyncFromProtos(run_options, signature, inputs,
+                                       output_tensor_names, outputs,
+                                       std::move(done));
+    return;
+  }
+  proto_input_requests->GetCell("decoded")->IncrementBy(1);
+  const int bucket = LengthBucket(input_specs);
+  IncrementalInputMerger* merger =
+      signature_state->incremental_input_mergers[bucket].get();
+  outputs->clear();
+
+  auto task = std::unique_ptr<BatchingSessionTask>(new BatchingSessionTask);
+  task->zeroth_dim_size = input_specs[0].shape.dim_size(0);
+  task->output_tensor_names = &output_tensor_names;
+  task->absolute_deadline_micros = DeadlineMicros(run_options);
+  task->done = std::move(done);
+  task->outputs = outputs;
+
+  // As in ScheduleTask(), the batch thread waits for 'inputs_merged' before
+  // touching the task, so the task outlives the decoding below.
+  BatchingSessionTask* raw_task = task.get();
+  Status schedule_status;
+  {
+    mutex_lock l(*merger->mu());
+    merger->ReserveRows(input_specs, raw_task);
+    DCHECK(raw_task->merge_buffer != nullptr);
+    const int64 offset = raw_task->merge_buffer_offset;
+    for (const InputTensorSpec& input : input_specs) {
+      const Tensor rows =
+          raw_task->merge_buffer->tensors.at(*input.name)
+              .Slice(offset, offset + raw_task->zeroth_dim_size);
+      raw_task->input_bytes += rows.TotalBytes();
+      raw_task->merge_buffer_inputs.emplace_back(*input.name, rows);
+    }
+    raw_task->inputs = &raw_task->merge_buffer_inputs;
+    raw_task->input_cost =
+        ComputeInputCost(*raw_task->inputs, raw_task->zeroth_dim_size);
+    schedule_status =
+        signature_state->batch_schedulers[bucket]->Schedule(&task);
+    if (!schedule_status.ok()) {
+      merger->UnreserveRows(raw_task);
+    }
+  }
+  if (!schedule_status.ok()) {
+    // The scheduler leaves 'task' alone if it rejects it.
+    task->done(schedule_status);
+    return;
+  }
+  for (const auto& entry : inputs) {
+    DecodeTensorProtoRows(*entry.second, raw_task->merge_buffer_offset,
+                          &raw_task->merge_buffer->tensors.at(entry.first));
+  }
+  raw_task->inputs_merged.Notify();
+}
+
+Status BatchingSession::ScheduleTask(
+    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<string>& output_tensor_names, uint64 deadline_micros,
+    std::vector<Tensor>* outputs,
+    BatchScheduler<BatchingSessionTask>* batch_scheduler,
+    IncrementalInputMerger* merger, std::function<void(const Status&)> done) {
+  outputs->clear();
+
   auto task = std::unique_ptr<BatchingSessionTask>(new BatchingSessionTask);
   TF_RETURN_IF_ERROR(ComputeInputSize(inputs, &task->zeroth_dim_size));
+  task->input_cost = ComputeInputCost(inputs, task->zeroth_dim_size);
+  for (const auto& entry : inputs) {
+    task->input_bytes += entry.second.TotalBytes();
+  }
   task->inputs = &inputs;
   task->output_tensor_names = &output_tensor_names;
-  task->done = &done;
-  task->status = &status;
+  task->absolute_deadline_micros = deadline_micros;
+  task->done = std::move(done);
   task->outputs = outputs;
 
-  TF_RETURN_IF_ERROR(batch_scheduler->Schedule(&task));
-  done.WaitForNotification();
-  return status;
+  if (merger == nullptr) {
+    return batch_scheduler->Schedule(&task);
+  }
+
+  // The batch thread waits for 'inputs_merged' before touching a task with
+  // reserved rows, so such a task outlives the copy below even though the
+  // scheduler owns it. Any other task may be processed and destroyed as soon
+  // as it is scheduled, so whether to copy is decided beforehand.
+  BatchingSessionTask* raw_task = task.get();
+  bool merge_inputs;
+  {
+    mutex_lock l(*merger->mu());
+    merger->ReserveRows(InputTensorSpecs(inputs), raw_task);
+    // (Tasks with reserved rows are never split by the scheduler, so
+    // 'raw_task' remains valid if 'merge_inputs' is true.)
+    merge_inputs = raw_task->merge_buffer != nullptr;
+    const Status schedule_status = batch_scheduler->Schedule(&task);
+    if (!schedule_status.ok()) {
+      merger->UnreserveRows(raw_task);
+      return schedule_status;
+    }
+  }
+  if (merge_inputs) {
+    IncrementalInputMerger::CopyInputs(raw_task);
+  }
+  return Status::OK();
+}
+
+const BatchingSession::SignatureState* BatchingSession::FindSignatureState(
+    const TensorSignature& signature) const {
+  auto exact_match = signature_states_.find(signature);
+  if (exact_match != signature_states_.end()) {
+    return &exact_match->second;
+  }
+  const SignatureState* best_match = nullptr;
+  size_t best_match_num_outputs = 0;
+  for (const auto& entry : signature_states_) {
+    const TensorSignature& candidate = entry.first;
+    if (candidate.input_tensors != signature.input_tensors ||
+        !std::includes(candidate.output_tensors.begin(),
+                       candidate.output_tensors.end(),
+                       signature.output_tensors.begin(),
+                       signature.output_tensors.end())) {
+      continue;
+    }
+    if (best_match == nullptr ||
+        candidate.output_tensors.size() < best_match_num_outputs) {
+      best_match = &entry.second;
+      best_match_num_outputs = candidate.output_tensors.size();
+    }
+  }
+  return best_match;
+}
+
+template <typename InputType>
+const BatchingSession::SignatureState* BatchingSession::FindSignatureState(
+    const RunSignatureHandle& handle,
+    const std::vector<std::pair<string, InputType>>& inputs,
+    const std::vector<string>& output_tensor_names) const {
+  const std::shared_ptr<const void> resolved = handle.Lock();
+  // Check that this session issued the handle, i.e. that 'resolved' shares
+  // ownership with 'signature_handle_owner_'.
+  if (resolved != nullptr &&
+      !resolved.owner_before(signature_handle_owner_) &&
+      !signature_handle_owner_.owner_before(resolved)) {
+    const auto* resolved_signature =
+        static_cast<const ResolvedSignatureMap::value_type*>(resolved.get());
+    // The names were matched when the handle was resolved, and the caller
+    // vouches that the call has the same ones.
+    DCHECK(EqTensorSignature()(
+        resolved_signature->first,
+        TensorSignatureFromRunArgs(inputs, output_tensor_names)))
+        << "RunSignatureHandle passed with other tensor names";
+    return resolved_signature->second;
+  }
+  return FindSignatureState(
+      TensorSignatureFromRunArgs(inputs, output_tensor_names));
 }
 
 BatchingSession::BatchingSession(const BatchingSessionOptions& options)
-    : options_(options) {}
+    : options_(options),
+      padded_batch_size_cell_(
+          padded_batch_size_histogram->GetCell(options.model_name)),
+      padding_rows_cell_(padding_rows->GetCell(options.model_name)) {}
+
+BatchingSession::~BatchingSession() {
+  signature_handle_owner_.reset();
+  // Drain the batch schedulers, and then the pipeline stages they feed, in
+  // order, while 'wrapped_' is still around.
+  signature_states_.clear();
+  execution_pool_.reset();
+  completion_pool_.reset();
+}
 
 Status BatchingSession::ComputeInputSize(
     const std::vector<std::pair<string, Tensor>>& inputs, size_t* size) const {
@@ -278,6 +1373,26 @@ Status BatchingSession::ComputeInputSize(
   return Status::OK();
 }
 
+size_t BatchingSession::ComputeInputCost(
+    const std::vector<std::pair<string, Tensor>>& inputs, size_t size) const {
+  size_t cost = 0;
+  switch (options_.task_cost_measure) {
+    case BatchingSessionOptions::TaskCostMeasure::kRows:
+      return size;
+    case BatchingSessionOptions::TaskCostMeasure::kElements:
+      for (const auto& entry : inputs) {
+        cost += entry.second.NumElements();
+      }
+      return cost;
+    case BatchingSessionOptions::TaskCostMeasure::kBytes:
+      for (const auto& entry : inputs) {
+        cost += entry.second.TotalBytes();
+      }
+      return cost;
+  }
+  return size;
+}
+
 int BatchingSession::RoundToLowestAllowedBatchSize(int batch_size) const {
   if (options_.allowed_batch_sizes.empty()) {
     return batch_size;
@@ -292,6 +1407,51 @@ int BatchingSession::RoundToLowestAllowedBatchSize(int batch_size) const {
   return batch_size;
 }
 
+int BatchingSession::LengthBucket(
+    const std::vector<std::pair<string, Tensor>>& inputs) const {
+  if (options_.length_bucket_limits.empty()) {
+    return 0;
+  }
+  return LengthBucket(InputTensorSpecs(inputs));
+}
+
+int BatchingSession::LengthBucket(
+    const std::vector<InputTensorSpec>& inputs) const {
+  if (options_.length_bucket_limits.empty()) {
+    return 0;
+  }
+  int64 length = 0;
+  for (const InputTensorSpec& input : inputs) {
+    if (input.shape.dims() >= 2) {
+      length = std::max(length, input.shape.dim_size(1));
+    }
+  }
+  const auto& limits = options_.length_bucket_limits;
+  return std::lower_bound(limits.begin(), limits.end(), length) -
+         limits.begin();
+}
+
+Status BatchingSession::PadVariableLengthInputs(
+    const string& tensor_name, std::vector<Tensor>* tensors) const {
+  TensorShape max_shape;
+  TF_RETURN_IF_ERROR(CalculateMaxInnerDimSizes(*tensors, &max_shape));
+  auto padding_value_it =
+      options_.variable_length_padding_values.find(tensor_name);
+  const Tensor* padding_value =
+      padding_value_it == options_.variable_length_padding_values.end()
+          ? nullptr
+          : &padding_value_it->second;
+  for (Tensor& tensor : *tensors) {
+    max_shape.set_dim(0, tensor.dim_size(0));
+    if (!tensor.shape().IsSameSize(max_shape)) {
+      Tensor padded;
+      TF_RETURN_IF_ERROR(PadTensor(tensor, max_shape, padding_value, &padded));
+      tensor = padded;
+    }
+  }
+  return Status::OK();
+}
+
 Status BatchingSession::MergeInputTensors(
     const TensorSignature& signature, const Batch<BatchingSessionTask>& batch,
     std::vector<std::pair<string, Tensor>>* merged_inputs) {
@@ -301,36 +1461,31 @@ Status BatchingSession::MergeInputTensors(
                             batch.num_tasks());
   }
 
-  const int padding_size =
-      RoundToLowestAllowedBatchSize(batch.size()) - batch.size();
+  const int padded_batch_size = RoundToLowestAllowedBatchSize(batch.size());
+  const int padding_size = padded_batch_size - batch.size();
+  padded_batch_size_cell_->Add(padded_batch_size);
+  padding_rows_cell_->IncrementBy(padding_size);
 
-  // For each input tensor name, a vector of tensors from the individual tasks.
+  // For each input tensor name, a vector of tensors to concatenate: either one
+  // tensor from each individual task or, if the tasks' inputs have already been
+  // copied into a contiguous range of a staging buffer, a single slice of that
+  // buffer.
   std::map<string, std::vector<Tensor>> tensors_to_merge;
 
   // Populate 'tensors_to_merge'.
-  for (int i = 0; i < batch.num_tasks(); ++i) {
-    const std::vector<std::pair<string, Tensor>>& task_inputs =
-        *batch.task(i).inputs;
-    for (const auto& entry : task_inputs) {
-      const string& tensor_name = entry.first;
-      const Tensor& tensor = entry.second;
-
-      std::vector<Tensor>& tensor_vec = tensors_to_merge[tensor_name];
-      tensor_vec.push_back(tensor);
-
-      if (i == batch.num_tasks() - 1 && padding_size > 0) {
-        // This is the last task. Insert padding.
-        //
-        // Use the first row of this task's tensor as the padding data. (We know
-        // it represents a valid input tensor row, so it should always be safe
-        // to use for padding.)
-        //
-        // Slice() operates on the 0th dimension, which is the batch dimension.
-        // It avoids a deep copy, which is a nice efficiency bonus.
-        const Tensor padding_tensor = tensor.Slice(0, 1);
-        for (int i = 0; i < padding_size; ++i) {
-          tensor_vec.push_back(padding_tensor);
-        }
+  std::map<string, Tensor> incrementally_merged_inputs;
+  if (GetIncrementallyMergedInputs(batch, &incrementally_merged_inputs)) {
+    for (const auto& entry : incrementally_merged_inputs) {
+      tensors_to_merge[entry.first].push_back(entry.second);
+    }
+  } else {
+    for (int i = 0; i < batch.num_tasks(); ++i) {
+      const std::vector<std::pair<string, Tensor>>& task_inputs =
+          *batch.task(i).inputs;
+      for (const auto& entry : task_inputs) {
+        const string& tensor_name = entry.first;
+        const Tensor& tensor = entry.second;
+        tensors_to_merge[tensor_name].push_back(tensor);
       }
     }
   }
@@ -341,6 +1496,8 @@ Status BatchingSession::MergeInputTensors(
     return errors::Internal(
         "One or more tasks does not conform to batch signature");
   }
+  BatchInputBufferPool* buffer_pool =
+      signature_states_.at(signature).input_buffer_pool.get();
   for (const string& tensor_name : signature.input_tensors) {
     auto tensors = tensors_to_merge.find(tensor_name);
     DCHECK(tensors != tensors_to_merge.end());
@@ -348,12 +1505,79 @@ Status BatchingSession::MergeInputTensors(
       return errors::Internal(
           "One or more tasks does not conform to batch signature");
     }
-    merged_inputs->push_back({tensor_name, tensor::Concat(tensors->second)});
+    std::vector<Tensor>& tensor_vec = tensors->second;
+
+    if (options_.pad_variable_length_inputs && tensor_vec.size() > 1) {
+      TF_RETURN_IF_ERROR(PadVariableLengthInputs(tensor_name, &tensor_vec));
+    }
+
+    Tensor merged_tensor;
+    if (tensor_vec.size() == 1 && padding_size == 0 &&
+        tensor_vec[0].IsAligned()) {
+      // Nothing to concatenate. (Kernels in the wrapped session may require
+      // aligned input buffers, so unaligned tensors get copied below.)
+      merged_tensor = tensor_vec[0];
+    } else if (buffer_pool != nullptr &&
+               CanCopyTensorRows(tensor_vec[0].dtype())) {
+      TF_RETURN_IF_ERROR(MergeIntoPooledTensor(tensor_name, tensor_vec,
+                                               padded_batch_size, buffer_pool,
+                                               &merged_tensor));
+    } else {
+      if (padding_size > 0) {
+        // Insert padding.
+        //
+        // Use the first row of the last task's tensor as the padding data. (We
+        // know it represents a valid input tensor row, so it should always be
+        // safe to use for padding.)
+        //
+        // Slice() operates on the 0th dimension, which is the batch dimension.
+        // It avoids a deep copy, which is a nice efficiency bonus.
+        const Tensor padding_tensor = tensor_vec.back().Slice(0, 1);
+        for (int i = 0; i < padding_size; ++i) {
+          tensor_vec.push_back(padding_tensor);
+        }
+      }
+      merged_tensor = tensor::Concat(tensor_vec);
+    }
+    merged_inputs->push_back({tensor_name, merged_tensor});
   }
 
   return Status::OK();
 }
 
+Status BatchingSession::TrimVariableLengthOutput(
+    const string& tensor_name, const BatchingSessionTask& task,
+    Tensor* output) const {
+  auto source_it = options_.variable_length_output_sources.find(tensor_name);
+  if (source_it == options_.variable_length_output_sources.end()) {
+    return Status::OK();
+  }
+  const string& input_tensor_name = source_it->second;
+  for (const auto& entry : *task.inputs) {
+    if (entry.first != input_tensor_name) {
+      continue;
+    }
+    const Tensor& input = entry.second;
+    if (input.dims() < 2 || output->dims() < 2) {
+      return errors::InvalidArgument(
+          "Variable-length output tensor ", tensor_name, " and its input ",
+          input_tensor_name, " must have at least two dimensions");
+    }
+    if (output->dim_size(1) == input.dim_size(1)) {
+      return Status::OK();
+    }
+    TensorShape trimmed_shape = output->shape();
+    trimmed_shape.set_dim(1, input.dim_size(1));
+    Tensor trimmed;
+    TF_RETURN_IF_ERROR(TrimTensor(*output, trimmed_shape, &trimmed));
+    *output = trimmed;
+    return Status::OK();
+  }
+  return errors::InvalidArgument("Variable-length output tensor ", tensor_name,
+                                 " refers to input ", input_tensor_name,
+                                 ", which is not in the signature");
+}
+
 Status BatchingSession::SplitOutputTensors(
     const TensorSignature& signature,
     const std::vector<Tensor>& combined_outputs,
@@ -364,20 +1588,13 @@ Status BatchingSession::SplitOutputTensors(
                             batch->num_tasks());
   }
 
-  std::vector<int64> task_sizes_plus_optional_padding;
-  for (int i = 0; i < batch->num_tasks(); ++i) {
-    task_sizes_plus_optional_padding.push_back(batch->task(i).zeroth_dim_size);
-  }
   const int padding_size =
       RoundToLowestAllowedBatchSize(batch->size()) - batch->size();
-  if (padding_size > 0) {
-    task_sizes_plus_optional_padding.push_back(padding_size);
-  }
 
-  // For each output tensor name, a divided-up tensor with one entry per task.
-  std::map<string, std::vector<Tensor>> split_tensors;
+  // For each output tensor name, the corresponding batched output tensor.
+  std::map<string, const Tensor*> batched_outputs;
 
-  // Populate 'split_tensors'.
+  // Populate 'batched_outputs'.
   DCHECK_EQ(signature.output_tensors.size(), combined_outputs.size());
   if (combined_outputs.size() != signature.output_tensors.size()) {
     return errors::Internal("Wrong number of batched output tensors");
@@ -397,31 +1614,36 @@ Status BatchingSession::SplitOutputTensors(
           "Batched output tensor's 0th dimension does not equal the sum of the "
           "0th dimension sizes of the input tensors");
     }
-
-    std::vector<Tensor> split_tensor =
-        tensor::Split(tensor, task_sizes_plus_optional_padding);
-    DCHECK_EQ(split_tensor.size(), task_sizes_plus_optional_padding.size());
-    if (split_tensor.size() != task_sizes_plus_optional_padding.size()) {
-      return errors::Internal(
-          "Tensor split operation did not work as expected; got ",
-          split_tensor.size(), " splits; expected ",
-          task_sizes_plus_optional_padding.size());
-    }
-    split_tensors[tensor_name] = std::move(split_tensor);
+    batched_outputs[tensor_name] = &tensor;
   }
 
+  // Hand each task 0th-dimension slices of the batched outputs. The slices
+  // share (and keep alive) the batched outputs' buffers, so no rows are copied
+  // unless alignment is required and a slice isn't aligned. (The final
+  // 'padding_size' rows of each batched output are simply not handed out.)
+  int64 task_offset = 0;
   for (int i = 0; i < batch->num_tasks(); ++i) {
     BatchingSessionTask* task = batch->mutable_task(i);
+    const int64 task_limit = task_offset + task->zeroth_dim_size;
     for (const string& tensor_name : *task->output_tensor_names) {
-      auto split_tensor = split_tensors.find(tensor_name);
-      DCHECK(split_tensor != split_tensors.end());
-      if (split_tensor == split_tensors.end()) {
+      auto batched_output = batched_outputs.find(tensor_name);
+      DCHECK(batched_output != batched_outputs.end());
+      if (batched_output == batched_outputs.end()) {
         return errors::Internal("Task does not conform to batch signature");
       }
-      task->outputs->push_back(split_tensor->second[i]);
+      Tensor task_output =
+          batched_output->second->Slice(task_offset, task_limit);
+      if (options_.pad_variable_length_inputs) {
+        TF_RETURN_IF_ERROR(
+            TrimVariableLengthOutput(tensor_name, *task, &task_output));
+      }
+      if (options_.align_split_outputs && !task_output.IsAligned()) {
+        task_output = tensor::DeepCopy(task_output);
+      }
+      task->outputs->push_back(task_output);
     }
+    task_offset = task_limit;
   }
-  // (Ignore a possible final split_tensors entry containing the padding.)
 
   return Status::OK();
 }
@@ -429,24 +1651,41 @@ Status BatchingSession::SplitOutputTensors(
 void BatchingSession::ProcessBatch(
     const TensorSignature& signature,
     std::unique_ptr<Batch<BatchingSessionTask>> batch) {
-  // As a possible performance optimization, consider overlapping the tensor
-  // concatenation with waiting for the batch to close (i.e. do the
-  // concatenation incrementally as tasks stream into the batch).
+  // (If incremental input merging is enabled, the input concatenation overlaps
+  // with waiting for the batch to close; see IncrementalInputMerger.)
   batch->WaitUntilClosed();
 
   if (batch->empty()) {
     return;
   }
 
+  // Wait for any incrementally-merged inputs to finish being copied.
+  for (int i = 0; i < batch->num_tasks(); ++i) {
+    BatchingSessionTask* task = batch->mutable_task(i);
+    if (task->merge_buffer != nullptr) {
+      task->inputs_merged.WaitForNotification();
+    }
+  }
+
+  // Don't spend resources on tasks nobody is waiting for any more.
+  batch = RemoveExpiredTasks(std::move(batch));
+  if (batch->empty()) {
+    return;
+  }
+
   Status status;
 
   // Regardless of the outcome, we need to propagate the status to the
   // individual tasks and signal that they are done. We use MakeCleanup() to
   // ensure that this happens no matter how we exit the method below.
+  // (Unless the batch is handed over to the pipeline, which takes on that
+  // responsibility.)
   auto finally = MakeCleanup([&status, &batch] {
+    if (batch == nullptr) {
+      return;
+    }
     for (int i = 0; i < batch->num_tasks(); ++i) {
-      *batch->mutable_task(i)->status = status;
-      batch->mutable_task(i)->done->Notify();
+      CompleteTask(status, batch->mutable_task(i));
     }
   });
 
@@ -456,6 +1695,11 @@ void BatchingSession::ProcessBatch(
     return;
   }
 
+  if (execution_pool_ != nullptr) {
+    ExecuteInPipeline(signature, std::move(batch), std::move(merged_inputs));
+    return;
+  }
+
   const std::vector<string> output_tensor_names(
       signature.output_tensors.begin(), signature.output_tensors.end());
   std::vector<Tensor> combined_outputs;
@@ -468,6 +1712,132 @@ void BatchingSession::ProcessBatch(
   status = SplitOutputTensors(signature, combined_outputs, batch.get());
 }
 
+void BatchingSession::ExecuteInPipeline(
+    const TensorSignature& signature,
+    std::unique_ptr<Batch<BatchingSessionTask>> batch,
+    std::vector<std::pair<string, Tensor>> merged_inputs) {
+  {
+    mutex_lock l(pipeline_mu_);
+    while (num_executing_batches_ >= options_.num_pipeline_threads) {
+      execution_finished_cv_.wait(l);
+    }
+    ++num_executing_batches_;
+  }
+
+  // (ThreadPool closures must be copyable.)
+  std::shared_ptr<Batch<BatchingSessionTask>> shared_batch(std::move(batch));
+  auto shared_merged_inputs =
+      std::make_shared<std::vector<std::pair<string, Tensor>>>(
+          std::move(merged_inputs));
+  execution_pool_->Schedule([this, signature, shared_batch,
+                             shared_merged_inputs]() mutable {
+    MaybePinPipelineThread();
+    const std::vector<string> output_tensor_names(
+        signature.output_tensors.begin(), signature.output_tensors.end());
+    auto combined_outputs = std::make_shared<std::vector<Tensor>>();
+    const Status run_status =
+        wrapped_->Run(*shared_merged_inputs, output_tensor_names,
+                      {} /* target node names */, combined_outputs.get());
+    // Release the merged inputs (e.g. back to the input buffer pool) before
+    // letting the next batch in.
+    shared_merged_inputs.reset();
+    {
+      mutex_lock l(pipeline_mu_);
+      --num_executing_batches_;
+      execution_finished_cv_.notify_one();
+    }
+
+    completion_pool_->Schedule(
+        [this, signature, shared_batch, combined_outputs, run_status] {
+          MaybePinPipelineThread();
+          Status status = run_status;
+          if (status.ok()) {
+            status = SplitOutputTensors(signature, *combined_outputs,
+                                        shared_batch.get());
+          }
+          for (int i = 0; i < shared_batch->num_tasks(); ++i) {
+            CompleteTask(status, shared_batch->mutable_task(i));
+          }
+        });
+  });
+}
+
+void BatchingSession::MaybePinPipelineThread() {
+  if (pipeline_cpus_.empty()) {
+    return;
+  }
+  // Each thread of the pools belongs to this session alone.
+  static thread_local bool attempted_pinning = false;
+  if (attempted_pinning) {
+    return;
+  }
+  attempted_pinning = true;
+  const Status status = PinCurrentThreadToCpus(pipeline_cpus_);
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to pin batch pipeline thread: " << status;
+  }
+}
+
+Status SplitInputTask(
+    std::unique_ptr<BatchingSessionTask>* input_task,
+    int first_output_task_size, int max_batch_size,
+    std::vector<std::unique_ptr<BatchingSessionTask>>* output_tasks) {
+  const BatchingSessionTask& task = **input_task;
+  if (task.merge_buffer != nullptr) {
+    return errors::FailedPrecondition(
+        "Cannot split a task whose inputs are merged incrementally; "
+        "incremental_merge_buffer_size must not exceed the maximum batch size");
+  }
+  if (task.split_context != nullptr) {
+    return errors::FailedPrecondition("Cannot split a subtask of a split task");
+  }
+  if (first_output_task_size <= 0 || max_batch_size <= 0) {
+    return errors::InvalidArgument("Subtask sizes must be positive");
+  }
+
+  std::vector<int64> subtask_sizes;
+  int64 remaining_size = task.zeroth_dim_size;
+  int64 next_subtask_size = first_output_task_size;
+  while (remaining_size > 0) {
+    const int64 subtask_size = std::min(next_subtask_size, remaining_size);
+    subtask_sizes.push_back(subtask_size);
+    remaining_size -= subtask_size;
+    next_subtask_size = max_batch_size;
+  }
+
+  auto context = std::make_shared<SplitTaskContext>(subtask_sizes.size());
+  context->done = task.done;
+  context->outputs = task.outputs;
+
+  int64 offset = 0;
+  for (int i = 0; i < subtask_sizes.size(); ++i) {
+    const int64 limit = offset + subtask_sizes[i];
+    std::unique_ptr<BatchingSessionTask> subtask(new BatchingSessionTask);
+    subtask->zeroth_dim_size = subtask_sizes[i];
+    // Apportion the task's cost and bytes by size. Taking the difference of
+    // the cumulative shares hands out the rounding remainders, so the subtasks
+    // add up to the task.
+    subtask->input_cost = task.input_cost * limit / task.zeroth_dim_size -
+                          task.input_cost * offset / task.zeroth_dim_size;
+    subtask->input_bytes = task.input_bytes * limit / task.zeroth_dim_size -
+                           task.input_bytes * offset / task.zeroth_dim_size;
+    for (const auto& entry : *task.inputs) {
+      subtask->split_inputs.emplace_back(entry.first,
+                                         entry.second.Slice(offset, limit));
+    }
+    subtask->inputs = &subtask->split_inputs;
+    subtask->output_tensor_names = task.output_tensor_names;
+    subtask->absolute_deadline_micros = task.absolute_deadline_micros;
+    subtask->outputs = &context->subtask_outputs[i];
+    subtask->split_context = context;
+    output_tasks->push_back(std::move(subtask));
+    offset = limit;
+  }
+
+  input_task->reset();
+  return Status::OK();
+}
+
 Status CreateBatchingSession(
     const BatchingSessionOptions& options,
     const std::vector<SignatureWithBatchingSessionSchedulerCreator>&
@@ -497,6 +1867,13 @@ Status CreateBasicBatchingSession(
           schedule_options.max_batch_size);
     }
   }
+  if (batching_session_options.incremental_merge_buffer_size >
+      schedule_options.max_batch_size) {
+    return errors::InvalidArgument(
+        "incremental_merge_buffer_size must not exceed max_batch_size; was ",
+        batching_session_options.incremental_merge_buffer_size,
+        ", with max_batch_size ", schedule_options.max_batch_size);
+  }
 
   auto scheduler_creator = [schedule_options](
       std::function<void(std::unique_ptr<Batch<BatchingSessionTask>>)>
@@ -21,15 +21,18 @@ limitations under the License.
 
 #include <cstddef>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/protobuf/meta_graph.pb.h"
 #include "tensorflow/core/public/session.h"
 #include "tensorflow_serving/batching/basic_batch_scheduler.h"
 #include "tensorflow_serving/batching/batch_scheduler.h"
+#include "tensorflow_serving/util/free_list.h"
 
 namespace tensorflow {
 namespace serving {
@@ -99,6 +102,159 @@ struct BatchingSessionOptions {
   //
   // If left empty, no rounding/padding is performed.
   std::vector<int> allowed_batch_sizes;
+
+  // If positive, enables incremental merging of input tensors. As soon as the
+  // batch scheduler accepts a task, the task's input rows are copied (in the
+  // calling thread) into per-signature staging buffers, one per input tensor,
+  // each of which has this many rows in the 0th dimension. When a batch closes
+  // and its tasks occupy a contiguous range of rows in one staging buffer, the
+  // wrapped session is handed slices of that buffer instead of tensors
+  // concatenated by the batch thread. Other batches (e.g. ones that straddle
+  // two staging buffers) fall back to concatenation.
+  //
+  // This takes the input copying off of the batch thread's critical path,
+  // which helps when batch timeouts are short and input tensors are large.
+  //
+  // Should be set to the maximum batch size parameter supplied to the batch
+  // scheduler, and must not exceed it (CreateBasicBatchingSession() checks
+  // this): a task with more rows than that would have to be split, which
+  // SplitInputTask() below refuses for a task whose rows are already staged.
+  // Note that a batch that starts partway into a staging buffer (e.g. because
+  // the previous batch closed on its timeout before filling the buffer) is
+  // only handed over as a slice if the slice happens to be suitably aligned
+  // for the wrapped session's kernels (see Tensor::IsAligned()), and if it
+  // needs no padding; otherwise its rows are copied once more by the batch
+  // thread.
+  //
+  // It also lets ServingSession::RunAsyncFromProtos() calls (e.g. from the
+  // Predict API) decode their TensorProto inputs straight into their rows of
+  // the staging buffers, skipping the intermediate per-request tensors. (The
+  // /tensorflow/serving/batching_session/proto_input_requests counter tells
+  // how many calls did so, and how many fell back to parsing their inputs.)
+  //
+  // If left as 0, input tensors are merged by the batch thread once the batch
+  // has closed.
+  int incremental_merge_buffer_size = 0;
+
+  // The output tensors handed back from a batched Run() call are 0th-dimension
+  // slices of the batch's output tensors, which share (and keep alive) the
+  // batch's output buffers rather than copying rows. Depending on the row size
+  // and the task's offset within the batch, a slice's data may not satisfy the
+  // alignment that Eigen-based accessors (e.g. Tensor::flat()) require.
+  //
+  // If true, slices that are not aligned (see Tensor::IsAligned()) are copied
+  // into freshly-allocated, aligned tensors. Set to false only if every
+  // consumer of the outputs tolerates unaligned tensors (e.g. they only use
+  // Tensor::unaligned_flat() or Tensor::AsProtoField()), to never copy.
+  bool align_split_outputs = true;
+
+  // If positive, batch inputs are merged into tensors drawn from a pool of
+  // recycled buffers, rather than into freshly-allocated ones. Each signature
+  // has its own pool, holding buffers of each batch size (i.e. each entry of
+  // 'allowed_batch_sizes') that occurs; padding rows are written only the
+  // first time a given buffer is used. This setting caps the total size of the
+  // buffers retained by each pool, in bytes.
+  //
+  // This avoids allocator churn (and page faults) from large, short-lived
+  // merged input tensors at high batch rates.
+  //
+  // If left as 0, merged input tensors are freshly allocated for each batch.
+  int64 input_buffer_pool_max_bytes = 0;
+
+  // If true, the tasks in a batch need only agree on the dtype and rank of each
+  // input tensor, rather than on the size of every dimension other than the
+  // 0th. Before concatenation, each task's tensor is padded in those dimensions
+  // to the largest size among the batch's tensors of the same name. This allows
+  // batching inputs of varying length, e.g. sequences of tokens.
+  //
+  // If false, tensors of a given name must match in all dimensions but the 0th.
+  bool pad_variable_length_inputs = false;
+
+  // The value with which to pad each input tensor, keyed by tensor name, when
+  // 'pad_variable_length_inputs' is true. Each value must be a scalar of the
+  // tensor's dtype. Tensors not listed are padded with zero (or the empty
+  // string, for DT_STRING).
+  std::map<string, Tensor> variable_length_padding_values;
+
+  // When 'pad_variable_length_inputs' is true, maps the name of an output
+  // tensor whose dimension 1 follows the (padded) dimension 1 of an input
+  // tensor, e.g. a per-token output of a sequence model, to the name of that
+  // input. Each task's slice of such an output is trimmed in dimension 1 to the
+  // size of the task's own, unpadded input. Other outputs are returned with
+  // whatever shape the wrapped session produced for the batch.
+  std::map<string, string> variable_length_output_sources;
+
+  // If non-empty, tasks of each signature are split into length classes
+  // ("buckets"), each with its own batch scheduler, so that short inputs are
+  // not batched with (and padded to the length of) long ones. A task's length
+  // is the largest dimension-1 size among its input tensors, or 0 if they are
+  // all one-dimensional. Bucket i holds the tasks whose length is at most
+  // 'length_bucket_limits[i]' (and greater than the previous limit), and a
+  // final bucket holds any longer tasks.
+  //
+  // Each bucket's scheduler is made by the signature's scheduler creator, so
+  // with a SharedBatchScheduler-based creator each bucket gets its own queue,
+  // and the buckets share the batch threads.
+  //
+  // IMPORTANT: The entries must be in increasing order.
+  std::vector<int64> length_bucket_limits;
+
+  // How the cost of a task (see BatchTask::cost()) is measured, for batch
+  // schedulers that limit the total cost of a batch (see e.g.
+  // SharedBatchScheduler::QueueOptions::max_batch_cost).
+  enum class TaskCostMeasure {
+    // The task's size, i.e. the 0th-dimension size of its input tensors.
+    kRows,
+    // The total number of elements in the task's input tensors, e.g. rows
+    // times sequence length.
+    kElements,
+    // The total size of the task's input tensors, in bytes (see
+    // Tensor::TotalBytes()).
+    kBytes,
+  };
+  TaskCostMeasure task_cost_measure = TaskCostMeasure::kRows;
+
+  // If positive, the processing of a batch is pipelined in three stages, so
+  // that copying tensors overlaps with running the wrapped session:
+  //  - preparation: the batch thread merges the batch's inputs;
+  //  - execution: one of this many threads runs the wrapped session on them;
+  //  - completion: one of another this many threads splits the outputs and
+  //    completes the tasks.
+  // The batch thread then moves on to the next batch, waiting before handing
+  // it over if this many batches are already executing. So the batch threads
+  // prepare upcoming batches while earlier ones execute and complete.
+  //
+  // This raises throughput for models whose input and output copying is a
+  // noticeable share of processing time. Typically set to the number of batch
+  // threads of the batch scheduler. (Note that from the scheduler's point of
+  // view, a batch is done once handed over for execution.)
+  //
+  // If left as 0, the batch thread performs all three stages itself.
+  int num_pipeline_threads = 0;
+
+  // The CPUs to pin the pipeline threads (see 'num_pipeline_threads') to,
+  // e.g. those of the batch scheduler thread group that serves the session's
+  // queues (see SharedBatchScheduler::Options::thread_groups), so that
+  // running the model on a batch and splitting its outputs stay on the NUMA
+  // node where its inputs were merged. If empty, and 'pipeline_numa_node' is
+  // non-negative, the CPUs of that NUMA node are used; if both are unset, the
+  // pipeline threads are not pinned. Pinning is only supported on Linux.
+  //
+  // Note that any threads of the wrapped session itself (e.g. its intra-op
+  // thread pool) are not pinned either way.
+  std::vector<int> pipeline_cpus;
+  int pipeline_numa_node = -1;
+
+  // The label of the session's metrics, which are exported via the TensorFlow
+  // monitoring API:
+  //  - /tensorflow/serving/batching_session/padded_batch_size: a histogram of
+  //    the sizes of the batches run on the wrapped session, i.e. after padding
+  //    up to an entry of 'allowed_batch_sizes'.
+  //  - /tensorflow/serving/batching_session/padding_rows: the number of
+  //    padding rows added to those batches.
+  // (Batch schedulers export metrics of their own; see e.g.
+  // batch_scheduler_metrics.h.)
+  string model_name;
 };
 
 // Wraps a session in a new session that automatically batches Run() calls.
@@ -112,16 +268,35 @@ struct BatchingSessionOptions {
 // are executed in-line without batching, and may harm performance. (Extra-
 // signature Run() support is intended primarily for debugging and diagnostics.)
 //
+// A Run() call that has the same input tensors as a specified signature but
+// fetches only some of its output tensors is batched with that signature's
+// calls: the batch fetches all of the signature's outputs, and each call gets
+// back just the ones it asked for. (If several signatures qualify, the one
+// with the fewest output tensors is used.)
+//
 // For batched calls, it is assumed that the outermost (0th) dimension of each
 // input and output tensor is the batch-size dimension. All input tensors must
 // have the same 0th-dimension size B; the produced output tensors are also
 // assumed to have 0th-dimension size B.
 //
+// A Run() call that supplies RunOptions with a positive 'timeout_in_ms' gets a
+// deadline that far in the future. The batch scheduler may close a batch early
+// to meet it (see SharedBatchScheduler), and if it has passed by the time the
+// call's batch is processed, the call fails with DEADLINE_EXCEEDED without
+// being run. (Other RunOptions, and RunMetadata, are not supported for batched
+// calls.)
+//
 // IMPORTANT: Each call to Session::Run() is synchronous, and blocks waiting for
 // other Run() calls with the same signature to merge with to form a large
 // batch. Consequently, to achieve good throughput we recommend setting the
 // number of client threads that call Session::Run() equal to about twice the
-// sum over all signatures of the maximum batch size.
+// sum over all signatures of the maximum batch size. Alternatively, callers
+// can use ServingSession::RunAsync() (e.g. via RunSessionAsync()), which
+// returns once the call has been scheduled and invokes its callback from the
+// batch thread, so that no client thread waits while the call is queued.
+// Such callers can also resolve their signature once, via ResolveRunSignature()
+// (see serving_session.h), and pass the handle to each call, which saves
+// matching the call's tensor names against the batching signatures.
 //
 // Example usage, for the common case of a single signature:
 //
@@ -159,21 +334,73 @@ Status CreateBasicBatchingSession(
     const TensorSignature& signature, std::unique_ptr<Session> session,
     std::unique_ptr<Session>* batching_session);
 
+// Splits a task along the 0th dimension of its input tensors, for use as the
+// 'split_input_task_func' of a batch scheduler (see
+// SharedBatchScheduler::QueueOptions::enable_large_batch_splitting). A batching
+// session whose scheduler splits a Run() call's task waits for all of the
+// subtasks to finish, and concatenates their outputs in order.
+Status SplitInputTask(
+    std::unique_ptr<BatchingSessionTask>* input_task,
+    int first_output_task_size, int max_batch_size,
+    std::vector<std::unique_ptr<BatchingSessionTask>>* output_tasks);
+
 //////////
 // Implementation details follow. API users need not read.
 
-struct BatchingSessionTask : public BatchTask {
+// A set of staging tensors into which tasks' input rows are copied, when
+// incremental input merging is enabled. Defined in batching_session.cc.
+struct IncrementalMergeBuffer;
+
+// The state shared by the subtasks of a task split by SplitInputTask(). Defined
+// in batching_session.cc.
+struct SplitTaskContext;
+
+// Created once per batched Run() call, so its memory is recycled via a free
+// list.
+struct BatchingSessionTask : public BatchTask,
+                             public FreeListAllocated<BatchingSessionTask> {
   ~BatchingSessionTask() override = default;
   size_t size() const override { return zeroth_dim_size; }
+  size_t cost() const override { return input_cost; }
+  size_t bytes() const override { return input_bytes; }
+  uint64 deadline_micros() const override { return absolute_deadline_micros; }
 
   // Fields populated when a task is received.
   size_t zeroth_dim_size;
+  size_t input_cost = 0;  // see BatchingSessionOptions::task_cost_measure
+  size_t input_bytes = 0;  // the total bytes of the input tensors
   const std::vector<std::pair<string, Tensor>>* inputs;
   const std::vector<string>* output_tensor_names;
+  uint64 absolute_deadline_micros = 0;  // 0 means no deadline
+
+  // Fields populated when a task is received, if incremental input merging is
+  // enabled (see BatchingSessionOptions::incremental_merge_buffer_size). The
+  // task's input rows occupy rows ['merge_buffer_offset', 'merge_buffer_offset'
+  // + 'zeroth_dim_size') of 'merge_buffer', and 'inputs_merged' is notified
+  // once they have been copied there. 'merge_buffer' is left null for tasks
+  // that do not participate in incremental merging.
+  std::shared_ptr<IncrementalMergeBuffer> merge_buffer;
+  int64 merge_buffer_offset = 0;
+  Notification inputs_merged;
+
+  // Fields populated when a task's TensorProto inputs are decoded straight
+  // into its rows of 'merge_buffer' (see BatchingSessionOptions::
+  // incremental_merge_buffer_size). The task's 'inputs' point to
+  // 'merge_buffer_inputs', which hold slices of 'merge_buffer' whose contents
+  // are valid once 'inputs_merged' is notified.
+  std::vector<std::pair<string, Tensor>> merge_buffer_inputs;
+
+  // Fields populated when a task is created by SplitInputTask(). The subtask's
+  // 'inputs' point to 'split_inputs', which hold slices of the original task's
+  // inputs; its 'done' is left empty, and 'split_context' instead completes
+  // the original task once every subtask has finished.
+  std::vector<std::pair<string, Tensor>> split_inputs;
+  std::shared_ptr<SplitTaskContext> split_context;
 
-  // Fields populated when a task is processed (as part of a batch).
-  Notification* done;
-  Status* status;
+  // Fields populated when a task is processed (as part of a batch). 'done' is
+  // invoked, from the batch thread, once 'outputs' have been populated or the
+  // task has failed.
+  std::function<void(const Status&)> done;
   std::vector<Tensor>* outputs;
 };
 
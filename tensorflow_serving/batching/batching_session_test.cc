@@ -20,11 +20,16 @@ limitations under the License.
 #include "tensorflow/cc/saved_model/tag_constants.h"
 #include "tensorflow/contrib/session_bundle/session_bundle.h"
 #include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor.pb.h"
 #include "tensorflow/core/framework/tensor_shape.h"
 #include "tensorflow/core/framework/tensor_testutil.h"
+#include "tensorflow/core/framework/tensor_util.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/notification.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/status_test_util.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/monitoring/collection_registry.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/platform/types.h"
@@ -38,7 +43,7 @@ namespace {
 
 using ::testing::UnorderedElementsAre;
 
-// A wrapper around a Session that captures the batch size.
+// A wrapper around a Session that captures the batch size and inputs.
 class BatchSizeCapturingSession : public ServingSession {
  public:
   explicit BatchSizeCapturingSession(std::unique_ptr<Session> wrapped)
@@ -50,21 +55,72 @@ class BatchSizeCapturingSession : public ServingSession {
              const std::vector<string>& target_node_names,
              std::vector<Tensor>* outputs) override {
     latest_batch_size_ = inputs[0].second.shape().dim_size(0);
+    latest_input_data_ = inputs[0].second.tensor_data().data();
+    // Copy the inputs, so as not to hold on to (e.g. pooled) input buffers.
+    latest_inputs_.clear();
+    for (const auto& input : inputs) {
+      latest_inputs_.emplace_back(input.first, tensor::DeepCopy(input.second));
+    }
     return wrapped_->Run(inputs, output_tensor_names, target_node_names,
                          outputs);
   }
 
   int latest_batch_size() const { return latest_batch_size_; }
 
+  const std::vector<std::pair<string, Tensor>>& latest_inputs() const {
+    return latest_inputs_;
+  }
+
+  const char* latest_input_data() const { return latest_input_data_; }
+
  private:
   std::unique_ptr<Session> wrapped_;
 
   // The size of the batch most recently submitted to Run().
   int latest_batch_size_ = -1;
 
+  // Copies of the inputs of the batch most recently submitted to Run(), and
+  // the address of the (original) first input's data.
+  std::vector<std::pair<string, Tensor>> latest_inputs_;
+  const char* latest_input_data_ = nullptr;
+
   TF_DISALLOW_COPY_AND_ASSIGN(BatchSizeCapturingSession);
 };
 
+// A wrapper around a Session whose Run() calls block until Open() is called.
+// Assumes Run() is not called concurrently.
+class GatedSession : public ServingSession {
+ public:
+  explicit GatedSession(std::unique_ptr<Session> wrapped)
+      : wrapped_(std::move(wrapped)) {}
+  ~GatedSession() override = default;
+
+  Status Run(const std::vector<std::pair<string, Tensor>>& inputs,
+             const std::vector<string>& output_tensor_names,
+             const std::vector<string>& target_node_names,
+             std::vector<Tensor>* outputs) override {
+    if (!run_started_.HasBeenNotified()) {
+      run_started_.Notify();
+    }
+    gate_.WaitForNotification();
+    return wrapped_->Run(inputs, output_tensor_names, target_node_names,
+                         outputs);
+  }
+
+  // Blocks until the first Run() call has started.
+  void WaitForRunStarted() { run_started_.WaitForNotification(); }
+
+  // Unblocks all current and future Run() calls.
+  void Open() { gate_.Notify(); }
+
+ private:
+  std::unique_ptr<Session> wrapped_;
+  Notification run_started_;
+  Notification gate_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(GatedSession);
+};
+
 // Creates a (non-batching) session with the half-plus-two model loaded.
 std::unique_ptr<Session> CreateHalfPlusTwoSession() {
   tensorflow::SessionOptions session_options;
@@ -328,6 +384,783 @@ TEST(BatchingSessionTest, DifferentOrderForInputAndOutputTensors) {
       }));
 }
 
+TEST(BatchingSessionTest, RequestsForSubsetsOfOutputsShareBatches) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 6;  // fits three 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x", "x2"}, {"y", "y3"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  const Tensor input0 = test::AsTensor<float>({8.0f, 6.0f}, {2});
+  const Tensor expected_output0 = test::AsTensor<float>({6.0f, 5.0f}, {2});
+  const Tensor input1 = test::AsTensor<float>({100.0f, 42.0f}, {2});
+  const Tensor expected_output1 = test::AsTensor<float>({53.0f, 24.0f}, {2});
+
+  // Since the batch timeout won't trigger, the requests only complete if they
+  // all join the same batch.
+  std::unique_ptr<Thread> first_request_thread(
+      Env::Default()->StartThread(ThreadOptions(), "first_request_thread", [&] {
+        std::vector<Tensor> outputs;
+        TF_ASSERT_OK(batching_session->Run({{"x", input0}, {"x2", input1}},
+                                           {"y"} /* outputs */,
+                                           {} /* target nodes */, &outputs));
+        ASSERT_EQ(1, outputs.size());
+        test::ExpectTensorEqual<float>(expected_output0, outputs[0]);
+      }));
+  std::unique_ptr<Thread> second_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "second_request_thread", [&] {
+        std::vector<Tensor> outputs;
+        TF_ASSERT_OK(batching_session->Run({{"x2", input1}, {"x", input0}},
+                                           {"y3"} /* outputs */,
+                                           {} /* target nodes */, &outputs));
+        ASSERT_EQ(1, outputs.size());
+        test::ExpectTensorEqual<float>(expected_output1, outputs[0]);
+      }));
+  std::unique_ptr<Thread> third_request_thread(
+      Env::Default()->StartThread(ThreadOptions(), "third_request_thread", [&] {
+        std::vector<Tensor> outputs;
+        TF_ASSERT_OK(batching_session->Run({{"x", input0}, {"x2", input1}},
+                                           {"y3", "y"} /* outputs */,
+                                           {} /* target nodes */, &outputs));
+        ASSERT_EQ(2, outputs.size());
+        test::ExpectTensorEqual<float>(expected_output1, outputs[0]);
+        test::ExpectTensorEqual<float>(expected_output0, outputs[1]);
+      }));
+}
+
+TEST(BatchingSessionTest, IncrementalInputMerge) {
+  std::unique_ptr<BatchSizeCapturingSession> batch_size_capturing_session(
+      new BatchSizeCapturingSession(CreateHalfPlusTwoSession()));
+  auto batch_size_capturing_session_raw = batch_size_capturing_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.incremental_merge_buffer_size = 4;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      std::move(batch_size_capturing_session), &batching_session));
+
+  // Issue two rounds of two concurrent requests. Each round fills one staging
+  // buffer, and yields one batch of size 4.
+  for (int round = 0; round < 2; ++round) {
+    std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+        ThreadOptions(), "first_request_thread", [&batching_session] {
+          TestSingleRequest(100.0f, 42.0f, batching_session.get());
+        }));
+    std::unique_ptr<Thread> second_request_thread(Env::Default()->StartThread(
+        ThreadOptions(), "second_request_thread", [&batching_session] {
+          TestSingleRequest(71.5f, 18.3f, batching_session.get());
+        }));
+  }
+  EXPECT_EQ(4, batch_size_capturing_session_raw->latest_batch_size());
+}
+
+TEST(BatchingSessionTest, IncrementalInputMergeValues) {
+  std::unique_ptr<BatchSizeCapturingSession> batch_size_capturing_session(
+      new BatchSizeCapturingSession(CreateHalfPlusTwoSession()));
+  auto batch_size_capturing_session_raw = batch_size_capturing_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.incremental_merge_buffer_size = 4;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      std::move(batch_size_capturing_session), &batching_session));
+
+  {
+    std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+        ThreadOptions(), "first_request_thread", [&batching_session] {
+          TestSingleRequest(1.0f, 2.0f, batching_session.get());
+        }));
+    std::unique_ptr<Thread> second_request_thread(Env::Default()->StartThread(
+        ThreadOptions(), "second_request_thread", [&batching_session] {
+          TestSingleRequest(3.0f, 4.0f, batching_session.get());
+        }));
+  }
+
+  // The wrapped session sees both requests' rows, in scheduling order.
+  const auto& inputs = batch_size_capturing_session_raw->latest_inputs();
+  ASSERT_EQ(1, inputs.size());
+  EXPECT_EQ("x", inputs[0].first);
+  const Tensor& merged_input = inputs[0].second;
+  ASSERT_EQ(4, merged_input.NumElements());
+  if (merged_input.flat<float>()(0) == 1.0f) {
+    test::ExpectTensorEqual<float>(
+        test::AsTensor<float>({1.0f, 2.0f, 3.0f, 4.0f}, {4}), merged_input);
+  } else {
+    test::ExpectTensorEqual<float>(
+        test::AsTensor<float>({3.0f, 4.0f, 1.0f, 2.0f}, {4}), merged_input);
+  }
+}
+
+TEST(BatchingSessionTest, IncrementalInputMergeWithPartialBatches) {
+  std::unique_ptr<BatchSizeCapturingSession> batch_size_capturing_session(
+      new BatchSizeCapturingSession(CreateHalfPlusTwoSession()));
+  auto batch_size_capturing_session_raw = batch_size_capturing_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.allowed_batch_sizes = {3, 4};
+  batching_session_options.incremental_merge_buffer_size = 4;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      std::move(batch_size_capturing_session), &batching_session));
+
+  // Each request forms its own batch, whose inputs are a slice of a staging
+  // buffer shared with its neighbors. The batch gets padded from 2 to 3.
+  for (int i = 0; i < 5; ++i) {
+    TestSingleRequest(100.0f + i, 42.0f, batching_session.get());
+    EXPECT_EQ(3, batch_size_capturing_session_raw->latest_batch_size());
+  }
+}
+
+TEST(BatchingSessionTest, IncrementalInputMergeWithTaskLargerThanBuffer) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.incremental_merge_buffer_size = 1;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  // The 2-unit request doesn't fit in a staging buffer, so its inputs get
+  // merged the conventional way.
+  TestSingleRequest(100.0f, 42.0f, batching_session.get());
+
+  // Staging buffers larger than a batch are rejected.
+  batching_session_options.incremental_merge_buffer_size = 8;
+  EXPECT_FALSE(CreateBasicBatchingSession(
+                   schedule_options, batching_session_options, {{"x"}, {"y"}},
+                   CreateHalfPlusTwoSession(), &batching_session)
+                   .ok());
+}
+
+TEST(BatchingSessionTest, UnalignedSplitOutputs) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.align_split_outputs = false;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  // The outputs alias the batched output tensor, so one of them starts partway
+  // into its buffer and may be unaligned. Inspect them via unaligned_flat().
+  auto run_request = [&batching_session](float input_0, float input_1) {
+    std::vector<Tensor> outputs;
+    TF_ASSERT_OK(batching_session->Run(
+        {{"x", test::AsTensor<float>({input_0, input_1}, {2})}}, {"y"},
+        {} /* target nodes */, &outputs));
+    ASSERT_EQ(1, outputs.size());
+    ASSERT_EQ(2, outputs[0].NumElements());
+    EXPECT_EQ(input_0 / 2 + 2, outputs[0].unaligned_flat<float>()(0));
+    EXPECT_EQ(input_1 / 2 + 2, outputs[0].unaligned_flat<float>()(1));
+  };
+  std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "first_request_thread",
+      [&run_request] { run_request(100.0f, 42.0f); }));
+  std::unique_ptr<Thread> second_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "second_request_thread",
+      [&run_request] { run_request(71.5f, 18.3f); }));
+}
+
+// Returns the value of the cell of the counter named 'metric_name' with the
+// given label value, or 0 if it has not been incremented so far.
+int64 GetCounterValue(const string& metric_name, const string& label_value) {
+  monitoring::CollectionRegistry::CollectMetricsOptions options;
+  std::unique_ptr<monitoring::CollectedMetrics> collected_metrics =
+      monitoring::CollectionRegistry::Default()->CollectMetrics(options);
+  auto it = collected_metrics->point_set_map.find(metric_name);
+  if (it == collected_metrics->point_set_map.end()) {
+    return 0;
+  }
+  for (const auto& point : it->second->points) {
+    if (point->labels.size() == 1 && point->labels[0].value == label_value) {
+      return point->int64_value;
+    }
+  }
+  return 0;
+}
+
+// Returns the number of requests made to input buffer pools so far with the
+// given outcome ("hit" or "miss").
+int64 NumInputBufferPoolRequests(const string& outcome) {
+  return GetCounterValue(
+      "/tensorflow/serving/batching_session/input_buffer_pool_requests",
+      outcome);
+}
+
+// Returns the number of requests with TensorProto inputs made so far whose
+// inputs took the given path ("decoded" or "parsed").
+int64 NumProtoInputRequests(const string& path) {
+  return GetCounterValue(
+      "/tensorflow/serving/batching_session/proto_input_requests", path);
+}
+
+TEST(BatchingSessionTest, InputBufferPool) {
+  for (const int64 max_bytes : {1, 1024}) {
+    const int64 initial_num_hits = NumInputBufferPoolRequests("hit");
+    const int64 initial_num_misses = NumInputBufferPoolRequests("miss");
+
+    std::unique_ptr<BatchSizeCapturingSession> batch_size_capturing_session(
+        new BatchSizeCapturingSession(CreateHalfPlusTwoSession()));
+    auto batch_size_capturing_session_raw = batch_size_capturing_session.get();
+
+    BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+    schedule_options.max_batch_size = 4;
+    schedule_options.batch_timeout_micros = 0;
+    schedule_options.num_batch_threads = 1;
+    BatchingSessionOptions batching_session_options;
+    batching_session_options.allowed_batch_sizes = {3, 4};
+    batching_session_options.input_buffer_pool_max_bytes = max_bytes;
+    std::unique_ptr<Session> batching_session;
+    TF_ASSERT_OK(CreateBasicBatchingSession(
+        schedule_options, batching_session_options, {{"x"}, {"y"}},
+        std::move(batch_size_capturing_session), &batching_session));
+
+    // Each request gets padded from 2 to 3. With the larger pool, all but the
+    // first request reuse the same merged input buffer (and its padding row).
+    const char* first_input_data = nullptr;
+    for (int i = 0; i < 5; ++i) {
+      TestSingleRequest(100.0f + i, 42.0f - i, batching_session.get());
+      EXPECT_EQ(3, batch_size_capturing_session_raw->latest_batch_size());
+      if (i == 0) {
+        first_input_data =
+            batch_size_capturing_session_raw->latest_input_data();
+      } else if (max_bytes == 1024) {
+        EXPECT_EQ(first_input_data,
+                  batch_size_capturing_session_raw->latest_input_data());
+      }
+    }
+    const int64 num_hits = NumInputBufferPoolRequests("hit") - initial_num_hits;
+    const int64 num_misses =
+        NumInputBufferPoolRequests("miss") - initial_num_misses;
+    if (max_bytes == 1024) {
+      EXPECT_EQ(4, num_hits);
+      EXPECT_EQ(1, num_misses);
+    } else {
+      // The buffer doesn't fit in the pool, so it is never recycled.
+      EXPECT_EQ(0, num_hits);
+      EXPECT_EQ(5, num_misses);
+    }
+  }
+}
+
+TEST(BatchingSessionTest, VariableLengthInputs) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 2;  // fits two 1-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.pad_variable_length_inputs = true;
+  batching_session_options.variable_length_padding_values["x"] =
+      test::AsScalar<float>(-4.0f);
+  batching_session_options.variable_length_output_sources["y"] = "x";
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  // Batch a length-3 request with a length-1 request. The latter is padded to
+  // length 3 (with values that half-plus-two maps to 0), and its output is
+  // trimmed back to length 1.
+  auto run_request = [&batching_session](const std::vector<float>& values) {
+    const int64 length = values.size();
+    std::vector<float> expected_values;
+    for (float value : values) {
+      expected_values.push_back(value / 2 + 2);
+    }
+    std::vector<Tensor> outputs;
+    TF_ASSERT_OK(batching_session->Run(
+        {{"x", test::AsTensor<float>(values, {1, length})}}, {"y"},
+        {} /* target nodes */, &outputs));
+    ASSERT_EQ(1, outputs.size());
+    test::ExpectTensorEqual<float>(
+        test::AsTensor<float>(expected_values, {1, length}), outputs[0]);
+  };
+  std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "first_request_thread",
+      [&run_request] { run_request({100.0f, 42.0f, 7.0f}); }));
+  std::unique_ptr<Thread> second_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "second_request_thread",
+      [&run_request] { run_request({71.5f}); }));
+}
+
+TEST(BatchingSessionTest, LengthBuckets) {
+  std::vector<BatchScheduler<BatchingSessionTask>*> schedulers;
+  auto create_scheduler = [&schedulers](
+      std::function<void(std::unique_ptr<Batch<BatchingSessionTask>>)>
+          process_batch_callback,
+      std::unique_ptr<BatchScheduler<BatchingSessionTask>>* scheduler) {
+    BasicBatchScheduler<BatchingSessionTask>::Options options;
+    options.max_batch_size = 2;                      // fits two 1-unit tasks
+    options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+    options.num_batch_threads = 1;
+    std::unique_ptr<BasicBatchScheduler<BatchingSessionTask>> basic_scheduler;
+    TF_RETURN_IF_ERROR(BasicBatchScheduler<BatchingSessionTask>::Create(
+        options, process_batch_callback, &basic_scheduler));
+    schedulers.push_back(basic_scheduler.get());
+    *scheduler = std::move(basic_scheduler);
+    return Status::OK();
+  };
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.pad_variable_length_inputs = true;
+  std::unique_ptr<Session> batching_session;
+
+  batching_session_options.length_bucket_limits = {4, 2};
+  EXPECT_FALSE(CreateBatchingSession(batching_session_options,
+                                     {{{{"x"}, {"y"}}, create_scheduler}},
+                                     CreateHalfPlusTwoSession(),
+                                     &batching_session)
+                   .ok());
+
+  batching_session_options.length_bucket_limits = {2};
+  TF_ASSERT_OK(CreateBatchingSession(batching_session_options,
+                                     {{{{"x"}, {"y"}}, create_scheduler}},
+                                     CreateHalfPlusTwoSession(),
+                                     &batching_session));
+  ASSERT_EQ(2, schedulers.size());
+
+  auto run_request = [&batching_session](int64 length) {
+    std::vector<Tensor> outputs;
+    TF_ASSERT_OK(batching_session->Run(
+        {{"x", test::AsTensor<float>(std::vector<float>(length, 2.0f),
+                                     {1, length})}},
+        {"y"}, {} /* target nodes */, &outputs));
+    ASSERT_EQ(1, outputs.size());
+    test::ExpectTensorEqual<float>(
+        test::AsTensor<float>(std::vector<float>(length, 3.0f), {1, length}),
+        outputs[0]);
+  };
+
+  // Enqueue a short request and a long request. They land in different
+  // buckets, so neither bucket's batch is full yet and both block.
+  std::unique_ptr<Thread> short_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "short_request_thread", [&] { run_request(2); }));
+  std::unique_ptr<Thread> long_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "long_request_thread", [&] { run_request(5); }));
+  while (schedulers[0]->NumEnqueuedTasks() != 1 ||
+         schedulers[1]->NumEnqueuedTasks() != 1) {
+    Env::Default()->SleepForMicroseconds(100);
+  }
+
+  // A second request of each length fills each bucket's batch.
+  run_request(1);
+  EXPECT_EQ(0, schedulers[0]->NumEnqueuedTasks());
+  run_request(3);
+  EXPECT_EQ(0, schedulers[1]->NumEnqueuedTasks());
+}
+
+TEST(BatchingSessionTest, LargeTaskSplitting) {
+  std::unique_ptr<BatchSizeCapturingSession> batch_size_capturing_session(
+      new BatchSizeCapturingSession(CreateHalfPlusTwoSession()));
+  auto batch_size_capturing_session_raw = batch_size_capturing_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 2;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  schedule_options.max_enqueued_batches = 3;
+  schedule_options.enable_large_batch_splitting = true;
+  schedule_options.split_input_task_func = SplitInputTask;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, BatchingSessionOptions(), {{"x"}, {"y"}},
+      std::move(batch_size_capturing_session), &batching_session));
+
+  // A 5-unit request spans three batches, and its outputs are reassembled.
+  std::vector<Tensor> outputs;
+  TF_ASSERT_OK(batching_session->Run(
+      {{"x", test::AsTensor<float>({1.0f, 2.0f, 3.0f, 4.0f, 5.0f}, {5})}},
+      {"y"}, {} /* target nodes */, &outputs));
+  ASSERT_EQ(1, outputs.size());
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>({2.5f, 3.0f, 3.5f, 4.0f, 4.5f}, {5}), outputs[0]);
+  EXPECT_GE(2, batch_size_capturing_session_raw->latest_batch_size());
+
+  // A request that would need more than three batches is rejected.
+  ExpectError("Task size 7 requires 4 batches, but max_enqueued_batches is 3",
+              {{"x", test::AsTensor<float>(std::vector<float>(7, 1.0f), {7})}},
+              {"y"}, batching_session.get());
+
+  // Requests that fit in a batch are unaffected.
+  TestSingleRequest(100.0f, 42.0f, batching_session.get());
+}
+
+TEST(BatchingSessionTest, SplitInputTaskApportionsCost) {
+  const std::vector<std::pair<string, Tensor>> inputs = {
+      {"x", test::AsTensor<float>({1.0f, 2.0f, 3.0f, 4.0f, 5.0f}, {5})}};
+  std::unique_ptr<BatchingSessionTask> task(new BatchingSessionTask);
+  task->zeroth_dim_size = 5;
+  task->input_cost = 7;
+  task->input_bytes = 20;
+  task->inputs = &inputs;
+
+  // Split 5 rows into subtasks of 2, 2 and 1 rows. Their costs and bytes add
+  // up to the task's, even though neither divides evenly.
+  std::vector<std::unique_ptr<BatchingSessionTask>> subtasks;
+  TF_ASSERT_OK(SplitInputTask(&task, 2, 2, &subtasks));
+  ASSERT_EQ(3, subtasks.size());
+  size_t total_cost = 0;
+  size_t total_bytes = 0;
+  for (const auto& subtask : subtasks) {
+    EXPECT_GE(subtask->input_cost, 1);
+    total_cost += subtask->input_cost;
+    total_bytes += subtask->input_bytes;
+  }
+  EXPECT_EQ(7, total_cost);
+  EXPECT_EQ(20, total_bytes);
+  EXPECT_EQ(8, subtasks[0]->input_bytes);
+  EXPECT_EQ(4, subtasks[2]->input_bytes);
+}
+
+TEST(BatchingSessionTest, PipelinedBatchProcessing) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000;
+  schedule_options.num_batch_threads = 2;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.num_pipeline_threads = 1;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  // Issue enough requests to keep several batches in the pipeline at once.
+  std::vector<std::unique_ptr<Thread>> request_threads;
+  for (int i = 0; i < 8; ++i) {
+    request_threads.emplace_back(Env::Default()->StartThread(
+        ThreadOptions(), "request_thread", [i, &batching_session] {
+          TestSingleRequest(10.0f * i, 2.0f * i, batching_session.get());
+        }));
+  }
+}
+
+TEST(BatchingSessionTest, PipelineThreadsPinnedToCpus) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;
+  schedule_options.batch_timeout_micros = 1 * 1000;
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.num_pipeline_threads = 1;
+  batching_session_options.pipeline_cpus = {-1};
+  std::unique_ptr<Session> batching_session;
+  EXPECT_FALSE(CreateBasicBatchingSession(
+                   schedule_options, batching_session_options, {{"x"}, {"y"}},
+                   CreateHalfPlusTwoSession(), &batching_session)
+                   .ok());
+
+  // (Where pinning is unsupported, the threads merely stay unpinned.)
+  batching_session_options.pipeline_cpus = {0};
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+  TestSingleRequest(100.0f, 42.0f, batching_session.get());
+}
+
+TEST(BatchingSessionTest, Deadlines) {
+  std::unique_ptr<GatedSession> gated_session(
+      new GatedSession(CreateHalfPlusTwoSession()));
+  auto gated_session_raw = gated_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 2;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  schedule_options.max_enqueued_batches = 2;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, BatchingSessionOptions(), {{"x"}, {"y"}},
+      std::move(gated_session), &batching_session));
+
+  // Occupy the batch thread with a request that has no deadline.
+  std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "first_request_thread", [&batching_session] {
+        TestSingleRequest(100.0f, 42.0f, batching_session.get());
+      }));
+  gated_session_raw->WaitForRunStarted();
+
+  // Enqueue a request whose deadline passes while it waits, and one whose
+  // deadline doesn't. Only the latter gets run.
+  RunOptions expiring_run_options;
+  expiring_run_options.set_timeout_in_ms(1);
+  RunOptions generous_run_options;
+  generous_run_options.set_timeout_in_ms(60 * 1000);
+  Status expiring_status;
+  std::unique_ptr<Thread> expiring_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "expiring_request_thread",
+      [&batching_session, &expiring_run_options, &expiring_status] {
+        std::vector<Tensor> outputs;
+        expiring_status = batching_session->Run(
+            expiring_run_options,
+            {{"x", test::AsTensor<float>({1.0f}, {1})}}, {"y"},
+            {} /* target nodes */, &outputs, nullptr /* run_metadata */);
+      }));
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  std::unique_ptr<Thread> generous_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "generous_request_thread",
+      [&batching_session, &generous_run_options] {
+        std::vector<Tensor> outputs;
+        TF_ASSERT_OK(batching_session->Run(
+            generous_run_options, {{"x", test::AsTensor<float>({2.0f}, {1})}},
+            {"y"}, {} /* target nodes */, &outputs,
+            nullptr /* run_metadata */));
+        ASSERT_EQ(1, outputs.size());
+        test::ExpectTensorEqual<float>(test::AsTensor<float>({3.0f}, {1}),
+                                       outputs[0]);
+      }));
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  gated_session_raw->Open();
+
+  first_request_thread.reset();
+  expiring_request_thread.reset();
+  generous_request_thread.reset();
+  EXPECT_EQ(error::DEADLINE_EXCEEDED, expiring_status.code());
+}
+
+TEST(BatchingSessionTest, RunAsyncDeadlines) {
+  std::unique_ptr<GatedSession> gated_session(
+      new GatedSession(CreateHalfPlusTwoSession()));
+  auto gated_session_raw = gated_session.get();
+
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 2;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  schedule_options.max_enqueued_batches = 2;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, BatchingSessionOptions(), {{"x"}, {"y"}},
+      std::move(gated_session), &batching_session));
+
+  // Occupy the batch thread with a request that has no deadline.
+  std::unique_ptr<Thread> first_request_thread(Env::Default()->StartThread(
+      ThreadOptions(), "first_request_thread", [&batching_session] {
+        TestSingleRequest(100.0f, 42.0f, batching_session.get());
+      }));
+  gated_session_raw->WaitForRunStarted();
+
+  // An asynchronous request honors its deadline just like Run() does.
+  RunOptions expiring_run_options;
+  expiring_run_options.set_timeout_in_ms(1);
+  const std::vector<std::pair<string, Tensor>> inputs = {
+      {"x", test::AsTensor<float>({1.0f}, {1})}};
+  std::vector<Tensor> outputs;
+  Notification expiring_done;
+  Status expiring_status;
+  RunSessionAsync(batching_session.get(), expiring_run_options,
+                  RunSignatureHandle(), inputs, {"y"}, &outputs,
+                  [&expiring_done, &expiring_status](const Status& status) {
+                    expiring_status = status;
+                    expiring_done.Notify();
+                  });
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  gated_session_raw->Open();
+
+  expiring_done.WaitForNotification();
+  first_request_thread.reset();
+  EXPECT_EQ(error::DEADLINE_EXCEEDED, expiring_status.code());
+}
+
+TEST(BatchingSessionTest, RunAsync) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  std::unique_ptr<Session> batching_session;
+  BatchingSessionOptions batching_session_options;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+  EXPECT_TRUE(SessionRunsAsync(batching_session.get()));
+  EXPECT_FALSE(SessionRunsAsync(CreateHalfPlusTwoSession().get()));
+
+  // Issue two requests whose total size is 4 from this one thread. Neither call
+  // waits for the batch, so together they fill it.
+  const std::vector<std::pair<string, Tensor>> inputs0 = {
+      {"x", test::AsTensor<float>({100.0f, 42.0f}, {2})}};
+  const std::vector<std::pair<string, Tensor>> inputs1 = {
+      {"x", test::AsTensor<float>({71.5f, 18.3f}, {2})}};
+  const std::vector<string> output_tensor_names = {"y"};
+  std::vector<Tensor> outputs0, outputs1;
+  Notification done0, done1;
+  Status status0, status1;
+  RunSessionAsync(batching_session.get(), inputs0, output_tensor_names,
+                  &outputs0, [&done0, &status0](const Status& status) {
+                    status0 = status;
+                    done0.Notify();
+                  });
+  EXPECT_FALSE(done0.HasBeenNotified());
+  RunSessionAsync(batching_session.get(), inputs1, output_tensor_names,
+                  &outputs1, [&done1, &status1](const Status& status) {
+                    status1 = status;
+                    done1.Notify();
+                  });
+  done0.WaitForNotification();
+  done1.WaitForNotification();
+  TF_ASSERT_OK(status0);
+  TF_ASSERT_OK(status1);
+  ASSERT_EQ(1, outputs0.size());
+  test::ExpectTensorEqual<float>(test::AsTensor<float>({52.0f, 23.0f}, {2}),
+                                 outputs0[0]);
+  ASSERT_EQ(1, outputs1.size());
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>({71.5f / 2 + 2, 18.3f / 2 + 2}, {2}), outputs1[0]);
+
+  // A request that doesn't match the signature is run in-line.
+  std::vector<Tensor> outputs2;
+  Notification done2;
+  RunSessionAsync(batching_session.get(),
+                  {{"x", test::AsTensor<float>({1.0f}, {1})},
+                   {"x2", test::AsTensor<float>({2.0f}, {1})}},
+                  {"y"}, &outputs2, [&done2](const Status& status) {
+                    TF_EXPECT_OK(status);
+                    done2.Notify();
+                  });
+  EXPECT_TRUE(done2.HasBeenNotified());
+}
+
+TEST(BatchingSessionTest, RunAsyncFromProtos) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;  // fits two 2-unit tasks
+  schedule_options.batch_timeout_micros = 1 * 1000 * 1000;  // won't trigger
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  batching_session_options.incremental_merge_buffer_size = 4;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+
+  // Issue four 2-unit requests, which form two batches, with their values in
+  // 'tensor_content' and 'float_val'. The last one has a single value, which
+  // fills both of its rows.
+  TensorProto content_proto;
+  test::AsTensor<float>({100.0f, 42.0f}, {2})
+      .AsProtoTensorContent(&content_proto);
+  TensorProto field_proto;
+  test::AsTensor<float>({71.5f, 18.3f}, {2}).AsProtoField(&field_proto);
+  TensorProto repeated_proto = field_proto;
+  repeated_proto.clear_float_val();
+  repeated_proto.add_float_val(5.0f);
+  const std::vector<std::vector<std::pair<string, const TensorProto*>>>
+      inputs = {{{"x", &content_proto}},
+                {{"x", &field_proto}},
+                {{"x", &content_proto}},
+                {{"x", &repeated_proto}}};
+  const std::vector<Tensor> expected_outputs = {
+      test::AsTensor<float>({52.0f, 23.0f}, {2}),
+      test::AsTensor<float>({71.5f / 2 + 2, 18.3f / 2 + 2}, {2}),
+      test::AsTensor<float>({52.0f, 23.0f}, {2}),
+      test::AsTensor<float>({4.5f, 4.5f}, {2})};
+  const std::vector<string> output_tensor_names = {"y"};
+  const int64 initial_num_decoded = NumProtoInputRequests("decoded");
+  const int64 initial_num_parsed = NumProtoInputRequests("parsed");
+  std::vector<std::vector<Tensor>> outputs(inputs.size());
+  std::vector<Status> statuses(inputs.size());
+  std::vector<Notification> done(inputs.size());
+  for (int i = 0; i < inputs.size(); ++i) {
+    RunSessionAsyncFromProtos(batching_session.get(), inputs[i],
+                              output_tensor_names, &outputs[i],
+                              [&done, &statuses, i](const Status& status) {
+                                statuses[i] = status;
+                                done[i].Notify();
+                              });
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    done[i].WaitForNotification();
+    TF_ASSERT_OK(statuses[i]);
+    ASSERT_EQ(1, outputs[i].size());
+    test::ExpectTensorEqual<float>(expected_outputs[i], outputs[i][0]);
+  }
+  // All four were decoded straight into the merge buffer, rather than parsed
+  // into tensors and then copied.
+  EXPECT_EQ(4, NumProtoInputRequests("decoded") - initial_num_decoded);
+  EXPECT_EQ(0, NumProtoInputRequests("parsed") - initial_num_parsed);
+
+  // A malformed proto fails the call without being scheduled.
+  TensorProto malformed_proto = content_proto;
+  malformed_proto.mutable_tensor_content()->resize(3);
+  std::vector<Tensor> malformed_outputs;
+  Notification malformed_done;
+  RunSessionAsyncFromProtos(
+      batching_session.get(), {{"x", &malformed_proto}}, output_tensor_names,
+      &malformed_outputs, [&malformed_done](const Status& status) {
+        EXPECT_EQ(error::INVALID_ARGUMENT, status.code());
+        malformed_done.Notify();
+      });
+  EXPECT_TRUE(malformed_done.HasBeenNotified());
+  EXPECT_EQ(1, NumProtoInputRequests("parsed") - initial_num_parsed);
+}
+
+TEST(BatchingSessionTest, RunSignatureHandles) {
+  BasicBatchScheduler<BatchingSessionTask>::Options schedule_options;
+  schedule_options.max_batch_size = 4;
+  schedule_options.batch_timeout_micros = 0;
+  schedule_options.num_batch_threads = 1;
+  BatchingSessionOptions batching_session_options;
+  std::unique_ptr<Session> batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &batching_session));
+  std::unique_ptr<Session> other_batching_session;
+  TF_ASSERT_OK(CreateBasicBatchingSession(
+      schedule_options, batching_session_options, {{"x"}, {"y"}},
+      CreateHalfPlusTwoSession(), &other_batching_session));
+
+  const RunSignatureHandle handle =
+      ResolveRunSignature(batching_session.get(), {"x"}, {"y"});
+  EXPECT_FALSE(handle.expired());
+  EXPECT_TRUE(
+      ResolveRunSignature(batching_session.get(), {"x", "x2"}, {"y"})
+          .expired());
+
+  // Calls with the handle are routed by it, on the session that resolved it.
+  // Another session ignores it, and matches the tensor names instead.
+  const std::vector<std::pair<string, Tensor>> inputs = {
+      {"x", test::AsTensor<float>({100.0f, 42.0f}, {2})}};
+  for (Session* session :
+       {batching_session.get(), other_batching_session.get()}) {
+    std::vector<Tensor> outputs;
+    Notification done;
+    RunSessionAsync(session, RunOptions(), handle, inputs, {"y"}, &outputs,
+                    [&done](const Status& status) {
+                      TF_EXPECT_OK(status);
+                      done.Notify();
+                    });
+    done.WaitForNotification();
+    ASSERT_EQ(1, outputs.size());
+    test::ExpectTensorEqual<float>(test::AsTensor<float>({52.0f, 23.0f}, {2}),
+                                   outputs[0]);
+  }
+
+  // The handle expires along with its session.
+  batching_session.reset();
+  EXPECT_TRUE(handle.expired());
+}
+
 TEST(BatchingSessionTest, MultipleSignatures) {
   std::vector<BatchScheduler<BatchingSessionTask>*> schedulers;
   auto create_scheduler = [&schedulers](
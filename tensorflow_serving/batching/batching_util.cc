@@ -0,0 +1,195 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/batching_util.h"
+
+#include <algorithm>
+
+#include "tensorflow/core/framework/register_types.h"
+#include "tensorflow/core/framework/types.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace serving {
+
+namespace {
+
+// Copies the region of 'src' that lies within the bounds of both 'src' and
+// 'dst' into the same position in 'dst'. Both tensors must have dtype T and the
+// same rank (of at least 1). 'src' need not be aligned; 'dst' must be.
+template <typename T>
+void CopyLeadingCorner(const Tensor& src, Tensor* dst) {
+  const int rank = src.dims();
+  std::vector<int64> region(rank);
+  std::vector<int64> src_strides(rank);
+  std::vector<int64> dst_strides(rank);
+  int64 src_stride = 1;
+  int64 dst_stride = 1;
+  for (int d = rank - 1; d >= 0; --d) {
+    region[d] = std::min(src.dim_size(d), dst->dim_size(d));
+    if (region[d] == 0) {
+      return;
+    }
+    src_strides[d] = src_stride;
+    dst_strides[d] = dst_stride;
+    src_stride *= src.dim_size(d);
+    dst_stride *= dst->dim_size(d);
+  }
+
+  auto src_flat = src.unaligned_flat<T>();
+  auto dst_flat = dst->flat<T>();
+
+  // Copy one contiguous run of the innermost dimension at a time, iterating
+  // 'index' over the outer dimensions of the region.
+  const int64 run_length = region[rank - 1];
+  std::vector<int64> index(rank, 0);
+  for (;;) {
+    int64 src_offset = 0;
+    int64 dst_offset = 0;
+    for (int d = 0; d < rank - 1; ++d) {
+      src_offset += index[d] * src_strides[d];
+      dst_offset += index[d] * dst_strides[d];
+    }
+    for (int64 i = 0; i < run_length; ++i) {
+      dst_flat(dst_offset + i) = src_flat(src_offset + i);
+    }
+
+    int d = rank - 2;
+    while (d >= 0 && ++index[d] == region[d]) {
+      index[d] = 0;
+      --d;
+    }
+    if (d < 0) {
+      break;
+    }
+  }
+}
+
+template <typename T>
+void PadTensorOfType(const Tensor& input, const Tensor* padding_value,
+                     Tensor* output) {
+  output->flat<T>().setConstant(padding_value == nullptr
+                                    ? T()
+                                    : padding_value->scalar<T>()());
+  CopyLeadingCorner<T>(input, output);
+}
+
+}  // namespace
+
+Status CalculateMaxInnerDimSizes(const std::vector<Tensor>& tensors,
+                                 TensorShape* max_shape) {
+  if (tensors.empty()) {
+    return errors::InvalidArgument("No tensors to calculate a shape for");
+  }
+  const Tensor& first = tensors[0];
+  if (first.dims() == 0) {
+    return errors::InvalidArgument(
+        "Tensors to be padded must have at least one dimension");
+  }
+  *max_shape = first.shape();
+  for (const Tensor& tensor : tensors) {
+    if (tensor.dtype() != first.dtype()) {
+      return errors::InvalidArgument(
+          "Tensors to be padded must have the same dtype; got ",
+          DataTypeString(first.dtype()), " and ",
+          DataTypeString(tensor.dtype()));
+    }
+    if (tensor.dims() != first.dims()) {
+      return errors::InvalidArgument(
+          "Tensors to be padded must have the same rank; got shapes ",
+          first.shape().DebugString(), " and ", tensor.shape().DebugString());
+    }
+    for (int d = 1; d < tensor.dims(); ++d) {
+      if (tensor.dim_size(d) > max_shape->dim_size(d)) {
+        max_shape->set_dim(d, tensor.dim_size(d));
+      }
+    }
+  }
+  return Status::OK();
+}
+
+Status PadTensor(const Tensor& input, const TensorShape& padded_shape,
+                 const Tensor* padding_value, Tensor* output) {
+  if (padded_shape.dims() != input.dims()) {
+    return errors::InvalidArgument("Cannot pad tensor of shape ",
+                                   input.shape().DebugString(), " to shape ",
+                                   padded_shape.DebugString());
+  }
+  for (int d = 0; d < input.dims(); ++d) {
+    if (padded_shape.dim_size(d) < input.dim_size(d)) {
+      return errors::InvalidArgument("Cannot pad tensor of shape ",
+                                     input.shape().DebugString(), " to shape ",
+                                     padded_shape.DebugString());
+    }
+  }
+  if (padding_value != nullptr &&
+      (padding_value->dtype() != input.dtype() ||
+       !TensorShapeUtils::IsScalar(padding_value->shape()))) {
+    return errors::InvalidArgument("Padding value must be a scalar of dtype ",
+                                   DataTypeString(input.dtype()));
+  }
+
+  *output = Tensor(input.dtype(), padded_shape);
+  switch (input.dtype()) {
+#define CASE(type)                                       \
+  case DataTypeToEnum<type>::value:                      \
+    PadTensorOfType<type>(input, padding_value, output); \
+    break;
+    TF_CALL_POD_TYPES(CASE);
+    TF_CALL_string(CASE);
+#undef CASE
+    default:
+      return errors::Unimplemented("Padding tensors of dtype ",
+                                   DataTypeString(input.dtype()),
+                                   " is not supported");
+  }
+  return Status::OK();
+}
+
+Status TrimTensor(const Tensor& input, const TensorShape& trimmed_shape,
+                  Tensor* output) {
+  if (trimmed_shape.dims() != input.dims()) {
+    return errors::InvalidArgument("Cannot trim tensor of shape ",
+                                   input.shape().DebugString(), " to shape ",
+                                   trimmed_shape.DebugString());
+  }
+  for (int d = 0; d < input.dims(); ++d) {
+    if (trimmed_shape.dim_size(d) > input.dim_size(d)) {
+      return errors::InvalidArgument("Cannot trim tensor of shape ",
+                                     input.shape().DebugString(), " to shape ",
+                                     trimmed_shape.DebugString());
+    }
+  }
+
+  *output = Tensor(input.dtype(), trimmed_shape);
+  switch (input.dtype()) {
+#define CASE(type)                          \
+  case DataTypeToEnum<type>::value:         \
+    CopyLeadingCorner<type>(input, output); \
+    break;
+    TF_CALL_POD_TYPES(CASE);
+    TF_CALL_string(CASE);
+#undef CASE
+    default:
+      return errors::Unimplemented("Trimming tensors of dtype ",
+                                   DataTypeString(input.dtype()),
+                                   " is not supported");
+  }
+  return Status::OK();
+}
+
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,60 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Tensor reshaping utilities used to batch variable-length inputs.
+
+#ifndef TENSORFLOW_SERVING_BATCHING_BATCHING_UTIL_H_
+#define TENSORFLOW_SERVING_BATCHING_BATCHING_UTIL_H_
+
+#include <vector>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/status.h"
+
+namespace tensorflow {
+namespace serving {
+
+// Computes the shape to which a set of tensors must be padded so that they can
+// be concatenated along the 0th dimension: each dimension other than the 0th
+// is the maximum of the tensors' sizes in that dimension, and the 0th
+// dimension is left as-is (i.e. taken from the first tensor). The tensors must
+// be non-empty, and must all have the same dtype and rank (of at least 1).
+Status CalculateMaxInnerDimSizes(const std::vector<Tensor>& tensors,
+                                 TensorShape* max_shape);
+
+// Sets '*output' to a tensor of shape 'padded_shape', whose leading corner
+// (i.e. the elements whose indices are all within the bounds of
+// 'input.shape()') holds a copy of 'input', and whose remaining elements equal
+// 'padding_value'. 'padded_shape' must have the same rank as 'input', and be at
+// least as large in every dimension.
+//
+// 'padding_value' must be a scalar of the same dtype as 'input'. If null, the
+// padding is the dtype's default value (zero, or the empty string).
+//
+// Supports all numeric dtypes, bool and string.
+Status PadTensor(const Tensor& input, const TensorShape& padded_shape,
+                 const Tensor* padding_value, Tensor* output);
+
+// Sets '*output' to a copy of the leading corner of 'input', of shape
+// 'trimmed_shape'. 'trimmed_shape' must have the same rank as 'input', and be
+// no larger in any dimension. (This is the inverse of PadTensor().)
+Status TrimTensor(const Tensor& input, const TensorShape& trimmed_shape,
+                  Tensor* output);
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_BATCHING_BATCHING_UTIL_H_
@@ -0,0 +1,94 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/batching/batching_util.h"
+
+#include <gtest/gtest.h>
+#include "tensorflow/core/framework/tensor_testutil.h"
+#include "tensorflow/core/lib/core/status_test_util.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+TEST(BatchingUtilTest, CalculateMaxInnerDimSizes) {
+  TensorShape max_shape;
+  TF_ASSERT_OK(CalculateMaxInnerDimSizes(
+      {Tensor(DT_FLOAT, {2, 3, 1}), Tensor(DT_FLOAT, {1, 5, 1}),
+       Tensor(DT_FLOAT, {4, 2, 2})},
+      &max_shape));
+  EXPECT_EQ(TensorShape({2, 5, 2}), max_shape);
+
+  EXPECT_FALSE(CalculateMaxInnerDimSizes(
+                   {Tensor(DT_FLOAT, {2, 3}), Tensor(DT_INT32, {2, 3})},
+                   &max_shape)
+                   .ok());
+  EXPECT_FALSE(CalculateMaxInnerDimSizes(
+                   {Tensor(DT_FLOAT, {2, 3}), Tensor(DT_FLOAT, {2, 3, 1})},
+                   &max_shape)
+                   .ok());
+  EXPECT_FALSE(CalculateMaxInnerDimSizes({}, &max_shape).ok());
+}
+
+TEST(BatchingUtilTest, PadTensor) {
+  const Tensor input = test::AsTensor<float>({1, 2, 3, 4}, {2, 2});
+  const Tensor padding_value = test::AsScalar<float>(-1);
+  Tensor padded;
+  TF_ASSERT_OK(PadTensor(input, {2, 3}, &padding_value, &padded));
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>({1, 2, -1, 3, 4, -1}, {2, 3}), padded);
+
+  // Default padding.
+  TF_ASSERT_OK(PadTensor(input, {3, 3}, nullptr, &padded));
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>({1, 2, 0, 3, 4, 0, 0, 0, 0}, {3, 3}), padded);
+
+  // Unaligned input.
+  const Tensor rows = test::AsTensor<float>({1, 2, 3, 4, 5, 6}, {3, 2});
+  TF_ASSERT_OK(PadTensor(rows.Slice(1, 3), {2, 3}, &padding_value, &padded));
+  test::ExpectTensorEqual<float>(
+      test::AsTensor<float>({3, 4, -1, 5, 6, -1}, {2, 3}), padded);
+
+  // Strings.
+  const Tensor strings = test::AsTensor<string>({"a", "b"}, {1, 2});
+  const Tensor string_padding_value = test::AsScalar<string>("<pad>");
+  TF_ASSERT_OK(PadTensor(strings, {1, 4}, &string_padding_value, &padded));
+  test::ExpectTensorEqual<string>(
+      test::AsTensor<string>({"a", "b", "<pad>", "<pad>"}, {1, 4}), padded);
+
+  // Bad arguments.
+  EXPECT_FALSE(PadTensor(input, {2, 1}, nullptr, &padded).ok());
+  EXPECT_FALSE(PadTensor(input, {2, 2, 1}, nullptr, &padded).ok());
+  EXPECT_FALSE(PadTensor(input, {2, 3}, &string_padding_value, &padded).ok());
+}
+
+TEST(BatchingUtilTest, TrimTensor) {
+  const Tensor input =
+      test::AsTensor<int32>({1, 2, 3, 4, 5, 6, 7, 8}, {2, 2, 2});
+  Tensor trimmed;
+  TF_ASSERT_OK(TrimTensor(input, {2, 1, 2}, &trimmed));
+  test::ExpectTensorEqual<int32>(test::AsTensor<int32>({1, 2, 5, 6}, {2, 1, 2}),
+                                 trimmed);
+  TF_ASSERT_OK(TrimTensor(input, {1, 2, 1}, &trimmed));
+  test::ExpectTensorEqual<int32>(test::AsTensor<int32>({1, 3}, {1, 2, 1}),
+                                 trimmed);
+
+  EXPECT_FALSE(TrimTensor(input, {2, 3, 2}, &trimmed).ok());
+  EXPECT_FALSE(TrimTensor(input, {2, 2}, &trimmed).ok());
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
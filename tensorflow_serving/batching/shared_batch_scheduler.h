@@ -17,11 +17,16 @@ limitations under the License.
 #define TENSORFLOW_SERVING_BATCHING_SHARED_BATCH_SCHEDULER_H_
 
 #include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
 #include <deque>
 #include <functional>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -29,9 +34,15 @@ limitations under the License.
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/thread_annotations.h"
 #include "tensorflow/core/platform/types.h"
+#include "tensorflow_serving/batching/adaptive_batch_controller.h"
 #include "tensorflow_serving/batching/batch_scheduler.h"
+#include "tensorflow_serving/batching/batch_scheduler_metrics.h"
+#include "tensorflow_serving/util/cleanup.h"
+#include "tensorflow_serving/util/cpu_affinity.h"
 #include "tensorflow_serving/util/periodic_function.h"
 
 namespace tensorflow {
@@ -39,6 +50,88 @@ namespace serving {
 namespace internal {
 template <typename TaskType>
 class Queue;
+
+// A budget of bytes (see BatchTask::bytes()) from which enqueued tasks reserve
+// room. Thread-safe.
+class ByteBudget {
+ public:
+  // A 'max_bytes' of 0 means no limit.
+  explicit ByteBudget(int64 max_bytes) : max_bytes_(max_bytes) {}
+
+  // Reserves 'bytes' if they fit in the budget. Returns whether it did.
+  bool TryReserve(int64 bytes) {
+    if (max_bytes_ == 0) {
+      return true;
+    }
+    int64 reserved_bytes = reserved_bytes_.load();
+    do {
+      if (reserved_bytes + bytes > max_bytes_) {
+        return false;
+      }
+    } while (!reserved_bytes_.compare_exchange_weak(reserved_bytes,
+                                                    reserved_bytes + bytes));
+    return true;
+  }
+
+  // Gives back 'bytes' reserved earlier. (May be negative, to account for
+  // additional bytes without checking the limit.)
+  void Release(int64 bytes) {
+    if (max_bytes_ != 0) {
+      reserved_bytes_ -= bytes;
+    }
+  }
+
+  // Returns the number of unreserved bytes, or kint64max if there is no limit.
+  int64 available_bytes() const {
+    return max_bytes_ == 0
+               ? kint64max
+               : std::max<int64>(max_bytes_ - reserved_bytes_.load(), 0);
+  }
+
+  int64 max_bytes() const { return max_bytes_; }
+
+  // Listeners that NotifyReleased() invokes, e.g. to wake callers waiting for
+  // room. A listener must not call back into the budget.
+  using ReleaseListeners = std::list<std::function<void()>>;
+  ReleaseListeners::iterator AddReleaseListener(
+      std::function<void()> listener) {
+    mutex_lock l(listeners_mu_);
+    return release_listeners_.insert(release_listeners_.end(),
+                                     std::move(listener));
+  }
+  void RemoveReleaseListener(ReleaseListeners::iterator listener) {
+    mutex_lock l(listeners_mu_);
+    release_listeners_.erase(listener);
+  }
+
+  // Called when a caller starts and stops waiting for room in the budget, so
+  // that NotifyReleased() can skip the listeners when no one waits.
+  void AddWaiter() { ++num_waiters_; }
+  void RemoveWaiter() { --num_waiters_; }
+
+  // Invokes the release listeners if any caller waits for room. To be called
+  // after releasing bytes, while holding no lock a listener might take.
+  void NotifyReleased() {
+    if (num_waiters_.load() == 0) {
+      return;
+    }
+    mutex_lock l(listeners_mu_);
+    for (const auto& listener : release_listeners_) {
+      listener();
+    }
+  }
+
+ private:
+  const int64 max_bytes_;
+  std::atomic<int64> reserved_bytes_{0};
+
+  std::atomic<int> num_waiters_{0};
+  mutex listeners_mu_;
+  ReleaseListeners release_listeners_ GUARDED_BY(listeners_mu_);
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ByteBudget);
+};
+
 }  // namespace internal
 }  // namespace serving
 }  // namespace tensorflow
@@ -68,10 +161,15 @@ namespace serving {
 // dynamically, to accommodate e.g. versions of a model being brought up and
 // down over the lifetime of a server.
 //
-// The batch thread pool round-robins through the queues, running one batch
-// from a queue and then moving to the next queue. Each queue behaves like a
-// BasicBatchScheduler instance, in the sense that it has maximum batch size and
-// timeout parameters, which govern when a batch is eligible to be processed.
+// The batch thread pool round-robins through the queues, running up to
+// 'weight' batches from a queue (see QueueOptions) and then moving to the next
+// queue. E.g. with queues A and B having weights 1 and 2 respectively, the
+// servicing pattern is ABBABB... while both have batches ready. A queue with no
+// batch ready forfeits the rest of its turn. A queue may also cap the number of
+// its batches that are processed concurrently, so that it cannot occupy all of
+// the threads. Each queue behaves like a BasicBatchScheduler instance, in the
+// sense that it has maximum batch size and timeout parameters, which govern
+// when a batch is eligible to be processed.
 //
 // Each queue is independently configured with a maximum size (in terms of the
 // maximum number of batches worth of enqueued tasks). For online serving, it is
@@ -89,9 +187,12 @@ namespace serving {
 // For bulk processing jobs and throughput-oriented benchmarks, you may want to
 // set the maximum queue size to a large value.
 //
-// TODO(b/26539183): Support queue servicing policies other than round-robin.
-// E.g. let each queue specify a "share" (an int >= 1), so e.g. with queues A
-// and B having shares 1 and 2 respectively, the servicing pattern is ABBABB...
+// Tasks may carry deadlines (see BatchTask::deadline_micros()). A queue closes
+// its open batch ahead of the timeout parameter once the earliest deadline
+// among the batch's tasks, less the queue's estimated batch processing time
+// (a moving average over the batches it has processed), has been reached. The
+// scheduler does not drop tasks whose deadlines have passed; that is left to
+// the process-batch callback, which knows how to fail a task.
 //
 template <typename TaskType>
 class SharedBatchScheduler
@@ -106,6 +207,34 @@ class SharedBatchScheduler
     // Must be >= 1, and should be tuned carefully.
     int num_batch_threads = 1;
 
+    // A group of batch threads restricted to a set of CPUs.
+    struct ThreadGroup {
+      // The number of threads in the group. Must be >= 1.
+      int num_threads = 1;
+
+      // The CPUs to pin the group's threads to. If empty, and 'numa_node' is
+      // non-negative, the CPUs of that NUMA node are used; if both are unset,
+      // the threads are not pinned. Pinning is only supported on Linux.
+      std::vector<int> cpus;
+      int numa_node = -1;
+    };
+
+    // If non-empty, the batch threads, in place of 'num_batch_threads'
+    // unpinned ones. Queues may be assigned to a group (see
+    // QueueOptions::thread_group), e.g. one per NUMA node on a multi-socket
+    // host. Since memory is generally placed on the node of the thread that
+    // first touches it, the batches of such a queue, and whatever the
+    // process-batch callback allocates for them, stay local to the node.
+    // (Only the batch threads are pinned; threads the callback hands batches
+    // on to, e.g. BatchingSession's pipeline threads, must be pinned
+    // separately, see BatchingSessionOptions::pipeline_cpus.)
+    std::vector<ThreadGroup> thread_groups;
+
+    // If positive, the maximum total bytes (see BatchTask::bytes()) of the
+    // tasks enqueued across all queues, in addition to each queue's own limits.
+    // A task that would exceed it is rejected with an UNAVAILABLE error.
+    int64 max_enqueued_bytes = 0;
+
     // The environment to use.
     // (Typically only overridden by test code.)
     Env* env = Env::Default();
@@ -133,6 +262,18 @@ class SharedBatchScheduler
     // done by adding padding in the process-batch callback.
     int max_batch_size = 1000;
 
+    // If positive, the maximum total cost (see BatchTask::cost()) of each
+    // batch. A batch is closed once it reaches 'max_batch_size' or this cost,
+    // or once the next task would take it beyond either limit, whichever comes
+    // first. A task whose cost alone exceeds this limit gets a batch of its own
+    // rather than being rejected. (The subtasks of a split task, however, are
+    // packed by size alone.)
+    //
+    // This keeps a few expensive tasks (e.g. ones with long sequence inputs)
+    // from forming a batch that takes too long to process, without holding
+    // back batches of cheap ones.
+    int64 max_batch_cost = 0;
+
     // If a task has been enqueued for this amount of time (in microseconds),
     // and a thread is available, the scheduler will immediately form a batch
     // from enqueued tasks and assign the batch to the thread for processing,
@@ -149,26 +290,162 @@ class SharedBatchScheduler
     // environment.
     int64 batch_timeout_micros = 1 * 1000 /* 1 millisecond */;
 
+    // If non-negative, a shorter batch timeout for a batch whose first task
+    // arrives while the queue has no other batches waiting and some batch
+    // thread is idle, i.e. when there is nothing to be gained by waiting to
+    // share the threads. If 0, such a task is processed right away, in a batch
+    // with whatever other tasks arrive before a thread picks it up. (If
+    // greater than the batch timeout in effect, the latter applies.)
+    //
+    // This keeps the batch timeout from dominating latency under light load,
+    // at the cost of smaller batches.
+    int64 idle_batch_timeout_micros = -1;
+
     // The maximum allowable number of enqueued (accepted by Schedule() but
     // not yet being processed on a batch thread) tasks in terms of batches.
     // If this limit is reached, Schedule() will return an UNAVAILABLE error.
     // See the class documentation above for guidelines on how to tune this
     // parameter.
     int max_enqueued_batches = 1;
+
+    // If positive, the maximum total bytes (see BatchTask::bytes()) of the
+    // tasks enqueued in this queue. If this limit is reached, Schedule() will
+    // return an UNAVAILABLE error. A task larger than this (or than the
+    // scheduler-wide Options::max_enqueued_bytes) on its own is rejected with
+    // INVALID_ARGUMENT.
+    //
+    // Whereas 'max_enqueued_batches' bounds the number of enqueued tasks, this
+    // bounds the memory they hold, which can vary widely with the size of the
+    // tasks' inputs.
+    int64 max_enqueued_bytes = 0;
+
+    // If true, a task whose size exceeds 'max_batch_size' is not rejected, but
+    // is split (via 'split_input_task_func') into subtasks: the first fills
+    // the remainder of the open batch, and each of the rest fills (all or part
+    // of) a subsequent batch. The subtasks are enqueued together; if the
+    // queue lacks room for all of them, Schedule() returns UNAVAILABLE. A task
+    // that would need more than 'max_enqueued_batches' batches even in an
+    // empty queue is rejected with INVALID_ARGUMENT.
+    //
+    // This allows 'max_batch_size' to be tuned for the common case without
+    // failing occasional large tasks. It is up to the task type to reassemble
+    // the subtasks' results (see e.g. batching_session.h).
+    bool enable_large_batch_splitting = false;
+
+    // Splits '*input_task' into subtasks, the first of size
+    // 'first_output_task_size' and the rest of size 'max_batch_size' (except
+    // the last, which holds the remainder), appending them to 'output_tasks' in
+    // order. On success, takes ownership of '*input_task' (leaving it null); on
+    // failure, must leave it untouched. Required iff
+    // 'enable_large_batch_splitting' is true.
+    std::function<Status(std::unique_ptr<TaskType>* input_task,
+                         int first_output_task_size, int max_batch_size,
+                         std::vector<std::unique_ptr<TaskType>>* output_tasks)>
+        split_input_task_func;
+
+    // The number of consecutive batches the batch threads take from this queue
+    // each time its turn comes around, while it has batches ready. Sets the
+    // queue's share of the batch threads under contention, relative to other
+    // queues. Must be >= 1.
+    int weight = 1;
+
+    // If positive, the maximum number of this queue's batches that may be
+    // processed concurrently; further batches wait in the queue until one
+    // finishes, and the batch threads serve other queues meanwhile. If 0, the
+    // queue may occupy all of the batch threads.
+    int max_in_flight_batches = 0;
+
+    // If positive, the queue adapts its batch timeout and maximum batch size
+    // to the traffic, aiming to keep the 99th-percentile latency of its tasks
+    // (from Schedule() until the process-batch callback returns) within this
+    // many microseconds. See adaptive_batch_controller.h for how. The chosen
+    // values lie between the following two options and 'max_batch_size' and
+    // 'batch_timeout_micros', respectively. (Split tasks, however, are still
+    // split to fill batches of up to 'max_batch_size'.)
+    int64 adaptive_target_latency_micros = 0;
+    int adaptive_min_batch_size = 1;
+    int64 adaptive_min_batch_timeout_micros = 0;
+
+    // If set, invoked with the queue's adaptively-chosen maximum batch size and
+    // batch timeout whenever they change. (They are also logged at VLOG level
+    // 1.)
+    std::function<void(int max_batch_size, int64 batch_timeout_micros)>
+        adaptive_batching_callback;
+
+    // If positive, Schedule() adds most tasks to the open batch without taking
+    // the queue's lock, staging them in this many shards (chosen by calling
+    // thread), from which they are moved into the batch when it closes. Only
+    // tasks that start or fill a batch (or need splitting) take the lock. This
+    // reduces lock contention when many threads submit tasks to a busy queue.
+    // The batch size, queue capacity and timeout semantics are unaffected, and
+    // a batch's tasks remain in the order in which they were scheduled.
+    // (Callers that schedule tasks one at a time anyway, e.g. a BatchingSession
+    // with 'incremental_merge_buffer_size' set, gain nothing from it.)
+    // Ignored if 'adaptive_target_latency_micros' is set.
+    int num_enqueue_shards = 0;
+
+    // If positive, the queue sheds load once its batches have waited for
+    // longer than this many microseconds after closing (i.e. excluding the
+    // time spent filling them) continuously for 'codel_interval_micros',
+    // in the spirit of the CoDel ("controlled delay") algorithm: while the
+    // delay stays above the target, Schedule() and ScheduleWithTimeout()
+    // reject every arriving task with UNAVAILABLE, until a batch waits less
+    // than the target or the queue drains. (CoDel's gradually increasing drop
+    // rate relies on senders slowing down in response, which callers of an
+    // open-loop server don't, so the standing queue would keep growing.)
+    //
+    // Rejections based on 'max_enqueued_batches' come only once the queue is
+    // full, by which time every enqueued task has waited a long time. This
+    // keeps the standing queue, and hence the tail latency, short under
+    // overload instead. The interval should be a few times the time it takes
+    // to process a batch, so that a short burst doesn't cause tasks to be shed.
+    int64 codel_target_delay_micros = 0;
+    int64 codel_interval_micros = 100 * 1000 /* 100 milliseconds */;
+
+    // If non-negative, the index into Options::thread_groups of the group
+    // whose threads (alone) process this queue's batches. Otherwise, any batch
+    // thread may process them.
+    int thread_group = -1;
+
+    // The labels of the queue's metrics (see batch_scheduler_metrics.h). Need
+    // not be unique.
+    string model_name;
+    string queue_name;
   };
   Status AddQueue(const QueueOptions& options,
                   std::function<void(std::unique_ptr<Batch<TaskType>>)>
                       process_batch_callback,
                   std::unique_ptr<BatchScheduler<TaskType>>* queue);
 
- private:
-  explicit SharedBatchScheduler(const Options& options);
+  // Wakes the idle batch threads to re-check when open batches become
+  // schedulable. The threads wait for that time in real time, so this must be
+  // called whenever the clock of 'options.env' jumps ahead, if it does not keep
+  // real time (e.g. a fake clock in tests).
+  void NotifyClockAdvanced();
 
-  // The code executed in 'batch_threads_'. Obtains a batch to process from the
-  // queue pointed to by 'next_queue_to_schedule_', and processes it. If that
-  // queue declines to provide a batch to process, moves onto the next queue. If
-  // no queues provide a batch to process, just sleeps briefly and exits.
-  void ThreadLogic();
+ private:
+  // 'thread_groups' are the groups of batch threads to start: those of
+  // 'options', with NUMA nodes resolved to their CPUs, or a single unpinned
+  // group of 'options.num_batch_threads' threads.
+  SharedBatchScheduler(
+      const Options& options,
+      const std::vector<typename Options::ThreadGroup>& thread_groups);
+
+  // The code executed in 'batch_threads_' of group 'thread_group'. Obtains a
+  // batch to process from the queue pointed to by the group's
+  // 'next_queue_to_schedule', and processes it. Once that queue has provided
+  // 'weight' batches in a row, or if it declines to provide a batch to process
+  // (or is assigned to another thread group), moves onto the next queue. If no
+  // queues provide a batch to process, waits until the earliest time at which
+  // an open batch of the group's queues becomes schedulable, or until notified
+  // of a change, and exits.
+  void ThreadLogic(int thread_group);
+
+  // Whether threads of group 'thread_group' may process batches of 'queue'.
+  static bool ServesQueue(int thread_group,
+                          const internal::Queue<TaskType>& queue) {
+    return queue.thread_group() < 0 || queue.thread_group() == thread_group;
+  }
 
   const Options options_;
 
@@ -184,13 +461,37 @@ class SharedBatchScheduler
   //  - have been removed but are not yet empty.
   QueueList queues_ GUARDED_BY(mu_);
 
-  // An iterator over 'queues_', pointing to the queue from which the next
-  // available batch thread should grab work.
-  typename QueueList::iterator next_queue_to_schedule_ GUARDED_BY(mu_);
+  // The state of a group of batch threads (a single one, if
+  // 'options_.thread_groups' is empty).
+  struct ThreadGroupState {
+    // Used by the group's idle threads to wait for work to enter the system.
+    // Notified whenever a batch of a queue the group serves becomes
+    // schedulable, or the time at which such a queue's open batch will become
+    // schedulable moves earlier. Also notified by a thread of the group that
+    // takes a batch to process, so that another idle thread takes over
+    // waiting for the next open batch to become schedulable.
+    condition_variable schedulable_batch_cv;
+
+    // The number of the group's threads waiting on 'schedulable_batch_cv'.
+    // Only modified while holding 'mu_', but read by the queues without it.
+    std::atomic<int> num_idle_threads{0};
+
+    // An iterator over 'queues_', pointing to the queue from which the group's
+    // next available thread should grab work, and the number of batches taken
+    // from that queue since the iterator last moved. Guarded by 'mu_'. Each
+    // group takes turns of its own, so that skipping the queues a group doesn't
+    // serve leaves the other groups' turns alone.
+    typename QueueList::iterator next_queue_to_schedule;
+    int num_batches_scheduled_in_turn = 0;
+  };
+  std::vector<std::unique_ptr<ThreadGroupState>> thread_groups_;
 
-  // Used by idle batch threads to wait for work to enter the system. Notified
-  // whenever a batch becomes schedulable.
-  condition_variable schedulable_batch_cv_;
+  // Set by the destructor, to stop idle batch threads from waiting.
+  bool destroying_ GUARDED_BY(mu_) = false;
+
+  // The bytes of the tasks enqueued across all queues, bounded by
+  // 'options_.max_enqueued_bytes'.
+  internal::ByteBudget enqueued_bytes_budget_;
 
   // Threads that process batches obtained from the queues.
   std::vector<std::unique_ptr<PeriodicFunction>> batch_threads_;
@@ -221,23 +522,51 @@ namespace internal {
 // closed. If the front-most batch is open (i.e. the queue contains only one
 // batch) and has reached the timeout, it is immediately closed and returned;
 // otherwise no batch is returned for the request.
+//
+// To reduce lock contention, the queue may be configured to let Schedule() add
+// a task to a non-empty open batch without taking the queue's lock, provided
+// the task doesn't fill the batch. Such tasks are staged in per-thread shards
+// until the batch is closed, while the open batch's size (including staged
+// tasks) is tracked by an atomic counter, on which the tasks reserve room.
+// Every task added to the open batch, staged or not, takes a sequence number,
+// by which the batch's tasks are put back in arrival order when it closes.
+//
+// If the queue has an adaptive controller, the controller's choices of maximum
+// batch size and timeout take the place of the configured ones, except that a
+// task no larger than the configured maximum is always accepted (into a batch
+// of its own, if need be).
 template <typename TaskType>
 class Queue {
  public:
   using ProcessBatchCallback =
       std::function<void(std::unique_ptr<Batch<TaskType>>)>;
   using SchedulableBatchCallback = std::function<void()>;
+  using IdleBatchThreadCallback = std::function<bool()>;
+  // 'adaptive_controller' may be null, in which case the configured maximum
+  // batch size and timeout are used. 'scheduler_bytes_budget' is the
+  // scheduler-wide budget for enqueued bytes, which must outlive the queue.
+  // 'idle_batch_thread_callback' reports whether some batch thread is idle.
   Queue(const typename SharedBatchScheduler<TaskType>::QueueOptions& options,
-        Env* env, ProcessBatchCallback process_batch_callback,
-        SchedulableBatchCallback schdulable_batch_callback);
+        Env* env, std::unique_ptr<AdaptiveBatchController> adaptive_controller,
+        ByteBudget* scheduler_bytes_budget,
+        ProcessBatchCallback process_batch_callback,
+        SchedulableBatchCallback schdulable_batch_callback,
+        IdleBatchThreadCallback idle_batch_thread_callback);
 
   // Illegal to destruct unless the queue is empty.
   ~Queue();
 
   // Submits a task to the queue, with the same semantics as
-  // BatchScheduler::Schedule().
+  // BatchScheduler::Schedule(). Rejections are recorded in the queue's
+  // metrics.
   Status Schedule(std::unique_ptr<TaskType>* task);
 
+  // Submits a task to the queue, with the same semantics as
+  // BatchScheduler::ScheduleWithTimeout(). Rejections are recorded in the
+  // queue's metrics.
+  Status ScheduleWithTimeout(std::unique_ptr<TaskType>* task,
+                             int64 timeout_micros);
+
   // Returns the number of enqueued tasks, with the same semantics as
   // BatchScheduler::NumEnqueuedTasks().
   size_t NumEnqueuedTasks() const;
@@ -246,9 +575,14 @@ class Queue {
   // BatchScheduler::SchedulingCapacity().
   size_t SchedulingCapacity() const;
 
+  // The thread group the queue is assigned to, or -1 if none (see
+  // QueueOptions::thread_group).
+  int thread_group() const { return options_.thread_group; }
+
   // Called by a thread that is ready to process a batch, to request one from
   // this queue. Either returns a batch that is ready to be processed, or
-  // nullptr if the queue declines to schedule a batch at this time. If it
+  // nullptr if the queue declines to schedule a batch at this time (e.g.
+  // because it has 'max_in_flight_batches' batches being processed). If it
   // returns a batch, the batch is guaranteed to be closed.
   std::unique_ptr<Batch<TaskType>> ScheduleBatch();
 
@@ -267,31 +601,124 @@ class Queue {
     return closed_;
   }
 
+  // Returns the time at which the open batch will become schedulable (due to
+  // its timeout or its tasks' deadlines), or 0 if there is no such time or the
+  // queue would decline to schedule it then (e.g. because it is empty, or due
+  // to 'max_in_flight_batches', in which case the queue will call the
+  // schedulable-batch callback when that changes). Called by idle batch
+  // threads to decide how long to wait.
+  uint64 OpenBatchSchedulableTimeMicros() const;
+
+  int weight() const { return options_.weight; }
+
  private:
+  // Same as Schedule(), but doesn't record rejections.
+  Status TrySchedule(std::unique_ptr<TaskType>* task);
+
+  // Returns UNAVAILABLE if the queue is shedding load (see
+  // QueueOptions::codel_target_delay_micros). Lock-free.
+  Status MaybeShedTask();
+
+  // Updates the load shedding state given that a batch that waited
+  // 'queue_delay_micros' after closing has just left the queue.
+  void RecordClosedBatchDelay(uint64 now_micros, int64 queue_delay_micros)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Notifies the front-most caller waiting in ScheduleWithTimeout(), if any.
+  void NotifyFrontWaiter();
+
+  // Reserves 'bytes' in both 'bytes_budget_' and '*scheduler_bytes_budget_',
+  // or returns an error if either lacks room.
+  Status ReserveBytes(int64 bytes);
+
+  // Gives back 'bytes' to both budgets.
+  void ReleaseBytes(int64 bytes);
+
+  // Handles Schedule() for a task that is not to be split.
+  Status ScheduleWithoutSplitting(std::unique_ptr<TaskType>* task);
+
+  // Handles Schedule() for a task larger than 'options_.max_batch_size', with
+  // large batch splitting enabled.
+  Status ScheduleWithSplitting(std::unique_ptr<TaskType>* task);
+
+  // Attempts to add '*task' to the open batch without locking 'mu_', by
+  // staging it in one of 'enqueue_shards_'. Returns false (leaving '*task'
+  // untouched) if the task must go through the locked path instead, i.e. if
+  // the open batch is empty or the task would fill it.
+  bool TryScheduleWithoutQueueLock(std::unique_ptr<TaskType>* task);
+
+  // Lock and unlock the mutexes of all of 'enqueue_shards_', which prevents
+  // tasks from being staged.
+  void LockEnqueueShards() NO_THREAD_SAFETY_ANALYSIS;
+  void UnlockEnqueueShards() NO_THREAD_SAFETY_ANALYSIS;
+
+  // Adds 'task_size' to 'open_batch_size_' and 'task_cost' to
+  // 'open_batch_cost_' if the open batch is empty, or if it has room for the
+  // task within 'max_batch_size' and 'max_batch_cost' (0 meaning no limit).
+  // Returns whether it did.
+  bool ReserveRoomInOpenBatch(size_t task_size, size_t task_cost,
+                              size_t max_batch_size, size_t max_batch_cost);
+
+  // Sets 'open_batch_earliest_deadline_micros_' to 'deadline_micros' if the
+  // latter is earlier. Returns whether it did.
+  bool LowerOpenBatchEarliestDeadline(uint64 deadline_micros);
+
   // Same as IsEmpty(), but assumes the caller already holds a lock on 'mu_'.
   bool IsEmptyInternal() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
-  // Closes the open batch residing at the back of 'batches_', and inserts a
-  // fresh open batch behind it.
+  // Closes the open batch residing at the back of 'batches_' (first moving
+  // any staged tasks into it), and inserts a fresh open batch behind it.
   void StartNewBatch() EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // Same as StartNewBatch(), but assumes the caller already holds the locks of
+  // all of 'enqueue_shards_'.
+  void StartNewBatchWithEnqueueShardsLocked() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Adds 'task' to the open batch residing at the back of 'batches_', for
+  // which the caller has reserved room via ReserveRoomInOpenBatch(). Returns
+  // true iff doing so moved the time at which the open batch becomes
+  // schedulable earlier (or set it, if the batch was empty).
+  bool AddTaskToOpenBatch(std::unique_ptr<TaskType> task)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Determines whether the open batch has reached the maximum batch size or
+  // cost.
+  bool IsOpenBatchFull() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   // Determines whether the open batch residing at the back of 'batches_' is
   // currently schedulable.
   bool IsOpenBatchSchedulable() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // The maximum batch size and batch timeout currently in effect.
+  int MaxBatchSize() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  int64 BatchTimeoutMicros() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // The timeout of the open batch: BatchTimeoutMicros(), or
+  // 'options_.idle_batch_timeout_micros' if the batch started while the batch
+  // threads were idle and that is shorter.
+  int64 OpenBatchTimeoutMicros() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   const typename SharedBatchScheduler<TaskType>::QueueOptions options_;
 
   // The environment to use.
   Env* env_;
 
+  // The time at which the queue was created. Task enqueue times are summed
+  // relative to it (see 'open_batch_enqueue_micros_sum_'), to keep the sums
+  // from overflowing.
+  const uint64 creation_time_micros_;
+
   // A callback invoked to processes a batch of work units. Always invoked from
   // a batch thread.
   ProcessBatchCallback process_batch_callback_;
 
   // A callback invoked to notify the scheduler that a new batch has become
-  // schedulable.
+  // schedulable, or that the open batch's schedulable time has moved earlier.
   SchedulableBatchCallback schedulable_batch_callback_;
 
+  // A callback that reports whether some batch thread is idle.
+  IdleBatchThreadCallback idle_batch_thread_callback_;
+
   mutable mutex mu_;
 
   // Whether this queue can accept new tasks. This variable is monotonic: it
@@ -306,6 +733,118 @@ class Queue {
   // in 'batches_'. Valid iff that batch contains at least one task.
   uint64 open_batch_start_time_micros_ GUARDED_BY(mu_);
 
+  // Whether the open batch's first task arrived while no other batches were
+  // waiting and some batch thread was idle, so that the batch is subject to
+  // 'options_.idle_batch_timeout_micros'. Valid iff the batch contains at
+  // least one task.
+  bool open_batch_started_idle_ GUARDED_BY(mu_) = false;
+
+  // The same, for each of the closed batches in 'batches_' (in order).
+  std::deque<uint64> closed_batch_start_times_micros_ GUARDED_BY(mu_);
+
+  // The sum of the times at which the closed batches' tasks were enqueued,
+  // relative to 'creation_time_micros_', for each of the closed batches in
+  // 'batches_' (in order). Yields the batches' mean queue delays.
+  std::deque<uint64> closed_batch_enqueue_micros_sums_ GUARDED_BY(mu_);
+
+  // The times at which the closed batches in 'batches_' were closed (in
+  // order), if 'options_.codel_target_delay_micros' is set.
+  std::deque<uint64> closed_batch_close_times_micros_ GUARDED_BY(mu_);
+
+  // The load shedding state, if 'options_.codel_target_delay_micros' is set:
+  // whether the queue is shedding load (which is written while holding 'mu_',
+  // but read without it so that arriving tasks need not take the lock); and
+  // the time by which the delay will have been above the target for the
+  // interval, or 0 if the last batch to leave the queue waited less than the
+  // target.
+  std::atomic<bool> shedding_load_{false};
+  uint64 delay_above_target_until_micros_ GUARDED_BY(mu_) = 0;
+
+  // A set of tasks that belong to the open batch, but have been staged here
+  // by TryScheduleWithoutQueueLock() rather than added to the batch itself.
+  // Each task is paired with its sequence number (see
+  // 'next_task_sequence_number_').
+  struct EnqueueShard {
+    mutex mu;
+    std::vector<std::pair<uint64, std::unique_ptr<TaskType>>> tasks
+        GUARDED_BY(mu);
+  };
+
+  // 'options_.num_enqueue_shards' shards, or none if tasks are not to be
+  // staged.
+  std::vector<std::unique_ptr<EnqueueShard>> enqueue_shards_;
+
+  // If there are 'enqueue_shards_', the sequence number to give the next task
+  // added to the open batch (whether staged or not), so that the batch's tasks
+  // can be put in arrival order when it closes.
+  std::atomic<uint64> next_task_sequence_number_{0};
+
+  // The sequence numbers of the tasks in the open batch itself (i.e. not
+  // staged), in order. Only maintained if there are 'enqueue_shards_'.
+  std::vector<uint64> open_batch_task_sequence_numbers_ GUARDED_BY(mu_);
+
+  // The size of the open batch, including staged tasks. Tasks reserve room by
+  // increasing it, either while holding 'mu_' or (if the batch is non-empty)
+  // a shard's lock; it is reset only while holding 'mu_' and all the shards'
+  // locks.
+  std::atomic<size_t> open_batch_size_{0};
+
+  // The cost of the open batch, including staged tasks, if
+  // 'options_.max_batch_cost' is set (and otherwise 0). Updated like
+  // 'open_batch_size_'.
+  std::atomic<size_t> open_batch_cost_{0};
+
+  // The earliest deadline among the tasks in the open batch (including staged
+  // ones), or 0 if none of them has a deadline. Updated like
+  // 'open_batch_size_'.
+  std::atomic<uint64> open_batch_earliest_deadline_micros_{0};
+
+  // The sum of the times at which the open batch's tasks (including staged
+  // ones) were enqueued, relative to 'creation_time_micros_'. Updated like
+  // 'open_batch_size_'.
+  std::atomic<uint64> open_batch_enqueue_micros_sum_{0};
+
+  // An exponential moving average of the time taken by
+  // 'process_batch_callback_', or 0 if no batch has been processed yet. Used
+  // to close the open batch in time to meet its earliest deadline.
+  int64 estimated_batch_processing_micros_ GUARDED_BY(mu_) = 0;
+
+  BatchQueueMetrics metrics_;
+
+  // The bytes of the queue's enqueued tasks, bounded by
+  // 'options_.max_enqueued_bytes', and the scheduler-wide budget they also
+  // count against. Reserved when a task is scheduled, and given back when its
+  // batch leaves the queue.
+  ByteBudget bytes_budget_;
+  ByteBudget* const scheduler_bytes_budget_;
+
+  // The total bytes and size of the tasks scheduled so far, if either budget
+  // is limited, from which SchedulingCapacity() estimates the bytes per unit
+  // of task size.
+  std::atomic<int64> total_task_bytes_{0};
+  std::atomic<int64> total_task_size_{0};
+
+  // Chooses the maximum batch size and timeout, if the queue adapts them.
+  std::unique_ptr<AdaptiveBatchController> adaptive_controller_
+      GUARDED_BY(mu_);
+
+  // Callers of ScheduleWithTimeout() waiting for room in the queue, in the
+  // order in which they called, each represented by a condition variable that
+  // is notified when the caller comes to the front or room frees up. Only the
+  // front-most caller tries to schedule its task, holding 'waiters_mu_' (which
+  // is therefore acquired before 'mu_' and the scheduler's lock). Callers wait
+  // until notified or their deadline passes, without polling.
+  mutex waiters_mu_;
+  std::list<condition_variable*> waiters_ GUARDED_BY(waiters_mu_);
+
+  // The size of 'waiters_', readable without 'waiters_mu_', so that callers
+  // and notifiers need not take it while no one waits.
+  std::atomic<int> num_waiters_{0};
+
+  // If the scheduler-wide byte budget is limited, the listener through which
+  // it notifies the front-most waiter when another queue releases bytes.
+  ByteBudget::ReleaseListeners::iterator scheduler_bytes_listener_;
+
   // Whether this queue contains a batch that is eligible to be scheduled. Used
   // to keep track of when to call 'schedulable_batch_callback_'.
   bool schedulable_batch_ GUARDED_BY(mu_) = false;
@@ -333,6 +872,8 @@ class QueueHandle : public BatchScheduler<TaskType> {
   ~QueueHandle() override;
 
   Status Schedule(std::unique_ptr<TaskType>* task) override;
+  Status ScheduleWithTimeout(std::unique_ptr<TaskType>* task,
+                             int64 timeout_micros) override;
   size_t NumEnqueuedTasks() const override;
   size_t SchedulingCapacity() const override;
 
@@ -353,11 +894,38 @@ template <typename TaskType>
 Status SharedBatchScheduler<TaskType>::Create(
     const Options& options,
     std::shared_ptr<SharedBatchScheduler<TaskType>>* scheduler) {
-  if (options.num_batch_threads < 1) {
-    return errors::InvalidArgument("num_batch_threads must be positive; was ",
-                                   options.num_batch_threads);
+  if (options.max_enqueued_bytes < 0) {
+    return errors::InvalidArgument(
+        "max_enqueued_bytes must be non-negative; was ",
+        options.max_enqueued_bytes);
+  }
+  std::vector<typename Options::ThreadGroup> thread_groups =
+      options.thread_groups;
+  if (thread_groups.empty()) {
+    if (options.num_batch_threads < 1) {
+      return errors::InvalidArgument("num_batch_threads must be positive; was ",
+                                     options.num_batch_threads);
+    }
+    thread_groups.resize(1);
+    thread_groups[0].num_threads = options.num_batch_threads;
+  }
+  for (auto& thread_group : thread_groups) {
+    if (thread_group.num_threads < 1) {
+      return errors::InvalidArgument(
+          "Each thread group's num_threads must be positive; was ",
+          thread_group.num_threads);
+    }
+    for (int cpu : thread_group.cpus) {
+      if (cpu < 0) {
+        return errors::InvalidArgument("Invalid CPU in thread group: ", cpu);
+      }
+    }
+    if (thread_group.cpus.empty() && thread_group.numa_node >= 0) {
+      TF_RETURN_IF_ERROR(
+          GetNumaNodeCpus(thread_group.numa_node, &thread_group.cpus));
+    }
   }
-  scheduler->reset(new SharedBatchScheduler<TaskType>(options));
+  scheduler->reset(new SharedBatchScheduler<TaskType>(options, thread_groups));
   return Status::OK();
 }
 
@@ -375,11 +943,26 @@ SharedBatchScheduler<TaskType>::~SharedBatchScheduler() {
     const int64 kSleepTimeMicros = 100;
     options_.env->SleepForMicroseconds(kSleepTimeMicros);
   }
+  {
+    mutex_lock l(mu_);
+    destroying_ = true;
+    for (const auto& thread_group : thread_groups_) {
+      thread_group->schedulable_batch_cv.notify_all();
+    }
+  }
   // Delete the batch threads before allowing state the threads may access (e.g.
   // 'mu_') to be deleted.
   batch_threads_.clear();
 }
 
+template <typename TaskType>
+void SharedBatchScheduler<TaskType>::NotifyClockAdvanced() {
+  mutex_lock l(mu_);
+  for (const auto& thread_group : thread_groups_) {
+    thread_group->schedulable_batch_cv.notify_all();
+  }
+}
+
 template <typename TaskType>
 Status SharedBatchScheduler<TaskType>::AddQueue(
     const QueueOptions& options,
@@ -400,23 +983,100 @@ Status SharedBatchScheduler<TaskType>::AddQueue(
         "max_enqueued_batches must be non-negative; was ",
         options.max_enqueued_batches);
   }
+  if (options.weight < 1) {
+    return errors::InvalidArgument("weight must be at least 1; was ",
+                                   options.weight);
+  }
+  if (options.max_in_flight_batches < 0) {
+    return errors::InvalidArgument(
+        "max_in_flight_batches must be non-negative; was ",
+        options.max_in_flight_batches);
+  }
+  if (options.max_batch_cost < 0) {
+    return errors::InvalidArgument("max_batch_cost must be non-negative; was ",
+                                   options.max_batch_cost);
+  }
+  if (options.max_enqueued_bytes < 0) {
+    return errors::InvalidArgument(
+        "max_enqueued_bytes must be non-negative; was ",
+        options.max_enqueued_bytes);
+  }
+  if (options.num_enqueue_shards < 0) {
+    return errors::InvalidArgument(
+        "num_enqueue_shards must be non-negative; was ",
+        options.num_enqueue_shards);
+  }
+  if (options.codel_target_delay_micros < 0) {
+    return errors::InvalidArgument(
+        "codel_target_delay_micros must be non-negative; was ",
+        options.codel_target_delay_micros);
+  }
+  if (options.codel_target_delay_micros > 0 &&
+      options.codel_interval_micros <= 0) {
+    return errors::InvalidArgument(
+        "codel_interval_micros must be positive; was ",
+        options.codel_interval_micros);
+  }
+  if (options.enable_large_batch_splitting &&
+      options.split_input_task_func == nullptr) {
+    return errors::InvalidArgument(
+        "split_input_task_func must be set if enable_large_batch_splitting is "
+        "true");
+  }
+  if (options.thread_group >= static_cast<int>(options_.thread_groups.size())) {
+    return errors::InvalidArgument("thread_group ", options.thread_group,
+                                   " is out of range; there are ",
+                                   options_.thread_groups.size(),
+                                   " thread groups");
+  }
+  std::unique_ptr<AdaptiveBatchController> adaptive_controller;
+  if (options.adaptive_target_latency_micros > 0) {
+    AdaptiveBatchController::Options controller_options;
+    controller_options.target_latency_micros =
+        options.adaptive_target_latency_micros;
+    controller_options.min_batch_size = options.adaptive_min_batch_size;
+    controller_options.max_batch_size = options.max_batch_size;
+    controller_options.min_batch_timeout_micros =
+        options.adaptive_min_batch_timeout_micros;
+    controller_options.max_batch_timeout_micros = options.batch_timeout_micros;
+    controller_options.env = options_.env;
+    TF_RETURN_IF_ERROR(AdaptiveBatchController::Create(controller_options,
+                                                       &adaptive_controller));
+  }
 
-  auto schedulable_batch_callback = [this] {
+  const int thread_group = options.thread_group;
+  auto schedulable_batch_callback = [this, thread_group] {
     mutex_lock l(mu_);
-    schedulable_batch_cv_.notify_one();
+    for (int i = 0; i < thread_groups_.size(); ++i) {
+      if (thread_group < 0 || i == thread_group) {
+        thread_groups_[i]->schedulable_batch_cv.notify_one();
+      }
+    }
+  };
+  auto idle_batch_thread_callback = [this, thread_group] {
+    for (int i = 0; i < thread_groups_.size(); ++i) {
+      if ((thread_group < 0 || i == thread_group) &&
+          thread_groups_[i]->num_idle_threads > 0) {
+        return true;
+      }
+    }
+    return false;
   };
   auto internal_queue =
       std::unique_ptr<internal::Queue<TaskType>>(new internal::Queue<TaskType>(
-          options, options_.env, process_batch_callback,
-          schedulable_batch_callback));
+          options, options_.env, std::move(adaptive_controller),
+          &enqueued_bytes_budget_, process_batch_callback,
+          schedulable_batch_callback, idle_batch_thread_callback));
   auto handle = std::unique_ptr<BatchScheduler<TaskType>>(
       new internal::QueueHandle<TaskType>(this->shared_from_this(),
                                           internal_queue.get()));
   {
     mutex_lock l(mu_);
     queues_.push_back(std::move(internal_queue));
-    if (next_queue_to_schedule_ == queues_.end()) {
-      next_queue_to_schedule_ = queues_.begin();
+    for (const auto& group_state : thread_groups_) {
+      if (group_state->next_queue_to_schedule == queues_.end()) {
+        group_state->next_queue_to_schedule = queues_.begin();
+      }
     }
   }
   *queue = std::move(handle);
@@ -424,22 +1084,45 @@ Status SharedBatchScheduler<TaskType>::AddQueue(
 }
 
 template <typename TaskType>
-SharedBatchScheduler<TaskType>::SharedBatchScheduler(const Options& options)
-    : options_(options), next_queue_to_schedule_(queues_.end()) {
+SharedBatchScheduler<TaskType>::SharedBatchScheduler(
+    const Options& options,
+    const std::vector<typename Options::ThreadGroup>& thread_groups)
+    : options_(options), enqueued_bytes_budget_(options.max_enqueued_bytes) {
+  for (int i = 0; i < thread_groups.size(); ++i) {
+    thread_groups_.emplace_back(new ThreadGroupState);
+    thread_groups_.back()->next_queue_to_schedule = queues_.end();
+  }
+
   // Kick off the batch threads.
   PeriodicFunction::Options periodic_fn_options;
   periodic_fn_options.thread_name_prefix =
       strings::StrCat(options.thread_pool_name, "_");
-  for (int i = 0; i < options.num_batch_threads; ++i) {
-    std::unique_ptr<PeriodicFunction> thread(new PeriodicFunction(
-        [this] { this->ThreadLogic(); },
-        0 /* function invocation interval time */, periodic_fn_options));
-    batch_threads_.push_back(std::move(thread));
+  for (int group = 0; group < thread_groups.size(); ++group) {
+    const std::vector<int>& cpus = thread_groups[group].cpus;
+    for (int i = 0; i < thread_groups[group].num_threads; ++i) {
+      bool skip_pinning = cpus.empty();
+      std::unique_ptr<PeriodicFunction> thread(new PeriodicFunction(
+          [this, group, cpus, skip_pinning]() mutable {
+            if (!skip_pinning) {
+              const Status status = PinCurrentThreadToCpus(cpus);
+              if (!status.ok()) {
+                LOG(WARNING) << "Failed to pin batch thread of group " << group
+                             << ": " << status;
+              }
+              // Pin (or attempt to) only on the first run.
+              skip_pinning = true;
+            }
+            this->ThreadLogic(group);
+          },
+          0 /* function invocation interval time */, periodic_fn_options));
+      batch_threads_.push_back(std::move(thread));
+    }
   }
 }
 
 template <typename TaskType>
-void SharedBatchScheduler<TaskType>::ThreadLogic() {
+void SharedBatchScheduler<TaskType>::ThreadLogic(int thread_group) {
+  ThreadGroupState* const group_state = thread_groups_[thread_group].get();
   // A batch to process next (or nullptr if no work to do).
   std::unique_ptr<Batch<TaskType>> batch_to_process;
   // The queue with which 'batch_to_process' is associated.
@@ -447,46 +1130,101 @@ void SharedBatchScheduler<TaskType>::ThreadLogic() {
   {
     mutex_lock l(mu_);
 
+    typename QueueList::iterator& next_queue_to_schedule =
+        group_state->next_queue_to_schedule;
     const int num_queues = queues_.size();
     for (int num_queues_tried = 0;
          batch_to_process == nullptr && num_queues_tried < num_queues;
          ++num_queues_tried) {
-      DCHECK(next_queue_to_schedule_ != queues_.end());
+      DCHECK(next_queue_to_schedule != queues_.end());
 
       // If a closed queue responds to ScheduleBatch() with nullptr, the queue
       // will never yield any further batches so we can drop it. To avoid a
       // race, we take a snapshot of the queue's closedness state *before*
       // calling ScheduleBatch().
-      const bool queue_closed = (*next_queue_to_schedule_)->closed();
-
-      // Ask '*next_queue_to_schedule_' if it wants us to process a batch.
-      batch_to_process = (*next_queue_to_schedule_)->ScheduleBatch();
-      if (batch_to_process != nullptr) {
-        queue_for_batch = next_queue_to_schedule_->get();
+      const bool queue_closed = (*next_queue_to_schedule)->closed();
+
+      // Ask '*next_queue_to_schedule' if it wants us to process a batch,
+      // unless it is assigned to another thread group.
+      if (ServesQueue(thread_group, **next_queue_to_schedule)) {
+        batch_to_process = (*next_queue_to_schedule)->ScheduleBatch();
+        if (batch_to_process != nullptr) {
+          queue_for_batch = next_queue_to_schedule->get();
+        }
       }
 
-      // Advance 'next_queue_to_schedule_'.
-      if (queue_closed && (*next_queue_to_schedule_)->IsEmpty() &&
+      // Advance 'next_queue_to_schedule', unless the queue has turns left.
+      if (queue_closed && (*next_queue_to_schedule)->IsEmpty() &&
           batch_to_process == nullptr) {
-        // We've encountered a closed queue with no work to do. Drop it.
-        DCHECK_NE(queue_for_batch, next_queue_to_schedule_->get());
-        next_queue_to_schedule_ = queues_.erase(next_queue_to_schedule_);
-      } else {
-        ++next_queue_to_schedule_;
+        // We've encountered a closed queue with no work to do. Drop it, moving
+        // any other group that was about to visit it on to the next queue.
+        DCHECK_NE(queue_for_batch, next_queue_to_schedule->get());
+        const auto dropped_queue = next_queue_to_schedule;
+        auto following_queue = std::next(dropped_queue);
+        if (following_queue == queues_.end()) {
+          following_queue = queues_.begin();
+        }
+        for (const auto& other_group_state : thread_groups_) {
+          if (other_group_state->next_queue_to_schedule == dropped_queue) {
+            other_group_state->next_queue_to_schedule = following_queue;
+            other_group_state->num_batches_scheduled_in_turn = 0;
+          }
+        }
+        queues_.erase(dropped_queue);
+        if (queues_.empty()) {
+          for (const auto& other_group_state : thread_groups_) {
+            other_group_state->next_queue_to_schedule = queues_.end();
+          }
+        }
+      } else if (batch_to_process == nullptr ||
+                 ++group_state->num_batches_scheduled_in_turn >=
+                     (*next_queue_to_schedule)->weight()) {
+        ++next_queue_to_schedule;
+        group_state->num_batches_scheduled_in_turn = 0;
       }
-      if (next_queue_to_schedule_ == queues_.end() && !queues_.empty()) {
+      if (next_queue_to_schedule == queues_.end() && !queues_.empty()) {
         // We've hit the end. Wrap to the first queue.
-        next_queue_to_schedule_ = queues_.begin();
+        next_queue_to_schedule = queues_.begin();
       }
     }
 
     if (batch_to_process == nullptr) {
-      // We couldn't find any work to do. Wait until a new batch becomes
-      // schedulable, or some time has elapsed, before checking again.
-      const int64 kTimeoutMillis = 1;  // The smallest accepted granule of time.
-      WaitForMilliseconds(&l, &schedulable_batch_cv_, kTimeoutMillis);
+      // We couldn't find any work to do. Wait until the earliest time at which
+      // an open batch becomes schedulable, or until notified of a change,
+      // before checking again.
+      if (destroying_) {
+        return;
+      }
+      uint64 wakeup_time_micros = 0;
+      for (const auto& queue : queues_) {
+        if (!ServesQueue(thread_group, *queue)) {
+          continue;
+        }
+        const uint64 queue_wakeup_time_micros =
+            queue->OpenBatchSchedulableTimeMicros();
+        if (queue_wakeup_time_micros != 0 &&
+            (wakeup_time_micros == 0 ||
+             queue_wakeup_time_micros < wakeup_time_micros)) {
+          wakeup_time_micros = queue_wakeup_time_micros;
+        }
+      }
+      ++group_state->num_idle_threads;
+      if (wakeup_time_micros == 0) {
+        group_state->schedulable_batch_cv.wait(l);
+      } else {
+        const uint64 now_micros = options_.env->NowMicros();
+        if (wakeup_time_micros > now_micros) {
+          group_state->schedulable_batch_cv.wait_for(
+              l, std::chrono::microseconds(wakeup_time_micros - now_micros));
+        }
+      }
+      --group_state->num_idle_threads;
       return;
     }
+
+    // Another idle thread of the group, if any, takes over waiting for open
+    // batches to become schedulable.
+    group_state->schedulable_batch_cv.notify_one();
   }
 
   queue_for_batch->ProcessBatch(std::move(batch_to_process));
@@ -497,18 +1235,41 @@ namespace internal {
 template <typename TaskType>
 Queue<TaskType>::Queue(
     const typename SharedBatchScheduler<TaskType>::QueueOptions& options,
-    Env* env, ProcessBatchCallback process_batch_callback,
-    SchedulableBatchCallback schedulable_batch_callback)
+    Env* env, std::unique_ptr<AdaptiveBatchController> adaptive_controller,
+    ByteBudget* scheduler_bytes_budget,
+    ProcessBatchCallback process_batch_callback,
+    SchedulableBatchCallback schedulable_batch_callback,
+    IdleBatchThreadCallback idle_batch_thread_callback)
     : options_(options),
       env_(env),
+      creation_time_micros_(env->NowMicros()),
+      metrics_(options.model_name, options.queue_name),
+      bytes_budget_(options.max_enqueued_bytes),
+      scheduler_bytes_budget_(scheduler_bytes_budget),
+      adaptive_controller_(std::move(adaptive_controller)),
       process_batch_callback_(process_batch_callback),
-      schedulable_batch_callback_(schedulable_batch_callback) {
+      schedulable_batch_callback_(schedulable_batch_callback),
+      idle_batch_thread_callback_(idle_batch_thread_callback) {
+  if (options_.adaptive_target_latency_micros == 0) {
+    for (int i = 0; i < options_.num_enqueue_shards; ++i) {
+      enqueue_shards_.emplace_back(new EnqueueShard);
+    }
+  }
   // Create an initial, open batch.
   batches_.emplace_back(new Batch<TaskType>);
+
+  if (scheduler_bytes_budget_->max_bytes() != 0) {
+    scheduler_bytes_listener_ = scheduler_bytes_budget_->AddReleaseListener(
+        [this] { NotifyFrontWaiter(); });
+  }
 }
 
 template <typename TaskType>
 Queue<TaskType>::~Queue() {
+  if (scheduler_bytes_budget_->max_bytes() != 0) {
+    scheduler_bytes_budget_->RemoveReleaseListener(scheduler_bytes_listener_);
+  }
+
   mutex_lock l(mu_);
   DCHECK(IsEmptyInternal());
 
@@ -518,35 +1279,290 @@ Queue<TaskType>::~Queue() {
 
 template <typename TaskType>
 Status Queue<TaskType>::Schedule(std::unique_ptr<TaskType>* task) {
+  Status status = MaybeShedTask();
+  if (status.ok()) {
+    status = TrySchedule(task);
+  }
+  if (!status.ok()) {
+    metrics_.RecordScheduleRejection(status);
+  }
+  return status;
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::ScheduleWithTimeout(std::unique_ptr<TaskType>* task,
+                                            int64 timeout_micros) {
+  // A shed task is rejected right away, rather than waiting for room.
+  const Status shed_status = MaybeShedTask();
+  if (!shed_status.ok()) {
+    metrics_.RecordScheduleRejection(shed_status);
+    return shed_status;
+  }
+
+  const uint64 deadline_micros =
+      env_->NowMicros() + std::max<int64>(timeout_micros, 0);
+  // Unless callers are already waiting (whom the task shouldn't overtake), try
+  // to schedule it right away, and only take 'waiters_mu_' if it must wait.
+  Status status = errors::Unavailable(
+      "The batch scheduling queue to which this task was submitted is full");
+  if (num_waiters_.load() == 0) {
+    status = TrySchedule(task);
+  }
+  if (status.code() == error::UNAVAILABLE) {
+    mutex_lock l(waiters_mu_);
+    condition_variable cv;
+    auto waiter = waiters_.insert(waiters_.end(), &cv);
+    ++num_waiters_;
+    // Have other queues' batch threads notify us when they free up room in the
+    // scheduler-wide budget. (This queue's own do so regardless.)
+    scheduler_bytes_budget_->AddWaiter();
+    for (;;) {
+      if (waiter == waiters_.begin()) {
+        status = TrySchedule(task);
+        if (status.code() != error::UNAVAILABLE) {
+          break;
+        }
+      }
+      const uint64 now_micros = env_->NowMicros();
+      if (now_micros >= deadline_micros) {
+        break;
+      }
+      cv.wait_for(l, std::chrono::microseconds(deadline_micros - now_micros));
+    }
+    scheduler_bytes_budget_->RemoveWaiter();
+    const bool was_front = waiter == waiters_.begin();
+    waiters_.erase(waiter);
+    --num_waiters_;
+    if (was_front && !waiters_.empty()) {
+      // Let the next caller in line try.
+      waiters_.front()->notify_one();
+    }
+  }
+
+  if (!status.ok()) {
+    metrics_.RecordScheduleRejection(status);
+  }
+  return status;
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::TrySchedule(std::unique_ptr<TaskType>* task) {
+  const int64 task_bytes = (*task)->bytes();
+  const int64 task_size = (*task)->size();
+  TF_RETURN_IF_ERROR(ReserveBytes(task_bytes));
+  const Status status = task_size > options_.max_batch_size &&
+                                options_.enable_large_batch_splitting
+                            ? ScheduleWithSplitting(task)
+                            : ScheduleWithoutSplitting(task);
+  if (!status.ok()) {
+    ReleaseBytes(task_bytes);
+  } else if (bytes_budget_.max_bytes() != 0 ||
+             scheduler_bytes_budget_->max_bytes() != 0) {
+    total_task_bytes_ += task_bytes;
+    total_task_size_ += task_size;
+  }
+  return status;
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::MaybeShedTask() {
+  if (!shedding_load_.load(std::memory_order_relaxed)) {
+    return Status::OK();
+  }
+  return errors::Unavailable(
+      "The batch scheduling queue to which this task was submitted is "
+      "shedding load, as its batches have been waiting longer than ",
+      options_.codel_target_delay_micros, " microseconds");
+}
+
+template <typename TaskType>
+void Queue<TaskType>::RecordClosedBatchDelay(uint64 now_micros,
+                                             int64 queue_delay_micros) {
+  // Since every arriving task is shed while shedding load, the queue drains,
+  // and the last batch to leave it stops the shedding.
+  if (queue_delay_micros < options_.codel_target_delay_micros ||
+      (batches_.size() == 1 && open_batch_size_ == 0)) {
+    delay_above_target_until_micros_ = 0;
+    shedding_load_ = false;
+  } else if (delay_above_target_until_micros_ == 0) {
+    delay_above_target_until_micros_ =
+        now_micros + options_.codel_interval_micros;
+  } else if (now_micros >= delay_above_target_until_micros_) {
+    shedding_load_ = true;
+  }
+}
+
+template <typename TaskType>
+void Queue<TaskType>::NotifyFrontWaiter() {
+  if (num_waiters_.load() == 0) {
+    return;
+  }
+  mutex_lock l(waiters_mu_);
+  if (!waiters_.empty()) {
+    waiters_.front()->notify_one();
+  }
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::ReserveBytes(int64 bytes) {
+  for (const ByteBudget* budget : {&bytes_budget_, scheduler_bytes_budget_}) {
+    if (budget->max_bytes() != 0 && bytes > budget->max_bytes()) {
+      return errors::InvalidArgument("Task of ", bytes,
+                                     " bytes is larger than the maximum of ",
+                                     budget->max_bytes(), " enqueued bytes");
+    }
+  }
+  if (!bytes_budget_.TryReserve(bytes)) {
+    return errors::Unavailable(
+        "The batch scheduling queue to which this task was submitted is full");
+  }
+  if (!scheduler_bytes_budget_->TryReserve(bytes)) {
+    bytes_budget_.Release(bytes);
+    return errors::Unavailable(
+        "The batch scheduler to which this task was submitted is full");
+  }
+  return Status::OK();
+}
+
+template <typename TaskType>
+void Queue<TaskType>::ReleaseBytes(int64 bytes) {
+  bytes_budget_.Release(bytes);
+  scheduler_bytes_budget_->Release(bytes);
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::ScheduleWithoutSplitting(
+    std::unique_ptr<TaskType>* task) {
   if ((*task)->size() > options_.max_batch_size) {
     return errors::InvalidArgument("Task size ", (*task)->size(),
                                    " is larger than maximum batch size ",
                                    options_.max_batch_size);
   }
 
+  if (!enqueue_shards_.empty() && TryScheduleWithoutQueueLock(task)) {
+    return Status::OK();
+  }
+
   bool notify_of_schedulable_batch = false;
   {
     mutex_lock l(mu_);
 
     DCHECK(!closed_);
 
-    if (batches_.back()->size() + (*task)->size() > options_.max_batch_size) {
+    const size_t task_size = (*task)->size();
+    if (adaptive_controller_ != nullptr) {
+      adaptive_controller_->RecordArrival(task_size);
+    }
+    const size_t task_cost = (*task)->cost();
+    if (!ReserveRoomInOpenBatch(task_size, task_cost, MaxBatchSize(),
+                                options_.max_batch_cost)) {
       if (batches_.size() >= options_.max_enqueued_batches) {
         return errors::Unavailable(
             "The batch scheduling queue to which this task was submitted is "
             "full");
       }
       StartNewBatch();
+      ReserveRoomInOpenBatch(task_size, task_cost, MaxBatchSize(),
+                             options_.max_batch_cost);
+    }
+    const bool open_batch_schedulable_time_moved =
+        AddTaskToOpenBatch(std::move(*task));
+
+    if (!schedulable_batch_) {
+      if (batches_.size() > 1 || IsOpenBatchSchedulable()) {
+        schedulable_batch_ = true;
+        notify_of_schedulable_batch = true;
+      } else if (open_batch_schedulable_time_moved) {
+        // Let an idle batch thread know when to wake up.
+        notify_of_schedulable_batch = true;
+      }
+    }
+  }
+
+  if (notify_of_schedulable_batch) {
+    schedulable_batch_callback_();
+  }
+
+  return Status::OK();
+}
+
+template <typename TaskType>
+Status Queue<TaskType>::ScheduleWithSplitting(
+    std::unique_ptr<TaskType>* task) {
+  const size_t task_size = (*task)->size();
+  const size_t max_num_batches =
+      (task_size + options_.max_batch_size - 1) / options_.max_batch_size;
+  if (max_num_batches > options_.max_enqueued_batches) {
+    return errors::InvalidArgument(
+        "Task size ", task_size, " requires ", max_num_batches,
+        " batches, but max_enqueued_batches is ",
+        options_.max_enqueued_batches);
+  }
+
+  bool notify_of_schedulable_batch = false;
+  {
+    mutex_lock l(mu_);
+
+    DCHECK(!closed_);
+
+    if (adaptive_controller_ != nullptr) {
+      adaptive_controller_->RecordArrival(task_size);
+    }
+
+    // Keep the open batch's size fixed while we work out how to fill it.
+    LockEnqueueShards();
+    auto unlock_enqueue_shards =
+        MakeCleanup([this] { UnlockEnqueueShards(); });
+
+    // Fill the open batch (or a new one, if the open batch is full), and then
+    // as many new batches as it takes.
+    size_t first_task_size = options_.max_batch_size - open_batch_size_;
+    int num_new_batches = 0;
+    if (first_task_size == 0) {
+      first_task_size = options_.max_batch_size;
+      ++num_new_batches;
+    }
+    const size_t remaining_task_size = task_size - first_task_size;
+    num_new_batches +=
+        (remaining_task_size + options_.max_batch_size - 1) /
+        options_.max_batch_size;
+    if (batches_.size() + num_new_batches > options_.max_enqueued_batches) {
+      return errors::Unavailable(
+          "The batch scheduling queue to which this task was submitted is "
+          "full");
     }
-    if (batches_.back()->empty()) {
-      open_batch_start_time_micros_ = env_->NowMicros();
+
+    const int64 task_bytes = (*task)->bytes();
+    std::vector<std::unique_ptr<TaskType>> output_tasks;
+    TF_RETURN_IF_ERROR(options_.split_input_task_func(
+        task, first_task_size, options_.max_batch_size, &output_tasks));
+    // The subtasks' bytes are given back as their batches leave the queue, so
+    // account for any difference from the task's (e.g. due to rounding).
+    int64 output_task_bytes = 0;
+    for (const std::unique_ptr<TaskType>& output_task : output_tasks) {
+      output_task_bytes += output_task->bytes();
+    }
+    ReleaseBytes(task_bytes - output_task_bytes);
+    bool open_batch_schedulable_time_moved = false;
+    for (std::unique_ptr<TaskType>& output_task : output_tasks) {
+      if (!ReserveRoomInOpenBatch(output_task->size(), output_task->cost(),
+                                  options_.max_batch_size,
+                                  0 /* max_batch_cost */)) {
+        StartNewBatchWithEnqueueShardsLocked();
+        ReserveRoomInOpenBatch(output_task->size(), output_task->cost(),
+                               options_.max_batch_size, 0 /* max_batch_cost */);
+      }
+      open_batch_schedulable_time_moved =
+          AddTaskToOpenBatch(std::move(output_task));
     }
-    batches_.back()->AddTask(std::move(*task));
 
     if (!schedulable_batch_) {
       if (batches_.size() > 1 || IsOpenBatchSchedulable()) {
         schedulable_batch_ = true;
         notify_of_schedulable_batch = true;
+      } else if (open_batch_schedulable_time_moved) {
+        // Let an idle batch thread know when to wake up.
+        notify_of_schedulable_batch = true;
       }
     }
   }
@@ -558,6 +1574,113 @@ Status Queue<TaskType>::Schedule(std::unique_ptr<TaskType>* task) {
   return Status::OK();
 }
 
+template <typename TaskType>
+bool Queue<TaskType>::TryScheduleWithoutQueueLock(
+    std::unique_ptr<TaskType>* task) {
+  const size_t task_size = (*task)->size();
+  EnqueueShard* shard =
+      enqueue_shards_[std::hash<std::thread::id>()(std::this_thread::get_id()) %
+                      enqueue_shards_.size()]
+          .get();
+  bool deadline_moved = false;
+  {
+    mutex_lock l(shard->mu);
+
+    // Leave a task that starts the open batch, or fills it, to the locked
+    // path, which records when the batch started and announces when it becomes
+    // schedulable.
+    size_t open_batch_size = open_batch_size_.load();
+    do {
+      if (open_batch_size == 0 ||
+          open_batch_size + task_size >= options_.max_batch_size) {
+        return false;
+      }
+    } while (!open_batch_size_.compare_exchange_weak(
+        open_batch_size, open_batch_size + task_size));
+    if (options_.max_batch_cost > 0) {
+      const size_t task_cost = (*task)->cost();
+      size_t open_batch_cost = open_batch_cost_.load();
+      do {
+        if (open_batch_cost + task_cost >= options_.max_batch_cost) {
+          // Give back the room reserved above.
+          open_batch_size_ -= task_size;
+          return false;
+        }
+      } while (!open_batch_cost_.compare_exchange_weak(
+          open_batch_cost, open_batch_cost + task_cost));
+    }
+
+    const uint64 deadline_micros = (*task)->deadline_micros();
+    if (deadline_micros != 0) {
+      deadline_moved = LowerOpenBatchEarliestDeadline(deadline_micros);
+    }
+    open_batch_enqueue_micros_sum_ += env_->NowMicros() - creation_time_micros_;
+    shard->tasks.emplace_back(next_task_sequence_number_++, std::move(*task));
+  }
+
+  if (deadline_moved) {
+    // The open batch may become schedulable sooner.
+    schedulable_batch_callback_();
+  }
+  return true;
+}
+
+template <typename TaskType>
+void Queue<TaskType>::LockEnqueueShards() {
+  for (const auto& shard : enqueue_shards_) {
+    shard->mu.lock();
+  }
+}
+
+template <typename TaskType>
+void Queue<TaskType>::UnlockEnqueueShards() {
+  for (auto it = enqueue_shards_.rbegin(); it != enqueue_shards_.rend(); ++it) {
+    (*it)->mu.unlock();
+  }
+}
+
+template <typename TaskType>
+bool Queue<TaskType>::ReserveRoomInOpenBatch(size_t task_size,
+                                             size_t task_cost,
+                                             size_t max_batch_size,
+                                             size_t max_batch_cost) {
+  size_t open_batch_size = open_batch_size_.load();
+  do {
+    if (open_batch_size != 0 && open_batch_size + task_size > max_batch_size) {
+      return false;
+    }
+  } while (!open_batch_size_.compare_exchange_weak(
+      open_batch_size, open_batch_size + task_size));
+  if (options_.max_batch_cost == 0) {
+    return true;
+  }
+
+  size_t open_batch_cost = open_batch_cost_.load();
+  do {
+    if (open_batch_size != 0 && max_batch_cost > 0 &&
+        open_batch_cost + task_cost > max_batch_cost) {
+      // Give back the room reserved above.
+      open_batch_size_ -= task_size;
+      return false;
+    }
+  } while (!open_batch_cost_.compare_exchange_weak(
+      open_batch_cost, open_batch_cost + task_cost));
+  return true;
+}
+
+template <typename TaskType>
+bool Queue<TaskType>::LowerOpenBatchEarliestDeadline(uint64 deadline_micros) {
+  uint64 earliest_deadline_micros = open_batch_earliest_deadline_micros_.load();
+  while (earliest_deadline_micros == 0 ||
+         deadline_micros < earliest_deadline_micros) {
+    if (open_batch_earliest_deadline_micros_.compare_exchange_weak(
+            earliest_deadline_micros, deadline_micros)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 template <typename TaskType>
 size_t Queue<TaskType>::NumEnqueuedTasks() const {
   mutex_lock l(mu_);
@@ -565,18 +1688,38 @@ size_t Queue<TaskType>::NumEnqueuedTasks() const {
   for (const auto& batch : batches_) {
     num_enqueued_tasks += batch->num_tasks();
   }
+  for (const auto& shard : enqueue_shards_) {
+    mutex_lock shard_lock(shard->mu);
+    num_enqueued_tasks += shard->tasks.size();
+  }
   return num_enqueued_tasks;
 }
 
 template <typename TaskType>
 size_t Queue<TaskType>::SchedulingCapacity() const {
   mutex_lock l(mu_);
+  const int max_batch_size = MaxBatchSize();
   const int num_new_batches_schedulable =
       options_.max_enqueued_batches - batches_.size();
   const int open_batch_capacity =
-      options_.max_batch_size - batches_.back()->size();
-  return (num_new_batches_schedulable * options_.max_batch_size) +
-         open_batch_capacity;
+      std::max(max_batch_size - static_cast<int>(open_batch_size_.load()), 0);
+  size_t capacity =
+      (num_new_batches_schedulable * max_batch_size) + open_batch_capacity;
+
+  // Convert the room left in the byte budgets to task size, at the average
+  // bytes per unit of size seen so far.
+  const int64 available_bytes =
+      std::min(bytes_budget_.available_bytes(),
+               scheduler_bytes_budget_->available_bytes());
+  const int64 total_task_bytes = total_task_bytes_;
+  if (available_bytes != kint64max && total_task_bytes > 0) {
+    const double bytes_capacity = static_cast<double>(available_bytes) *
+                                  total_task_size_ / total_task_bytes;
+    if (bytes_capacity < capacity) {
+      capacity = bytes_capacity;
+    }
+  }
+  return capacity;
 }
 
 template <typename TaskType>
@@ -584,10 +1727,19 @@ std::unique_ptr<Batch<TaskType>> Queue<TaskType>::ScheduleBatch() {
   // The batch to schedule, which we may populate below. (If left as nullptr,
   // that means we are electing not to schedule a batch at this time.)
   std::unique_ptr<Batch<TaskType>> batch_to_schedule;
+  uint64 batch_start_time_micros;
+  uint64 batch_enqueue_micros_sum;
 
   {
     mutex_lock l(mu_);
 
+    if (options_.max_in_flight_batches > 0 &&
+        num_batches_being_processed_ >= options_.max_in_flight_batches) {
+      // (Leave 'schedulable_batch_' as-is. ProcessBatch() re-announces any
+      // schedulable batch once a batch finishes.)
+      return nullptr;
+    }
+
     // Consider closing the open batch at this time, to schedule it.
     if (batches_.size() == 1 && IsOpenBatchSchedulable()) {
       StartNewBatch();
@@ -598,24 +1750,100 @@ std::unique_ptr<Batch<TaskType>> Queue<TaskType>::ScheduleBatch() {
       ++num_batches_being_processed_;
       batch_to_schedule = std::move(batches_.front());
       batches_.pop_front();
+      batch_start_time_micros = closed_batch_start_times_micros_.front();
+      closed_batch_start_times_micros_.pop_front();
+      batch_enqueue_micros_sum = closed_batch_enqueue_micros_sums_.front();
+      closed_batch_enqueue_micros_sums_.pop_front();
+      if (options_.codel_target_delay_micros > 0) {
+        const uint64 now_micros = env_->NowMicros();
+        RecordClosedBatchDelay(
+            now_micros, now_micros - closed_batch_close_times_micros_.front());
+        closed_batch_close_times_micros_.pop_front();
+      }
     } else {
       schedulable_batch_ = false;
     }
   }
 
+  if (batch_to_schedule != nullptr) {
+    // The batch's tasks no longer count as enqueued.
+    int64 batch_bytes = 0;
+    for (int i = 0; i < batch_to_schedule->num_tasks(); ++i) {
+      batch_bytes += batch_to_schedule->task(i).bytes();
+    }
+    ReleaseBytes(batch_bytes);
+  }
+
+  if (batch_to_schedule != nullptr) {
+    // The batch's first task waited the longest; the mean follows from the sum
+    // of the tasks' enqueue times.
+    const uint64 now_micros = env_->NowMicros();
+    const uint64 mean_enqueue_time_micros =
+        creation_time_micros_ +
+        batch_enqueue_micros_sum / batch_to_schedule->num_tasks();
+    metrics_.RecordBatch(batch_to_schedule->size(),
+                         now_micros - batch_start_time_micros,
+                         now_micros - mean_enqueue_time_micros);
+  }
   return batch_to_schedule;
 }
 
 template <typename TaskType>
 void Queue<TaskType>::ProcessBatch(std::unique_ptr<Batch<TaskType>> batch) {
+  // The batch has left the queue, making room for a waiting caller, if any,
+  // of this queue or (if its bytes count against the scheduler-wide budget)
+  // another one.
+  NotifyFrontWaiter();
+  scheduler_bytes_budget_->NotifyReleased();
+
+  const int batch_size = batch->size();
+  const uint64 start_time_micros = env_->NowMicros();
   process_batch_callback_(std::move(batch));
+  const int64 processing_micros = env_->NowMicros() - start_time_micros;
 
+  bool notify_of_schedulable_batch;
+  bool adaptive_choices_changed = false;
+  int adaptive_max_batch_size;
+  int64 adaptive_batch_timeout_micros;
   {
     mutex_lock l(mu_);
+    // Weight the latest sample by 1/8.
+    constexpr int64 kSmoothingFactor = 8;
+    if (estimated_batch_processing_micros_ == 0) {
+      estimated_batch_processing_micros_ = processing_micros;
+    } else {
+      estimated_batch_processing_micros_ +=
+          (processing_micros - estimated_batch_processing_micros_) /
+          kSmoothingFactor;
+    }
+    if (adaptive_controller_ != nullptr &&
+        adaptive_controller_->RecordBatch(batch_size, processing_micros)) {
+      adaptive_choices_changed = true;
+      adaptive_max_batch_size = adaptive_controller_->max_batch_size();
+      adaptive_batch_timeout_micros =
+          adaptive_controller_->batch_timeout_micros();
+      VLOG(1) << "Adaptive batching chose max_batch_size "
+              << adaptive_max_batch_size << " and batch_timeout_micros "
+              << adaptive_batch_timeout_micros << " for an arrival rate of "
+              << adaptive_controller_->arrival_rate_per_second() << "/s";
+    }
     --num_batches_being_processed_;
     if (empty_notification_ != nullptr && IsEmptyInternal()) {
       empty_notification_->Notify();
     }
+    // A batch may have been held back by the in-flight limit, or the adaptive
+    // choices may have changed when the open batch becomes schedulable.
+    notify_of_schedulable_batch =
+        (options_.max_in_flight_batches > 0 && schedulable_batch_) ||
+        adaptive_choices_changed;
+  }
+
+  if (notify_of_schedulable_batch) {
+    schedulable_batch_callback_();
+  }
+  if (adaptive_choices_changed && options_.adaptive_batching_callback) {
+    options_.adaptive_batching_callback(adaptive_max_batch_size,
+                                        adaptive_batch_timeout_micros);
   }
 }
 
@@ -638,9 +1866,37 @@ void Queue<TaskType>::CloseAndWaitUntilEmpty() {
       empty_notification_ = &empty;
     }
   }
+  // Closing makes the open batch schedulable (or, if the queue is empty, lets
+  // the batch threads drop the queue).
+  schedulable_batch_callback_();
   empty.WaitForNotification();
 }
 
+template <typename TaskType>
+uint64 Queue<TaskType>::OpenBatchSchedulableTimeMicros() const {
+  mutex_lock l(mu_);
+  if (batches_.back()->empty() ||
+      (options_.max_in_flight_batches > 0 &&
+       num_batches_being_processed_ >= options_.max_in_flight_batches)) {
+    return 0;
+  }
+  if (closed_ || IsOpenBatchFull()) {
+    return open_batch_start_time_micros_;
+  }
+  uint64 schedulable_time_micros =
+      open_batch_start_time_micros_ + OpenBatchTimeoutMicros();
+  const uint64 earliest_deadline_micros = open_batch_earliest_deadline_micros_;
+  if (earliest_deadline_micros != 0) {
+    const uint64 deadline_schedulable_time_micros =
+        earliest_deadline_micros -
+        std::min<uint64>(estimated_batch_processing_micros_,
+                         earliest_deadline_micros);
+    schedulable_time_micros =
+        std::min(schedulable_time_micros, deadline_schedulable_time_micros);
+  }
+  return std::max<uint64>(schedulable_time_micros, 1);
+}
+
 template <typename TaskType>
 bool Queue<TaskType>::IsEmptyInternal() const {
   return num_batches_being_processed_ == 0 && batches_.size() == 1 &&
@@ -649,8 +1905,72 @@ bool Queue<TaskType>::IsEmptyInternal() const {
 
 template <typename TaskType>
 void Queue<TaskType>::StartNewBatch() {
-  batches_.back()->Close();
+  LockEnqueueShards();
+  StartNewBatchWithEnqueueShardsLocked();
+  UnlockEnqueueShards();
+}
+
+template <typename TaskType>
+void Queue<TaskType>::StartNewBatchWithEnqueueShardsLocked() {
+  Batch<TaskType>* open_batch = batches_.back().get();
+  std::vector<std::pair<uint64, std::unique_ptr<TaskType>>> tasks;
+  for (const auto& shard : enqueue_shards_) {
+    for (auto& task : shard->tasks) {
+      tasks.push_back(std::move(task));
+    }
+    shard->tasks.clear();
+  }
+  if (!tasks.empty()) {
+    // Put the staged tasks and those added to the batch itself back in the
+    // order in which they were scheduled.
+    for (auto it = open_batch_task_sequence_numbers_.rbegin();
+         it != open_batch_task_sequence_numbers_.rend(); ++it) {
+      tasks.emplace_back(*it, open_batch->RemoveTask());
+    }
+    std::sort(tasks.begin(), tasks.end(),
+              [](const std::pair<uint64, std::unique_ptr<TaskType>>& a,
+                 const std::pair<uint64, std::unique_ptr<TaskType>>& b) {
+                return a.first < b.first;
+              });
+    for (auto& task : tasks) {
+      open_batch->AddTask(std::move(task.second));
+    }
+  }
+  open_batch_task_sequence_numbers_.clear();
+  open_batch->Close();
+  closed_batch_start_times_micros_.push_back(open_batch_start_time_micros_);
+  closed_batch_enqueue_micros_sums_.push_back(open_batch_enqueue_micros_sum_);
+  if (options_.codel_target_delay_micros > 0) {
+    closed_batch_close_times_micros_.push_back(env_->NowMicros());
+  }
   batches_.emplace_back(new Batch<TaskType>);
+  open_batch_size_ = 0;
+  open_batch_cost_ = 0;
+  open_batch_earliest_deadline_micros_ = 0;
+  open_batch_enqueue_micros_sum_ = 0;
+}
+
+template <typename TaskType>
+bool Queue<TaskType>::AddTaskToOpenBatch(std::unique_ptr<TaskType> task) {
+  bool schedulable_time_moved = false;
+  const uint64 now_micros = env_->NowMicros();
+  open_batch_enqueue_micros_sum_ += now_micros - creation_time_micros_;
+  if (batches_.back()->empty()) {
+    open_batch_start_time_micros_ = now_micros;
+    open_batch_started_idle_ = options_.idle_batch_timeout_micros >= 0 &&
+                               batches_.size() == 1 &&
+                               idle_batch_thread_callback_();
+    schedulable_time_moved = true;
+  }
+  const uint64 deadline_micros = task->deadline_micros();
+  if (deadline_micros != 0 && LowerOpenBatchEarliestDeadline(deadline_micros)) {
+    schedulable_time_moved = true;
+  }
+  if (!enqueue_shards_.empty()) {
+    open_batch_task_sequence_numbers_.push_back(next_task_sequence_number_++);
+  }
+  batches_.back()->AddTask(std::move(task));
+  return schedulable_time_moved;
 }
 
 template <typename TaskType>
@@ -659,9 +1979,45 @@ bool Queue<TaskType>::IsOpenBatchSchedulable() const {
   if (open_batch->empty()) {
     return false;
   }
-  return closed_ || open_batch->size() >= options_.max_batch_size ||
-         env_->NowMicros() >=
-             open_batch_start_time_micros_ + options_.batch_timeout_micros;
+  const uint64 now_micros = env_->NowMicros();
+  const uint64 earliest_deadline_micros = open_batch_earliest_deadline_micros_;
+  if (earliest_deadline_micros != 0 &&
+      now_micros + estimated_batch_processing_micros_ >=
+          earliest_deadline_micros) {
+    return true;
+  }
+  return closed_ || IsOpenBatchFull() ||
+         now_micros >= open_batch_start_time_micros_ + OpenBatchTimeoutMicros();
+}
+
+template <typename TaskType>
+bool Queue<TaskType>::IsOpenBatchFull() const {
+  return open_batch_size_ >= MaxBatchSize() ||
+         (options_.max_batch_cost > 0 &&
+          open_batch_cost_ >= options_.max_batch_cost);
+}
+
+template <typename TaskType>
+int Queue<TaskType>::MaxBatchSize() const {
+  return adaptive_controller_ == nullptr
+             ? options_.max_batch_size
+             : adaptive_controller_->max_batch_size();
+}
+
+template <typename TaskType>
+int64 Queue<TaskType>::BatchTimeoutMicros() const {
+  return adaptive_controller_ == nullptr
+             ? options_.batch_timeout_micros
+             : adaptive_controller_->batch_timeout_micros();
+}
+
+template <typename TaskType>
+int64 Queue<TaskType>::OpenBatchTimeoutMicros() const {
+  const int64 batch_timeout_micros = BatchTimeoutMicros();
+  if (!open_batch_started_idle_) {
+    return batch_timeout_micros;
+  }
+  return std::min(batch_timeout_micros, options_.idle_batch_timeout_micros);
 }
 
 template <typename TaskType>
@@ -680,6 +2036,12 @@ Status QueueHandle<TaskType>::Schedule(std::unique_ptr<TaskType>* task) {
   return queue_->Schedule(task);
 }
 
+template <typename TaskType>
+Status QueueHandle<TaskType>::ScheduleWithTimeout(
+    std::unique_ptr<TaskType>* task, int64 timeout_micros) {
+  return queue_->ScheduleWithTimeout(task, timeout_micros);
+}
+
 template <typename TaskType>
 size_t QueueHandle<TaskType>::NumEnqueuedTasks() const {
   return queue_->NumEnqueuedTasks();
@@ -0,0 +1,120 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for the throughput of SharedBatchScheduler when many threads
+// submit tasks to a single queue concurrently, with and without enqueue shards
+// (see QueueOptions::num_enqueue_shards).
+//
+// Run with:
+// bazel run -c opt --dynamic_mode=off \
+// tensorflow_serving/batching:shared_batch_scheduler_benchmark --
+// --benchmarks=.
+
+#include <memory>
+#include <vector>
+
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/init_main.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/test.h"
+#include "tensorflow/core/platform/test_benchmark.h"
+#include "tensorflow_serving/batching/shared_batch_scheduler.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+class BenchmarkBatchTask : public BatchTask {
+ public:
+  BenchmarkBatchTask() = default;
+
+  BenchmarkBatchTask(const BenchmarkBatchTask&) = delete;
+  BenchmarkBatchTask& operator=(const BenchmarkBatchTask&) = delete;
+
+  ~BenchmarkBatchTask() override = default;
+
+  size_t size() const override { return 1; }
+};
+
+// Has 'num_producers' threads submit tasks to one queue as fast as they can,
+// and measures the time until all the tasks have been processed.
+static void BM_MultiProducerThroughput(int iters, int num_producers,
+                                       int num_enqueue_shards) {
+  testing::StopTiming();
+
+  SharedBatchScheduler<BenchmarkBatchTask>::Options options;
+  options.num_batch_threads = 4;
+  std::shared_ptr<SharedBatchScheduler<BenchmarkBatchTask>> scheduler;
+  TF_CHECK_OK(
+      SharedBatchScheduler<BenchmarkBatchTask>::Create(options, &scheduler));
+  SharedBatchScheduler<BenchmarkBatchTask>::QueueOptions queue_options;
+  queue_options.max_batch_size = 100;
+  queue_options.batch_timeout_micros = 1000;
+  queue_options.max_enqueued_batches = INT_MAX;  // Unbounded queue.
+  queue_options.num_enqueue_shards = num_enqueue_shards;
+  std::unique_ptr<BatchScheduler<BenchmarkBatchTask>> queue;
+  TF_CHECK_OK(scheduler->AddQueue(
+      queue_options,
+      [](std::unique_ptr<Batch<BenchmarkBatchTask>> batch) {
+        // No-op.
+      },
+      &queue));
+
+  // Have each iteration issue a reasonably large number of tasks, to ensure our
+  // measurements reflect steady-state behavior.
+  const int kNumTasksPerIteration = 100 * 1000;
+  const int64 num_tasks_per_producer =
+      static_cast<int64>(iters) * kNumTasksPerIteration / num_producers;
+
+  testing::ItemsProcessed(num_tasks_per_producer * num_producers);
+  testing::UseRealTime();
+  testing::StartTiming();
+
+  {
+    std::vector<std::unique_ptr<Thread>> producers;
+    for (int i = 0; i < num_producers; ++i) {
+      producers.emplace_back(Env::Default()->StartThread(
+          {}, "Producer", [&queue, num_tasks_per_producer] {
+            for (int64 j = 0; j < num_tasks_per_producer; ++j) {
+              auto task =
+                  std::unique_ptr<BenchmarkBatchTask>(new BenchmarkBatchTask);
+              TF_CHECK_OK(queue->Schedule(&task));
+            }
+          }));
+    }
+    // Wait for the producers to finish.
+  }
+
+  // Wait for the scheduler to process all tasks.
+  queue.reset();
+  testing::StopTiming();
+}
+BENCHMARK(BM_MultiProducerThroughput)
+    ->ArgPair(1, 0)
+    ->ArgPair(8, 0)
+    ->ArgPair(8, 8)
+    ->ArgPair(32, 0)
+    ->ArgPair(32, 8)
+    ->ArgPair(32, 32);
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
+
+int main(int argc, char** argv) {
+  tensorflow::port::InitMain(argv[0], &argc, &argv);
+  tensorflow::testing::RunBenchmarks();
+  return 0;
+}
@@ -15,11 +15,14 @@ limitations under the License.
 
 #include "tensorflow_serving/batching/shared_batch_scheduler.h"
 
+#include <algorithm>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/notification.h"
 #include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow/core/lib/monitoring/collection_registry.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow_serving/test_util/fake_clock_env.h"
 
@@ -33,28 +36,80 @@ namespace {
 
 class FakeTask : public BatchTask {
  public:
-  explicit FakeTask(size_t size) : size_(size) {}
+  explicit FakeTask(size_t size, uint64 deadline_micros = 0)
+      : size_(size), deadline_micros_(deadline_micros) {}
 
   ~FakeTask() override = default;
 
   size_t size() const override { return size_; }
 
+  uint64 deadline_micros() const override { return deadline_micros_; }
+
  private:
   const size_t size_;
+  const uint64 deadline_micros_;
 
   TF_DISALLOW_COPY_AND_ASSIGN(FakeTask);
 };
 
-// Creates a FakeTask of size 'task_size', and calls 'scheduler->Schedule()' on
-// that task. Returns the resulting status.
-Status ScheduleTask(size_t task_size, BatchScheduler<FakeTask>* scheduler) {
-  std::unique_ptr<FakeTask> task(new FakeTask(task_size));
+// A FakeTask whose cost differs from its size.
+class FakeTaskWithCost : public FakeTask {
+ public:
+  FakeTaskWithCost(size_t size, size_t cost) : FakeTask(size), cost_(cost) {}
+
+  ~FakeTaskWithCost() override = default;
+
+  size_t cost() const override { return cost_; }
+
+ private:
+  const size_t cost_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(FakeTaskWithCost);
+};
+
+// A FakeTask that holds some bytes (see BatchTask::bytes()).
+class FakeTaskWithBytes : public FakeTask {
+ public:
+  FakeTaskWithBytes(size_t size, size_t bytes)
+      : FakeTask(size), bytes_(bytes) {}
+
+  ~FakeTaskWithBytes() override = default;
+
+  size_t bytes() const override { return bytes_; }
+
+ private:
+  const size_t bytes_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(FakeTaskWithBytes);
+};
+
+// Creates a FakeTask of size 'task_size' (and deadline 'deadline_micros'), and
+// calls 'scheduler->Schedule()' on that task. Returns the resulting status.
+Status ScheduleTask(size_t task_size, BatchScheduler<FakeTask>* scheduler,
+                    uint64 deadline_micros = 0) {
+  std::unique_ptr<FakeTask> task(new FakeTask(task_size, deadline_micros));
   Status status = scheduler->Schedule(&task);
   // Schedule() should have consumed 'task' iff it returned Status::OK.
   CHECK_EQ(status.ok(), task == nullptr);
   return status;
 }
 
+// A 'split_input_task_func' for FakeTasks.
+Status SplitFakeTask(std::unique_ptr<FakeTask>* input_task,
+                     int first_output_task_size, int max_batch_size,
+                     std::vector<std::unique_ptr<FakeTask>>* output_tasks) {
+  size_t remaining_size = (*input_task)->size();
+  size_t output_task_size = first_output_task_size;
+  while (remaining_size > 0) {
+    const size_t size = std::min(output_task_size, remaining_size);
+    output_tasks->emplace_back(new FakeTask(size));
+    remaining_size -= size;
+    output_task_size = max_batch_size;
+  }
+  input_task->reset();
+  return Status::OK();
+}
+
 // Creates a thread that waits on 'start' and then advances the fake clock in
 // 'env' in a loop until 'stop' is notified. Useful for allowing objects that
 // use the clock to be destroyed.
@@ -71,6 +126,26 @@ std::unique_ptr<Thread> CreateFakeClockAdvancerThread(
                                   }));
 }
 
+// Wakes the batch threads of 'scheduler' each time the fake clock in 'env'
+// advances, for as long as it lives, since they wait for open batches to
+// become schedulable in real time. Must be destroyed before 'scheduler'.
+class ClockAdvanceNotifier {
+ public:
+  ClockAdvanceNotifier(test_util::FakeClockEnv* env,
+                       SharedBatchScheduler<FakeTask>* scheduler)
+      : env_(env),
+        listener_id_(env->AddAdvanceListener(
+            [scheduler] { scheduler->NotifyClockAdvanced(); })) {}
+
+  ~ClockAdvanceNotifier() { env_->RemoveAdvanceListener(listener_id_); }
+
+ private:
+  test_util::FakeClockEnv* const env_;
+  const int listener_id_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(ClockAdvanceNotifier);
+};
+
 TEST(SharedBatchSchedulerTest, Basic) {
   for (int num_batch_threads : {1, 2, 3}) {
     for (const bool delete_scheduler_early : {false, true}) {
@@ -184,6 +259,125 @@ TEST(SharedBatchSchedulerTest, ObeyBatchSizeConstraint) {
               UnorderedElementsAre(ElementsAre(3, 5), ElementsAre(3, 1, 6)));
 }
 
+TEST(SharedBatchSchedulerTest, ObeyBatchCostConstraint) {
+  // Set up a callback that captures the batches' task costs.
+  mutex mu;
+  std::vector<std::vector<size_t>> callback_data;
+  auto callback = [&mu,
+                   &callback_data](std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    std::vector<size_t> batch_data;
+    for (int i = 0; i < batch->num_tasks(); ++i) {
+      batch_data.push_back(batch->mutable_task(i)->cost());
+    }
+    {
+      mutex_lock l(mu);
+      callback_data.push_back(batch_data);
+    }
+  };
+
+  // Run a batch scheduler and inject some tasks.
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 2;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 10;
+    queue_options.max_batch_cost = 10;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 3;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+    auto schedule_task = [&queue](size_t size, size_t cost) {
+      std::unique_ptr<FakeTask> task(new FakeTaskWithCost(size, cost));
+      return queue->Schedule(&task);
+    };
+
+    // First batch.
+    TF_ASSERT_OK(schedule_task(1, 4));
+    TF_ASSERT_OK(schedule_task(1, 4));
+
+    // Second batch (due to cost overage, although the size is within limits).
+    TF_ASSERT_OK(schedule_task(1, 4 /* (4+4) + 4 > 10 */));
+
+    // Third batch, of its own (its cost exceeds the limit by itself).
+    TF_ASSERT_OK(schedule_task(1, 20));
+
+    // (The third batch is full, and gets processed.)
+  }
+
+  // Expect a certain grouping of the tasks into batches.
+  EXPECT_THAT(callback_data,
+              UnorderedElementsAre(ElementsAre(4, 4), ElementsAre(4),
+                                   ElementsAre(20)));
+}
+
+TEST(SharedBatchSchedulerTest, LargeBatchSplitting) {
+  // Set up a callback that captures the batches' task sizes. The first batch's
+  // callback blocks until 'proceed' is notified, tying up the sole batch thread
+  // so that the queue's contents are deterministic.
+  mutex mu;
+  std::vector<std::vector<size_t>> callback_data;
+  Notification first_callback_started, proceed;
+  auto callback = [&mu, &callback_data, &first_callback_started,
+                   &proceed](std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    std::vector<size_t> batch_data;
+    for (int i = 0; i < batch->num_tasks(); ++i) {
+      batch_data.push_back(batch->mutable_task(i)->size());
+    }
+    {
+      mutex_lock l(mu);
+      callback_data.push_back(batch_data);
+    }
+    if (!first_callback_started.HasBeenNotified()) {
+      first_callback_started.Notify();
+      proceed.WaitForNotification();
+    }
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 4;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 3;
+    queue_options.enable_large_batch_splitting = true;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    EXPECT_FALSE(scheduler->AddQueue(queue_options, callback, &queue).ok());
+    queue_options.split_input_task_func = SplitFakeTask;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Occupy the batch thread.
+    TF_ASSERT_OK(ScheduleTask(4, queue.get()));
+    first_callback_started.WaitForNotification();
+
+    // The second task fills the rest of the open batch, all of the next batch
+    // and part of the one after that.
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(9, queue.get()));
+    EXPECT_EQ(4, queue->NumEnqueuedTasks());
+
+    // A task that needs a fourth batch doesn't fit right now, and one that
+    // needs more than 'max_enqueued_batches' batches never will.
+    EXPECT_EQ(error::UNAVAILABLE, ScheduleTask(5, queue.get()).code());
+    EXPECT_EQ(error::INVALID_ARGUMENT, ScheduleTask(13, queue.get()).code());
+
+    // Tasks that fit in one batch are not split.
+    TF_ASSERT_OK(ScheduleTask(2, queue.get()));
+
+    proceed.Notify();
+  }
+
+  EXPECT_THAT(callback_data,
+              ElementsAre(ElementsAre(4), ElementsAre(1, 3), ElementsAre(4),
+                          ElementsAre(2, 2)));
+}
+
 TEST(SharedBatchSchedulerTest, ObeysTimeout) {
   // Set up a fake clock, which only advances when we explicitly tell it to.
   test_util::FakeClockEnv env(Env::Default());
@@ -214,6 +408,7 @@ TEST(SharedBatchSchedulerTest, ObeysTimeout) {
     options.env = &env;
     std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
     TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
     SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
     queue_options.max_batch_size = 4;
     queue_options.batch_timeout_micros = 10;
@@ -252,6 +447,179 @@ TEST(SharedBatchSchedulerTest, ObeysTimeout) {
   stop_teardown.Notify();
 }
 
+TEST(SharedBatchSchedulerTest, IdleBatchTimeout) {
+  // Set up a fake clock, which only advances when we explicitly tell it to.
+  test_util::FakeClockEnv env(Env::Default());
+
+  Notification first_batch_started, finish_first_batch, second_batch_processed;
+  auto callback = [&](std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    if (batch->size() == 1) {
+      first_batch_started.Notify();
+      finish_first_batch.WaitForNotification();
+    } else if (batch->size() == 2) {
+      second_batch_processed.Notify();
+    } else {
+      EXPECT_TRUE(false) << "Unexpected batch size";
+    }
+  };
+
+  SharedBatchScheduler<FakeTask>::Options options;
+  options.num_batch_threads = 1;
+  options.env = &env;
+  std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+  TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+  ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
+  SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+  queue_options.max_batch_size = 10;
+  queue_options.batch_timeout_micros = 1000;
+  queue_options.idle_batch_timeout_micros = 0;
+  queue_options.max_enqueued_batches = 2;
+  std::unique_ptr<BatchScheduler<FakeTask>> queue;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+  // Let the batch thread go idle. A task that arrives then is processed right
+  // away, without the clock advancing.
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+  first_batch_started.WaitForNotification();
+
+  // While the batch thread is busy, a task waits out the full timeout.
+  TF_ASSERT_OK(ScheduleTask(2, queue.get()));
+  finish_first_batch.Notify();
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  EXPECT_FALSE(second_batch_processed.HasBeenNotified());
+  env.AdvanceByMicroseconds(1000);
+  second_batch_processed.WaitForNotification();
+}
+
+TEST(SharedBatchSchedulerTest, ObeysDeadlines) {
+  // Set up a fake clock, which only advances when we explicitly tell it to.
+  test_util::FakeClockEnv env(Env::Default());
+  Notification start_teardown, stop_teardown;
+  std::unique_ptr<Thread> teardown_thread =
+      CreateFakeClockAdvancerThread(&env, &start_teardown, &stop_teardown);
+
+  {
+    Notification first_batch_processed, second_batch_processed;
+    auto callback = [&env, &first_batch_processed, &second_batch_processed](
+        std::unique_ptr<Batch<FakeTask>> batch) {
+      ASSERT_TRUE(batch->IsClosed());
+      if (batch->size() == 1) {
+        // Make processing take 20 microseconds.
+        env.AdvanceByMicroseconds(20);
+        first_batch_processed.Notify();
+      } else if (batch->size() == 2) {
+        second_batch_processed.Notify();
+      } else {
+        EXPECT_TRUE(false) << "Unexpected batch size";
+      }
+    };
+
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    options.env = &env;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 4;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 2;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // With no estimate of the processing time yet, an underfull batch gets
+    // processed when the clock hits its task's deadline.
+    TF_ASSERT_OK(ScheduleTask(1, queue.get(), env.NowMicros() + 100));
+    env.AdvanceByMicroseconds(99);
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    EXPECT_FALSE(first_batch_processed.HasBeenNotified());
+    env.AdvanceByMicroseconds(1);
+    first_batch_processed.WaitForNotification();
+
+    // Now the batch gets processed 20 microseconds ahead of the earliest
+    // deadline among its tasks.
+    TF_ASSERT_OK(ScheduleTask(1, queue.get(), env.NowMicros() + 200));
+    TF_ASSERT_OK(ScheduleTask(1, queue.get(), env.NowMicros() + 100));
+    env.AdvanceByMicroseconds(79);
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    EXPECT_FALSE(second_batch_processed.HasBeenNotified());
+    env.AdvanceByMicroseconds(1);
+    second_batch_processed.WaitForNotification();
+
+    start_teardown.Notify();
+  }
+  stop_teardown.Notify();
+}
+
+TEST(SharedBatchSchedulerTest, AdaptiveBatching) {
+  // Set up a fake clock, which only advances when we explicitly tell it to.
+  test_util::FakeClockEnv env(Env::Default());
+  Notification start_teardown, stop_teardown;
+  std::unique_ptr<Thread> teardown_thread =
+      CreateFakeClockAdvancerThread(&env, &start_teardown, &stop_teardown);
+
+  {
+    mutex mu;
+    std::vector<int> batch_sizes;
+    auto callback = [&env, &mu,
+                     &batch_sizes](std::unique_ptr<Batch<FakeTask>> batch) {
+      ASSERT_TRUE(batch->IsClosed());
+      if (batch->size() == 8) {
+        // Make processing take 2 milliseconds.
+        env.AdvanceByMicroseconds(2 * 1000);
+      }
+      mutex_lock l(mu);
+      batch_sizes.push_back(batch->size());
+    };
+    Notification adaptive_choices_made;
+    int adaptive_max_batch_size = 0;
+    int64 adaptive_batch_timeout_micros = -1;
+
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    options.env = &env;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 8;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 4;
+    queue_options.adaptive_target_latency_micros = 1000;
+    queue_options.adaptive_batching_callback =
+        [&](int max_batch_size, int64 batch_timeout_micros) {
+          adaptive_max_batch_size = max_batch_size;
+          adaptive_batch_timeout_micros = batch_timeout_micros;
+          adaptive_choices_made.Notify();
+        };
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Initially the configured maximum batch size and timeout apply. Once the
+    // adjustment interval has passed, the first batch's processing time is
+    // found to exceed the latency target by itself, so the controller falls
+    // back to the lower bounds.
+    env.AdvanceByMicroseconds(1000 * 1000);
+    for (int i = 0; i < 8; ++i) {
+      TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    }
+    adaptive_choices_made.WaitForNotification();
+    EXPECT_EQ(1, adaptive_max_batch_size);
+    EXPECT_EQ(0, adaptive_batch_timeout_micros);
+
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    queue.reset();
+    mutex_lock l(mu);
+    EXPECT_EQ((std::vector<int>{8, 1, 1}), batch_sizes);
+
+    start_teardown.Notify();
+  }
+  stop_teardown.Notify();
+}
+
 TEST(SharedBatchSchedulerTest, ObeysTimeoutWithRealClock) {
   Notification first_batch_processed, second_batch_processed;
   auto callback = [&first_batch_processed, &second_batch_processed](
@@ -314,6 +682,7 @@ TEST(SharedBatchSchedulerTest,
     options.env = &env;
     std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
     TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
     SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
     // Set a large batch size, so that we don't hit the batch size limit.
     queue_options.max_batch_size = 100;
@@ -368,6 +737,7 @@ TEST(SharedBatchSchedulerTest, Fairness) {
     options.env = &env;
     std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
     TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
     SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
     queue_options.max_batch_size = 10;
     queue_options.batch_timeout_micros = 1;
@@ -405,6 +775,592 @@ TEST(SharedBatchSchedulerTest, Fairness) {
   stop_teardown.Notify();
 }
 
+TEST(SharedBatchSchedulerTest, WeightedFairness) {
+  // Record the order in which the two queues' batches get processed. The first
+  // batch blocks the sole batch thread until 'proceed' is notified, so that
+  // both queues can be loaded up in the meantime.
+  mutex mu;
+  std::vector<int> processed_queues;
+  Notification first_batch_started, proceed;
+  auto make_callback = [&mu, &processed_queues, &first_batch_started,
+                        &proceed](int queue_index) {
+    return [&mu, &processed_queues, &first_batch_started, &proceed,
+            queue_index](std::unique_ptr<Batch<FakeTask>> batch) {
+      {
+        mutex_lock l(mu);
+        processed_queues.push_back(queue_index);
+      }
+      if (!first_batch_started.HasBeenNotified()) {
+        first_batch_started.Notify();
+        proceed.WaitForNotification();
+      }
+    };
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 10;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 100 /* give plenty of room */;
+    std::vector<std::unique_ptr<BatchScheduler<FakeTask>>> queues(2);
+    queue_options.weight = 0;
+    EXPECT_FALSE(
+        scheduler->AddQueue(queue_options, make_callback(0), &queues[0]).ok());
+    queue_options.weight = 1;
+    TF_ASSERT_OK(
+        scheduler->AddQueue(queue_options, make_callback(0), &queues[0]));
+    queue_options.weight = 2;
+    TF_ASSERT_OK(
+        scheduler->AddQueue(queue_options, make_callback(1), &queues[1]));
+
+    // Occupy the batch thread with a batch from queue 0, which ends queue 0's
+    // turn.
+    TF_ASSERT_OK(ScheduleTask(10, queues[0].get()));
+    first_batch_started.WaitForNotification();
+
+    // Enqueue three batch-filling tasks to queue 0, and four to queue 1.
+    for (int i = 0; i < 3; ++i) {
+      TF_ASSERT_OK(ScheduleTask(10, queues[0].get()));
+    }
+    for (int i = 0; i < 4; ++i) {
+      TF_ASSERT_OK(ScheduleTask(10, queues[1].get()));
+    }
+    proceed.Notify();
+  }
+
+  EXPECT_THAT(processed_queues, ElementsAre(0, 1, 1, 0, 1, 1, 0, 0));
+}
+
+TEST(SharedBatchSchedulerTest, MaxInFlightBatches) {
+  Notification first_batch_started, first_batch_proceed, second_batch_started;
+  auto callback = [&first_batch_started, &first_batch_proceed,
+                   &second_batch_started](
+      std::unique_ptr<Batch<FakeTask>> batch) {
+    if (!first_batch_started.HasBeenNotified()) {
+      first_batch_started.Notify();
+      first_batch_proceed.WaitForNotification();
+    } else {
+      second_batch_started.Notify();
+    }
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 2;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 10;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 2;
+    queue_options.max_in_flight_batches = 1;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Although a second thread is free, the queue's second batch waits for the
+    // first one to finish.
+    TF_ASSERT_OK(ScheduleTask(10, queue.get()));
+    first_batch_started.WaitForNotification();
+    TF_ASSERT_OK(ScheduleTask(10, queue.get()));
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    EXPECT_FALSE(second_batch_started.HasBeenNotified());
+    first_batch_proceed.Notify();
+    second_batch_started.WaitForNotification();
+  }
+}
+
+TEST(SharedBatchSchedulerTest, ByteBudgets) {
+  auto schedule_task = [](size_t task_size, size_t task_bytes,
+                          BatchScheduler<FakeTask>* scheduler) {
+    std::unique_ptr<FakeTask> task(
+        new FakeTaskWithBytes(task_size, task_bytes));
+    return scheduler->Schedule(&task);
+  };
+  auto callback = [](std::unique_ptr<Batch<FakeTask>> batch) {};
+
+  SharedBatchScheduler<FakeTask>::Options options;
+  options.max_enqueued_bytes = 150;
+  std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+  TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+  SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+  queue_options.max_batch_size = 100;
+  queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+  queue_options.max_enqueued_batches = 2;
+  queue_options.max_enqueued_bytes = 100;
+  std::unique_ptr<BatchScheduler<FakeTask>> queue_0;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue_0));
+  std::unique_ptr<BatchScheduler<FakeTask>> queue_1;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue_1));
+
+  // The queue's own budget.
+  TF_ASSERT_OK(schedule_task(1, 60, queue_0.get()));
+  TF_ASSERT_OK(schedule_task(1, 40, queue_0.get()));
+  EXPECT_EQ(error::UNAVAILABLE, schedule_task(1, 1, queue_0.get()).code());
+  EXPECT_EQ(0, queue_0->SchedulingCapacity());
+  EXPECT_EQ(error::INVALID_ARGUMENT,
+            schedule_task(1, 101, queue_0.get()).code());
+
+  // The scheduler-wide budget. The remaining 10 bytes amount to a capacity of
+  // 1, at 10 bytes per unit of task size.
+  TF_ASSERT_OK(schedule_task(4, 40, queue_1.get()));
+  EXPECT_EQ(1, queue_1->SchedulingCapacity());
+  EXPECT_EQ(error::UNAVAILABLE, schedule_task(1, 20, queue_1.get()).code());
+  EXPECT_EQ(2, queue_0->NumEnqueuedTasks());
+  EXPECT_EQ(1, queue_1->NumEnqueuedTasks());
+
+  // Once queue 0's tasks have been processed, their bytes are given back.
+  queue_0.reset();
+  TF_ASSERT_OK(schedule_task(1, 20, queue_1.get()));
+}
+
+TEST(SharedBatchSchedulerTest, ScheduleWithTimeoutWaitsForSchedulerBytes) {
+  Notification first_batch_started, first_batch_proceed;
+  auto callback = [&](std::unique_ptr<Batch<FakeTask>> batch) {
+    if (!first_batch_started.HasBeenNotified()) {
+      first_batch_started.Notify();
+      first_batch_proceed.WaitForNotification();
+    }
+  };
+
+  SharedBatchScheduler<FakeTask>::Options options;
+  options.num_batch_threads = 1;
+  options.max_enqueued_bytes = 100;
+  std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+  TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+  SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+  queue_options.max_batch_size = 10;
+  queue_options.batch_timeout_micros = 0;
+  std::unique_ptr<BatchScheduler<FakeTask>> queue_0;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue_0));
+  std::unique_ptr<BatchScheduler<FakeTask>> queue_1;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue_1));
+
+  // Occupy the batch thread, and use up the scheduler-wide budget with a task
+  // enqueued in queue 0.
+  std::unique_ptr<FakeTask> task(new FakeTaskWithBytes(1, 10));
+  TF_ASSERT_OK(queue_0->Schedule(&task));
+  first_batch_started.WaitForNotification();
+  task.reset(new FakeTaskWithBytes(1, 90));
+  TF_ASSERT_OK(queue_0->Schedule(&task));
+
+  // A caller of queue 1 waits for room, and is notified as soon as queue 0's
+  // task leaves its queue, rather than when its own timeout expires.
+  Notification waiter_done;
+  std::unique_ptr<Thread> waiter(Env::Default()->StartThread(
+      {}, "Waiter", [&queue_1, &waiter_done] {
+        std::unique_ptr<FakeTask> waiting_task(new FakeTaskWithBytes(1, 20));
+        TF_EXPECT_OK(queue_1->ScheduleWithTimeout(
+            &waiting_task, 60 * 1000 * 1000 /* 60 seconds */));
+        waiter_done.Notify();
+      }));
+  Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+  EXPECT_FALSE(waiter_done.HasBeenNotified());
+  first_batch_proceed.Notify();
+  EXPECT_TRUE(WaitForNotificationWithTimeout(
+      &waiter_done, 10 * 1000 * 1000 /* 10 seconds */));
+}
+
+TEST(SharedBatchSchedulerTest, ShedsLoadWhenQueueDelayStaysAboveTarget) {
+  test_util::FakeClockEnv env(Env::Default());
+  // The callback blocks on the i-th batch until 'batch_proceed[i]' is
+  // notified.
+  constexpr int kNumBatches = 7;
+  Notification batch_started[kNumBatches];
+  Notification batch_proceed[kNumBatches];
+  int num_batches = 0;
+  auto callback = [&](std::unique_ptr<Batch<FakeTask>> batch) {
+    const int i = num_batches++;
+    batch_started[i].Notify();
+    batch_proceed[i].WaitForNotification();
+  };
+
+  SharedBatchScheduler<FakeTask>::Options options;
+  options.num_batch_threads = 1;
+  options.env = &env;
+  std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+  TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+  ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
+  SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+  queue_options.max_batch_size = 1;
+  queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+  queue_options.max_enqueued_batches = 100;
+  queue_options.codel_target_delay_micros = 1000;
+  queue_options.codel_interval_micros = 0;
+  std::unique_ptr<BatchScheduler<FakeTask>> queue;
+  EXPECT_EQ(error::INVALID_ARGUMENT,
+            scheduler->AddQueue(queue_options, callback, &queue).code());
+  queue_options.codel_interval_micros = 10 * 1000;
+  TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+  // Batch 0 occupies the thread, while batches 1-3 are closed right away (by
+  // the next task) and batch 4 is open.
+  TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+  batch_started[0].WaitForNotification();
+  for (int i = 0; i < 4; ++i) {
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+  }
+
+  // Batch 1 has waited longer than the target, but not yet for the interval.
+  env.AdvanceByMicroseconds(2000);
+  batch_proceed[0].Notify();
+  batch_started[1].WaitForNotification();
+  TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+
+  // Once batch 2 has also waited too long, an interval later, every arriving
+  // task is shed for as long as the delay stays above the target.
+  env.AdvanceByMicroseconds(10 * 1000);
+  batch_proceed[1].Notify();
+  batch_started[2].WaitForNotification();
+  EXPECT_EQ(error::UNAVAILABLE, ScheduleTask(1, queue.get()).code());
+  EXPECT_EQ(error::UNAVAILABLE, ScheduleTask(1, queue.get()).code());
+  env.AdvanceByMicroseconds(10 * 1000);
+  EXPECT_EQ(error::UNAVAILABLE, ScheduleTask(1, queue.get()).code());
+
+  // Shedding stops once a batch waits less than the target, which happens
+  // when the queue has drained.
+  for (int i = 2; i < 5; ++i) {
+    batch_proceed[i].Notify();
+  }
+  batch_started[5].WaitForNotification();
+  TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+  batch_proceed[5].Notify();
+  batch_started[6].WaitForNotification();
+  batch_proceed[6].Notify();
+  queue.reset();
+  EXPECT_EQ(kNumBatches, num_batches);
+}
+
+TEST(SharedBatchSchedulerTest, RecordsQueueDelays) {
+  test_util::FakeClockEnv env(Env::Default());
+  Notification batch_processed;
+  auto callback = [&batch_processed](std::unique_ptr<Batch<FakeTask>> batch) {
+    batch_processed.Notify();
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    options.env = &env;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 3;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.model_name = "queue_delay_test_model";
+    queue_options.queue_name = "queue_delay_test_queue";
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Tasks enqueued 300, 150 and 0 microseconds before their batch is taken,
+    // which happens once the last of them fills it.
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    env.AdvanceByMicroseconds(150);
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    env.AdvanceByMicroseconds(150);
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    batch_processed.WaitForNotification();
+  }
+
+  // The first task's delay, and the mean delay.
+  monitoring::CollectionRegistry::CollectMetricsOptions collect_options;
+  std::unique_ptr<monitoring::CollectedMetrics> collected_metrics =
+      monitoring::CollectionRegistry::Default()->CollectMetrics(
+          collect_options);
+  auto recorded_delay = [&collected_metrics](const string& metric_name) {
+    for (const auto& point :
+         collected_metrics->point_set_map.at(metric_name)->points) {
+      if (point->labels[1].value == "queue_delay_test_queue") {
+        EXPECT_EQ(1, point->histogram_value.num());
+        return point->histogram_value.sum();
+      }
+    }
+    ADD_FAILURE() << "No " << metric_name << " recorded";
+    return 0.0;
+  };
+  EXPECT_EQ(300,
+            recorded_delay("/tensorflow/serving/batching/queue_delay_micros"));
+  EXPECT_EQ(
+      150,
+      recorded_delay("/tensorflow/serving/batching/mean_queue_delay_micros"));
+}
+
+TEST(SharedBatchSchedulerTest, ThreadGroups) {
+  Notification queue_0_batch_started, queue_0_batch_proceed;
+  auto queue_0_callback = [&queue_0_batch_started, &queue_0_batch_proceed](
+      std::unique_ptr<Batch<FakeTask>> batch) {
+    if (!queue_0_batch_started.HasBeenNotified()) {
+      queue_0_batch_started.Notify();
+    }
+    queue_0_batch_proceed.WaitForNotification();
+  };
+  Notification queue_1_batch_processed;
+  auto queue_1_callback = [&queue_1_batch_processed](
+      std::unique_ptr<Batch<FakeTask>> batch) {
+    queue_1_batch_processed.Notify();
+  };
+
+  {
+    // Two groups of one (unpinned) thread each.
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.thread_groups.resize(2);
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 10;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 2;
+    queue_options.thread_group = 2;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue_0;
+    EXPECT_FALSE(
+        scheduler->AddQueue(queue_options, queue_0_callback, &queue_0).ok());
+    queue_options.thread_group = 0;
+    TF_ASSERT_OK(
+        scheduler->AddQueue(queue_options, queue_0_callback, &queue_0));
+    queue_options.thread_group = 1;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue_1;
+    TF_ASSERT_OK(
+        scheduler->AddQueue(queue_options, queue_1_callback, &queue_1));
+
+    // While group 0's thread is busy with queue 0, group 1's thread serves
+    // queue 1.
+    TF_ASSERT_OK(ScheduleTask(10, queue_0.get()));
+    queue_0_batch_started.WaitForNotification();
+    TF_ASSERT_OK(ScheduleTask(10, queue_1.get()));
+    queue_1_batch_processed.WaitForNotification();
+
+    // Group 1's thread leaves queue 0's batches to group 0.
+    TF_ASSERT_OK(ScheduleTask(10, queue_0.get()));
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    EXPECT_EQ(1, queue_0->NumEnqueuedTasks());
+    queue_0_batch_proceed.Notify();
+  }
+}
+
+TEST(SharedBatchSchedulerTest, InvalidThreadGroups) {
+  SharedBatchScheduler<FakeTask>::Options options;
+  options.thread_groups.resize(1);
+  options.thread_groups[0].num_threads = 0;
+  std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+  EXPECT_FALSE(
+      SharedBatchScheduler<FakeTask>::Create(options, &scheduler).ok());
+  options.thread_groups[0].num_threads = 1;
+  options.thread_groups[0].cpus = {-1};
+  EXPECT_FALSE(
+      SharedBatchScheduler<FakeTask>::Create(options, &scheduler).ok());
+
+  // Without thread groups, queues cannot be assigned to one.
+  TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(
+      SharedBatchScheduler<FakeTask>::Options(), &scheduler));
+  SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+  queue_options.thread_group = 0;
+  std::unique_ptr<BatchScheduler<FakeTask>> queue;
+  EXPECT_FALSE(scheduler
+                   ->AddQueue(queue_options,
+                              [](std::unique_ptr<Batch<FakeTask>> batch) {},
+                              &queue)
+                   .ok());
+}
+
+TEST(SharedBatchSchedulerTest, ScheduleWithTimeout) {
+  Notification first_batch_started, first_batch_proceed;
+  mutex mu;
+  std::vector<size_t> processed_task_sizes;
+  auto callback = [&](std::unique_ptr<Batch<FakeTask>> batch) {
+    {
+      mutex_lock l(mu);
+      for (int i = 0; i < batch->num_tasks(); ++i) {
+        processed_task_sizes.push_back(batch->task(i).size());
+      }
+    }
+    if (!first_batch_started.HasBeenNotified()) {
+      first_batch_started.Notify();
+      first_batch_proceed.WaitForNotification();
+    }
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 10;
+    queue_options.batch_timeout_micros = 0;
+    queue_options.max_enqueued_batches = 1;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Occupy the batch thread, and fill the queue.
+    TF_ASSERT_OK(ScheduleTask(6, queue.get()));
+    first_batch_started.WaitForNotification();
+    TF_ASSERT_OK(ScheduleTask(7, queue.get()));
+    std::unique_ptr<FakeTask> task(new FakeTask(8));
+    EXPECT_EQ(error::UNAVAILABLE,
+              queue->ScheduleWithTimeout(&task, 0 /* timeout_micros */).code());
+
+    // Two callers wait for room. Although both of their tasks would fit in an
+    // empty batch, the first caller goes first.
+    auto schedule_with_timeout = [&queue](size_t task_size) {
+      std::unique_ptr<FakeTask> task(new FakeTask(task_size));
+      TF_EXPECT_OK(queue->ScheduleWithTimeout(
+          &task, 10 * 1000 * 1000 /* 10 seconds */));
+    };
+    std::unique_ptr<Thread> first_waiter(Env::Default()->StartThread(
+        {}, "FirstWaiter", [&schedule_with_timeout] {
+          schedule_with_timeout(8);
+        }));
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    std::unique_ptr<Thread> second_waiter(Env::Default()->StartThread(
+        {}, "SecondWaiter", [&schedule_with_timeout] {
+          schedule_with_timeout(9);
+        }));
+    Env::Default()->SleepForMicroseconds(10 * 1000 /* 10 milliseconds */);
+    // (Waiting tasks are not enqueued.)
+    EXPECT_EQ(1, queue->NumEnqueuedTasks());
+    first_batch_proceed.Notify();
+  }
+  EXPECT_THAT(processed_task_sizes, ElementsAre(6, 7, 8, 9));
+}
+
+TEST(SharedBatchSchedulerTest, EnqueueShards) {
+  Notification processing, proceed;
+  mutex mu;
+  std::vector<int> batch_num_tasks;
+  auto callback = [&processing, &proceed, &mu,
+                   &batch_num_tasks](std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    EXPECT_LE(batch->size(), 4);
+    {
+      mutex_lock l(mu);
+      batch_num_tasks.push_back(batch->num_tasks());
+    }
+    if (!processing.HasBeenNotified()) {
+      processing.Notify();
+    }
+    proceed.WaitForNotification();
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 4;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.max_enqueued_batches = 2;
+    queue_options.num_enqueue_shards = 2;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // Keep the batch thread busy.
+    TF_ASSERT_OK(ScheduleTask(4, queue.get()));
+    processing.WaitForNotification();
+
+    // Staged tasks count towards the open batch's size.
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    EXPECT_EQ(3, queue->NumEnqueuedTasks());
+    EXPECT_EQ(5, queue->SchedulingCapacity());
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(2, queue.get()));
+    TF_ASSERT_OK(ScheduleTask(1, queue.get()));
+    EXPECT_EQ(6, queue->NumEnqueuedTasks());
+    EXPECT_EQ(1, queue->SchedulingCapacity());
+    Status status = ScheduleTask(2, queue.get());
+    ASSERT_FALSE(status.ok());
+    EXPECT_EQ(error::UNAVAILABLE, status.code());
+
+    proceed.Notify();
+  }
+  mutex_lock l(mu);
+  EXPECT_THAT(batch_num_tasks, ElementsAre(1, 4, 2));
+}
+
+TEST(SharedBatchSchedulerTest, EnqueueShardsKeepArrivalOrder) {
+  std::vector<size_t> task_sizes;
+  Notification processed;
+  auto callback = [&task_sizes,
+                   &processed](std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    for (int i = 0; i < batch->num_tasks(); ++i) {
+      task_sizes.push_back(batch->task(i).size());
+    }
+    processed.Notify();
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 1;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 100;
+    queue_options.batch_timeout_micros = 10 * 1000 * 1000;  // 10 seconds
+    queue_options.num_enqueue_shards = 4;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    // The first task starts the batch, the next ones are staged in the shards
+    // of the threads that schedule them, and the last one fills the batch.
+    for (int size = 1; size <= 8; ++size) {
+      std::unique_ptr<Thread> thread(Env::Default()->StartThread(
+          {}, "Producer",
+          [&queue, size] { TF_ASSERT_OK(ScheduleTask(size, queue.get())); }));
+    }
+    TF_ASSERT_OK(ScheduleTask(64, queue.get()));
+    processed.WaitForNotification();
+  }
+  EXPECT_THAT(task_sizes, ElementsAre(1, 2, 3, 4, 5, 6, 7, 8, 64));
+}
+
+TEST(SharedBatchSchedulerTest, EnqueueShardsWithManyProducers) {
+  const int kNumProducers = 8;
+  const int kNumTasksPerProducer = 1000;
+  mutex mu;
+  int num_tasks_processed = 0;
+  auto callback = [&mu, &num_tasks_processed](
+      std::unique_ptr<Batch<FakeTask>> batch) {
+    ASSERT_TRUE(batch->IsClosed());
+    EXPECT_LE(batch->size(), 16);
+    mutex_lock l(mu);
+    num_tasks_processed += batch->num_tasks();
+  };
+
+  {
+    SharedBatchScheduler<FakeTask>::Options options;
+    options.num_batch_threads = 2;
+    std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
+    TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
+    queue_options.max_batch_size = 16;
+    queue_options.batch_timeout_micros = 100;
+    queue_options.max_enqueued_batches = kNumProducers * kNumTasksPerProducer;
+    queue_options.num_enqueue_shards = 4;
+    std::unique_ptr<BatchScheduler<FakeTask>> queue;
+    TF_ASSERT_OK(scheduler->AddQueue(queue_options, callback, &queue));
+
+    std::vector<std::unique_ptr<Thread>> producers;
+    for (int i = 0; i < kNumProducers; ++i) {
+      producers.emplace_back(Env::Default()->StartThread(
+          {}, "Producer", [&queue] {
+            for (int j = 0; j < kNumTasksPerProducer; ++j) {
+              TF_ASSERT_OK(ScheduleTask(1 + j % 3, queue.get()));
+            }
+          }));
+    }
+    producers.clear();
+  }
+  mutex_lock l(mu);
+  EXPECT_EQ(kNumProducers * kNumTasksPerProducer, num_tasks_processed);
+}
+
 TEST(SharedBatchSchedulerTest, ConstMethods) {
   for (const int max_enqueued_batches : {1, 2, 5}) {
     Notification processing, proceed;
@@ -546,6 +1502,7 @@ TEST(SharedBatchSchedulerTest, QueueDestructorBlocksUntilAllTasksProcessed) {
     options.env = &env;
     std::shared_ptr<SharedBatchScheduler<FakeTask>> scheduler;
     TF_ASSERT_OK(SharedBatchScheduler<FakeTask>::Create(options, &scheduler));
+    ClockAdvanceNotifier clock_advance_notifier(&env, scheduler.get());
     SharedBatchScheduler<FakeTask>::QueueOptions queue_options;
     queue_options.max_batch_size = 10;
     queue_options.batch_timeout_micros = 0;
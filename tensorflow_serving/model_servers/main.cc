@@ -41,9 +41,16 @@ limitations under the License.
 // To specify model name (default "default"): --model_name=my_name
 // To specify port (default 8500): --port=my_port
 // To enable batching (default disabled): --enable_batching
+// To set the number of threads serving Predict RPCs (default: number of CPUs):
+//     --num_predict_threads=N
+// To set the number of threads running Predict on models served without
+// batching (default 256): --num_blocking_predict_threads=N
 // To log on stderr (default disabled): --alsologtostderr
 
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <utility>
@@ -58,6 +65,8 @@ limitations under the License.
 #include "grpc++/support/status_code_enum.h"
 #include "grpc/grpc.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/cpu_info.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/init_main.h"
 #include "tensorflow/core/platform/protobuf.h"
@@ -151,22 +160,29 @@ grpc::Status ToGRPCStatus(const tensorflow::Status& status) {
                       error_message);
 }
 
-class PredictionServiceImpl final : public PredictionService::Service {
+class PredictionServiceImpl final
+    : public PredictionService::WithAsyncMethod_Predict<
+          PredictionService::Service> {
  public:
-  explicit PredictionServiceImpl(std::unique_ptr<ServerCore> core,
-                                 bool use_saved_model)
+  // 'blocking_predict_pool' runs predictions on models whose sessions would
+  // block the calling thread (see TensorflowPredictor). It must outlive the
+  // service.
+  PredictionServiceImpl(std::unique_ptr<ServerCore> core, bool use_saved_model,
+                        tensorflow::thread::ThreadPool* blocking_predict_pool)
       : core_(std::move(core)),
-        predictor_(new TensorflowPredictor(use_saved_model)),
+        predictor_(
+            new TensorflowPredictor(use_saved_model, blocking_predict_pool)),
         use_saved_model_(use_saved_model) {}
 
-  grpc::Status Predict(ServerContext* context, const PredictRequest* request,
-                       PredictResponse* response) override {
-    const grpc::Status status =
-        ToGRPCStatus(predictor_->Predict(core_.get(), *request, response));
-    if (!status.ok()) {
-      VLOG(1) << "Predict failed: " << status.error_message();
-    }
-    return status;
+  // Predict is served asynchronously (see PredictCallData), so a request that
+  // waits for a batch doesn't hold a gRPC thread, and one that runs on a model
+  // served without batching holds a thread of the blocking predict pool
+  // instead.
+  void PredictAsync(const tensorflow::RunOptions& run_options,
+                    const PredictRequest& request, PredictResponse* response,
+                    std::function<void(const tensorflow::Status&)> done) {
+    predictor_->PredictAsync(run_options, core_.get(), request, response,
+                             std::move(done));
   }
 
   grpc::Status GetModelMetadata(ServerContext* context,
@@ -192,19 +208,115 @@ class PredictionServiceImpl final : public PredictionService::Service {
   bool use_saved_model_;
 };
 
+// The state of one asynchronous Predict RPC. It requests an incoming call on
+// construction, runs the prediction once the call arrives, and completes the
+// RPC from the prediction's 'done' callback. It deletes itself once the RPC
+// has finished (or the completion queue shuts down).
+class PredictCallData {
+ public:
+  PredictCallData(PredictionServiceImpl* service, ServerCompletionQueue* cq)
+      : service_(service), cq_(cq), responder_(&context_) {
+    service_->RequestPredict(&context_, &request_, &responder_, cq_, cq_,
+                             this);
+  }
+
+  // Called by the thread polling 'cq_' when an event tagged with this object
+  // completes. 'ok' is false if the event did not complete normally.
+  void Proceed(bool ok) {
+    if (state_ == State::kFinishing || !ok) {
+      delete this;
+      return;
+    }
+    state_ = State::kFinishing;
+
+    // Accept the next call while this one is processed.
+    new PredictCallData(service_, cq_);
+
+    tensorflow::RunOptions run_options;
+    run_options.set_timeout_in_ms(TimeoutMillis(context_.deadline()));
+    service_->PredictAsync(
+        run_options, request_, &response_,
+        [this](const tensorflow::Status& status) {
+          if (status.ok()) {
+            responder_.Finish(response_, grpc::Status::OK, this);
+          } else {
+            VLOG(1) << "Predict failed: " << status.error_message();
+            responder_.FinishWithError(ToGRPCStatus(status), this);
+          }
+        });
+  }
+
+ private:
+  enum class State { kReceiving, kFinishing };
+
+  // Returns the time left until 'deadline' in milliseconds, in the form of
+  // RunOptions::timeout_in_ms (where 0 means no deadline).
+  static tensorflow::int64 TimeoutMillis(
+      std::chrono::system_clock::time_point deadline) {
+    if (deadline == std::chrono::system_clock::time_point::max()) {
+      return 0;
+    }
+    const tensorflow::int64 timeout_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::system_clock::now())
+            .count();
+    // An expired deadline still has to be reported as one.
+    return std::max<tensorflow::int64>(timeout_ms, 1);
+  }
+
+  PredictionServiceImpl* const service_;
+  ServerCompletionQueue* const cq_;
+  ServerContext context_;
+  PredictRequest request_;
+  PredictResponse response_;
+  ServerAsyncResponseWriter<PredictResponse> responder_;
+  State state_ = State::kReceiving;
+};
+
+// Serves Predict RPCs from 'cq' until it is shut down.
+void HandlePredictRpcs(PredictionServiceImpl* service,
+                       ServerCompletionQueue* cq) {
+  new PredictCallData(service, cq);
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<PredictCallData*>(tag)->Proceed(ok);
+  }
+}
+
 void RunServer(int port, std::unique_ptr<ServerCore> core,
-               bool use_saved_model) {
+               bool use_saved_model, int num_predict_threads,
+               int num_blocking_predict_threads) {
   // "0.0.0.0" is the way to listen on localhost in gRPC.
   const string server_address = "0.0.0.0:" + std::to_string(port);
-  PredictionServiceImpl service(std::move(core), use_saved_model);
+  std::unique_ptr<tensorflow::thread::ThreadPool> blocking_predict_pool(
+      new tensorflow::thread::ThreadPool(tensorflow::Env::Default(),
+                                         "blocking_predict",
+                                         num_blocking_predict_threads));
+  PredictionServiceImpl service(std::move(core), use_saved_model,
+                                blocking_predict_pool.get());
   ServerBuilder builder;
   std::shared_ptr<grpc::ServerCredentials> creds = InsecureServerCredentials();
   builder.AddListeningPort(server_address, creds);
   builder.RegisterService(&service);
   builder.SetMaxMessageSize(tensorflow::kint32max);
+  std::unique_ptr<ServerCompletionQueue> predict_cq =
+      builder.AddCompletionQueue();
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  std::vector<std::unique_ptr<tensorflow::Thread>> predict_threads;
+  for (int i = 0; i < num_predict_threads; ++i) {
+    predict_threads.emplace_back(tensorflow::Env::Default()->StartThread(
+        tensorflow::ThreadOptions(), "predict_rpc_thread",
+        [&service, &predict_cq] {
+          HandlePredictRpcs(&service, predict_cq.get());
+        }));
+  }
   LOG(INFO) << "Running ModelServer at " << server_address << " ...";
   server->Wait();
+  predict_cq->Shutdown();
+  predict_threads.clear();
+  // Let the predictions in flight finish while the service is still alive.
+  blocking_predict_pool.reset();
 }
 
 // Parses an ascii PlatformConfigMap protobuf from 'file'.
@@ -226,6 +338,9 @@ tensorflow::serving::PlatformConfigMap ParsePlatformConfigMap(
 
 int main(int argc, char** argv) {
   tensorflow::int32 port = 8500;
+  tensorflow::int32 num_predict_threads =
+      tensorflow::port::NumSchedulableCPUs();
+  tensorflow::int32 num_blocking_predict_threads = 256;
   bool enable_batching = false;
   tensorflow::string model_name = "default";
   tensorflow::int32 file_system_poll_wait_seconds = 1;
@@ -240,6 +355,15 @@ int main(int argc, char** argv) {
           FileSystemStoragePathSourceConfig::LATEST_VERSION);
   std::vector<tensorflow::Flag> flag_list = {
       tensorflow::Flag("port", &port, "port to listen on"),
+      tensorflow::Flag("num_predict_threads", &num_predict_threads,
+                       "number of threads serving Predict RPCs; they only "
+                       "parse requests and send responses, and don't wait "
+                       "while a request is batched or run"),
+      tensorflow::Flag("num_blocking_predict_threads",
+                       &num_blocking_predict_threads,
+                       "number of threads running Predict on models served "
+                       "without batching, each waiting for one request to "
+                       "run; bounds how many such requests run at once"),
       tensorflow::Flag("enable_batching", &enable_batching, "enable batching"),
       tensorflow::Flag("model_name", &model_name, "name of model"),
       tensorflow::Flag(
@@ -325,7 +449,14 @@ int main(int argc, char** argv) {
 
   std::unique_ptr<ServerCore> core;
   TF_CHECK_OK(ServerCore::Create(std::move(options), &core));
-  RunServer(port, std::move(core), use_saved_model);
+  QCHECK_GE(num_predict_threads, 1)  // Crash ok.
+      << "--num_predict_threads must be at least 1\n"
+      << usage;
+  QCHECK_GE(num_blocking_predict_threads, 1)  // Crash ok.
+      << "--num_blocking_predict_threads must be at least 1\n"
+      << usage;
+  RunServer(port, std::move(core), use_saved_model, num_predict_threads,
+            num_blocking_predict_threads);
 
   return 0;
 }
@@ -18,8 +18,11 @@ limitations under the License.
 #include "google/protobuf/wrappers.pb.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/types.h"
+#include "tensorflow_serving/batching/allowed_batch_sizes.h"
 #include "tensorflow_serving/batching/batch_scheduler.h"
 #include "tensorflow_serving/resources/resource_values.h"
 #include "tensorflow_serving/servables/tensorflow/serving_session.h"
@@ -108,6 +111,10 @@ Status CreateBatchScheduler(const BatchingParameters& batching_config,
   if (batching_config.has_thread_pool_name()) {
     options.thread_pool_name = batching_config.thread_pool_name().value();
   }
+  if (batching_config.has_max_total_enqueued_bytes()) {
+    options.max_enqueued_bytes =
+        batching_config.max_total_enqueued_bytes().value();
+  }
   return Batcher::Create(options, batch_scheduler);
 }
 
@@ -149,6 +156,7 @@ Status EstimateResourceFromPath(const string& path, FileProbingEnv* env,
 Status WrapSessionForBatching(const BatchingParameters& batching_config,
                               std::shared_ptr<Batcher> batch_scheduler,
                               const std::vector<SignatureDef>& signatures,
+                              const string& servable_name,
                               std::unique_ptr<Session>* session) {
   LOG(INFO) << "Wrapping session to perform batch processing";
 
@@ -160,36 +168,146 @@ Status WrapSessionForBatching(const BatchingParameters& batching_config,
   }
 
   Batcher::QueueOptions queue_options;
+  queue_options.model_name = servable_name;
   if (batching_config.has_max_batch_size()) {
     queue_options.max_batch_size = batching_config.max_batch_size().value();
   }
+  if (batching_config.has_max_batch_cost()) {
+    queue_options.max_batch_cost = batching_config.max_batch_cost().value();
+  }
   if (batching_config.has_batch_timeout_micros()) {
     queue_options.batch_timeout_micros =
         batching_config.batch_timeout_micros().value();
   }
+  if (batching_config.has_idle_batch_timeout_micros()) {
+    queue_options.idle_batch_timeout_micros =
+        batching_config.idle_batch_timeout_micros().value();
+  }
   if (batching_config.has_max_enqueued_batches()) {
     queue_options.max_enqueued_batches =
         batching_config.max_enqueued_batches().value();
   }
+  if (batching_config.has_max_enqueued_bytes()) {
+    queue_options.max_enqueued_bytes =
+        batching_config.max_enqueued_bytes().value();
+  }
+  if (batching_config.has_codel_target_delay_micros()) {
+    queue_options.codel_target_delay_micros =
+        batching_config.codel_target_delay_micros().value();
+  }
+  if (batching_config.has_codel_interval_micros()) {
+    queue_options.codel_interval_micros =
+        batching_config.codel_interval_micros().value();
+  }
+  if (batching_config.has_enable_large_batch_splitting()) {
+    queue_options.enable_large_batch_splitting =
+        batching_config.enable_large_batch_splitting().value();
+    queue_options.split_input_task_func = SplitInputTask;
+  }
+  if (batching_config.has_max_in_flight_batches()) {
+    queue_options.max_in_flight_batches =
+        batching_config.max_in_flight_batches().value();
+  }
+  if (batching_config.has_adaptive_target_latency_micros()) {
+    queue_options.adaptive_target_latency_micros =
+        batching_config.adaptive_target_latency_micros().value();
+  }
+  if (batching_config.has_adaptive_min_batch_size()) {
+    queue_options.adaptive_min_batch_size =
+        batching_config.adaptive_min_batch_size().value();
+  }
+  if (batching_config.has_adaptive_min_batch_timeout_micros()) {
+    queue_options.adaptive_min_batch_timeout_micros =
+        batching_config.adaptive_min_batch_timeout_micros().value();
+  }
+  if (batching_config.has_num_enqueue_shards()) {
+    queue_options.num_enqueue_shards =
+        batching_config.num_enqueue_shards().value();
+  }
 
   BatchingSessionOptions batching_session_options;
+  batching_session_options.model_name = servable_name;
   for (int allowed_batch_size : batching_config.allowed_batch_sizes()) {
     batching_session_options.allowed_batch_sizes.push_back(allowed_batch_size);
   }
+  if (batching_config.allowed_batch_sizes().empty() &&
+      batching_config.has_num_auto_allowed_batch_sizes()) {
+    const int64 num_auto_allowed_batch_sizes =
+        batching_config.num_auto_allowed_batch_sizes().value();
+    if (num_auto_allowed_batch_sizes < 1 ||
+        num_auto_allowed_batch_sizes > queue_options.max_batch_size) {
+      return errors::InvalidArgument(
+          "num_auto_allowed_batch_sizes must be between 1 and max_batch_size (",
+          queue_options.max_batch_size, "); was ",
+          num_auto_allowed_batch_sizes);
+    }
+    ProfileAllowedBatchSizesOptions profile_options;
+    profile_options.max_batch_size = queue_options.max_batch_size;
+    profile_options.max_num_allowed_batch_sizes = num_auto_allowed_batch_sizes;
+    profile_options.batch_size_weights.assign(
+        batching_config.batch_size_weights().begin(),
+        batching_config.batch_size_weights().end());
+    TF_RETURN_IF_ERROR(ProfileAllowedBatchSizes(
+        profile_options, signatures, session->get(),
+        &batching_session_options.allowed_batch_sizes));
+  }
+  if (batching_config.has_incremental_input_merge() &&
+      batching_config.incremental_input_merge().value()) {
+    batching_session_options.incremental_merge_buffer_size =
+        queue_options.max_batch_size;
+  }
+  if (batching_config.has_input_buffer_pool_max_bytes()) {
+    batching_session_options.input_buffer_pool_max_bytes =
+        batching_config.input_buffer_pool_max_bytes().value();
+  }
+  if (batching_config.has_pad_variable_length_inputs()) {
+    batching_session_options.pad_variable_length_inputs =
+        batching_config.pad_variable_length_inputs().value();
+  }
+  for (const auto& entry : batching_config.variable_length_output_sources()) {
+    batching_session_options.variable_length_output_sources[entry.first] =
+        entry.second;
+  }
+  for (int64 length_bucket_limit : batching_config.length_bucket_limits()) {
+    batching_session_options.length_bucket_limits.push_back(
+        length_bucket_limit);
+  }
+  switch (batching_config.task_cost_measure()) {
+    case BatchingParameters::ELEMENTS:
+      batching_session_options.task_cost_measure =
+          BatchingSessionOptions::TaskCostMeasure::kElements;
+      break;
+    case BatchingParameters::BYTES:
+      batching_session_options.task_cost_measure =
+          BatchingSessionOptions::TaskCostMeasure::kBytes;
+      break;
+    default:
+      batching_session_options.task_cost_measure =
+          BatchingSessionOptions::TaskCostMeasure::kRows;
+      break;
+  }
+  if (batching_config.has_num_pipeline_threads()) {
+    batching_session_options.num_pipeline_threads =
+        batching_config.num_pipeline_threads().value();
+  }
 
-  auto create_queue = [batch_scheduler, queue_options](
-      std::function<void(std::unique_ptr<Batch<BatchingSessionTask>>)>
-          process_batch_callback,
-      std::unique_ptr<BatchScheduler<BatchingSessionTask>>* queue) {
-    TF_RETURN_IF_ERROR(batch_scheduler->AddQueue(
-        queue_options, process_batch_callback, queue));
-    return Status::OK();
-  };
   std::vector<SignatureWithBatchingSessionSchedulerCreator>
       signatures_with_scheduler_creators;
   for (const SignatureDef& signature : signatures) {
     const TensorSignature tensor_signature =
         TensorSignatureFromSignatureDef(signature);
+    Batcher::QueueOptions signature_queue_options = queue_options;
+    signature_queue_options.queue_name = strings::StrCat(
+        str_util::Join(tensor_signature.input_tensors, ","), "->",
+        str_util::Join(tensor_signature.output_tensors, ","));
+    auto create_queue = [batch_scheduler, signature_queue_options](
+        std::function<void(std::unique_ptr<Batch<BatchingSessionTask>>)>
+            process_batch_callback,
+        std::unique_ptr<BatchScheduler<BatchingSessionTask>>* queue) {
+      TF_RETURN_IF_ERROR(batch_scheduler->AddQueue(
+          signature_queue_options, process_batch_callback, queue));
+      return Status::OK();
+    };
     signatures_with_scheduler_creators.push_back(
         {tensor_signature, create_queue});
   }
@@ -62,14 +62,15 @@ Status EstimateResourceFromPath(const string& path, FileProbingEnv* env,
                                 ResourceAllocation* estimate);
 
 // Wraps a session in a new session that automatically batches Run() calls, for
-// the given signatures.
+// the given signatures. The batching metrics are labeled with 'servable_name',
+// and with each signature's input and output tensor names.
 // TODO(b/33233998): Support batching for Run() calls that use a combination of
 // signatures -- i.e. sometimes construct a single TensorSignature for a set of
 // SignatureDefs (usually just two of them) -- based on some config.
 Status WrapSessionForBatching(
     const BatchingParameters& batching_config,
     std::shared_ptr<SharedBatchScheduler<BatchingSessionTask>> batch_scheduler,
-    const std::vector<SignatureDef>& signatures,
+    const std::vector<SignatureDef>& signatures, const string& servable_name,
     std::unique_ptr<Session>* session);
 
 // Wraps a session in a new session that only supports Run() without batching.
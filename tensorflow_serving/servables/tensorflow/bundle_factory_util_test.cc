@@ -114,12 +114,71 @@ TEST_F(BundleFactoryUtilTest, WrapSessionForBatching) {
   // Wrap the session.
   TF_ASSERT_OK(WrapSessionForBatching(batching_params, batcher,
                                       {test_util::GetTestSessionSignature()},
-                                      &bundle.session));
+                                      "test_model", &bundle.session));
 
   // Run multiple requests concurrently. They should be executed as 5 batches.
   test_util::TestMultipleRequests(10, bundle.session.get());
 }
 
+TEST_F(BundleFactoryUtilTest, WrapSessionForBatchingWithIncrementalMerge) {
+  SessionBundle bundle;
+  TF_ASSERT_OK(LoadSessionBundleFromPathUsingRunOptions(
+      SessionOptions(), RunOptions(), export_dir_, &bundle));
+
+  BatchingParameters batching_params;
+  batching_params.mutable_max_batch_size()->set_value(2);
+  batching_params.mutable_max_enqueued_batches()->set_value(INT_MAX);
+  batching_params.mutable_incremental_input_merge()->set_value(true);
+
+  std::shared_ptr<Batcher> batcher;
+  TF_ASSERT_OK(CreateBatchScheduler(batching_params, &batcher));
+  TF_ASSERT_OK(WrapSessionForBatching(batching_params, batcher,
+                                      {test_util::GetTestSessionSignature()},
+                                      "test_model", &bundle.session));
+
+  test_util::TestMultipleRequests(10, bundle.session.get());
+}
+
+TEST_F(BundleFactoryUtilTest, WrapSessionForBatchingWithAutoAllowedSizes) {
+  SessionBundle bundle;
+  TF_ASSERT_OK(LoadSessionBundleFromPathUsingRunOptions(
+      SessionOptions(), RunOptions(), export_dir_, &bundle));
+
+  BatchingParameters batching_params;
+  batching_params.mutable_max_batch_size()->set_value(4);
+  batching_params.mutable_max_enqueued_batches()->set_value(INT_MAX);
+  batching_params.mutable_num_auto_allowed_batch_sizes()->set_value(2);
+
+  // Profiling needs the input's dtype and rank.
+  SignatureDef signature = test_util::GetTestSessionSignature();
+  TensorInfo* input = &(*signature.mutable_inputs())["x"];
+  input->set_dtype(DT_FLOAT);
+  input->mutable_tensor_shape()->add_dim()->set_size(-1);
+
+  std::shared_ptr<Batcher> batcher;
+  TF_ASSERT_OK(CreateBatchScheduler(batching_params, &batcher));
+  TF_ASSERT_OK(WrapSessionForBatching(batching_params, batcher, {signature},
+                                      "test_model", &bundle.session));
+
+  test_util::TestMultipleRequests(10, bundle.session.get());
+
+  // Without the dtype, the model fails to load.
+  TF_ASSERT_OK(LoadSessionBundleFromPathUsingRunOptions(
+      SessionOptions(), RunOptions(), export_dir_, &bundle));
+  EXPECT_FALSE(WrapSessionForBatching(batching_params, batcher,
+                                      {test_util::GetTestSessionSignature()},
+                                      "test_model", &bundle.session)
+                   .ok());
+
+  // Nor with more allowed sizes than 'max_batch_size'.
+  batching_params.mutable_num_auto_allowed_batch_sizes()->set_value(5);
+  TF_ASSERT_OK(LoadSessionBundleFromPathUsingRunOptions(
+      SessionOptions(), RunOptions(), export_dir_, &bundle));
+  EXPECT_FALSE(WrapSessionForBatching(batching_params, batcher, {signature},
+                                      "test_model", &bundle.session)
+                   .ok());
+}
+
 TEST_F(BundleFactoryUtilTest, BatchingConfigError) {
   BatchingParameters batching_params;
   batching_params.mutable_max_batch_size()->set_value(2);
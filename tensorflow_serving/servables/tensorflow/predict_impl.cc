@@ -18,6 +18,7 @@ limitations under the License.
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -26,16 +27,54 @@ limitations under the License.
 #include "tensorflow/contrib/session_bundle/session_bundle.h"
 #include "tensorflow/contrib/session_bundle/signature.h"
 #include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/notification.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/protobuf/named_tensor.pb.h"
 #include "tensorflow_serving/core/servable_handle.h"
+#include "tensorflow_serving/servables/tensorflow/serving_session.h"
 
 namespace tensorflow {
 namespace serving {
 namespace {
 
+// The state of a prediction whose session call is in flight. Shared with the
+// call's completion callback, so that the servable and the call's arguments
+// stay alive until the call finishes.
+template <typename BundleType>
+struct PredictCall {
+  ServableHandle<BundleType> bundle;
+  std::vector<std::pair<string, Tensor>> inputs;
+  // Used instead of 'inputs' for SavedModel calls. Points into the request,
+  // which outlives the call.
+  std::vector<std::pair<string, const TensorProto*>> input_protos;
+  std::vector<string> output_tensor_names;
+  std::vector<string> output_tensor_aliases;
+  std::vector<Tensor> outputs;
+};
+
+// Calls 'run', which issues a session call on 'session', right away if
+// 'session' runs calls asynchronously (see ServingSession::RunsAsync()) or
+// 'blocking_run_pool' is null. Otherwise schedules it on 'blocking_run_pool',
+// so that the calling thread does not wait for the call to run.
+void RunOrSchedule(const Session* session,
+                   thread::ThreadPool* blocking_run_pool,
+                   std::function<void()> run) {
+  if (blocking_run_pool == nullptr || SessionRunsAsync(session)) {
+    run();
+    return;
+  }
+  blocking_run_pool->Schedule(std::move(run));
+}
+
 // Implementation of Predict using the legacy SessionBundle GenericSignature.
-Status SessionBundlePredict(ServerCore* core, const PredictRequest& request,
-                            PredictResponse* response) {
+// If an error is returned, no session call was issued and 'done' will not be
+// invoked.
+Status SessionBundlePredict(const RunOptions& run_options, ServerCore* core,
+                            thread::ThreadPool* blocking_run_pool,
+                            const PredictRequest& request,
+                            PredictResponse* response,
+                            std::function<void(const Status&)> done) {
   // Validate signatures.
   ServableHandle<SessionBundle> bundle;
   TF_RETURN_IF_ERROR(core->GetServableHandle(request.model_spec(), &bundle));
@@ -110,30 +149,49 @@ Status SessionBundlePredict(ServerCore* core, const PredictRequest& request,
   }
 
   // Run session.
-  std::vector<Tensor> outputs;
-  TF_RETURN_IF_ERROR(
-      bundle->session->Run(inputs, output_tensor_names, {}, &outputs));
-
-  // Validate and return output.
-  if (outputs.size() != output_tensor_names.size()) {
-    return tensorflow::Status(tensorflow::error::UNKNOWN,
-                              "Predict internal error");
-  }
-  for (int i = 0; i < outputs.size(); i++) {
-    outputs[i].AsProtoField(
-        &((*response->mutable_outputs())[output_aliases[i]]));
-  }
+  auto call = std::make_shared<PredictCall<SessionBundle>>();
+  call->bundle = std::move(bundle);
+  call->inputs = std::move(inputs);
+  call->output_tensor_names = std::move(output_tensor_names);
+  call->output_tensor_aliases = std::move(output_aliases);
+  auto call_done = [call, response, done](const Status& status) {
+    if (!status.ok()) {
+      done(status);
+      return;
+    }
 
+    // Validate and return output.
+    const std::vector<Tensor>& outputs = call->outputs;
+    if (outputs.size() != call->output_tensor_names.size()) {
+      done(tensorflow::Status(tensorflow::error::UNKNOWN,
+                              "Predict internal error"));
+      return;
+    }
+    for (int i = 0; i < outputs.size(); i++) {
+      outputs[i].AsProtoField(&(
+          (*response->mutable_outputs())[call->output_tensor_aliases[i]]));
+    }
+    done(Status::OK());
+  };
+  RunOrSchedule(
+      call->bundle->session.get(), blocking_run_pool,
+      [call, run_options, call_done] {
+        RunSessionAsync(call->bundle->session.get(), run_options,
+                        RunSignatureHandle(), call->inputs,
+                        call->output_tensor_names, &call->outputs, call_done);
+      });
   return Status::OK();
 }
 
 // Validate a SignatureDef to make sure it's compatible with prediction, and
-// if so, populate the input and output tensor names.
-Status PreProcessPrediction(const SignatureDef& signature,
-                            const PredictRequest& request,
-                            std::vector<std::pair<string, Tensor>>* inputs,
-                            std::vector<string>* output_tensor_names,
-                            std::vector<string>* output_tensor_aliases) {
+// if so, populate the input and output tensor names. The input tensors are
+// left as protos in 'request', to be parsed (or, by a batching session,
+// decoded straight into its batch) by the session call.
+Status PreProcessPrediction(
+    const SignatureDef& signature, const PredictRequest& request,
+    std::vector<std::pair<string, const TensorProto*>>* inputs,
+    std::vector<string>* output_tensor_names,
+    std::vector<string>* output_tensor_aliases) {
   if (signature.method_name() != kPredictMethodName &&
       signature.method_name() != kClassifyMethodName &&
       signature.method_name() != kRegressMethodName) {
@@ -170,12 +228,7 @@ Status PreProcessPrediction(const SignatureDef& signature,
       }
       tensor_name = iter->second.name();
     }
-    Tensor tensor;
-    if (!tensor.FromProto(input.second)) {
-      return tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
-                                "tensor parsing error: " + alias);
-    }
-    inputs->emplace_back(std::make_pair(tensor_name, tensor));
+    inputs->emplace_back(tensor_name, &input.second);
   }
 
   // Prepare run target.
@@ -231,9 +284,91 @@ Status PostProcessPredictionResult(
   return Status::OK();
 }
 
-// Implementation of Predict using the SavedModel SignatureDef format.
-Status SavedModelPredict(ServerCore* core, const PredictRequest& request,
-                         PredictResponse* response) {
+// Caches the RunSignatureHandles of sessions' prediction signatures, keyed by
+// session and signature name, so that the session need not match the tensor
+// names of each request against its own signatures. Only used for requests to
+// Predict-method signatures without an output filter, whose tensor names are
+// then exactly the signature's: the names are resolved once per signature, and
+// the handle alone routes the requests that follow. (Classification and
+// regression signatures take their input tensor names from the request.)
+//
+// Each thread has a cache of its own, so that looking up a handle takes no
+// lock.
+class RunSignatureHandleCache {
+ public:
+  RunSignatureHandleCache() = default;
+
+  // Returns the calling thread's cache.
+  static RunSignatureHandleCache* ForCurrentThread();
+
+  // Returns the handle of 'signature', named 'signature_name', of 'session',
+  // resolving it on a miss.
+  RunSignatureHandle Get(Session* session, const string& signature_name,
+                         const SignatureDef& signature);
+
+ private:
+  struct Entry {
+    RunSignatureHandle handle;
+    // Whether 'handle' was resolved. (A resolved handle that has since expired
+    // belongs to a destroyed session at the same address.)
+    bool resolved = false;
+  };
+
+  // Entries of sessions that have been destroyed are not removed explicitly;
+  // instead the cache is cleared once it holds this many sessions.
+  static constexpr int kMaxNumSessions = 1024;
+
+  std::unordered_map<const Session*, std::unordered_map<string, Entry>>
+      entries_;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(RunSignatureHandleCache);
+};
+
+RunSignatureHandleCache* RunSignatureHandleCache::ForCurrentThread() {
+  static thread_local RunSignatureHandleCache cache;
+  return &cache;
+}
+
+RunSignatureHandle RunSignatureHandleCache::Get(
+    Session* session, const string& signature_name,
+    const SignatureDef& signature) {
+  auto session_entries = entries_.find(session);
+  if (session_entries != entries_.end()) {
+    auto entry = session_entries->second.find(signature_name);
+    if (entry != session_entries->second.end() &&
+        !(entry->second.resolved && entry->second.handle.expired())) {
+      return entry->second.handle;
+    }
+  }
+
+  std::vector<string> input_tensor_names;
+  for (const auto& input : signature.inputs()) {
+    input_tensor_names.push_back(input.second.name());
+  }
+  std::vector<string> output_tensor_names;
+  for (const auto& output : signature.outputs()) {
+    output_tensor_names.push_back(output.second.name());
+  }
+  Entry entry;
+  entry.handle =
+      ResolveRunSignature(session, input_tensor_names, output_tensor_names);
+  entry.resolved = !entry.handle.expired();
+
+  if (entries_.size() >= kMaxNumSessions && entries_.count(session) == 0) {
+    entries_.clear();
+  }
+  entries_[session][signature_name] = entry;
+  return entry.handle;
+}
+
+// Implementation of Predict using the SavedModel SignatureDef format. If an
+// error is returned, no session call was issued and 'done' will not be
+// invoked.
+Status SavedModelPredict(const RunOptions& run_options, ServerCore* core,
+                         thread::ThreadPool* blocking_run_pool,
+                         const PredictRequest& request,
+                         PredictResponse* response,
+                         std::function<void(const Status&)> done) {
   // Validate signatures.
   ServableHandle<SavedModelBundle> bundle;
   TF_RETURN_IF_ERROR(core->GetServableHandle(request.model_spec(), &bundle));
@@ -248,18 +383,34 @@ Status SavedModelPredict(ServerCore* core, const PredictRequest& request,
   }
   SignatureDef signature = iter->second;
 
-  std::vector<std::pair<string, Tensor>> input_tensors;
-  std::vector<string> output_tensor_names;
-  std::vector<string> output_tensor_aliases;
-  TF_RETURN_IF_ERROR(PreProcessPrediction(signature, request, &input_tensors,
-                                          &output_tensor_names,
-                                          &output_tensor_aliases));
-  std::vector<Tensor> outputs;
-  TF_RETURN_IF_ERROR(
-      bundle->session->Run(input_tensors, output_tensor_names, {}, &outputs));
-
-  return PostProcessPredictionResult(signature, output_tensor_aliases, outputs,
-                                     response);
+  auto call = std::make_shared<PredictCall<SavedModelBundle>>();
+  TF_RETURN_IF_ERROR(PreProcessPrediction(
+      signature, request, &call->input_protos, &call->output_tensor_names,
+      &call->output_tensor_aliases));
+  call->bundle = std::move(bundle);
+  Session* session = call->bundle->session.get();
+  RunSignatureHandle signature_handle;
+  if (request.output_filter().empty() &&
+      signature.method_name() == kPredictMethodName) {
+    signature_handle = RunSignatureHandleCache::ForCurrentThread()->Get(
+        session, signature_name, signature);
+  }
+  auto call_done = [call, signature, response, done](const Status& status) {
+    if (!status.ok()) {
+      done(status);
+      return;
+    }
+    done(PostProcessPredictionResult(signature, call->output_tensor_aliases,
+                                     call->outputs, response));
+  };
+  RunOrSchedule(session, blocking_run_pool,
+                [session, run_options, signature_handle, call, call_done] {
+                  RunSessionAsyncFromProtos(
+                      session, run_options, signature_handle,
+                      call->input_protos, call->output_tensor_names,
+                      &call->outputs, call_done);
+                });
+  return Status::OK();
 }
 
 }  // namespace
@@ -267,14 +418,35 @@ Status SavedModelPredict(ServerCore* core, const PredictRequest& request,
 Status TensorflowPredictor::Predict(ServerCore* core,
                                     const PredictRequest& request,
                                     PredictResponse* response) {
+  Notification done;
+  Status status;
+  PredictAsync(RunOptions(), core, request, response,
+               [&done, &status](const Status& predict_status) {
+                 status = predict_status;
+                 done.Notify();
+               });
+  done.WaitForNotification();
+  return status;
+}
+
+void TensorflowPredictor::PredictAsync(
+    const RunOptions& run_options, ServerCore* core,
+    const PredictRequest& request, PredictResponse* response,
+    std::function<void(const Status&)> done) {
   if (!request.has_model_spec()) {
-    return tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
-                              "Missing ModelSpec");
+    done(tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                            "Missing ModelSpec"));
+    return;
   }
-  if (use_saved_model_) {
-    return SavedModelPredict(core, request, response);
+  const Status status =
+      use_saved_model_
+          ? SavedModelPredict(run_options, core, blocking_run_pool_, request,
+                              response, done)
+          : SessionBundlePredict(run_options, core, blocking_run_pool_,
+                                 request, response, done);
+  if (!status.ok()) {
+    done(status);
   }
-  return SessionBundlePredict(core, request, response);
 }
 
 }  // namespace serving
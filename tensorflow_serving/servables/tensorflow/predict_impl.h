@@ -16,7 +16,11 @@ limitations under the License.
 #ifndef TENSORFLOW_SERVING_SERVABLES_TENSORFLOW_PREDICT_IMPL_H_
 #define TENSORFLOW_SERVING_SERVABLES_TENSORFLOW_PREDICT_IMPL_H_
 
+#include <functional>
+
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/protobuf/config.pb.h"
 #include "tensorflow_serving/apis/predict.pb.h"
 #include "tensorflow_serving/model_servers/server_core.h"
 
@@ -29,14 +33,40 @@ class TensorflowPredictor {
   explicit TensorflowPredictor(bool use_saved_model)
       : use_saved_model_(use_saved_model) {}
 
+  // Like above. In addition, PredictAsync() hands predictions on models whose
+  // sessions would run them in the calling thread (see
+  // ServingSession::RunsAsync(), e.g. models served without batching) to
+  // 'blocking_run_pool', so that it returns without waiting for them. The pool
+  // bounds how many such predictions run at once. It must outlive the
+  // predictor.
+  TensorflowPredictor(bool use_saved_model,
+                      thread::ThreadPool* blocking_run_pool)
+      : use_saved_model_(use_saved_model),
+        blocking_run_pool_(blocking_run_pool) {}
+
   Status Predict(ServerCore* core, const PredictRequest& request,
                  PredictResponse* response);
 
+  // Like Predict(), but may return before the prediction has finished, in
+  // which case 'done' is invoked with its status once it has (possibly in
+  // another thread). 'request' and 'response' must remain valid until then.
+  // For models served with batching, 'done' is invoked from the batch thread,
+  // so no thread waits while the request is queued. For other models, the
+  // prediction runs in the calling thread unless a 'blocking_run_pool' was
+  // given. 'run_options' are passed
+  // to the session, e.g. to carry the RPC's deadline in 'timeout_in_ms'.
+  void PredictAsync(const RunOptions& run_options, ServerCore* core,
+                    const PredictRequest& request, PredictResponse* response,
+                    std::function<void(const Status&)> done);
+
  private:
   // If use_saved_model_ is true, a SavedModelBundle handle will be retrieved
   // from the ServerCore and the new SavedModel SignatureDef format will be
   // used.
   bool use_saved_model_;
+
+  // Not owned. May be null.
+  thread::ThreadPool* const blocking_run_pool_ = nullptr;
 };
 
 }  // namespace serving
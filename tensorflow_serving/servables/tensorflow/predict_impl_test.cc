@@ -15,10 +15,15 @@ limitations under the License.
 
 #include "tensorflow_serving/servables/tensorflow/predict_impl.h"
 
+#include <thread>
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include "tensorflow/contrib/session_bundle/session_bundle.h"
+#include "tensorflow/core/lib/core/notification.h"
 #include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow_serving/core/availability_preserving_policy.h"
 #include "tensorflow_serving/model_servers/model_platform_types.h"
 #include "tensorflow_serving/model_servers/platform_config_util.h"
@@ -257,6 +262,40 @@ TEST_P(PredictImplTest, PredictionSuccess) {
   EXPECT_THAT(response, test_util::EqualsProto(expected_response));
 }
 
+TEST_P(PredictImplTest, PredictionOnBlockingRunPool) {
+  PredictRequest request;
+  PredictResponse response;
+
+  ModelSpec* model_spec = request.mutable_model_spec();
+  model_spec->set_name(kTestModelName);
+  model_spec->mutable_version()->set_value(kTestModelVersion);
+
+  TensorProto tensor_proto;
+  tensor_proto.add_float_val(2.0);
+  tensor_proto.set_dtype(tensorflow::DT_FLOAT);
+  (*request.mutable_inputs())[kInputTensorKey] = tensor_proto;
+
+  // The model is served without batching, so its session would run the
+  // prediction in the calling thread. Instead, it runs on the pool.
+  thread::ThreadPool blocking_run_pool(Env::Default(), "blocking_run", 1);
+  TensorflowPredictor predictor(GetParam(), &blocking_run_pool);
+  const std::thread::id calling_thread = std::this_thread::get_id();
+  std::thread::id done_thread;
+  Status status;
+  Notification done;
+  predictor.PredictAsync(RunOptions(), GetServerCore(), request, &response,
+                         [&](const Status& predict_status) {
+                           done_thread = std::this_thread::get_id();
+                           status = predict_status;
+                           done.Notify();
+                         });
+  done.WaitForNotification();
+  TF_EXPECT_OK(status);
+  EXPECT_NE(calling_thread, done_thread);
+  ASSERT_EQ(1, response.outputs().count(kOutputTensorKey));
+  EXPECT_EQ(3, response.outputs().at(kOutputTensorKey).float_val(0));
+}
+
 // Test querying a model with a named regression signature (not default). This
 // will work with SavedModel but not supported in the legacy SessionBundle.
 TEST_P(PredictImplTest, PredictionWithNamedRegressionSignature) {
@@ -57,7 +57,8 @@ Status SavedModelBundleFactory::EstimateResourceRequirement(
 }
 
 Status SavedModelBundleFactory::CreateSavedModelBundle(
-    const string& path, std::unique_ptr<SavedModelBundle>* bundle) {
+    const ServableId& id, const string& path,
+    std::unique_ptr<SavedModelBundle>* bundle) {
   bundle->reset(new SavedModelBundle);
   TF_RETURN_IF_ERROR(LoadSessionBundleOrSavedModelBundle(
       GetSessionOptions(config_), GetRunOptions(config_), path,
@@ -72,7 +73,7 @@ Status SavedModelBundleFactory::CreateSavedModelBundle(
     // the one or many SignatureDefs to enable.
     const std::vector<SignatureDef> signatures = GetSignatureDefs(**bundle);
     return WrapSessionForBatching(config_.batching_parameters(),
-                                  batch_scheduler_, signatures,
+                                  batch_scheduler_, signatures, id.name,
                                   &(*bundle)->session);
   }
   return WrapSession(&(*bundle)->session);
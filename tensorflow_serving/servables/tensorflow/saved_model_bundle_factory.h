@@ -21,6 +21,7 @@ limitations under the License.
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow_serving/batching/batching_session.h"
 #include "tensorflow_serving/batching/shared_batch_scheduler.h"
+#include "tensorflow_serving/core/servable_id.h"
 #include "tensorflow_serving/resources/resources.pb.h"
 #include "tensorflow_serving/servables/tensorflow/session_bundle_config.pb.h"
 
@@ -50,8 +51,10 @@ class SavedModelBundleFactory {
   static Status Create(const SessionBundleConfig& config,
                        std::unique_ptr<SavedModelBundleFactory>* factory);
 
-  // Instantiates a bundle from a given export or SavedModel path.
-  Status CreateSavedModelBundle(const string& path,
+  // Instantiates a bundle of servable version 'id' from a given export or
+  // SavedModel path. The servable's name labels the bundle's batching metrics,
+  // if any.
+  Status CreateSavedModelBundle(const ServableId& id, const string& path,
                                 std::unique_ptr<SavedModelBundle>* bundle);
 
   // Estimates the resources a SavedModel bundle will use once loaded, from its
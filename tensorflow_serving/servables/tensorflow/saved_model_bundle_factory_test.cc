@@ -43,7 +43,8 @@ Status CreateSessionFromPath(const SessionBundleConfig& config,
   std::unique_ptr<SavedModelBundleFactory> factory;
   TF_RETURN_IF_ERROR(SavedModelBundleFactory::Create(config, &factory));
   std::unique_ptr<SavedModelBundle> bundle;
-  TF_RETURN_IF_ERROR(factory->CreateSavedModelBundle(path, &bundle));
+  TF_RETURN_IF_ERROR(
+      factory->CreateSavedModelBundle({"test_model", 0}, path, &bundle));
   *session = std::move(bundle->session);
   return Status::OK();
 }
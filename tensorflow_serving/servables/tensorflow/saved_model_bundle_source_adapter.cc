@@ -17,6 +17,8 @@ limitations under the License.
 
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/platform/types.h"
@@ -43,12 +45,37 @@ SavedModelBundleSourceAdapter::SavedModelBundleSourceAdapter(
     std::unique_ptr<SavedModelBundleFactory> bundle_factory)
     : bundle_factory_(std::move(bundle_factory)) {}
 
-Status SavedModelBundleSourceAdapter::Convert(const StoragePath& path,
+std::vector<ServableData<std::unique_ptr<Loader>>>
+SavedModelBundleSourceAdapter::Adapt(
+    const StringPiece servable_name,
+    std::vector<ServableData<StoragePath>> versions) {
+  std::vector<ServableData<std::unique_ptr<Loader>>> adapted_versions;
+  for (const ServableData<StoragePath>& version : versions) {
+    if (!version.status().ok()) {
+      adapted_versions.emplace_back(ServableData<std::unique_ptr<Loader>>{
+          version.id(), version.status()});
+      continue;
+    }
+    std::unique_ptr<Loader> loader;
+    const Status status = Convert(version.id(), version.DataOrDie(), &loader);
+    if (status.ok()) {
+      adapted_versions.emplace_back(ServableData<std::unique_ptr<Loader>>{
+          version.id(), std::move(loader)});
+    } else {
+      adapted_versions.emplace_back(
+          ServableData<std::unique_ptr<Loader>>{version.id(), status});
+    }
+  }
+  return adapted_versions;
+}
+
+Status SavedModelBundleSourceAdapter::Convert(const ServableId& id,
+                                              const StoragePath& path,
                                               std::unique_ptr<Loader>* loader) {
   std::shared_ptr<SavedModelBundleFactory> bundle_factory = bundle_factory_;
-  auto servable_creator = [bundle_factory,
+  auto servable_creator = [bundle_factory, id,
                            path](std::unique_ptr<SavedModelBundle>* bundle) {
-    return bundle_factory->CreateSavedModelBundle(path, bundle);
+    return bundle_factory->CreateSavedModelBundle(id, path, bundle);
   };
   auto resource_estimator = [bundle_factory,
                              path](ResourceAllocation* estimate) {
@@ -33,7 +33,7 @@ namespace serving {
 // It keeps a SavedModelBundleFactory as its state, which may house a batch
 // scheduler that is shared across all of the SavedModel bundles it emits.
 class SavedModelBundleSourceAdapter final
-    : public UnarySourceAdapter<StoragePath, std::unique_ptr<Loader>> {
+    : public SourceAdapter<StoragePath, std::unique_ptr<Loader>> {
  public:
   // TODO(b/32248363): Switch to SavedModelBundleSourceAdapterConfig after we
   // switch Model Server to Saved Model and populate the "real" fields of
@@ -54,8 +54,15 @@ class SavedModelBundleSourceAdapter final
   explicit SavedModelBundleSourceAdapter(
       std::unique_ptr<SavedModelBundleFactory> bundle_factory);
 
-  Status Convert(const StoragePath& path,
-                 std::unique_ptr<Loader>* loader) override;
+  // Like UnarySourceAdapter::Adapt(), but passes each version's id on to
+  // Convert(), so that the bundles know the name of their servable.
+  std::vector<ServableData<std::unique_ptr<Loader>>> Adapt(
+      const StringPiece servable_name,
+      std::vector<ServableData<StoragePath>> versions) override;
+
+  // Creates a loader of servable version 'id' from 'path'.
+  Status Convert(const ServableId& id, const StoragePath& path,
+                 std::unique_ptr<Loader>* loader);
 
   // We use a shared ptr to share ownership with Loaders we emit, in case they
   // outlive this object.
@@ -15,13 +15,51 @@ limitations under the License.
 
 #include "tensorflow_serving/servables/tensorflow/serving_session.h"
 
+#include <memory>
+
 #include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
 
 namespace tensorflow {
 namespace serving {
 
+namespace {
+
+// Parses each of 'input_protos' into a tensor in '*inputs'.
+Status ParseInputProtos(
+    const std::vector<std::pair<string, const TensorProto*>>& input_protos,
+    std::vector<std::pair<string, Tensor>>* inputs) {
+  inputs->clear();
+  inputs->reserve(input_protos.size());
+  for (const auto& entry : input_protos) {
+    Tensor tensor;
+    if (!tensor.FromProto(*entry.second)) {
+      return errors::InvalidArgument("tensor parsing error: ", entry.first);
+    }
+    inputs->emplace_back(entry.first, std::move(tensor));
+  }
+  return Status::OK();
+}
+
+// Calls 'session->Run()' without target nodes, passing 'run_options' unless
+// they are the defaults (since not every session supports them).
+Status RunSession(Session* session, const RunOptions& run_options,
+                  const std::vector<std::pair<string, Tensor>>& inputs,
+                  const std::vector<string>& output_tensor_names,
+                  std::vector<Tensor>* outputs) {
+  if (run_options.ByteSize() == 0) {
+    return session->Run(inputs, output_tensor_names, {} /* target nodes */,
+                        outputs);
+  }
+  RunMetadata run_metadata;
+  return session->Run(run_options, inputs, output_tensor_names,
+                      {} /* target nodes */, outputs, &run_metadata);
+}
+
+}  // namespace
+
 Status ServingSession::Create(const GraphDef& graph) {
   return errors::PermissionDenied("State changes denied via ServingSession");
 }
@@ -34,5 +72,113 @@ Status ServingSession::Close() {
   return errors::PermissionDenied("State changes denied via ServingSession");
 }
 
+RunSignatureHandle ServingSession::ResolveRunSignature(
+    const std::vector<string>& input_tensor_names,
+    const std::vector<string>& output_tensor_names) const {
+  return RunSignatureHandle();
+}
+
+void ServingSession::RunAsync(
+    const RunOptions& run_options, const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, Tensor>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  done(RunSession(this, run_options, inputs, output_tensor_names, outputs));
+}
+
+void ServingSession::RunAsyncFromProtos(
+    const RunOptions& run_options, const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  // The parsed tensors must outlive the call, so 'done' holds on to them.
+  auto parsed_inputs =
+      std::make_shared<std::vector<std::pair<string, Tensor>>>();
+  const Status parse_status = ParseInputProtos(inputs, parsed_inputs.get());
+  if (!parse_status.ok()) {
+    done(parse_status);
+    return;
+  }
+  RunAsync(run_options, signature, *parsed_inputs, output_tensor_names,
+           outputs,
+           [parsed_inputs, done](const Status& status) { done(status); });
+}
+
+bool ServingSession::RunsAsync() const { return false; }
+
+bool SessionRunsAsync(const Session* session) {
+  const ServingSession* serving_session =
+      dynamic_cast<const ServingSession*>(session);
+  return serving_session != nullptr && serving_session->RunsAsync();
+}
+
+RunSignatureHandle ResolveRunSignature(
+    const Session* session, const std::vector<string>& input_tensor_names,
+    const std::vector<string>& output_tensor_names) {
+  const ServingSession* serving_session =
+      dynamic_cast<const ServingSession*>(session);
+  if (serving_session == nullptr) {
+    return RunSignatureHandle();
+  }
+  return serving_session->ResolveRunSignature(input_tensor_names,
+                                              output_tensor_names);
+}
+
+void RunSessionAsync(Session* session, const RunOptions& run_options,
+                     const RunSignatureHandle& signature,
+                     const std::vector<std::pair<string, Tensor>>& inputs,
+                     const std::vector<string>& output_tensor_names,
+                     std::vector<Tensor>* outputs,
+                     std::function<void(const Status&)> done) {
+  ServingSession* serving_session = dynamic_cast<ServingSession*>(session);
+  if (serving_session != nullptr) {
+    serving_session->RunAsync(run_options, signature, inputs,
+                              output_tensor_names, outputs, std::move(done));
+    return;
+  }
+  done(RunSession(session, run_options, inputs, output_tensor_names, outputs));
+}
+
+void RunSessionAsync(Session* session,
+                     const std::vector<std::pair<string, Tensor>>& inputs,
+                     const std::vector<string>& output_tensor_names,
+                     std::vector<Tensor>* outputs,
+                     std::function<void(const Status&)> done) {
+  RunSessionAsync(session, RunOptions(), RunSignatureHandle(), inputs,
+                  output_tensor_names, outputs, std::move(done));
+}
+
+void RunSessionAsyncFromProtos(
+    Session* session, const RunOptions& run_options,
+    const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  ServingSession* serving_session = dynamic_cast<ServingSession*>(session);
+  if (serving_session != nullptr) {
+    serving_session->RunAsyncFromProtos(run_options, signature, inputs,
+                                        output_tensor_names, outputs,
+                                        std::move(done));
+    return;
+  }
+  std::vector<std::pair<string, Tensor>> parsed_inputs;
+  const Status parse_status = ParseInputProtos(inputs, &parsed_inputs);
+  if (!parse_status.ok()) {
+    done(parse_status);
+    return;
+  }
+  done(RunSession(session, run_options, parsed_inputs, output_tensor_names,
+                  outputs));
+}
+
+void RunSessionAsyncFromProtos(
+    Session* session,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done) {
+  RunSessionAsyncFromProtos(session, RunOptions(), RunSignatureHandle(), inputs,
+                            output_tensor_names, outputs, std::move(done));
+}
+
 }  // namespace serving
 }  // namespace tensorflow
@@ -16,16 +16,48 @@ limitations under the License.
 #ifndef TENSORFLOW_SERVING_SERVABLES_TENSORFLOW_SERVING_SESSION_H_
 #define TENSORFLOW_SERVING_SERVABLES_TENSORFLOW_SERVING_SESSION_H_
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "tensorflow/core/framework/tensor.pb.h"
+#include "tensorflow/core/protobuf/config.pb.h"
 #include "tensorflow/core/public/session.h"
 
 namespace tensorflow {
 namespace serving {
 
+// A Run() signature, i.e. the set of a call's input and output tensor names,
+// that a ServingSession has resolved ahead of time (see
+// ServingSession::ResolveRunSignature()), so that calls with that signature
+// can be routed without matching the tensor names again. A default-constructed
+// handle is unresolved.
+//
+// A handle does not keep its session alive, and may be kept after the session
+// has been destroyed; it then expires, and is treated as unresolved.
+class RunSignatureHandle {
+ public:
+  RunSignatureHandle() = default;
+
+  // For use by ServingSession implementations: 'signature' is the session's
+  // own record of the signature, owned in a way that expires it along with
+  // the session.
+  explicit RunSignatureHandle(std::weak_ptr<const void> signature)
+      : signature_(std::move(signature)) {}
+
+  // Returns the session's record of the signature, or null if the handle is
+  // unresolved or has expired.
+  std::shared_ptr<const void> Lock() const { return signature_.lock(); }
+
+  // Returns true iff the handle is unresolved or has expired.
+  bool expired() const { return signature_.expired(); }
+
+ private:
+  std::weak_ptr<const void> signature_;
+};
+
 // A Session that blocks state-changing methods such as Close(), while allowing
 // Run() for read-only access (not enforced). Useful for Session implementations
 // that intend to be read-only and only implement Run().
@@ -39,9 +71,108 @@ class ServingSession : public Session {
   Status Extend(const GraphDef& graph) final;
   Status Close() final;
 
-  // (Subclasses just implement Run().)
+  // Resolves the signature of calls with 'input_tensor_names' and
+  // 'output_tensor_names' (in any order) into a handle that can be passed to
+  // RunAsync() and RunAsyncFromProtos() calls with exactly those tensor names.
+  // The names are matched against the session's signatures here, once, rather
+  // than per call. Intended to be called once per signature, e.g. when a
+  // servable is loaded.
+  //
+  // The default implementation returns an unresolved handle. Subclasses that
+  // route calls by signature (e.g. BatchingSession) override it.
+  virtual RunSignatureHandle ResolveRunSignature(
+      const std::vector<string>& input_tensor_names,
+      const std::vector<string>& output_tensor_names) const;
+
+  // Like Run(), but may return before the call has finished, in which case
+  // 'done' is invoked with the call's status once it has (possibly in another
+  // thread). 'inputs', 'output_tensor_names' and 'outputs' must remain valid
+  // until 'done' is invoked. Does not support target nodes or RunMetadata.
+  // 'run_options' are as for Run() (e.g. 'timeout_in_ms' sets the call's
+  // deadline). 'signature' is either unresolved, or a handle resolved for
+  // exactly the call's tensor names: a handle this session resolved routes the
+  // call on its own, without the names being matched again. (Handles resolved
+  // by other sessions are ignored.)
+  //
+  // The default implementation calls Run() (with 'run_options', unless they
+  // are the defaults) and then invokes 'done' in the calling thread.
+  // Subclasses that queue calls (e.g. BatchingSession) override it so that no
+  // thread is tied up while a call is queued.
+  virtual void RunAsync(const RunOptions& run_options,
+                        const RunSignatureHandle& signature,
+                        const std::vector<std::pair<string, Tensor>>& inputs,
+                        const std::vector<string>& output_tensor_names,
+                        std::vector<Tensor>* outputs,
+                        std::function<void(const Status&)> done);
+
+  // Like RunAsync(), but takes the inputs as TensorProtos, which must remain
+  // valid until 'done' is invoked. A malformed proto fails the call with
+  // INVALID_ARGUMENT.
+  //
+  // The default implementation parses the protos into tensors and calls
+  // RunAsync(). Subclasses that stage inputs in buffers of their own (e.g.
+  // BatchingSession) override it to decode the protos straight into them.
+  virtual void RunAsyncFromProtos(
+      const RunOptions& run_options, const RunSignatureHandle& signature,
+      const std::vector<std::pair<string, const TensorProto*>>& inputs,
+      const std::vector<string>& output_tensor_names,
+      std::vector<Tensor>* outputs, std::function<void(const Status&)> done);
+
+  // Whether RunAsync() and RunAsyncFromProtos() return without waiting for
+  // calls to run (e.g. once they have been queued), so that callers need not
+  // set aside a thread per call in flight. The default implementation returns
+  // false, as do the default RunAsync() and RunAsyncFromProtos().
+  virtual bool RunsAsync() const;
+
+  // (Subclasses just implement Run(), and optionally ResolveRunSignature(),
+  // RunAsync(), RunAsyncFromProtos() and RunsAsync().)
 };
 
+// Calls 'session->ResolveRunSignature()' if 'session' is a ServingSession.
+// Otherwise returns an unresolved handle.
+RunSignatureHandle ResolveRunSignature(
+    const Session* session, const std::vector<string>& input_tensor_names,
+    const std::vector<string>& output_tensor_names);
+
+// Calls 'session->RunsAsync()' if 'session' is a ServingSession. Otherwise
+// returns false.
+bool SessionRunsAsync(const Session* session);
+
+// Calls 'session->RunAsync()' if 'session' is a ServingSession. Otherwise calls
+// 'session->Run()' (with 'run_options', unless they are the defaults) and then
+// invokes 'done' in the calling thread.
+void RunSessionAsync(Session* session, const RunOptions& run_options,
+                     const RunSignatureHandle& signature,
+                     const std::vector<std::pair<string, Tensor>>& inputs,
+                     const std::vector<string>& output_tensor_names,
+                     std::vector<Tensor>* outputs,
+                     std::function<void(const Status&)> done);
+
+// As above, with default RunOptions and an unresolved signature handle.
+void RunSessionAsync(Session* session,
+                     const std::vector<std::pair<string, Tensor>>& inputs,
+                     const std::vector<string>& output_tensor_names,
+                     std::vector<Tensor>* outputs,
+                     std::function<void(const Status&)> done);
+
+// Calls 'session->RunAsyncFromProtos()' if 'session' is a ServingSession.
+// Otherwise parses 'inputs' into tensors, calls 'session->Run()' (with
+// 'run_options', unless they are the defaults) and then invokes 'done' in the
+// calling thread.
+void RunSessionAsyncFromProtos(
+    Session* session, const RunOptions& run_options,
+    const RunSignatureHandle& signature,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done);
+
+// As above, with default RunOptions and an unresolved signature handle.
+void RunSessionAsyncFromProtos(
+    Session* session,
+    const std::vector<std::pair<string, const TensorProto*>>& inputs,
+    const std::vector<string>& output_tensor_names,
+    std::vector<Tensor>* outputs, std::function<void(const Status&)> done);
+
 // A ServingSession that wraps a given Session, and blocks all calls other than
 // Run().
 class ServingSessionWrapper : public ServingSession {
@@ -58,6 +189,44 @@ class ServingSessionWrapper : public ServingSession {
                          outputs);
   }
 
+  Status Run(const RunOptions& run_options,
+             const std::vector<std::pair<string, Tensor>>& inputs,
+             const std::vector<string>& output_tensor_names,
+             const std::vector<string>& target_node_names,
+             std::vector<Tensor>* outputs, RunMetadata* run_metadata) override {
+    return wrapped_->Run(run_options, inputs, output_tensor_names,
+                         target_node_names, outputs, run_metadata);
+  }
+
+  RunSignatureHandle ResolveRunSignature(
+      const std::vector<string>& input_tensor_names,
+      const std::vector<string>& output_tensor_names) const override {
+    return serving::ResolveRunSignature(wrapped_.get(), input_tensor_names,
+                                        output_tensor_names);
+  }
+
+  void RunAsync(const RunOptions& run_options,
+                const RunSignatureHandle& signature,
+                const std::vector<std::pair<string, Tensor>>& inputs,
+                const std::vector<string>& output_tensor_names,
+                std::vector<Tensor>* outputs,
+                std::function<void(const Status&)> done) override {
+    RunSessionAsync(wrapped_.get(), run_options, signature, inputs,
+                    output_tensor_names, outputs, std::move(done));
+  }
+
+  void RunAsyncFromProtos(
+      const RunOptions& run_options, const RunSignatureHandle& signature,
+      const std::vector<std::pair<string, const TensorProto*>>& inputs,
+      const std::vector<string>& output_tensor_names,
+      std::vector<Tensor>* outputs,
+      std::function<void(const Status&)> done) override {
+    RunSessionAsyncFromProtos(wrapped_.get(), run_options, signature, inputs,
+                              output_tensor_names, outputs, std::move(done));
+  }
+
+  bool RunsAsync() const override { return SessionRunsAsync(wrapped_.get()); }
+
  private:
   std::unique_ptr<Session> wrapped_;
 
@@ -74,7 +74,8 @@ Status SessionBundleFactory::EstimateResourceRequirement(
 }
 
 Status SessionBundleFactory::CreateSessionBundle(
-    const string& path, std::unique_ptr<SessionBundle>* bundle) {
+    const ServableId& id, const string& path,
+    std::unique_ptr<SessionBundle>* bundle) {
   bundle->reset(new SessionBundle);
   TF_RETURN_IF_ERROR(LoadSessionBundleFromPathUsingRunOptions(
       GetSessionOptions(config_), GetRunOptions(config_), path, bundle->get()));
@@ -87,7 +88,7 @@ Status SessionBundleFactory::CreateSessionBundle(
     std::vector<SignatureDef> signatures;
     TF_RETURN_IF_ERROR(GetSignatureDefs(**bundle, &signatures));
     return WrapSessionForBatching(config_.batching_parameters(),
-                                  batch_scheduler_, signatures,
+                                  batch_scheduler_, signatures, id.name,
                                   &(*bundle)->session);
   }
   return WrapSession(&(*bundle)->session);
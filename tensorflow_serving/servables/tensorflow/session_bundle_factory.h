@@ -20,6 +20,7 @@ limitations under the License.
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow_serving/batching/batching_session.h"
 #include "tensorflow_serving/batching/shared_batch_scheduler.h"
+#include "tensorflow_serving/core/servable_id.h"
 #include "tensorflow_serving/resources/resources.pb.h"
 #include "tensorflow_serving/servables/tensorflow/session_bundle_config.pb.h"
 
@@ -48,8 +49,9 @@ class SessionBundleFactory {
   static Status Create(const SessionBundleConfig& config,
                        std::unique_ptr<SessionBundleFactory>* factory);
 
-  // Instantiates a bundle from a given export path.
-  Status CreateSessionBundle(const string& path,
+  // Instantiates a bundle of servable version 'id' from a given export path.
+  // The servable's name labels the bundle's batching metrics, if any.
+  Status CreateSessionBundle(const ServableId& id, const string& path,
                              std::unique_ptr<SessionBundle>* bundle);
 
   // Estimates the resources a session bundle will use once loaded, from its
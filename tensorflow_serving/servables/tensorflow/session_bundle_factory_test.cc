@@ -53,7 +53,8 @@ class SessionBundleFactoryTest : public test_util::BundleFactoryTest {
     std::unique_ptr<SessionBundleFactory> factory;
     TF_RETURN_IF_ERROR(SessionBundleFactory::Create(config, &factory));
     std::unique_ptr<SessionBundle> bundle;
-    TF_RETURN_IF_ERROR(factory->CreateSessionBundle(export_dir_, &bundle));
+    TF_RETURN_IF_ERROR(
+        factory->CreateSessionBundle({"test_model", 0}, export_dir_, &bundle));
     *session = std::move(bundle->session);
     return Status::OK();
   }
@@ -17,6 +17,8 @@ limitations under the License.
 
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow_serving/core/simple_loader.h"
@@ -41,12 +43,37 @@ SessionBundleSourceAdapter::SessionBundleSourceAdapter(
     std::unique_ptr<SessionBundleFactory> bundle_factory)
     : bundle_factory_(std::move(bundle_factory)) {}
 
-Status SessionBundleSourceAdapter::Convert(const StoragePath& path,
+std::vector<ServableData<std::unique_ptr<Loader>>>
+SessionBundleSourceAdapter::Adapt(
+    const StringPiece servable_name,
+    std::vector<ServableData<StoragePath>> versions) {
+  std::vector<ServableData<std::unique_ptr<Loader>>> adapted_versions;
+  for (const ServableData<StoragePath>& version : versions) {
+    if (!version.status().ok()) {
+      adapted_versions.emplace_back(ServableData<std::unique_ptr<Loader>>{
+          version.id(), version.status()});
+      continue;
+    }
+    std::unique_ptr<Loader> loader;
+    const Status status = Convert(version.id(), version.DataOrDie(), &loader);
+    if (status.ok()) {
+      adapted_versions.emplace_back(ServableData<std::unique_ptr<Loader>>{
+          version.id(), std::move(loader)});
+    } else {
+      adapted_versions.emplace_back(
+          ServableData<std::unique_ptr<Loader>>{version.id(), status});
+    }
+  }
+  return adapted_versions;
+}
+
+Status SessionBundleSourceAdapter::Convert(const ServableId& id,
+                                           const StoragePath& path,
                                            std::unique_ptr<Loader>* loader) {
   std::shared_ptr<SessionBundleFactory> bundle_factory = bundle_factory_;
-  auto servable_creator = [bundle_factory,
+  auto servable_creator = [bundle_factory, id,
                            path](std::unique_ptr<SessionBundle>* bundle) {
-    return bundle_factory->CreateSessionBundle(path, bundle);
+    return bundle_factory->CreateSessionBundle(id, path, bundle);
   };
   auto resource_estimator = [bundle_factory,
                              path](ResourceAllocation* estimate) {
@@ -31,7 +31,7 @@ namespace serving {
 // keeps a SessionBundleFactory as its state, which may house a batch scheduler
 // that is shared across all of the session bundles it emits.
 class SessionBundleSourceAdapter final
-    : public UnarySourceAdapter<StoragePath, std::unique_ptr<Loader>> {
+    : public SourceAdapter<StoragePath, std::unique_ptr<Loader>> {
  public:
   static Status Create(const SessionBundleSourceAdapterConfig& config,
                        std::unique_ptr<SessionBundleSourceAdapter>* adapter);
@@ -49,8 +49,15 @@ class SessionBundleSourceAdapter final
   explicit SessionBundleSourceAdapter(
       std::unique_ptr<SessionBundleFactory> bundle_factory);
 
-  Status Convert(const StoragePath& path,
-                 std::unique_ptr<Loader>* loader) override;
+  // Like UnarySourceAdapter::Adapt(), but passes each version's id on to
+  // Convert(), so that the bundles know the name of their servable.
+  std::vector<ServableData<std::unique_ptr<Loader>>> Adapt(
+      const StringPiece servable_name,
+      std::vector<ServableData<StoragePath>> versions) override;
+
+  // Creates a loader of servable version 'id' from 'path'.
+  Status Convert(const ServableId& id, const StoragePath& path,
+                 std::unique_ptr<Loader>* loader);
 
   // We use a shared ptr to share ownership with Loaders we emit, in case they
   // outlive this object.
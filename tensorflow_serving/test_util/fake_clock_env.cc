@@ -16,6 +16,7 @@ limitations under the License.
 #include "tensorflow_serving/test_util/fake_clock_env.h"
 
 #include <string>
+#include <utility>
 
 namespace tensorflow {
 namespace serving {
@@ -36,6 +37,22 @@ void FakeClockEnv::AdvanceByMicroseconds(int micros) {
       }
     }
   }
+  mutex_lock l(listeners_mu_);
+  for (const auto& listener : advance_listeners_) {
+    listener.second();
+  }
+}
+
+int FakeClockEnv::AddAdvanceListener(std::function<void()> listener) {
+  mutex_lock l(listeners_mu_);
+  const int id = next_listener_id_++;
+  advance_listeners_.emplace(id, std::move(listener));
+  return id;
+}
+
+void FakeClockEnv::RemoveAdvanceListener(int id) {
+  mutex_lock l(listeners_mu_);
+  advance_listeners_.erase(id);
 }
 
 void FakeClockEnv::BlockUntilSleepingThread(uint64 wake_time) {
@@ -17,6 +17,7 @@ limitations under the License.
 #define TENSORFLOW_SERVING_TEST_UTIL_FAKE_CLOCK_ENV_H_
 
 #include <functional>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -44,6 +45,14 @@ class FakeClockEnv : public EnvWrapper {
   // Advance the clock by a certain number of microseconds.
   void AdvanceByMicroseconds(int micros);
 
+  // Registers 'listener' to be called each time the clock advances, until the
+  // returned id is passed to RemoveAdvanceListener(). Useful for waking
+  // threads that wait for the clock in real time (e.g. on a condition
+  // variable). The listener is called without holding the clock's lock, and
+  // must not call AdvanceByMicroseconds() or (Add|Remove)AdvanceListener().
+  int AddAdvanceListener(std::function<void()> listener);
+  void RemoveAdvanceListener(int id);
+
   // Blocks until there is a sleeping thread that is scheduled to wake up at
   // the given (absolute) time.
   void BlockUntilSleepingThread(uint64 wake_time);
@@ -66,6 +75,13 @@ class FakeClockEnv : public EnvWrapper {
   };
   std::vector<SleepingThread> sleeping_threads_ GUARDED_BY(mu_);
 
+  // Held while calling the advance listeners, so that a listener is not
+  // called once RemoveAdvanceListener() has returned.
+  mutex listeners_mu_;
+  int next_listener_id_ GUARDED_BY(listeners_mu_) = 0;
+  std::map<int, std::function<void()>> advance_listeners_
+      GUARDED_BY(listeners_mu_);
+
   TF_DISALLOW_COPY_AND_ASSIGN(FakeClockEnv);
 };
 
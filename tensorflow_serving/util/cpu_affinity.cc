@@ -0,0 +1,96 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/util/cpu_affinity.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace tensorflow {
+namespace serving {
+
+Status ParseCpuList(StringPiece cpu_list, std::vector<int>* cpus) {
+  cpus->clear();
+  str_util::RemoveWhitespaceContext(&cpu_list);
+  if (cpu_list.empty()) {
+    return Status::OK();
+  }
+  for (const string& range : str_util::Split(cpu_list, ',')) {
+    const std::vector<string> bounds = str_util::Split(range, '-');
+    int first;
+    int last;
+    if (bounds.size() > 2 || !strings::safe_strto32(bounds[0], &first) ||
+        !strings::safe_strto32(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      return errors::InvalidArgument("Invalid CPU list: ", cpu_list);
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+  }
+  std::sort(cpus->begin(), cpus->end());
+  cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+  return Status::OK();
+}
+
+Status GetNumaNodeCpus(int numa_node, std::vector<int>* cpus) {
+#if defined(__linux__)
+  string cpu_list;
+  TF_RETURN_IF_ERROR(ReadFileToString(
+      Env::Default(),
+      strings::StrCat("/sys/devices/system/node/node", numa_node, "/cpulist"),
+      &cpu_list));
+  TF_RETURN_IF_ERROR(ParseCpuList(cpu_list, cpus));
+  if (cpus->empty()) {
+    return errors::InvalidArgument("NUMA node ", numa_node, " has no CPUs");
+  }
+  return Status::OK();
+#else
+  return errors::Unimplemented("NUMA nodes are only supported on Linux");
+#endif
+}
+
+Status PinCurrentThreadToCpus(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return errors::InvalidArgument("Invalid CPU: ", cpu);
+    }
+    CPU_SET(cpu, &cpu_set);
+  }
+  if (sched_setaffinity(0 /* calling thread */, sizeof(cpu_set), &cpu_set) !=
+      0) {
+    return errors::Internal("sched_setaffinity failed with errno ", errno);
+  }
+  return Status::OK();
+#else
+  return errors::Unimplemented("CPU affinity is only supported on Linux");
+#endif
+}
+
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,43 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Utilities for restricting threads to sets of CPUs, e.g. those of one NUMA
+// node.
+
+#ifndef TENSORFLOW_SERVING_UTIL_CPU_AFFINITY_H_
+#define TENSORFLOW_SERVING_UTIL_CPU_AFFINITY_H_
+
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/stringpiece.h"
+
+namespace tensorflow {
+namespace serving {
+
+// Parses a list of CPU numbers in the format the Linux kernel uses for CPU
+// sets, e.g. "0-3,8,10-11", into '*cpus' (in increasing order).
+Status ParseCpuList(StringPiece cpu_list, std::vector<int>* cpus);
+
+// Gets the CPUs of NUMA node 'numa_node'. Only supported on Linux.
+Status GetNumaNodeCpus(int numa_node, std::vector<int>* cpus);
+
+// Restricts the calling thread to run on 'cpus'. Only supported on Linux.
+Status PinCurrentThreadToCpus(const std::vector<int>& cpus);
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_UTIL_CPU_AFFINITY_H_
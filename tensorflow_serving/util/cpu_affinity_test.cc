@@ -0,0 +1,93 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/util/cpu_affinity.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <memory>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow/core/platform/env.h"
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+TEST(CpuAffinityTest, ParseCpuList) {
+  std::vector<int> cpus;
+  TF_ASSERT_OK(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_THAT(cpus, ElementsAre(0, 1, 2, 3, 8, 10, 11));
+
+  TF_ASSERT_OK(ParseCpuList("5,1-2,2", &cpus));
+  EXPECT_THAT(cpus, ElementsAre(1, 2, 5));
+
+  TF_ASSERT_OK(ParseCpuList("", &cpus));
+  EXPECT_THAT(cpus, IsEmpty());
+}
+
+TEST(CpuAffinityTest, ParseInvalidCpuList) {
+  std::vector<int> cpus;
+  EXPECT_FALSE(ParseCpuList("0-", &cpus).ok());
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus).ok());
+  EXPECT_FALSE(ParseCpuList("1-2-3", &cpus).ok());
+  EXPECT_FALSE(ParseCpuList("a", &cpus).ok());
+  EXPECT_FALSE(ParseCpuList("1,,2", &cpus).ok());
+}
+
+#if defined(__linux__)
+TEST(CpuAffinityTest, PinCurrentThreadToCpus) {
+  // Pin a thread of its own, so as not to restrict the test's other threads,
+  // to a CPU it is allowed to run on (which need not include CPU 0).
+  std::unique_ptr<Thread> thread(Env::Default()->StartThread(
+      ThreadOptions(), "PinnedThread", [] {
+        cpu_set_t original_cpu_set;
+        CPU_ZERO(&original_cpu_set);
+        ASSERT_EQ(0, sched_getaffinity(0 /* calling thread */,
+                                       sizeof(original_cpu_set),
+                                       &original_cpu_set));
+        int cpu = 0;
+        while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &original_cpu_set)) {
+          ++cpu;
+        }
+        ASSERT_LT(cpu, CPU_SETSIZE);
+
+        TF_EXPECT_OK(PinCurrentThreadToCpus({cpu}));
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        ASSERT_EQ(0, sched_getaffinity(0 /* calling thread */,
+                                       sizeof(cpu_set), &cpu_set));
+        EXPECT_EQ(1, CPU_COUNT(&cpu_set));
+        EXPECT_TRUE(CPU_ISSET(cpu, &cpu_set));
+        EXPECT_FALSE(PinCurrentThreadToCpus({-1}).ok());
+
+        // Restore the thread's original CPUs.
+        EXPECT_EQ(0, sched_setaffinity(0 /* calling thread */,
+                                       sizeof(original_cpu_set),
+                                       &original_cpu_set));
+      }));
+}
+#endif
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
@@ -0,0 +1,238 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Free lists for recycling objects, and the memory of objects, that are
+// created and destroyed at a steady rate (e.g. once per request), so that in
+// steady state they do not go through the allocator.
+
+#ifndef TENSORFLOW_SERVING_UTIL_FREE_LIST_H_
+#define TENSORFLOW_SERVING_UTIL_FREE_LIST_H_
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+
+namespace tensorflow {
+namespace serving {
+
+// A thread-safe list of up to 'max_size' recycled objects of type T (which
+// must be movable). Space for the objects is allocated up front, so Push() and
+// Pop() do not allocate.
+//
+// Example, recycling vectors along with their capacity:
+//   FreeList<std::vector<int>> free_list(16);
+//   std::vector<int> v;
+//   free_list.Pop(&v);  // 'v' keeps its (empty) value if the list is empty
+//   ... use 'v' ...
+//   v.clear();
+//   free_list.Push(&v);
+template <typename T>
+class FreeList {
+ public:
+  explicit FreeList(size_t max_size) : max_size_(max_size) {
+    objects_.reserve(max_size);
+  }
+  ~FreeList() = default;
+
+  // Moves the most recently pushed object into '*object' and returns true, or
+  // returns false (leaving '*object' untouched) if the list is empty.
+  bool Pop(T* object) {
+    mutex_lock l(mu_);
+    if (objects_.empty()) {
+      return false;
+    }
+    *object = std::move(objects_.back());
+    objects_.pop_back();
+    return true;
+  }
+
+  // Moves '*object' onto the list and returns true, or returns false (leaving
+  // '*object' untouched) if the list already holds 'max_size' objects.
+  bool Push(T* object) {
+    mutex_lock l(mu_);
+    if (objects_.size() >= max_size_) {
+      return false;
+    }
+    objects_.push_back(std::move(*object));
+    return true;
+  }
+
+  // Like Pop(), for up to 'n' objects at once, which are moved into
+  // 'objects[0]' onwards. Returns the number of objects moved.
+  size_t PopMany(T* objects, size_t n) {
+    mutex_lock l(mu_);
+    size_t num_popped = 0;
+    while (num_popped < n && !objects_.empty()) {
+      objects[num_popped++] = std::move(objects_.back());
+      objects_.pop_back();
+    }
+    return num_popped;
+  }
+
+  // Like Push(), for the 'n' objects 'objects[0]' onwards. Returns the number
+  // of objects moved onto the list, which are the first ones.
+  size_t PushMany(T* objects, size_t n) {
+    mutex_lock l(mu_);
+    size_t num_pushed = 0;
+    while (num_pushed < n && objects_.size() < max_size_) {
+      objects_.push_back(std::move(objects[num_pushed++]));
+    }
+    return num_pushed;
+  }
+
+  // Returns the number of objects on the list.
+  size_t size() const {
+    mutex_lock l(mu_);
+    return objects_.size();
+  }
+
+ private:
+  const size_t max_size_;
+
+  mutable mutex mu_;
+
+  std::vector<T> objects_ GUARDED_BY(mu_);
+
+  TF_DISALLOW_COPY_AND_ASSIGN(FreeList);
+};
+
+// A base class that gives class T class-specific operator new and delete,
+// which recycle the memory of deleted T objects for new ones. Objects of
+// subclasses of T, whose size differs, are allocated as usual.
+//
+// Each thread keeps up to 64 (or 'kMaxFreeBlocks', if fewer) free blocks in a
+// cache of its own, which it allocates from and frees to without locking. A
+// thread whose cache runs empty or full moves half a cache's worth of blocks
+// from or to a shared free list of up to 'kMaxFreeBlocks' blocks, under a
+// single lock acquisition. The shared list thus lets blocks freed by one thread
+// be reused by another (e.g. objects created by request threads and destroyed
+// by batch threads), without making it a point of contention. A thread's cached
+// blocks go to the shared list when it exits; blocks that fit on neither are
+// freed.
+//
+// Example:
+//   class Request : public FreeListAllocated<Request> { ... };
+//   std::unique_ptr<Request> request(new Request);  // reuses freed memory
+template <typename T, size_t kMaxFreeBlocks = 1024>
+class FreeListAllocated {
+ public:
+  static void* operator new(size_t size) {
+    if (size == sizeof(T)) {
+      ThreadCache* const cache = GetThreadCache();
+      if (cache != nullptr) {
+        if (cache->num_blocks == 0) {
+          cache->num_blocks =
+              SharedFreeList()->PopMany(cache->blocks, kTransferSize);
+        }
+        if (cache->num_blocks > 0) {
+          return cache->blocks[--cache->num_blocks];
+        }
+      }
+    }
+    return ::operator new(size);
+  }
+
+  static void operator delete(void* block, size_t size) {
+    if (block == nullptr) {
+      return;
+    }
+    if (size == sizeof(T)) {
+      ThreadCache* const cache = GetThreadCache();
+      if (cache != nullptr) {
+        if (cache->num_blocks == kMaxThreadCachedBlocks) {
+          cache->num_blocks -= kTransferSize;
+          ReleaseBlocks(cache->blocks + cache->num_blocks, kTransferSize);
+        }
+        cache->blocks[cache->num_blocks++] = block;
+        return;
+      }
+    }
+    ::operator delete(block);
+  }
+
+  // Returns the number of free blocks available to the calling thread, i.e.
+  // those in its cache and on the shared free list.
+  static size_t NumFreeBlocks() {
+    const ThreadCache* const cache = GetThreadCache();
+    return (cache == nullptr ? 0 : cache->num_blocks) +
+           SharedFreeList()->size();
+  }
+
+ protected:
+  FreeListAllocated() = default;
+  ~FreeListAllocated() = default;
+
+ private:
+  static_assert(kMaxFreeBlocks > 0, "kMaxFreeBlocks must be positive");
+
+  static constexpr size_t kMaxThreadCachedBlocks =
+      kMaxFreeBlocks < 64 ? kMaxFreeBlocks : 64;
+  static constexpr size_t kTransferSize = (kMaxThreadCachedBlocks + 1) / 2;
+
+  // A thread's cache of free blocks. Trivially destructible, so that it
+  // remains usable until the thread is gone; 'ThreadCacheFlusher' empties it
+  // when the thread exits, after which it is bypassed.
+  struct ThreadCache {
+    void* blocks[kMaxThreadCachedBlocks];
+    size_t num_blocks;
+    bool flusher_created;
+    bool thread_exiting;
+  };
+
+  struct ThreadCacheFlusher {
+    explicit ThreadCacheFlusher(ThreadCache* cache) : cache(cache) {}
+    ~ThreadCacheFlusher() {
+      ReleaseBlocks(cache->blocks, cache->num_blocks);
+      cache->num_blocks = 0;
+      cache->thread_exiting = true;
+    }
+    ThreadCache* const cache;
+  };
+
+  // Returns the calling thread's cache, or null if the thread is exiting.
+  static ThreadCache* GetThreadCache() {
+    static thread_local ThreadCache cache;  // zero-initialized
+    if (!cache.flusher_created) {
+      cache.flusher_created = true;
+      static thread_local ThreadCacheFlusher flusher(&cache);
+    }
+    return cache.thread_exiting ? nullptr : &cache;
+  }
+
+  // Moves 'n' blocks onto the shared free list, freeing those that don't fit.
+  static void ReleaseBlocks(void** blocks, size_t n) {
+    for (size_t i = SharedFreeList()->PushMany(blocks, n); i < n; ++i) {
+      ::operator delete(blocks[i]);
+    }
+  }
+
+  // Never destroyed, so that objects deleted during static destruction can
+  // still use it.
+  static FreeList<void*>* SharedFreeList() {
+    static FreeList<void*>* const free_list =
+        new FreeList<void*>(kMaxFreeBlocks);
+    return free_list;
+  }
+};
+
+}  // namespace serving
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_SERVING_UTIL_FREE_LIST_H_
@@ -0,0 +1,193 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for allocating and freeing FreeListAllocated objects from many
+// threads at once, compared with the default allocator. Each thread allocates
+// objects in bursts (like the tasks of a batch) and frees them either itself,
+// or after handing them to whichever thread comes next (like tasks created by
+// request threads and destroyed by batch threads).
+//
+// As in fast_read_dynamic_ptr_benchmark, the threads do no other work between
+// allocations, so this measures the worst-case contention.
+//
+// Run with:
+// bazel run -c opt tensorflow_serving/util:free_list_benchmark --
+// --benchmarks=.
+
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/lib/core/notification.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/init_main.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/test_benchmark.h"
+#include "tensorflow/core/platform/types.h"
+#include "tensorflow_serving/util/free_list.h"
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+// The number of objects each thread allocates before freeing them.
+constexpr int kBurstSize = 64;
+
+// An object about the size of a small task.
+class Unpooled {
+ public:
+  int64 payload[8];
+};
+
+class Pooled : public FreeListAllocated<Pooled> {
+ public:
+  int64 payload[8];
+};
+
+// Bursts of objects that threads hand off to one another.
+template <typename ObjectType>
+class BurstExchange {
+ public:
+  BurstExchange() : bursts_(1) {}
+
+  // Adds 'burst', and takes back the burst added longest ago, which another
+  // thread added if there are several threads (or is empty, at first).
+  void Exchange(std::vector<ObjectType*>* burst) {
+    mutex_lock l(mu_);
+    bursts_.push_back(std::move(*burst));
+    *burst = std::move(bursts_.front());
+    bursts_.erase(bursts_.begin());
+  }
+
+  ~BurstExchange() {
+    for (const std::vector<ObjectType*>& burst : bursts_) {
+      for (ObjectType* object : burst) {
+        delete object;
+      }
+    }
+  }
+
+ private:
+  mutex mu_;
+  std::vector<std::vector<ObjectType*>> bursts_ GUARDED_BY(mu_);
+};
+
+template <typename ObjectType>
+void RunAllocations(int iters, Notification* start,
+                    BurstExchange<ObjectType>* exchange) {
+  start->WaitForNotification();
+  std::vector<ObjectType*> burst;
+  burst.reserve(kBurstSize);
+  for (int i = 0; i < iters; i += kBurstSize) {
+    for (int j = 0; j < kBurstSize; ++j) {
+      burst.push_back(new ObjectType);
+    }
+    if (exchange != nullptr) {
+      exchange->Exchange(&burst);
+    }
+    for (ObjectType* object : burst) {
+      delete object;
+    }
+    burst.clear();
+  }
+}
+
+template <typename ObjectType>
+void BenchmarkAllocations(bool cross_thread, int iters, int num_threads) {
+  testing::StopTiming();
+
+  // Use real time, so that items/s increases with the number of threads when
+  // they don't contend.
+  testing::UseRealTime();
+  testing::ItemsProcessed(static_cast<int64>(num_threads) * iters);
+
+  BurstExchange<ObjectType> exchange;
+  Notification start;
+  {
+    thread::ThreadPool pool(Env::Default(), "RunAllocations", num_threads);
+    for (int thread_index = 0; thread_index < num_threads; ++thread_index) {
+      pool.Schedule([iters, cross_thread, &start, &exchange]() {
+        RunAllocations(iters, &start, cross_thread ? &exchange : nullptr);
+      });
+    }
+    testing::StartTiming();
+    start.Notify();
+
+    // Destroying the pool waits for all threads to finish.
+  }
+  testing::StopTiming();
+}
+
+void BM_Unpooled_SameThread(int iters, int num_threads) {
+  BenchmarkAllocations<Unpooled>(false, iters, num_threads);
+}
+
+void BM_Pooled_SameThread(int iters, int num_threads) {
+  BenchmarkAllocations<Pooled>(false, iters, num_threads);
+}
+
+void BM_Unpooled_CrossThread(int iters, int num_threads) {
+  BenchmarkAllocations<Unpooled>(true, iters, num_threads);
+}
+
+void BM_Pooled_CrossThread(int iters, int num_threads) {
+  BenchmarkAllocations<Pooled>(true, iters, num_threads);
+}
+
+BENCHMARK(BM_Unpooled_SameThread)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16)
+    ->Arg(32)
+    ->Arg(64);
+
+BENCHMARK(BM_Pooled_SameThread)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16)
+    ->Arg(32)
+    ->Arg(64);
+
+BENCHMARK(BM_Unpooled_CrossThread)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16)
+    ->Arg(32)
+    ->Arg(64);
+
+BENCHMARK(BM_Pooled_CrossThread)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16)
+    ->Arg(32)
+    ->Arg(64);
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow
+
+int main(int argc, char** argv) {
+  tensorflow::port::InitMain(argv[0], &argc, &argv);
+  tensorflow::testing::RunBenchmarks();
+  return 0;
+}
@@ -0,0 +1,123 @@
+/* Copyright 2017 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_serving/util/free_list.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include "tensorflow/core/platform/env.h"
+
+using ::testing::IsEmpty;
+
+namespace tensorflow {
+namespace serving {
+namespace {
+
+TEST(FreeListTest, PushAndPop) {
+  FreeList<std::vector<int>> free_list(2);
+  std::vector<int> v;
+  EXPECT_FALSE(free_list.Pop(&v));
+
+  std::vector<int> a(100);
+  a.clear();
+  std::vector<int> b;
+  std::vector<int> c;
+  EXPECT_TRUE(free_list.Push(&a));
+  EXPECT_TRUE(free_list.Push(&b));
+  EXPECT_FALSE(free_list.Push(&c));
+  EXPECT_EQ(2, free_list.size());
+
+  // Objects come back in last-in, first-out order, with their capacity.
+  EXPECT_TRUE(free_list.Pop(&v));
+  EXPECT_EQ(0, v.capacity());
+  EXPECT_TRUE(free_list.Pop(&v));
+  EXPECT_THAT(v, IsEmpty());
+  EXPECT_GE(v.capacity(), 100);
+  EXPECT_FALSE(free_list.Pop(&v));
+  EXPECT_EQ(0, free_list.size());
+}
+
+class Pooled : public FreeListAllocated<Pooled, 2> {
+ public:
+  int value = 0;
+};
+
+class LargerPooled : public Pooled {
+ public:
+  int other_value = 0;
+};
+
+TEST(FreeListAllocatedTest, RecyclesMemory) {
+  std::unique_ptr<Pooled> first(new Pooled);
+  Pooled* const first_address = first.get();
+  first.reset();
+  EXPECT_EQ(1, Pooled::NumFreeBlocks());
+  std::unique_ptr<Pooled> second(new Pooled);
+  EXPECT_EQ(first_address, second.get());
+  EXPECT_EQ(0, Pooled::NumFreeBlocks());
+
+  // The thread's cache holds at most two blocks, and passes the excess to the
+  // shared free list, which also holds at most two.
+  std::vector<std::unique_ptr<Pooled>> objects;
+  for (int i = 0; i < 6; ++i) {
+    objects.emplace_back(new Pooled);
+  }
+  second.reset();
+  objects.clear();
+  EXPECT_EQ(4, Pooled::NumFreeBlocks());
+
+  // Subclass objects are allocated as usual.
+  std::unique_ptr<LargerPooled> larger(new LargerPooled);
+  EXPECT_EQ(4, Pooled::NumFreeBlocks());
+  larger.reset();
+  EXPECT_EQ(4, Pooled::NumFreeBlocks());
+}
+
+class CrossThreadPooled : public FreeListAllocated<CrossThreadPooled, 4> {
+ public:
+  int value = 0;
+};
+
+TEST(FreeListAllocatedTest, RecyclesMemoryAcrossThreads) {
+  std::vector<CrossThreadPooled*> objects;
+  for (int i = 0; i < 4; ++i) {
+    objects.push_back(new CrossThreadPooled);
+  }
+  const std::vector<CrossThreadPooled*> addresses = objects;
+
+  // Blocks freed by another thread reach the shared free list when that
+  // thread exits, and are reused by this one.
+  {
+    std::unique_ptr<Thread> thread(Env::Default()->StartThread(
+        {}, "deleter", [&objects] {
+          for (CrossThreadPooled* object : objects) {
+            delete object;
+          }
+        }));
+  }
+  EXPECT_EQ(4, CrossThreadPooled::NumFreeBlocks());
+  std::unique_ptr<CrossThreadPooled> reused(new CrossThreadPooled);
+  EXPECT_NE(addresses.end(),
+            std::find(addresses.begin(), addresses.end(), reused.get()));
+  EXPECT_EQ(3, CrossThreadPooled::NumFreeBlocks());
+}
+
+}  // namespace
+}  // namespace serving
+}  // namespace tensorflow